@@ -18,6 +18,7 @@
 #include "cli.h"
 #include "friendreq.h"
 #include "conversation.h"
+#include "stream.h"
 
 pthread_t bg_manager;
 
@@ -105,6 +106,23 @@ int add_unotfound(struct message *m) {
 	return 0;
 }
 
+int add_streamresp(struct message *m) {
+	if(m->length != 0x11) {
+		/* server lying is a crashing error */
+		return -1;
+	}
+
+	/* only the latest answer is kept, the sender checks it's theirs */
+	pthread_mutex_lock(&bg_lock);
+	if(stream_resp) {
+		free_message(stream_resp);
+	}
+	stream_resp = m;
+	pthread_cond_broadcast(&bg_wait);
+	pthread_mutex_unlock(&bg_lock);
+	return 0;
+}
+
 void *background_thread(void *_arg) {
 	struct server_connection *sc = (struct server_connection *) _arg;
 
@@ -127,6 +145,13 @@ void *background_thread(void *_arg) {
 		case 1:
 			ret = add_pkeyresp(m);
 			break;
+		case 5:
+			ret = parse_stream_chunk(m);
+			free_message(m);
+			break;
+		case 6:
+			ret = add_streamresp(m);
+			break;
 		case 0xff:
 			ret = add_unotfound(m);
 			break;
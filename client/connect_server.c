@@ -6,6 +6,8 @@
 
 #include <ibcrypt/rsa.h>
 
+#include "connect_server.h"
+
 #include "../crypto/handshake.h"
 #include "../crypto/crypto_layer.h"
 #include "../inet/connect.h"
@@ -14,9 +16,19 @@
 
 /* Returns -1 for programatic error, 1 for server error */
 int connect_server(char *addr, struct con_handle **con_hndl, RSA_PUBLIC_KEY *server_key, struct keyset *keys) {
+	pthread_t handler_thread;
+	int fd;
+
+	return connect_server_port(addr, DFLT_PORT, con_hndl, &handler_thread,
+		&fd, server_key, keys);
+}
+
+int connect_server_port(char *addr, char *port, struct con_handle **con_hndl,
+	pthread_t *handler_thread, int *fd, RSA_PUBLIC_KEY *server_key,
+	struct keyset *keys) {
 	struct sock server;
 
-	server = client_connect(addr, DFLT_PORT);
+	server = client_connect(addr, port);
 	if(server.fd == -1) {
 		if(errno == 0) {
 			ERR("could not find server at given address");
@@ -31,9 +43,10 @@ int connect_server(char *addr, struct con_handle **con_hndl, RSA_PUBLIC_KEY *ser
 	int res;
 	int ret;
 
-	pthread_t handler_thread;
-
-	launch_handler(&handler_thread, con_hndl, server.fd);
+	if(launch_handler(handler_thread, con_hndl, server.fd) != 0) {
+		close(server.fd);
+		return -1;
+	}
 
 	ret = client_handshake(*con_hndl, server_key, keys, &res);
 	if(ret == -1) {
@@ -55,10 +68,13 @@ int connect_server(char *addr, struct con_handle **con_hndl, RSA_PUBLIC_KEY *ser
 	}
 
 	/* connected */
+	*fd = server.fd;
 	return 0;
 
 err:
 	end_handler(*con_hndl);
+	pthread_join(*handler_thread, NULL);
+	release_handler(*con_hndl);
+	close(server.fd);
 	return ret;
 }
-
@@ -1,10 +1,19 @@
 #ifndef IBCHAT_CLIENT_CONNECT_SERVER_H
 #define IBCHAT_CLIENT_CONNECT_SERVER_H
 
+#include <pthread.h>
+
 #include "../crypto/crypto_layer.h"
 #include "../inet/connect.h"
 
 int connect_server(char *addr, struct con_handle **con_hndl, RSA_PUBLIC_KEY *server_key, struct keyset *keys);
 
+/* connect_server to the given port.  the connection's handler thread and
+ * socket are returned so that the caller can end_handler, join and close
+ * them when it's done */
+int connect_server_port(char *addr, char *port, struct con_handle **con_hndl,
+	pthread_t *handler_thread, int *fd, RSA_PUBLIC_KEY *server_key,
+	struct keyset *keys);
+
 #endif
 
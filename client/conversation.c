@@ -22,6 +22,7 @@
 #include "ibchat_client.h"
 #include "uname.h"
 #include "bg_manager.h"
+#include "stream.h"
 
 int select_conversation(struct account *acc) {
 	/* list friends so one can be selected */
@@ -186,6 +187,28 @@ err:
 	return ret;
 }
 
+/* streams the file to f, then tells them what it was */
+static int cmessage_send_file(struct friend *f, char *path,
+	struct cmessage **head) {
+	int res = stream_send(f, path);
+	if(res != 0) {
+		return res < 0 ? -1 : 0;
+	}
+
+	const char *fmt = "[sent file %s]";
+	char *text = malloc(strlen(fmt) - 2 + strlen(path) + 1);
+	if(text == NULL) {
+		ERR("failed to allocate memory");
+		return -1;
+	}
+	sprintf(text, fmt, path);
+
+	int ret = cmessage_send(f, text, head);
+	free(text);
+
+	return ret;
+}
+
 int start_conversation(struct friend *f) {
 #define PRINT_MESSAGE(__mess) do {\
 	char *sender;\
@@ -252,6 +275,14 @@ int start_conversation(struct friend *f) {
 				/* command, process */
 				if(strcmp(text, "/exit") == 0) {
 					goto end;
+				} else if(strncmp(text, "/send ", 6) == 0) {
+					struct cmessage *prev = head;
+					if(cmessage_send_file(f, &text[6], &head) != 0) {
+						goto err;
+					}
+					if(head != prev) {
+						PRINT_MESSAGE(head);
+					}
 				} else {
 					printf("unrecognized command\n");
 				}
@@ -331,10 +362,22 @@ int parse_conv_message(uint8_t *sender, uint8_t *payload, uint64_t plen) {
 		goto inv;
 	}
 
+	/* everything is valid, message is parsed, place it in the queue */
+	if(add_received_message(f, m) != 0) {
+		goto err;
+	}
+
+inv:
+	ret = 0;
+err:
+	return ret;
+}
+
+int add_received_message(struct friend *f, struct cmessage *m) {
 	/* add it to the conversation file */
 	if(cfile_add(f, m) != 0) {
 		ERR("failed to add to conversation file");
-		goto err;
+		return -1;
 	}
 
 	/* if we're in conversation add to current conversation */
@@ -348,15 +391,7 @@ int parse_conv_message(uint8_t *sender, uint8_t *payload, uint64_t plen) {
 	}
 	release_readlock(&lock);
 
-	/* everything is valid, message is parsed, place it in the queue */
-	if(add_new_message(f) != 0) {
-		goto err;
-	}
-
-inv:
-	ret = 0;
-err:
-	return ret;
+	return add_new_message(f);
 }
 
 static int parse_conv_message_payload(struct friend *f,
@@ -19,6 +19,8 @@ int select_conversation(struct account *acc);
 int start_conversation(struct friend *f);
 
 int parse_conv_message(uint8_t *sender, uint8_t *payload, uint64_t plen);
+/* files a message from f and lets the user know about it */
+int add_received_message(struct friend *f, struct cmessage *m);
 
 int cfile_check(struct friend *f);
 int cfile_init(struct friend *f);
@@ -168,6 +168,7 @@ static int open_logfile() {
 }
 
 static int close_logfile() {
+	set_logfile(NULL);
 	fclose(lgf);
 	return 0;
 }
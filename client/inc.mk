@@ -1,4 +1,7 @@
 DIR=client
-FILTER=$(wildcard */*_test.c)
+FILTER=$(wildcard */*_test.c) $(wildcard */*_bench.c) $(DIR)/loadgen.c
 CLIENTSOURCES+=$(filter-out $(FILTER),$(wildcard $(DIR)/*.c))
+# the load generator only takes the parts of the client that connect and log in
+LOADGENSOURCES+=$(DIR)/loadgen.c $(DIR)/connect_server.c \
+	$(DIR)/login_auth.c $(DIR)/uname.c
 
@@ -0,0 +1,814 @@
+/* ibchat-loadgen: registers and logs in a set of synthetic users from one
+ * process and has them chat with each other through a running server, then
+ * reports throughput and delivery latency.  nothing here prompts, so it can
+ * be run from a script against a server on loopback */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ibcrypt/rand.h>
+#include <ibcrypt/rsa.h>
+#include <ibcrypt/rsa_util.h>
+#include <ibcrypt/zfree.h>
+
+#include <libibur/endian.h>
+#include <libibur/util.h>
+
+#include "account.h"
+#include "connect_server.h"
+#include "login_auth.h"
+#include "uname.h"
+
+#include "../crypto/crypto_layer.h"
+#include "../inet/protocol.h"
+#include "../util/defaults.h"
+#include "../util/log.h"
+#include "../util/metrics.h"
+
+/* every message sent starts with this and the time it was sent, so the
+ * receiver can tell how long it took */
+#define PAYLOAD_MAGIC "lgen"
+#define PAYLOAD_HEAD (4 + 8)
+
+/* the most a user lets queue up to the server before it waits */
+#define SEND_QUEUE_MAX (1 << 20)
+#define SEND_WAIT (1000000ULL)
+#define READ_WAIT (100000ULL)
+
+/* how long to wait for messages still in flight once sending stops */
+#define DRAIN_TIME (2000000ULL)
+
+/* the most targets in one type 2 message */
+#define FANOUT_MAX (256)
+
+/* tries at logging back in while the server still has the old session */
+#define LOGIN_TRIES (20)
+
+struct samples {
+	uint64_t *v;
+	uint64_t num;
+	uint64_t cap;
+};
+
+struct lg_user {
+	char uname[32];
+	uint8_t uid[32];
+	struct account acc;
+	RSA_KEY key;
+
+	/* held while sending, and while the connection is changed */
+	pthread_mutex_t lock;
+	int online;
+
+	struct con_handle *ch;
+	pthread_t handler;
+	int fd;
+	struct keyset keys;
+	RSA_PUBLIC_KEY server_key;
+
+	pthread_t reader;
+	volatile int stop;
+	uint64_t login_time;
+
+	/* only touched by the reader, which there's one of at a time */
+	struct samples live;
+	struct samples stored;
+};
+
+static struct {
+	char *addr;
+	char *port;
+	uint64_t users;
+	uint64_t duration; /* seconds */
+	uint64_t rate; /* messages per second over all senders, 0 for no limit */
+	uint64_t min_size;
+	uint64_t max_size;
+	uint64_t fanout;
+	double offline;
+	double churn; /* reconnects per second */
+	double lookups;
+	uint64_t senders;
+	uint64_t key_bits;
+	char *prefix;
+} opts;
+
+static struct lg_user *users;
+static volatile int sending;
+
+static struct {
+	uint64_t messages;
+	uint64_t deliveries; /* messages times their targets */
+	uint64_t bytes;
+	uint64_t received;
+	uint64_t lookups;
+	uint64_t answers;
+	uint64_t not_found;
+	uint64_t reconnects;
+	uint64_t login_failures;
+	uint64_t stalls;
+} stats;
+
+#define STAT_ADD(s, n) __atomic_add_fetch(&stats.s, n, __ATOMIC_RELAXED)
+#define STAT(s) __atomic_load_n(&stats.s, __ATOMIC_RELAXED)
+
+static void usage(char *argv0) {
+	fprintf(stderr, "usage: %s [options]\n"
+		"  -a, --addr <addr>        server address (localhost)\n"
+		"  -p, --port <port>        server port (%s)\n"
+		"  -n, --users <n>          synthetic users (16)\n"
+		"  -t, --time <s>           seconds to send for (10)\n"
+		"  -r, --rate <n>           messages per second, 0 for no "
+		"limit (1000)\n"
+		"  -s, --size <min[:max]>   message payload sizes (64:1024)\n"
+		"  -f, --fanout <n>         targets per message (1)\n"
+		"  -o, --offline <ratio>    share of users kept offline (0)\n"
+		"  -c, --churn <n>          reconnects per second (0)\n"
+		"  -l, --lookups <ratio>    share of sends that are key "
+		"lookups (0.05)\n"
+		"  -w, --senders <n>        sending threads (4)\n"
+		"  -k, --key-bits <n>       identity key size (1024)\n"
+		"  -u, --prefix <name>      username prefix (random)\n",
+		argv0, DFLT_PORT);
+}
+
+static struct option longopts[] = {
+	{ "addr", 1, NULL, 'a' },
+	{ "port", 1, NULL, 'p' },
+	{ "users", 1, NULL, 'n' },
+	{ "time", 1, NULL, 't' },
+	{ "rate", 1, NULL, 'r' },
+	{ "size", 1, NULL, 's' },
+	{ "fanout", 1, NULL, 'f' },
+	{ "offline", 1, NULL, 'o' },
+	{ "churn", 1, NULL, 'c' },
+	{ "lookups", 1, NULL, 'l' },
+	{ "senders", 1, NULL, 'w' },
+	{ "key-bits", 1, NULL, 'k' },
+	{ "prefix", 1, NULL, 'u' },
+	{ NULL, 0, NULL, 0 },
+};
+static char *optstring = "a:p:n:t:r:s:f:o:c:l:w:k:u:";
+
+static int process_opts(int argc, char **argv) {
+	opts.addr = "localhost";
+	opts.port = DFLT_PORT;
+	opts.users = 16;
+	opts.duration = 10;
+	opts.rate = 1000;
+	opts.min_size = 64;
+	opts.max_size = 1024;
+	opts.fanout = 1;
+	opts.offline = 0;
+	opts.churn = 0;
+	opts.lookups = 0.05;
+	opts.senders = 4;
+	opts.key_bits = 1024;
+	opts.prefix = NULL;
+
+	int option;
+	char *end;
+	while((option = getopt_long(argc, argv, optstring, longopts, NULL))
+		!= -1) {
+		switch(option) {
+		case 'a': opts.addr = optarg; break;
+		case 'p': opts.port = optarg; break;
+		case 'n': opts.users = strtoull(optarg, NULL, 10); break;
+		case 't': opts.duration = strtoull(optarg, NULL, 10); break;
+		case 'r': opts.rate = strtoull(optarg, NULL, 10); break;
+		case 's':
+			opts.min_size = strtoull(optarg, &end, 10);
+			opts.max_size = *end == ':' ?
+				strtoull(end + 1, NULL, 10) : opts.min_size;
+			break;
+		case 'f': opts.fanout = strtoull(optarg, NULL, 10); break;
+		case 'o': opts.offline = strtod(optarg, NULL); break;
+		case 'c': opts.churn = strtod(optarg, NULL); break;
+		case 'l': opts.lookups = strtod(optarg, NULL); break;
+		case 'w': opts.senders = strtoull(optarg, NULL, 10); break;
+		case 'k': opts.key_bits = strtoull(optarg, NULL, 10); break;
+		case 'u': opts.prefix = optarg; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(opts.users < 2 || opts.senders == 0 || opts.fanout == 0 ||
+		opts.key_bits == 0 || (opts.key_bits & 1)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if(opts.min_size < PAYLOAD_HEAD) {
+		opts.min_size = PAYLOAD_HEAD;
+	}
+	if(opts.max_size < opts.min_size) {
+		opts.max_size = opts.min_size;
+	}
+	if(opts.max_size > proto_max_frame() / 2) {
+		fprintf(stderr, "messages can be at most %llu bytes\n",
+			(unsigned long long) proto_max_frame() / 2);
+		return 1;
+	}
+	if(opts.offline < 0 || opts.offline >= 1 ||
+		opts.lookups < 0 || opts.lookups > 1 || opts.churn < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	/* at least two users have to be online to talk to each other */
+	if(opts.users - (uint64_t) (opts.offline * opts.users) < 2) {
+		fprintf(stderr, "too few users online\n");
+		return 1;
+	}
+	if(opts.fanout > FANOUT_MAX || opts.fanout >= opts.users) {
+		fprintf(stderr, "fanout must be less than the number of users "
+			"and at most %d\n", FANOUT_MAX);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* xorshift, one state per thread */
+static uint64_t next_rand(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static uint64_t rand_seed() {
+	uint64_t s = 0;
+	while(s == 0) {
+		if(cs_rand(&s, sizeof(s)) != 0) {
+			s = metrics_now() | 1;
+		}
+	}
+	return s;
+}
+
+static double rand_unit(uint64_t *s) {
+	return (next_rand(s) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static int samples_add(struct samples *s, uint64_t v) {
+	if(s->num == s->cap) {
+		uint64_t cap = s->cap ? s->cap * 2 : 1024;
+		uint64_t *nv = realloc(s->v, cap * sizeof(uint64_t));
+		if(nv == NULL) {
+			return -1;
+		}
+		s->v = nv;
+		s->cap = cap;
+	}
+	s->v[s->num++] = v;
+	return 0;
+}
+
+static void handle_received(struct lg_user *u, struct message *m) {
+	uint8_t *buf = m->message;
+
+	switch(buf[0]) {
+	case 0: {
+		if(m->length < 0x29 + PAYLOAD_HEAD ||
+			memcmp(&buf[0x29], PAYLOAD_MAGIC, 4) != 0) {
+			break;
+		}
+		uint64_t sent = decbe64(&buf[0x29 + 4]);
+		uint64_t now = metrics_now();
+		if(now < sent) {
+			break;
+		}
+		STAT_ADD(received, 1);
+		/* anything sent before we logged in was stored for us */
+		samples_add(sent < u->login_time ? &u->stored : &u->live,
+			now - sent);
+		break;
+	}
+	case 1:
+		STAT_ADD(answers, 1);
+		break;
+	case 0xff:
+		STAT_ADD(not_found, 1);
+		break;
+	}
+}
+
+static void *reader_thread(void *arg) {
+	struct lg_user *u = arg;
+
+	while(!u->stop && handler_status(u->ch) == 0) {
+		struct message *m = recv_message(u->ch, &u->keys, READ_WAIT);
+		if(m == NULL) {
+			continue;
+		}
+		if(m->length > 0) {
+			handle_received(u, m);
+		}
+		free_message(m);
+	}
+
+	return NULL;
+}
+
+/* the server doesn't answer a registration, but it has finished with it by
+ * the time it answers a lookup of ourselves */
+static int wait_registered(struct lg_user *u) {
+	uint8_t req[0x21];
+	req[0] = 1;
+	memcpy(&req[1], u->uid, 0x20);
+	if(send_message(u->ch, &u->keys, req, sizeof(req)) != 0) {
+		return -1;
+	}
+
+	struct message *m = recv_message(u->ch, &u->keys, SEND_WAIT * 5);
+	if(m == NULL) {
+		return -1;
+	}
+	int ret = m->length > 0x21 && m->message[0] == 1 ? 0 : -1;
+	free_message(m);
+
+	return ret;
+}
+
+/* returns 0 once logged in, 2 if the server still has us logged in and
+ * -1 on anything else */
+static int try_login(struct lg_user *u) {
+	int ret = connect_server_port(opts.addr, opts.port, &u->ch,
+		&u->handler, &u->fd, &u->server_key, &u->keys);
+	if(ret != 0) {
+		return -1;
+	}
+
+	/* the server's key isn't checked, this is only ever pointed at our
+	 * own servers */
+	rsa_free_pubkey(&u->server_key);
+
+	if(send_login_message(u->ch, &u->acc, &u->key, &u->keys) != 0) {
+		goto err;
+	}
+
+	ret = get_server_authresponse(u->ch, &u->keys);
+	if(ret == 1) {
+		if(send_message(u->ch, &u->keys, (uint8_t *) "register", 8)
+			!= 0 || wait_registered(u) != 0) {
+			goto err;
+		}
+	} else if(ret != 0) {
+		goto err;
+	}
+
+	return 0;
+err:
+	end_handler(u->ch);
+	pthread_join(u->handler, NULL);
+	release_handler(u->ch);
+	close(u->fd);
+	memsets(&u->keys, 0, sizeof(u->keys));
+	return ret == 2 ? 2 : -1;
+}
+
+static int login(struct lg_user *u) {
+	int ret = -1;
+	for(int i = 0; i < LOGIN_TRIES; i++) {
+		ret = try_login(u);
+		if(ret != 2) {
+			break;
+		}
+		/* it hasn't noticed our last connection going yet */
+		usleep(100000);
+	}
+	if(ret != 0) {
+		ERR("failed to log in %s", u->uname);
+		STAT_ADD(login_failures, 1);
+		return -1;
+	}
+
+	u->login_time = metrics_now();
+	u->stop = 0;
+	if(pthread_create(&u->reader, NULL, reader_thread, u) != 0) {
+		end_handler(u->ch);
+		pthread_join(u->handler, NULL);
+		release_handler(u->ch);
+		close(u->fd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&u->lock);
+	u->online = 1;
+	pthread_mutex_unlock(&u->lock);
+
+	return 0;
+}
+
+static void logout(struct lg_user *u) {
+	pthread_mutex_lock(&u->lock);
+	if(!u->online) {
+		pthread_mutex_unlock(&u->lock);
+		return;
+	}
+	u->online = 0;
+	pthread_mutex_unlock(&u->lock);
+
+	u->stop = 1;
+	pthread_join(u->reader, NULL);
+
+	end_handler(u->ch);
+	pthread_join(u->handler, NULL);
+	release_handler(u->ch);
+	close(u->fd);
+	memsets(&u->keys, 0, sizeof(u->keys));
+}
+
+static int init_user(struct lg_user *u, uint64_t idx, char *prefix) {
+	memset(u, 0, sizeof(*u));
+	snprintf(u->uname, sizeof(u->uname), "%s_%llu", prefix,
+		(unsigned long long) idx);
+	gen_uid(u->uname, u->uid);
+
+	if(rsa_gen_key(&u->key, opts.key_bits, 65537) != 0) {
+		ERR("failed to generate key for %s", u->uname);
+		return -1;
+	}
+
+	u->acc.uname = u->uname;
+	u->acc.u_len = strlen(u->uname);
+	u->acc.addr = opts.addr;
+	u->acc.a_len = strlen(opts.addr);
+	u->acc.k_len = rsa_prikey_bufsize(u->key.bits);
+	u->acc.key_bin = malloc(u->acc.k_len);
+	if(u->acc.key_bin == NULL) {
+		return -1;
+	}
+	rsa_prikey2wire(&u->key, u->acc.key_bin, u->acc.k_len);
+
+	pthread_mutex_init(&u->lock, NULL);
+
+	return 0;
+}
+
+static void free_user(struct lg_user *u) {
+	zfree(u->acc.key_bin, u->acc.k_len);
+	rsa_free_prikey(&u->key);
+	pthread_mutex_destroy(&u->lock);
+	free(u->live.v);
+	free(u->stored.v);
+}
+
+/* locks and returns a random user that's online */
+static struct lg_user *pick_online(uint64_t *rs) {
+	for(int i = 0; i < 64; i++) {
+		struct lg_user *u = &users[next_rand(rs) % opts.users];
+		pthread_mutex_lock(&u->lock);
+		if(u->online) {
+			return u;
+		}
+		pthread_mutex_unlock(&u->lock);
+	}
+	return NULL;
+}
+
+/* builds a type 0 message, or a type 2 one with a shared payload if there's
+ * more than one target.  returns its length, and where the send time goes
+ * in stamp */
+static uint64_t build_message(uint8_t *buf, struct lg_user *from,
+	uint64_t *rs, uint8_t **stamp) {
+	uint64_t plen = opts.min_size;
+	if(opts.max_size > opts.min_size) {
+		plen += next_rand(rs) % (opts.max_size - opts.min_size + 1);
+	}
+
+	/* distinct targets other than the sender */
+	uint8_t *targets[FANOUT_MAX];
+	uint64_t num = 0;
+	while(num < opts.fanout) {
+		struct lg_user *t = &users[next_rand(rs) % opts.users];
+		int dup = t == from;
+		for(uint64_t i = 0; i < num && !dup; i++) {
+			dup = targets[i] == t->uid;
+		}
+		if(!dup) {
+			targets[num++] = t->uid;
+		}
+	}
+
+	uint8_t *p = buf;
+	if(num == 1) {
+		*p++ = 0;
+		memcpy(p, targets[0], 0x20);
+		p += 0x20;
+	} else {
+		*p++ = 2;
+		*p++ = 1;
+		encbe64(num, p);
+		p += 8;
+		for(uint64_t i = 0; i < num; i++) {
+			memcpy(p, targets[i], 0x20);
+			p += 0x20;
+		}
+	}
+	encbe64(plen, p);
+	p += 8;
+
+	memcpy(p, PAYLOAD_MAGIC, 4);
+	*stamp = p + 4;
+	memset(p + PAYLOAD_HEAD, 0x5a, plen - PAYLOAD_HEAD);
+	return p + plen - buf;
+}
+
+static void *sender_thread(void *arg) {
+	uint64_t rs = rand_seed();
+	uint64_t hlen = 1 + 1 + 8 + FANOUT_MAX * 0x20 + 8;
+	uint8_t *buf = malloc(hlen + opts.max_size);
+	if(buf == NULL) {
+		ERR("failed to allocate memory");
+		return NULL;
+	}
+
+	/* each sender keeps its share of the rate */
+	uint64_t interval = opts.rate ? 1000000ULL * opts.senders / opts.rate
+		: 0;
+	uint64_t next = metrics_now();
+
+	while(sending) {
+		if(interval) {
+			uint64_t now = metrics_now();
+			if(now < next) {
+				usleep(next - now);
+			}
+			next += interval;
+		}
+
+		struct lg_user *u = pick_online(&rs);
+		if(u == NULL) {
+			usleep(1000);
+			continue;
+		}
+
+		if(con_wait_space(u->ch, SEND_QUEUE_MAX, SEND_WAIT) != 0) {
+			STAT_ADD(stalls, 1);
+			pthread_mutex_unlock(&u->lock);
+			continue;
+		}
+
+		if(rand_unit(&rs) < opts.lookups) {
+			uint8_t req[0x21];
+			req[0] = 1;
+			memcpy(&req[1], users[next_rand(&rs) % opts.users].uid,
+				0x20);
+			if(send_message(u->ch, &u->keys, req, sizeof(req))
+				== 0) {
+				STAT_ADD(lookups, 1);
+			}
+			pthread_mutex_unlock(&u->lock);
+			continue;
+		}
+
+		uint8_t *stamp;
+		uint64_t len = build_message(buf, u, &rs, &stamp);
+		encbe64(metrics_now(), stamp);
+		if(send_message(u->ch, &u->keys, buf, len) == 0) {
+			STAT_ADD(messages, 1);
+			STAT_ADD(deliveries, opts.fanout);
+			STAT_ADD(bytes, len);
+		}
+		pthread_mutex_unlock(&u->lock);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* swaps a random online user for a random offline one, or reconnects it if
+ * everyone is online */
+static void *churn_thread(void *arg) {
+	uint64_t rs = rand_seed();
+	uint64_t interval = (uint64_t) (1000000.0 / opts.churn);
+	uint64_t next = metrics_now() + interval;
+
+	while(sending) {
+		uint64_t now = metrics_now();
+		if(now < next) {
+			usleep(next - now < 100000 ? next - now : 100000);
+			continue;
+		}
+		next += interval;
+
+		struct lg_user *out = NULL, *in = NULL;
+		for(int i = 0; i < 64 && (out == NULL || in == NULL); i++) {
+			struct lg_user *u = &users[next_rand(&rs) % opts.users];
+			/* only this thread changes who's online */
+			if(u->online && out == NULL) {
+				out = u;
+			} else if(!u->online && in == NULL) {
+				in = u;
+			}
+		}
+		if(out == NULL) {
+			continue;
+		}
+		if(in == NULL || opts.offline == 0) {
+			in = out;
+		}
+
+		logout(out);
+		if(login(in) == 0) {
+			STAT_ADD(reconnects, 1);
+		}
+	}
+
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void report_latency(const char *name, int stored) {
+	uint64_t total = 0;
+	for(uint64_t i = 0; i < opts.users; i++) {
+		total += stored ? users[i].stored.num : users[i].live.num;
+	}
+	if(total == 0) {
+		printf("%-16s none\n", name);
+		return;
+	}
+
+	uint64_t *v = malloc(total * sizeof(uint64_t));
+	if(v == NULL) {
+		printf("%-16s out of memory\n", name);
+		return;
+	}
+	uint64_t n = 0;
+	for(uint64_t i = 0; i < opts.users; i++) {
+		struct samples *s = stored ? &users[i].stored : &users[i].live;
+		memcpy(&v[n], s->v, s->num * sizeof(uint64_t));
+		n += s->num;
+	}
+	qsort(v, n, sizeof(uint64_t), cmp_u64);
+
+	printf("%-16s p50 %llu  p99 %llu  p999 %llu  max %llu us\n", name,
+		(unsigned long long) v[n / 2],
+		(unsigned long long) v[n * 99 / 100],
+		(unsigned long long) v[n * 999 / 1000],
+		(unsigned long long) v[n - 1]);
+
+	free(v);
+}
+
+static void report(double secs, uint64_t online) {
+	printf("users            %llu, %llu online\n",
+		(unsigned long long) opts.users, (unsigned long long) online);
+	printf("sent             %llu messages to %llu targets, %.1f/s, "
+		"%.2f MB/s\n",
+		(unsigned long long) STAT(messages),
+		(unsigned long long) STAT(deliveries),
+		STAT(messages) / secs, STAT(bytes) / secs / 1e6);
+	printf("received         %llu, %.1f/s\n",
+		(unsigned long long) STAT(received), STAT(received) / secs);
+	printf("lookups          %llu, %llu answered, %llu not found\n",
+		(unsigned long long) STAT(lookups),
+		(unsigned long long) STAT(answers),
+		(unsigned long long) STAT(not_found));
+	printf("reconnects       %llu, %llu failed logins\n",
+		(unsigned long long) STAT(reconnects),
+		(unsigned long long) STAT(login_failures));
+	printf("send stalls      %llu\n", (unsigned long long) STAT(stalls));
+	report_latency("live latency", 0);
+	report_latency("stored latency", 1);
+}
+
+int main(int argc, char **argv) {
+	if(process_opts(argc, argv) != 0) {
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	char prefix[17];
+	if(opts.prefix == NULL) {
+		/* fresh users every run, so old keys on the server don't
+		 * get in the way */
+		uint8_t r[4];
+		if(cs_rand(r, sizeof(r)) != 0) {
+			ERR("failed to generate random numbers");
+			return 1;
+		}
+		memcpy(prefix, "lg", 2);
+		to_hex(r, sizeof(r), &prefix[2]);
+		prefix[10] = '\0';
+		opts.prefix = prefix;
+	}
+	if(!valid_uname(opts.prefix, strlen(opts.prefix)) ||
+		strlen(opts.prefix) > 16) {
+		fprintf(stderr, "invalid username prefix\n");
+		return 1;
+	}
+
+	users = calloc(opts.users, sizeof(struct lg_user));
+	if(users == NULL) {
+		ERR("failed to allocate memory");
+		return 1;
+	}
+
+	int ret = 1;
+	uint64_t made = 0;
+	pthread_t *senders = NULL;
+	pthread_t churn;
+	int churning = 0;
+
+	fprintf(stderr, "logging in %llu users as %s_*\n",
+		(unsigned long long) opts.users, opts.prefix);
+	for(made = 0; made < opts.users; made++) {
+		if(init_user(&users[made], made, opts.prefix) != 0) {
+			goto end;
+		}
+		if(login(&users[made]) != 0) {
+			made++;
+			goto end;
+		}
+	}
+
+	/* everyone had to log in once to register */
+	uint64_t offline = (uint64_t) (opts.offline * opts.users);
+	for(uint64_t i = 0; i < offline; i++) {
+		logout(&users[opts.users - 1 - i]);
+	}
+
+	senders = calloc(opts.senders, sizeof(pthread_t));
+	if(senders == NULL) {
+		goto end;
+	}
+
+	fprintf(stderr, "sending for %llu seconds\n",
+		(unsigned long long) opts.duration);
+	sending = 1;
+	uint64_t start = metrics_now();
+	uint64_t started = 0;
+	for(; started < opts.senders; started++) {
+		if(pthread_create(&senders[started], NULL, sender_thread,
+			NULL) != 0) {
+			break;
+		}
+	}
+	if(opts.churn > 0 && pthread_create(&churn, NULL, churn_thread, NULL)
+		== 0) {
+		churning = 1;
+	}
+
+	for(uint64_t s = 1; s <= opts.duration; s++) {
+		sleep(1);
+		fprintf(stderr, "%llus: %llu sent, %llu received\n",
+			(unsigned long long) s,
+			(unsigned long long) STAT(messages),
+			(unsigned long long) STAT(received));
+	}
+
+	sending = 0;
+	for(uint64_t i = 0; i < started; i++) {
+		pthread_join(senders[i], NULL);
+	}
+	if(churning) {
+		pthread_join(churn, NULL);
+	}
+	double secs = (metrics_now() - start) / 1e6;
+
+	/* give what's in flight a chance to arrive */
+	uint64_t drain_end = metrics_now() + DRAIN_TIME;
+	uint64_t last = STAT(received);
+	while(metrics_now() < drain_end) {
+		usleep(100000);
+		uint64_t r = STAT(received);
+		if(r == last) {
+			break;
+		}
+		last = r;
+	}
+
+	uint64_t online = 0;
+	for(uint64_t i = 0; i < opts.users; i++) {
+		online += users[i].online;
+	}
+	report(secs, online);
+	ret = 0;
+
+end:
+	sending = 0;
+	for(uint64_t i = 0; i < made; i++) {
+		logout(&users[i]);
+		free_user(&users[i]);
+	}
+	free(senders);
+	free(users);
+
+	return ret;
+}
+
@@ -0,0 +1,22 @@
+#ifndef IBCHAT_CLIENT_LOGIN_AUTH_H
+#define IBCHAT_CLIENT_LOGIN_AUTH_H
+
+#include <ibcrypt/rsa.h>
+
+#include "../inet/protocol.h"
+#include "../crypto/crypto_layer.h"
+
+#include "account.h"
+
+/* the client's half of server/client_auth.txt, with nothing that prompts or
+ * touches the account file so that it can be used without a terminal */
+
+/* answers the server's challenge with acc's identity, signed by rkey */
+int send_login_message(struct con_handle *ch, struct account *acc, RSA_KEY *rkey, struct keyset *keys);
+
+/* returns the code in the server's cliauth message, or -1 if it didn't
+ * send a valid one */
+int get_server_authresponse(struct con_handle *ch, struct keyset *keys);
+
+#endif
+
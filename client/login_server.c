@@ -10,6 +10,7 @@
 #include <libibur/util.h>
 
 #include "login_server.h"
+#include "login_auth.h"
 #include "account.h"
 #include "connect_server.h"
 #include "ibchat_client.h"
@@ -20,89 +21,6 @@
 #include "../util/defaults.h"
 #include "../util/log.h"
 
-static int send_login_message(struct con_handle *ch, struct account *acc, RSA_KEY *rkey, struct keyset *keys) {
-	struct message *challenge = NULL;
-	uint8_t *resp = NULL;
-	int ret = 0;
-
-	challenge = recv_message(ch, keys, 0);
-	if(challenge == NULL) {
-		goto err;
-	}
-
-	if(challenge->length != 0x20) {
-		ERR("invalid challenge message from server");
-		goto err;
-	}
-
-	uint64_t bits = decbe64(acc->key_bin);
-
-	uint64_t size = 0;
-	size += 0x20;
-	size += rsa_pubkey_bufsize(bits);
-	size += 0x20;
-	size += 0x08;
-	size += (bits + 7) / 8;
-	resp = malloc(size);
-
-	uint8_t *uid_b, *pkey_b, *chn_b, *sigl_b, *sig_b;
-	uid_b = resp;
-	pkey_b = uid_b + 0x20;
-	chn_b = pkey_b + rsa_pubkey_bufsize(bits);
-	sigl_b = chn_b + 0x20;
-	sig_b = sigl_b + 8;
-
-	gen_uid(acc->uname, uid_b);
-	if(rsa_wire_prikey2pubkey(acc->key_bin, acc->k_len, pkey_b,
-		rsa_pubkey_bufsize(bits)) != 0) {
-		goto err;
-	}
-	memcpy(chn_b, challenge->message, 0x20);
-	encbe64((bits + 7) / 8, sigl_b);
-
-	if(rsa_pss_sign(rkey, resp, sig_b - resp, sig_b, (bits + 7) / 8) != 0) {
-		ERR("failed to sign message");
-		goto err;
-	}
-
-	if(send_message(ch, keys, resp, size) != 0) {
-		ERR("failed to send message");
-		goto err;
-	}
-
-	goto cleanup;
-err:
-	ret = -1;
-cleanup:
-	if(challenge) free_message(challenge);
-	if(resp) zfree(resp, size);
-
-	return ret;
-}
-
-int get_server_authresponse(struct con_handle *ch, struct keyset *keys) {
-	struct message *authresponse = NULL;
-
-	/* wait for 5 seconds, that should be long enough */
-	authresponse = recv_message(ch, keys, 5000000ULL);
-	if(authresponse == NULL) {
-		return -1;
-	}
-
-	if(authresponse->length != 8 ||
-		memcmp("cliauth", authresponse->message, 7) != 0 ||
-		(authresponse->message[7] > 4) != 0) {
-		ERR("server sent invalid authorization response");
-
-		free_message(authresponse);
-		return -1;
-	}
-	int val = authresponse->message[7];
-
-	free_message(authresponse);
-	return val;
-}
-
 static int prompt_verify_skey(struct account *acc, RSA_PUBLIC_KEY *key, int firsttime) {
 	uint64_t len = rsa_pubkey_bufsize(key->bits);
 	uint8_t *pkey_bin = malloc(len);
@@ -379,5 +297,6 @@ void cleanup_server_connection(struct server_connection *sc) {
 	memsets(&(sc->keys), 0, sizeof(struct keyset));
 
 	end_handler(sc->ch);
+	release_handler(sc->ch);
 }
 
@@ -0,0 +1,601 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <ibcrypt/chacha.h>
+#include <ibcrypt/sha256.h>
+#include <ibcrypt/zfree.h>
+
+#include <libibur/util.h>
+#include <libibur/endian.h>
+
+#include "../util/log.h"
+
+#include "bg_manager.h"
+#include "cli.h"
+#include "conversation.h"
+#include "ibchat_client.h"
+#include "stream.h"
+
+/* the largest chunk the server takes, and the part of it left for the file
+ * once the mac is added */
+#define CHUNK_MAX ((uint64_t) 65536)
+#define CHUNK_DATA (CHUNK_MAX - 0x20)
+
+/* how much can be waiting to go out to the server before the next chunk
+ * is held back, and how long it's held back for before giving up */
+#define SEND_QUEUE_MAX ((uint64_t) 1 << 20)
+#define SEND_WAIT ((uint64_t) 10000000ULL)
+
+struct message *stream_resp = NULL;
+
+/* the length of the stream for a file of len bytes */
+static uint64_t stream_len(uint64_t len) {
+	return len + (len + CHUNK_DATA - 1) / CHUNK_DATA * 0x20;
+}
+
+/* each stream gets keys of its own, so the chunk number can be the nonce */
+static void stream_keys(uint8_t symm[32], uint8_t hmac[32], uint64_t sid,
+	uint8_t s_key[32], uint8_t h_key[32]) {
+	uint8_t buf[8];
+	encbe64(sid, buf);
+
+	hmac_sha256(symm, 32, buf, 8, s_key);
+	hmac_sha256(hmac, 32, buf, 8, h_key);
+}
+
+/* the same file sent to the same friend gets the same id, so that sending it
+ * again picks up where the last try stopped */
+static uint64_t stream_id(struct friend *f, char *path, struct stat *st) {
+	HMAC_SHA256_CTX ctx;
+	uint8_t buf[16];
+	uint8_t mac[32];
+
+	encbe64(st->st_size, &buf[0]);
+	encbe64(st->st_mtime, &buf[8]);
+
+	hmac_sha256_init(&ctx, f->s_hmac_key, 32);
+	hmac_sha256_update(&ctx, buf, 16);
+	hmac_sha256_update(&ctx, (uint8_t *) path, strlen(path));
+	hmac_sha256_final(&ctx, mac);
+
+	return decbe64(mac);
+}
+
+/* asks the server how far along a stream is */
+static int stream_position(uint64_t sid, uint64_t *pos) {
+	uint8_t req[9];
+	req[0] = 6;
+	encbe64(sid, &req[1]);
+
+	/* an answer nobody asked for is from a chunk that didn't fit */
+	pthread_mutex_lock(&bg_lock);
+	if(stream_resp) {
+		free_message(stream_resp);
+		stream_resp = NULL;
+	}
+	pthread_mutex_unlock(&bg_lock);
+
+	if(acquire_netlock() != 0) {
+		return -1;
+	}
+	if(send_message(sc.ch, &sc.keys, req, sizeof(req)) != 0) {
+		ERR("failed to send stream request");
+		release_netlock();
+		return -1;
+	}
+	release_netlock();
+
+	int ret = -1;
+	pthread_mutex_lock(&bg_lock);
+	while(get_mode() != -1) {
+		if(stream_resp == NULL) {
+			pthread_cond_wait(&bg_wait, &bg_lock);
+			continue;
+		}
+
+		struct message *m = stream_resp;
+		stream_resp = NULL;
+		uint64_t r_sid = decbe64(&m->message[0x01]);
+		*pos = decbe64(&m->message[0x09]);
+		free_message(m);
+		if(r_sid == sid) {
+			ret = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bg_lock);
+
+	return ret;
+}
+
+static int read_full(int fd, uint8_t *buf, uint64_t len, uint64_t offset) {
+	while(len > 0) {
+		ssize_t r = pread(fd, buf, len, offset);
+		if(r < 0 && errno == EINTR) {
+			continue;
+		}
+		if(r <= 0) {
+			return -1;
+		}
+		buf += r;
+		len -= r;
+		offset += r;
+	}
+
+	return 0;
+}
+
+static int send_chunk(uint8_t *buf, uint64_t len) {
+	/* wait without the netlock so the background thread keeps reading */
+	if(con_wait_space(sc.ch, SEND_QUEUE_MAX, SEND_WAIT) != 0) {
+		ERR("server is not keeping up with the stream");
+		return -1;
+	}
+
+	if(acquire_netlock() != 0) {
+		return -1;
+	}
+	int ret = send_message(sc.ch, &sc.keys, buf, len);
+	release_netlock();
+	if(ret != 0) {
+		ERR("failed to send stream chunk");
+	}
+
+	return ret;
+}
+
+int stream_send(struct friend *f, char *path) {
+	int ret = -1;
+
+	uint8_t s_key[32], h_key[32];
+	uint8_t *buf = NULL, *data = NULL;
+	uint64_t buflen = 0x41 + CHUNK_MAX;
+
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		printf("failed to open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+		printf("%s is not a file that can be sent\n", path);
+		ret = 1;
+		goto end;
+	}
+
+	uint64_t total = stream_len(st.st_size);
+	uint64_t sid = stream_id(f, path, &st);
+
+	uint64_t offset;
+	if(stream_position(sid, &offset) != 0) {
+		goto end;
+	}
+	if(offset == total) {
+		printf("%s was already sent\n", path);
+		ret = 1;
+		goto end;
+	}
+	if(offset > total || offset % CHUNK_MAX != 0) {
+		ERR("server returned invalid stream position");
+		goto end;
+	}
+	if(offset != 0) {
+		printf("picking up %s from where it stopped\n", path);
+	}
+
+	buf = malloc(buflen);
+	data = malloc(CHUNK_DATA);
+	if(buf == NULL || data == NULL) {
+		ERR("failed to allocate memory");
+		goto end;
+	}
+
+	stream_keys(f->s_symm_key, f->s_hmac_key, sid, s_key, h_key);
+
+	while(offset < total) {
+		uint64_t clen = total - offset < CHUNK_MAX ?
+			total - offset : CHUNK_MAX;
+		uint64_t dlen = clen - 0x20;
+		uint64_t chunk = offset / CHUNK_MAX;
+
+		if(read_full(fd, data, dlen, chunk * CHUNK_DATA) != 0) {
+			printf("failed to read %s, it may have changed\n", path);
+			ret = 1;
+			goto end;
+		}
+
+		uint8_t *ptr = buf;
+		*ptr = 5; ptr++;
+		memcpy(ptr, f->uid, 0x20); ptr += 0x20;
+		encbe64(sid, ptr); ptr += 8;
+		encbe64(offset, ptr); ptr += 8;
+		encbe64(total, ptr); ptr += 8;
+		encbe64(clen, ptr); ptr += 8;
+
+		chacha_enc(s_key, 32, chunk, data, ptr, dlen);
+		ptr += dlen;
+
+		/* everything but who it's to, which the server swaps out */
+		hmac_sha256(h_key, 32, &buf[0x21], ptr - &buf[0x21], ptr);
+		ptr += 0x20;
+
+		if(send_chunk(buf, ptr - buf) != 0) {
+			goto end;
+		}
+		offset += clen;
+	}
+
+	/* the server answers chunks that don't fit before this */
+	if(stream_position(sid, &offset) != 0) {
+		goto end;
+	}
+	if(offset != total) {
+		printf("sending %s was cut off, send it again to finish\n",
+			path);
+		ret = 1;
+		goto end;
+	}
+
+	ret = 0;
+end:
+	memsets(s_key, 0, sizeof(s_key));
+	memsets(h_key, 0, sizeof(h_key));
+	if(buf) zfree(buf, buflen);
+	if(data) zfree(data, CHUNK_DATA);
+	close(fd);
+
+	return ret;
+}
+
+/* the ranges of a stream that have arrived are kept next to its file, as
+ * the stream length, the number of ranges, and then each range's start and
+ * end.  chunks can come out of order when some were stored while we were
+ * away, so it takes more than a count */
+struct range {
+	uint64_t start;
+	uint64_t end;
+};
+
+static char *part_path(uint8_t *sender, uint64_t sid, const char *suffix) {
+	uint8_t buf[0x28];
+	uint8_t id[0x20];
+	memcpy(buf, sender, 0x20);
+	encbe64(sid, &buf[0x20]);
+	sha256(buf, sizeof(buf), id);
+
+	char *base = file_path(id);
+	if(base == NULL) {
+		return NULL;
+	}
+
+	char *path = malloc(strlen(base) + strlen(suffix) + 1);
+	if(path == NULL) {
+		ERR("failed to allocate memory for path");
+		free(base);
+		return NULL;
+	}
+	strcpy(path, base);
+	strcat(path, suffix);
+	free(base);
+
+	return path;
+}
+
+/* loads the ranges that have arrived, none if the stream is new, with room
+ * for one more */
+static int map_load(char *path, uint64_t total, struct range **ranges,
+	uint64_t *num) {
+	FILE *file = fopen(path, "rb");
+	if(file == NULL && errno != ENOENT) {
+		return -1;
+	}
+
+	int valid = 1;
+	uint64_t n = 0;
+	if(file != NULL) {
+		uint8_t head[16];
+		if(fread(head, 1, 16, file) == 16 &&
+			decbe64(&head[0]) == total &&
+			decbe64(&head[8]) <= total / CHUNK_MAX + 1) {
+			n = decbe64(&head[8]);
+		} else {
+			valid = 0;
+		}
+	}
+
+	struct range *r = malloc((n + 1) * sizeof(*r));
+	if(r == NULL) {
+		if(file) fclose(file);
+		return -1;
+	}
+	for(uint64_t i = 0; i < n; i++) {
+		uint8_t buf[16];
+		if(fread(buf, 1, 16, file) != 16) {
+			valid = 0;
+			break;
+		}
+		r[i].start = decbe64(&buf[0]);
+		r[i].end = decbe64(&buf[8]);
+		if(r[i].start >= r[i].end || r[i].end > total ||
+			(i > 0 && r[i].start <= r[i - 1].end)) {
+			valid = 0;
+			break;
+		}
+	}
+	if(file) fclose(file);
+
+	if(!valid) {
+		/* the chunks it lost track of will have to be sent again */
+		LOG("stream map %s invalid, starting it over", path);
+		n = 0;
+	}
+
+	*ranges = r;
+	*num = n;
+	return 0;
+}
+
+static int map_write(char *path, uint64_t total, struct range *ranges,
+	uint64_t num) {
+	char *tmp = malloc(strlen(path) + 5);
+	if(tmp == NULL) {
+		return -1;
+	}
+	strcpy(tmp, path);
+	strcat(tmp, ".tmp");
+
+	FILE *file = fopen(tmp, "wb");
+	if(file == NULL) {
+		goto err;
+	}
+
+	uint8_t buf[16];
+	encbe64(total, &buf[0]);
+	encbe64(num, &buf[8]);
+	if(fwrite(buf, 1, 16, file) != 16) {
+		goto err;
+	}
+	for(uint64_t i = 0; i < num; i++) {
+		encbe64(ranges[i].start, &buf[0]);
+		encbe64(ranges[i].end, &buf[8]);
+		if(fwrite(buf, 1, 16, file) != 16) {
+			goto err;
+		}
+	}
+
+	if(fclose(file) != 0) {
+		file = NULL;
+		goto err;
+	}
+	file = NULL;
+	if(rename(tmp, path) != 0) {
+		goto err;
+	}
+
+	free(tmp);
+	return 0;
+
+err:
+	ERR("failed to write stream map %s", path);
+	if(file) fclose(file);
+	unlink(tmp);
+	free(tmp);
+	return -1;
+}
+
+/* adds [start, end) to the sorted ranges, returns 1 if it was already there */
+static int map_add(struct range *ranges, uint64_t *num, uint64_t start,
+	uint64_t end) {
+	uint64_t i = 0;
+	while(i < *num && ranges[i].end < start) {
+		i++;
+	}
+
+	if(i < *num && ranges[i].start <= start && ranges[i].end >= end) {
+		return 1;
+	}
+
+	if(i == *num || ranges[i].start > end) {
+		memmove(&ranges[i + 1], &ranges[i],
+			(*num - i) * sizeof(*ranges));
+		ranges[i].start = start;
+		ranges[i].end = end;
+		(*num)++;
+		return 0;
+	}
+
+	/* it touches ranges[i], and maybe the ones after */
+	if(start < ranges[i].start) {
+		ranges[i].start = start;
+	}
+	if(end > ranges[i].end) {
+		ranges[i].end = end;
+	}
+	uint64_t j = i + 1;
+	while(j < *num && ranges[j].start <= ranges[i].end) {
+		if(ranges[j].end > ranges[i].end) {
+			ranges[i].end = ranges[j].end;
+		}
+		j++;
+	}
+	memmove(&ranges[i + 1], &ranges[j], (*num - j) * sizeof(*ranges));
+	*num -= j - i - 1;
+
+	return 0;
+}
+
+/* moves a finished stream's file next to the others from the same friend
+ * and says so in the conversation */
+static int finish_stream(struct friend *f, uint64_t sid, char *part) {
+	char hex[17];
+	uint8_t sbuf[8];
+	encbe64(sid, sbuf);
+	to_hex(sbuf, 8, hex);
+	hex[16] = '\0';
+
+	char *path = malloc(strlen(ROOT_DIR) + f->u_len + 1 + 16 + 1);
+	if(path == NULL) {
+		ERR("failed to allocate memory for path");
+		return -1;
+	}
+	sprintf(path, "%s%s-%s", ROOT_DIR, f->uname, hex);
+
+	int ret = -1;
+	if(rename(part, path) != 0) {
+		ERR("failed to move finished stream to %s", path);
+		goto end;
+	}
+	LOG("stream from %s saved to %s", f->uname, path);
+
+	const char *fmt = "[file saved to %s]";
+	struct cmessage *m = alloc_cmessage(strlen(fmt) - 2 + strlen(path));
+	if(m == NULL) {
+		ERR("failed to allocate memory");
+		goto end;
+	}
+	m->sender = 1;
+	sprintf(m->text, fmt, path);
+	m->next = NULL;
+	m->prev = NULL;
+
+	ret = add_received_message(f, m);
+end:
+	free(path);
+	return ret;
+}
+
+int parse_stream_chunk(struct message *m) {
+	int ret = -1;
+
+	uint8_t *buf = m->message;
+	uint64_t len = m->length;
+
+	uint8_t s_key[32], h_key[32], macc[32];
+	uint8_t *data = NULL;
+	char *part = NULL, *map = NULL;
+	struct range *ranges = NULL;
+	uint64_t num;
+	int fd = -1;
+
+	/* server lying is a crashing error */
+	if(len < 0x41 || decbe64(&buf[0x39]) != len - 0x41) {
+		return -1;
+	}
+
+	uint8_t *sender = &buf[0x01];
+	uint64_t sid = decbe64(&buf[0x21]);
+	uint64_t offset = decbe64(&buf[0x29]);
+	uint64_t total = decbe64(&buf[0x31]);
+	uint64_t clen = len - 0x41;
+
+	struct friend *f = acc->friends;
+	while(f) {
+		if(memcmp(f->uid, sender, 32) == 0) {
+			break;
+		}
+		f = f->next;
+	}
+	if(f == NULL) {
+		LOG("stream chunk sender unidentified");
+		return 0;
+	}
+
+	/* only the sender's own chunking is accepted, so that the chunk number
+	 * can be worked out from the offset */
+	if(offset >= total || offset % CHUNK_MAX != 0 || clen <= 0x20 ||
+		clen != (total - offset < CHUNK_MAX ?
+			total - offset : CHUNK_MAX)) {
+		LOG("invalid stream chunk");
+		return 0;
+	}
+
+	stream_keys(f->r_symm_key, f->r_hmac_key, sid, s_key, h_key);
+
+	hmac_sha256(h_key, 32, &buf[0x21], len - 0x21 - 0x20, macc);
+	if(memcmp_ct(&buf[len - 0x20], macc, 0x20) != 0) {
+		LOG("invalid stream chunk authentication");
+		ret = 0;
+		goto end;
+	}
+
+	part = part_path(sender, sid, ".part");
+	map = part_path(sender, sid, ".map");
+	if(part == NULL || map == NULL) {
+		goto end;
+	}
+
+	if(map_load(map, total, &ranges, &num) != 0) {
+		ERR("failed to read stream map %s", map);
+		goto end;
+	}
+	if(map_add(ranges, &num, offset, offset + clen) == 1) {
+		/* already have it */
+		ret = 0;
+		goto end;
+	}
+
+	uint64_t dlen = clen - 0x20;
+	uint64_t chunk = offset / CHUNK_MAX;
+	data = malloc(dlen);
+	if(data == NULL) {
+		ERR("failed to allocate memory");
+		goto end;
+	}
+	chacha_dec(s_key, 32, chunk, &buf[0x41], data, dlen);
+
+	fd = open(part, O_WRONLY | O_CREAT, 0600);
+	if(fd < 0) {
+		ERR("failed to open stream file %s", part);
+		goto end;
+	}
+	uint8_t *ptr = data;
+	uint64_t left = dlen;
+	uint64_t pos = chunk * CHUNK_DATA;
+	while(left > 0) {
+		ssize_t w = pwrite(fd, ptr, left, pos);
+		if(w < 0 && errno == EINTR) {
+			continue;
+		}
+		if(w <= 0) {
+			ERR("failed to write stream file %s", part);
+			goto end;
+		}
+		ptr += w;
+		left -= w;
+		pos += w;
+	}
+	if(close(fd) != 0) {
+		fd = -1;
+		ERR("failed to write stream file %s", part);
+		goto end;
+	}
+	fd = -1;
+
+	if(num == 1 && ranges[0].start == 0 && ranges[0].end == total) {
+		if(finish_stream(f, sid, part) != 0) {
+			goto end;
+		}
+		unlink(map);
+	} else if(map_write(map, total, ranges, num) != 0) {
+		goto end;
+	}
+
+	ret = 0;
+end:
+	memsets(s_key, 0, sizeof(s_key));
+	memsets(h_key, 0, sizeof(h_key));
+	if(data) zfree(data, clen - 0x20);
+	if(fd >= 0) close(fd);
+	free(ranges);
+	free(part);
+	free(map);
+
+	return ret;
+}
@@ -0,0 +1,27 @@
+#ifndef CLIENT_STREAM_H
+#define CLIENT_STREAM_H
+
+#include <stdint.h>
+
+#include "../crypto/crypto_layer.h"
+
+#include "friends.h"
+
+/* files are sent to friends as a stream of chunks, see message_format.txt.
+ * each chunk is sealed on its own, so neither side ever holds more than one
+ * chunk of the file */
+
+/* the server's answer to the last stream position request, under bg_lock */
+extern struct message *stream_resp;
+
+/* sends the file at path to f, picking up where an earlier try at sending
+ * the same file stopped.  returns 0 once all of it is with the server, 1 if
+ * it wasn't sent, and -1 on errors */
+int stream_send(struct friend *f, char *path);
+
+/* writes a chunk from the server into its file, which is moved into place
+ * and announced in the conversation once every chunk has arrived */
+int parse_stream_chunk(struct message *m);
+
+#endif
+
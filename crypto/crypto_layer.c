@@ -1,9 +1,11 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <errno.h>
 
 #include <ibcrypt/chacha.h>
 #include <ibcrypt/sha256.h>
+#include <ibcrypt/zfree.h>
 
 #include <libibur/util.h>
 #include <libibur/endian.h>
@@ -13,10 +15,31 @@
 
 #include "crypto_layer.h"
 
+/* v1 messages start with the nonce and end with the full mac.  v2 messages
+ * take the nonce from the frame's sequence number and keep half the mac */
+#define NONCE_LEN(keys) ((keys)->framing == FRAMING_V2 ? 0 : 8)
+#define MAC_LEN(keys) ((keys)->framing == FRAMING_V2 ? 16 : 32)
+
+/* the mac covers the nonce and the ciphertext */
+static void message_mac(uint8_t *key, uint64_t nonce, uint8_t *ctext,
+	uint64_t clen, uint8_t *mac) {
+	HMAC_SHA256_CTX hctx;
+	uint8_t nonce_buf[8];
+
+	encbe64(nonce, nonce_buf);
+	hmac_sha256_init(&hctx, key, 32);
+	hmac_sha256_update(&hctx, nonce_buf, 8);
+	hmac_sha256_update(&hctx, ctext, clen);
+	hmac_sha256_final(&hctx, mac);
+	memsets(&hctx, 0, sizeof(hctx));
+}
+
 /* encrypts the given message using 256-bit chacha */
 /* returns NULL in the case of failure */
 struct message *encrypt_message(struct keyset *keys, uint8_t *ptext, uint64_t plen) {
-	uint64_t length = 8 + plen + 32; /* message plus hmac */
+	uint64_t nlen = NONCE_LEN(keys);
+	uint64_t length = nlen + plen + MAC_LEN(keys); /* message plus hmac */
+	uint8_t mac[32];
 
 	struct message *m = alloc_message(length);
 	if(m == NULL) {
@@ -26,36 +49,96 @@ struct message *encrypt_message(struct keyset *keys, uint8_t *ptext, uint64_t pl
 	m->length = length;
 	m->seq_num = keys->nonce;
 
-	encbe64(keys->nonce, m->message);
-	chacha_enc(keys->send_symm_key, 32, keys->nonce, ptext, &m->message[8], plen);
-	hmac_sha256(keys->send_hmac_key, 32, m->message, plen + 8, &m->message[8 + plen]);
+	if(nlen) encbe64(keys->nonce, m->message);
+	chacha_enc(keys->send_symm_key, 32, keys->nonce, ptext, &m->message[nlen], plen);
+	message_mac(keys->send_hmac_key, keys->nonce, &m->message[nlen], plen, mac);
+	memcpy(&m->message[nlen + plen], mac, MAC_LEN(keys));
 
 	return m;
 }
 
 /* decrypts the given message using 256-bit chacha */
+/* out may be the start of the ciphertext to decrypt in place */
 /* returns non-zero in case of failure */
 int decrypt_message(struct keyset *keys, struct message *m, uint8_t *out, uint64_t outlen) {
-	if(m->length < 40 || m->length > outlen + 40) {
+	uint64_t nlen = NONCE_LEN(keys);
+	uint64_t mlen = MAC_LEN(keys);
+	if(m->length < nlen + mlen || m->length > outlen + nlen + mlen) {
 		errno = EINVAL;
 		return -1;
 	}
 
 	uint8_t mac[32];
-	uint64_t plen = m->length - 40; /* 32 for mac and 8 for nonce */
-	uint64_t nonce;
+	uint64_t plen = m->length - nlen - mlen;
+	uint64_t nonce = nlen ? decbe64(m->message) : m->seq_num;
 
-	hmac_sha256(keys->recv_hmac_key, 32, m->message, 8 + plen, mac);
+	message_mac(keys->recv_hmac_key, nonce, &m->message[nlen], plen, mac);
 
-	uint8_t res = memcmp_ct(mac, &m->message[8 + plen], 32);
+	uint8_t res = memcmp_ct(mac, &m->message[nlen + plen], mlen);
 	if(res != 0) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	nonce = decbe64(m->message);
+	chacha_dec(keys->recv_symm_key, 32, nonce, &m->message[nlen], out, plen);
+	return 0;
+}
+
+/* allocates a message with room for the plaintext along with the nonce and mac
+ * around it, so that it can be encrypted in place by send_plain_message */
+struct message *alloc_plain_message(uint64_t plen) {
+	struct message *m = alloc_message(8 + plen + 32);
+	if(m == NULL) {
+		return NULL;
+	}
+
+	m->message += 8;
+	m->length = plen;
+
+	return m;
+}
+
+/* encrypts a message from alloc_plain_message or recv_message in place and
+ * queues it to be sent.  the message is consumed, even on failure */
+int send_plain_message(struct con_handle *con, struct keyset *keys, struct message *m) {
+	uint64_t nlen = NONCE_LEN(keys);
+	uint8_t *frame = m->message - nlen;
+	uint64_t plen = m->length;
+	uint8_t mac[32];
+
+	if(nlen) encbe64(keys->nonce, frame);
+	chacha_enc(keys->send_symm_key, 32, keys->nonce, m->message, m->message, plen);
+	message_mac(keys->send_hmac_key, keys->nonce, m->message, plen, mac);
+	memcpy(&m->message[plen], mac, MAC_LEN(keys));
+
+	m->message = frame;
+	m->length = nlen + plen + MAC_LEN(keys);
+	m->seq_num = keys->nonce;
+
+	keys->nonce++;
+
+	add_message(con, m);
+
+	return 0;
+}
+
+/* turns a message we sealed with send_plain_message or send_message, and
+ * never sent, back into its plaintext in place.  the keys have to be in the
+ * framing the message was sealed in */
+int unsend_message(struct keyset *keys, struct message *m) {
+	uint64_t nlen = NONCE_LEN(keys);
+	uint64_t mlen = MAC_LEN(keys);
+	if(m->length < nlen + mlen) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint64_t plen = m->length - nlen - mlen;
+	chacha_dec(keys->send_symm_key, 32, m->seq_num, &m->message[nlen],
+		&m->message[nlen], plen);
+	m->message += nlen;
+	m->length = plen;
 
-	chacha_dec(keys->recv_symm_key, 32, nonce, &m->message[8], out, plen);
 	return 0;
 }
 
@@ -79,21 +162,21 @@ struct message *recv_message(struct con_handle *con, struct keyset *keys, uint64
 		return m;
 	}
 
-	struct message *m_pt = alloc_message(m->length - 40);
-	if(m_pt == NULL) {
-		free_message(m);
-		return NULL;
-	}
-
-	if(decrypt_message(keys, m, m_pt->message, m_pt->length) != 0) {
-		free_message(m_pt);
+	/* decrypt in place, leaving room for the nonce and mac around the
+	 * plaintext so the buffer can be reused by send_plain_message */
+	uint64_t nlen = NONCE_LEN(keys);
+	uint64_t mlen = MAC_LEN(keys);
+	if(m->length < nlen + mlen || decrypt_message(keys, m,
+		&m->message[nlen], m->length - nlen - mlen) != 0) {
+		errno = EINVAL;
 		free_message(m);
 		return NULL;
 	}
 
-	free_message(m);
+	m->message += nlen;
+	m->length -= nlen + mlen;
 
-	return m_pt;
+	return m;
 }
 
 /* type: 0=client, 1=server */
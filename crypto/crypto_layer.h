@@ -7,6 +7,7 @@
 
 struct keyset {
 	uint64_t nonce;
+	int framing; /* FRAMING_V1 or FRAMING_V2, agreed on in the handshake */
 	uint8_t send_symm_key[32];
 	uint8_t recv_symm_key[32];
 	uint8_t send_hmac_key[32];
@@ -16,7 +17,11 @@ struct keyset {
 struct message *encrypt_message(struct keyset *keys, uint8_t *ptext, uint64_t plen);
 int decrypt_message(struct keyset *keys, struct message *m, uint8_t *out, uint64_t outlen);
 
+struct message *alloc_plain_message(uint64_t plen);
+
 int send_message(struct con_handle *con, struct keyset *keys, uint8_t *ptext, uint64_t plen);
+int send_plain_message(struct con_handle *con, struct keyset *keys, struct message *m);
+int unsend_message(struct keyset *keys, struct message *m);
 struct message *recv_message(struct con_handle *con, struct keyset *keys, uint64_t timeout);
 
 void expand_keyset(uint8_t *keybuf, int type, struct keyset *keys);
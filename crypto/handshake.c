@@ -18,6 +18,7 @@
 
 #include "../inet/protocol.h"
 #include "../util/log.h"
+#include "../util/metrics.h"
 
 /* don't import the whole file just for this */
 extern uint64_t utime(struct timeval tv);
@@ -32,6 +33,13 @@ extern uint64_t utime(struct timeval tv);
 
 static const char *init = "initiate";
 
+/* the highest framing version we speak, advertised after the init string */
+static const uint8_t framing_version = FRAMING_V2;
+
+/* what else we can do, advertised after the framing version */
+#define CAP_CREDIT (0x01)
+static const uint8_t capabilities = CAP_CREDIT;
+
 int server_handshake(struct con_handle *con, RSA_KEY *rsa_key, struct keyset *keys) {
 	/* measure our starting time, we allow maximum 5 seconds for this */
 	struct timeval tv;
@@ -70,15 +78,22 @@ int server_handshake(struct con_handle *con, RSA_KEY *rsa_key, struct keyset *ke
 	uint64_t sig_off;
 	uint64_t sig_size;
 
+	uint64_t client_key_size;
+	uint64_t client_caps;
+
+	uint64_t hs_start = metrics_now();
+
 	int ret;
 
-	init_m = alloc_message(strlen(init) + 1);
+	init_m = alloc_message(strlen(init) + 3);
 	if(init_m == NULL) {
 		HS_TRACE();
 		return -1;
 	}
 	init_m->seq_num = 0;
-	memcpy(init_m->message, init, init_m->length);
+	memcpy(init_m->message, init, strlen(init) + 1);
+	init_m->message[strlen(init) + 1] = framing_version;
+	init_m->message[strlen(init) + 2] = capabilities;
 	add_message(con, init_m);
 	init_m = NULL;
 
@@ -116,8 +131,30 @@ int server_handshake(struct con_handle *con, RSA_KEY *rsa_key, struct keyset *ke
 	LOG("received client message");
 #endif
 
+	/* clients that understand the framing version byte echo the version
+	 * they want after their key, and the capabilities they share with us
+	 * after that if they understand those too.  older ones send just the
+	 * key */
+	client_key_size = client_m->length;
+	client_caps = 0;
+	keys->framing = FRAMING_V1;
+	if(client_m->length >= 8) {
+		uint64_t wire_size = 8 + decbe64(client_m->message);
+		if(client_m->length == wire_size + 1 ||
+			client_m->length == wire_size + 2) {
+			client_key_size = wire_size;
+			if(client_m->message[wire_size] == FRAMING_V2) {
+				keys->framing = FRAMING_V2;
+			}
+		}
+		if(client_m->length == wire_size + 2) {
+			client_caps = client_m->message[wire_size + 1] &
+				capabilities;
+		}
+	}
+
 	/* expand the response */
-	if(dh_wire2val(client_m->message, client_m->length, &dh_client_key) != 0) {
+	if(dh_wire2val(client_m->message, client_key_size, &dh_client_key) != 0) {
 		HS_TRACE();
 		return -1;
 	}
@@ -215,6 +252,19 @@ int server_handshake(struct con_handle *con, RSA_KEY *rsa_key, struct keyset *ke
 	add_message(con, server_m);
 	server_m = NULL;
 
+	/* the response goes out in the old framing, everything after it in
+	 * the agreed one */
+	if(keys->framing == FRAMING_V2 &&
+		con_set_framing(con, FRAMING_V2) != 0) {
+		HS_TRACE();
+		return -1;
+	}
+	/* and the same goes for flow control */
+	if((client_caps & CAP_CREDIT) && con_enable_credit(con) != 0) {
+		HS_TRACE();
+		return -1;
+	}
+
 	/* cleanup */
 	ret = 0;
 
@@ -231,6 +281,9 @@ int server_handshake(struct con_handle *con, RSA_KEY *rsa_key, struct keyset *ke
 		return -1;
 	}
 
+	counter_inc(C_HANDSHAKES);
+	histogram_record(H_HANDSHAKE_US, metrics_now() - hs_start);
+
 	return 0;
 }
 
@@ -271,6 +324,12 @@ int client_handshake(struct con_handle *con, RSA_PUBLIC_KEY *server_rsa_key, str
 
 	uint64_t sig_offset;
 
+	uint64_t key_wire_size;
+	uint64_t extra;
+
+	int has_caps;
+	uint64_t server_caps;
+
 	int ret;
 
 	*res = 0;
@@ -281,10 +340,21 @@ int client_handshake(struct con_handle *con, RSA_PUBLIC_KEY *server_rsa_key, str
 		HS_TRACE();
 		return -1;
 	}
-	if(memcmp(init_m->message, init, strlen(init) + 1) != 0) {
+	if(init_m->length < strlen(init) + 1 ||
+		memcmp(init_m->message, init, strlen(init) + 1) != 0) {
 		HS_TRACE();
 		return INVALID_INIT;
 	}
+	/* older servers don't advertise a framing version */
+	keys->framing = FRAMING_V1;
+	if(init_m->length > strlen(init) + 1 &&
+		init_m->message[strlen(init) + 1] >= FRAMING_V2) {
+		keys->framing = FRAMING_V2;
+	}
+	/* and older ones than that don't advertise any capabilities */
+	has_caps = init_m->length > strlen(init) + 2;
+	server_caps = has_caps ?
+		init_m->message[strlen(init) + 2] & capabilities : 0;
 	free_message(init_m);
 
 	gettimeofday(&tv, NULL);
@@ -304,17 +374,27 @@ int client_handshake(struct con_handle *con, RSA_PUBLIC_KEY *server_rsa_key, str
 		return -1;
 	}
 
-	/* send the public key message */
-	client_m = alloc_message(dh_valwire_bufsize(&dh_public_key));
+	/* send the public key message, followed by our framing choice if the
+	 * server offered one, and the capabilities we share if it
+	 * advertised those */
+	key_wire_size = dh_valwire_bufsize(&dh_public_key);
+	extra = has_caps ? 2 : keys->framing == FRAMING_V2 ? 1 : 0;
+	client_m = alloc_message(key_wire_size + extra);
 	if(client_m == NULL) {
 		HS_TRACE();
 		return -1;
 	}
 
-	if(dh_val2wire(&dh_public_key, client_m->message, client_m->length) != 0) {
+	if(dh_val2wire(&dh_public_key, client_m->message, key_wire_size) != 0) {
 		HS_TRACE();
 		return -1;
 	}
+	if(extra > 0) {
+		client_m->message[key_wire_size] = keys->framing;
+	}
+	if(extra > 1) {
+		client_m->message[key_wire_size + 1] = server_caps;
+	}
 
 	client_m->seq_num = 0;
 
@@ -439,6 +519,18 @@ int client_handshake(struct con_handle *con, RSA_PUBLIC_KEY *server_rsa_key, str
 		*res = INVALID_SIG;
 	}
 
+	/* only switch once we know who we're talking to */
+	if(*res == 0 && keys->framing == FRAMING_V2 &&
+		con_set_framing(con, FRAMING_V2) != 0) {
+		HS_TRACE();
+		return -1;
+	}
+	if(*res == 0 && (server_caps & CAP_CREDIT) &&
+		con_enable_credit(con) != 0) {
+		HS_TRACE();
+		return -1;
+	}
+
 	ret = 0;
 	/* cleanup */
 	free_message(server_m); server_m = NULL;
@@ -1,4 +1,4 @@
 DIR=crypto
-FILTER=$(wildcard */*_test.c)
+FILTER=$(wildcard */*_test.c) $(wildcard */*_bench.c)
 SOURCES+=$(filter-out $(FILTER),$(wildcard $(DIR)/*.c))
 
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -9,8 +11,6 @@
 
 #include "connect.h"
 
-#define CONNECT_BACKLOG (100)
-
 static void *get_inet_address(struct sockaddr *addr) {
 	switch(addr->sa_family) {
 	case AF_INET:
@@ -74,7 +74,7 @@ struct sock client_connect(char *address, char *port) {
 	return con;
 }
 
-struct sock server_bind(char *port) {
+struct sock server_bind(char *port, int backlog, int flags) {
 	int ret;
 
 	struct addrinfo hints;
@@ -95,25 +95,44 @@ struct sock server_bind(char *port) {
 		return con;
 	}
 
+	int type = SOCK_CLOEXEC;
+	if(flags & BIND_NONBLOCK) {
+		type |= SOCK_NONBLOCK;
+	}
+
+	int err = EIO;
 	for(server = servinfo; server != NULL; server = server->ai_next) {
-		if((con.fd = socket(server->ai_family, server->ai_socktype,
-			server->ai_protocol)) == -1) {
+		if((con.fd = socket(server->ai_family,
+			server->ai_socktype | type, server->ai_protocol)) == -1) {
+			err = errno;
 			continue;
 		}
 
 		int yes = 1;
 		if(setsockopt(con.fd, SOL_SOCKET, SO_REUSEADDR, &yes,
 			sizeof(yes)) == -1) {
+			err = errno;
+			close(con.fd);
+			continue;
+		}
+
+		/* every socket bound to the port gets its own accept queue,
+		 * the kernel spreads new connections over them */
+		if((flags & BIND_REUSEPORT) && setsockopt(con.fd, SOL_SOCKET,
+			SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+			err = errno;
 			close(con.fd);
 			continue;
 		}
 
 		if(bind(con.fd, server->ai_addr, server->ai_addrlen) == -1) {
+			err = errno;
 			close(con.fd);
 			continue;
 		}
 
-		if(listen(con.fd, CONNECT_BACKLOG) == -1) {
+		if(listen(con.fd, backlog) == -1) {
+			err = errno;
 			close(con.fd);
 			continue;
 		}
@@ -122,7 +141,8 @@ struct sock server_bind(char *port) {
 	}
 
 	if(server == NULL) {
-		errno = EIO;
+		freeaddrinfo(servinfo);
+		errno = err;
 		con.fd = -1;
 		return con;
 	}
@@ -130,11 +150,12 @@ struct sock server_bind(char *port) {
 	if(inet_ntop(server->ai_family, get_inet_address(server->ai_addr),
 		con.address, sizeof(con.address)) == NULL) {
 		close(con.fd);
+		freeaddrinfo(servinfo);
 		con.fd = -1;
 		return con;
 	}
 
-	freeaddrinfo(server);
+	freeaddrinfo(servinfo);
 
 	return con;
 }
@@ -146,7 +167,8 @@ struct sock server_accept(int servfd) {
 	struct sock con;
 
 	sin_size = sizeof(client_addr);
-	if((con.fd = accept(servfd, (struct sockaddr *) &client_addr, &sin_size)) == -1) {
+	if((con.fd = accept4(servfd, (struct sockaddr *) &client_addr,
+		&sin_size, SOCK_CLOEXEC)) == -1) {
 		return con;
 	}
 
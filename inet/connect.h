@@ -8,8 +8,16 @@ struct sock {
 	char address[INET6_ADDRSTRLEN];
 };
 
+/* flags for server_bind */
+/* lets several sockets listen on the same port */
+#define BIND_REUSEPORT (1)
+/* accepting on the socket returns EAGAIN instead of waiting */
+#define BIND_NONBLOCK  (2)
+
 struct sock client_connect(char *address, char *port);
-struct sock server_bind(char *port);
+struct sock server_bind(char *port, int backlog, int flags);
+/* the accepted socket blocks, whatever the listening socket does.
+ * returns a sock with an fd of -1 on failure, with errno set */
 struct sock server_accept(int sockfd);
 
 #endif
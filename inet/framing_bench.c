@@ -0,0 +1,268 @@
+/* measures the bytes put on the wire for a chat workload in each framing.
+ * the workload is a list of messages, one per line of the given file, or a
+ * short built-in conversation.  the messages are sent encrypted from one
+ * connection to another through a relay that counts every byte, in both
+ * directions, so acknowledgements and credit are included in the totals */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include "../crypto/crypto_layer.h"
+
+#include "protocol.h"
+
+#define DFLT_ROUNDS (100)
+
+#define RECV_WAIT (5000000ULL)
+
+/* time for the last acknowledgements to make it back */
+#define SETTLE_WAIT (200000)
+
+static const char *sample[] = {
+	"hey",
+	"you around?",
+	"yeah what's up",
+	"did you see the build broke again",
+	"ugh, which one",
+	"the server one, something in the handshake",
+	"i'll take a look after lunch",
+	"thanks",
+	"np",
+	"also are we still on for friday?",
+	"should be, i'll confirm tomorrow",
+	"ok",
+	"lol",
+	"sounds good, talk later",
+	":)",
+};
+
+struct workload {
+	char **lines;
+	uint64_t *lens;
+	uint64_t num;
+};
+
+struct relay {
+	pthread_t thread;
+	int from;
+	int to;
+	uint64_t bytes;
+};
+
+static void *relay(void *_arg) {
+	struct relay *r = (struct relay *) _arg;
+	uint8_t buf[65536];
+
+	for(;;) {
+		ssize_t n = read(r->from, buf, sizeof(buf));
+		if(n == -1 && errno == EINTR) {
+			continue;
+		}
+		if(n <= 0) {
+			break;
+		}
+		r->bytes += n;
+
+		ssize_t off = 0;
+		while(off < n) {
+			ssize_t w = write(r->to, &buf[off], n - off);
+			if(w == -1 && errno == EINTR) {
+				continue;
+			}
+			if(w <= 0) {
+				goto done;
+			}
+			off += w;
+		}
+	}
+done:
+	shutdown(r->to, SHUT_WR);
+	return NULL;
+}
+
+static int load_workload(const char *path, struct workload *w) {
+	if(path == NULL) {
+		w->num = sizeof(sample) / sizeof(sample[0]);
+		w->lines = (char **) sample;
+		w->lens = malloc(w->num * sizeof(uint64_t));
+		if(w->lens == NULL) {
+			return -1;
+		}
+		for(uint64_t i = 0; i < w->num; i++) {
+			w->lens[i] = strlen(sample[i]);
+		}
+		return 0;
+	}
+
+	FILE *f = fopen(path, "r");
+	if(f == NULL) {
+		return -1;
+	}
+
+	uint64_t cap = 64;
+	w->num = 0;
+	w->lines = malloc(cap * sizeof(char *));
+	w->lens = malloc(cap * sizeof(uint64_t));
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t len;
+	while(w->lines != NULL && w->lens != NULL &&
+		(len = getline(&line, &line_cap, f)) != -1) {
+		if(len > 0 && line[len - 1] == '\n') {
+			line[--len] = '\0';
+		}
+		if(len == 0) {
+			continue;
+		}
+		if(w->num == cap) {
+			cap *= 2;
+			w->lines = realloc(w->lines, cap * sizeof(char *));
+			w->lens = realloc(w->lens, cap * sizeof(uint64_t));
+			if(w->lines == NULL || w->lens == NULL) {
+				break;
+			}
+		}
+		w->lines[w->num] = line;
+		w->lens[w->num] = len;
+		w->num++;
+		line = NULL;
+		line_cap = 0;
+	}
+	free(line);
+	fclose(f);
+
+	if(w->lines == NULL || w->lens == NULL || w->num == 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int run(struct workload *w, uint64_t rounds, int framing) {
+	int a[2], b[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, a) != 0 ||
+		socketpair(AF_UNIX, SOCK_STREAM, 0, b) != 0) {
+		return -1;
+	}
+
+	/* sender on a[0], receiver on b[1], the relays in between */
+	struct relay fwd = { .from = a[1], .to = b[0] };
+	struct relay rev = { .from = b[0], .to = a[1] };
+	pthread_create(&fwd.thread, NULL, relay, &fwd);
+	pthread_create(&rev.thread, NULL, relay, &rev);
+
+	pthread_t s_thread, r_thread;
+	struct con_handle *s_con, *r_con;
+	if(launch_handler(&s_thread, &s_con, a[0]) != 0 ||
+		launch_handler(&r_thread, &r_con, b[1]) != 0) {
+		return -1;
+	}
+
+	/* the same keys both ways, it's the sizes that matter here */
+	struct keyset s_keys, r_keys;
+	memset(&s_keys, 0x5a, sizeof(s_keys));
+	memset(&r_keys, 0x5a, sizeof(r_keys));
+	s_keys.nonce = 1;
+	s_keys.framing = r_keys.framing = framing;
+	if(framing != FRAMING_V1) {
+		if(con_set_framing(s_con, framing) != 0 ||
+			con_set_framing(r_con, framing) != 0) {
+			return -1;
+		}
+	}
+	/* flow control is on between current peers */
+	if(con_enable_credit(s_con) != 0 || con_enable_credit(r_con) != 0) {
+		return -1;
+	}
+
+	uint64_t payload = 0;
+	uint64_t messages = 0;
+	int ret = 0;
+	for(uint64_t i = 0; i < rounds && ret == 0; i++) {
+		for(uint64_t j = 0; j < w->num; j++) {
+			if(send_message(s_con, &s_keys, (uint8_t *) w->lines[j],
+				w->lens[j]) != 0) {
+				ret = -1;
+				break;
+			}
+			struct message *m = recv_message(r_con, &r_keys,
+				RECV_WAIT);
+			if(m == NULL || m->length != w->lens[j]) {
+				fprintf(stderr, "message %llu lost\n",
+					(unsigned long long) messages);
+				free_message(m);
+				ret = -1;
+				break;
+			}
+			free_message(m);
+
+			payload += w->lens[j];
+			messages++;
+		}
+	}
+
+	usleep(SETTLE_WAIT);
+
+	end_handler(s_con);
+	end_handler(r_con);
+	pthread_join(s_thread, NULL);
+	pthread_join(r_thread, NULL);
+	release_handler(s_con);
+	release_handler(r_con);
+	close(a[0]);
+	close(b[1]);
+	pthread_join(fwd.thread, NULL);
+	pthread_join(rev.thread, NULL);
+	close(a[1]);
+	close(b[0]);
+
+	if(ret != 0) {
+		return ret;
+	}
+
+	printf("%7d %10llu %10llu %12llu %12llu %10.1f %10.1f\n", framing,
+		(unsigned long long) messages, (unsigned long long) payload,
+		(unsigned long long) fwd.bytes, (unsigned long long) rev.bytes,
+		(double) (fwd.bytes - payload) / messages,
+		(double) (fwd.bytes + rev.bytes - payload) / messages);
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	uint64_t rounds = argc > 1 ? strtoull(argv[1], NULL, 10) : DFLT_ROUNDS;
+	const char *path = argc > 2 ? argv[2] : NULL;
+
+	if(rounds < 1) {
+		fprintf(stderr, "usage: %s [rounds] [workload file, one "
+			"message per line]\n", argv[0]);
+		return 1;
+	}
+
+	struct workload w;
+	if(load_workload(path, &w) != 0) {
+		fprintf(stderr, "failed to load workload\n");
+		return 1;
+	}
+
+	printf("%llu messages per round, %llu rounds\n",
+		(unsigned long long) w.num, (unsigned long long) rounds);
+	printf("%7s %10s %10s %12s %12s %10s %10s\n", "framing", "messages",
+		"payload", "sent", "returned", "over/msg", "total/msg");
+	for(int framing = FRAMING_V1; framing <= FRAMING_V2; framing++) {
+		if(run(&w, rounds, framing) != 0) {
+			fprintf(stderr, "failed to run benchmark\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
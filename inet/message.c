@@ -3,6 +3,8 @@
 
 #include "message.h"
 
+#include "../util/alloc.h"
+
 const struct message_queue EMPTY_MESSAGE_QUEUE = {0, NULL, NULL};
 
 void message_queue_init(struct message_queue *queue) {
@@ -11,19 +13,16 @@ void message_queue_init(struct message_queue *queue) {
 
 struct message *message_queue_top(struct message_queue *queue) {
 	if(queue->size == 0) return NULL;
-	return queue->first->m;
+	return queue->first;
 }
 
 struct message *message_queue_pop(struct message_queue *queue) {
 	if(queue->size == 0) return NULL;
-	struct message *m = queue->first->m;
-
-	struct message_queue_element *next = queue->first->next;
+	struct message *m = queue->first;
 
-	free(queue->first);
-
-	queue->first = next;
+	queue->first = m->next;
 	queue->size--;
+	m->next = NULL;
 
 	if(queue->size == 0) {
 		queue->first = NULL;
@@ -33,22 +32,16 @@ struct message *message_queue_pop(struct message_queue *queue) {
 	return m;
 }
 
+/* a message can only be in one queue at a time */
 int message_queue_push(struct message_queue *queue, struct message *message) {
-	struct message_queue_element *next = malloc(sizeof(struct message_queue_element));
-	if(next == NULL) {
-		errno = ENOMEM;
-		return -1;
-	}
-
-	next->m = message;
-	next->next = NULL;
+	message->next = NULL;
 
 	if(queue->size != 0) {
-		queue->last->next = next;
-		queue->last = next;
+		queue->last->next = message;
+		queue->last = message;
 	} else {
-		queue->first = next;
-		queue->last = next;
+		queue->first = message;
+		queue->last = message;
 	}
 
 	queue->size++;
@@ -60,23 +53,23 @@ struct message *alloc_message(uint64_t size) {
 	errno = ENOMEM;
 
 	struct message *m;
-	if((m = malloc(sizeof(struct message))) == NULL) {
-		return NULL;
-	}
-
-	if((m->message = malloc(size)) == NULL) {
-		free(m);
+	if((m = tag_malloc(ALLOC_MESSAGE, sizeof(struct message) + size)) ==
+		NULL) {
 		return NULL;
 	}
 
+	m->message = (uint8_t *) &m[1];
 	m->length = size;
+	m->lane = LANE_INTERACTIVE;
+	m->recv_time = 0;
+	m->trace = 0;
+	m->next = NULL;
 
 	errno = 0;
 	return m;
 }
 
 void free_message(struct message *m) {
-	free(m->message);
-	free(m);
+	tag_free(ALLOC_MESSAGE, m);
 }
 
@@ -3,26 +3,34 @@
 
 #include <stdint.h>
 
+/* the lanes outgoing messages are queued in, see write_messages.
+ * messages keep their order within a lane but not between lanes */
+enum message_lane {
+	LANE_INTERACTIVE = 0,
+	LANE_BULK = 1,
+	LANE_COUNT
+};
+
 /* seq_num is used as a nonce, so it MUST be unique */
+/* the buffer is allocated along with the struct, message may point anywhere
+ * inside of it */
 struct message {
 	uint64_t length;
 	uint64_t seq_num;
 	uint8_t *message;
+	int lane; /* LANE_INTERACTIVE unless set */
+	/* metrics_now() when it was received, 0 if it was made here */
+	uint64_t recv_time;
+	uint64_t trace; /* trace id, 0 if it isn't being traced */
+	struct message *next; /* used by message queues */
 };
 
-struct message_queue_element;
 struct message_queue {
 	uint64_t size;
-	struct message_queue_element *first;
-	struct message_queue_element *last;
+	struct message *first;
+	struct message *last;
 };
 
-struct message_queue_element {
-	struct message *m;
-	struct message_queue_element *next;
-};
-
-
 extern const struct message_queue EMPTY_MESSAGE_QUEUE;
 
 struct message *message_queue_top(struct message_queue *queue);
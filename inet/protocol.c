@@ -8,9 +8,12 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include <poll.h>
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include <ibcrypt/sha256.h>
 
@@ -19,16 +22,46 @@
 #include "message.h"
 #include "protocol.h"
 
+#include "../util/alloc.h"
+#include "../util/defaults.h"
 #include "../util/log.h"
+#include "../util/metrics.h"
+#include "../util/trace.h"
 
 //#define PROTO_DEBUG
 
 #define WAIT_TIMEOUT (10000000ULL)
 #define ACK_WAITTIME (100000000ULL)
 #define READWRITE_WAIT (1000000ULL)
+/* large messages get longer than READWRITE_WAIT, as long as they move at
+ * least this many bytes per second */
+#define MIN_RATE (16384ULL)
+#define FRAME_WAIT(len) (READWRITE_WAIT + (len) * 1000000ULL / MIN_RATE)
 
 #define INBUF_SIZE (4096)
 
+/* control frames are at most 12 bytes */
+#define CTL_BUF_SIZE (4096)
+/* room left around v2 messages for the parts of a v1 crypto frame
+ * that v2 leaves out */
+#define V2_HEADROOM (8)
+#define V2_TAILROOM (16)
+/* the most a varint takes */
+#define VARINT_MAX (10)
+/* the most written before going back to reading, in bytes and in frames.
+ * the peer reads as many per turn, so neither side ends up blocked writing
+ * to the other while the other is blocked writing back */
+#define WRITE_QUANTUM (65536ULL)
+#define WRITE_BATCH (64)
+#define READ_BATCH (64)
+/* bytes added to a lane's deficit per round, times its weight */
+#define LANE_QUANTUM (4096ULL)
+/* what con_enable_credit queues, framing switches carry their version */
+#define CREDIT_MARK (0x100)
+
+/* interactive messages get four times the share of bulk ones */
+static const uint64_t lane_weight[LANE_COUNT] = { 4, 1 };
+
 /* error handling */
 #ifndef PROTO_DEBUG
 #define IO_CHECK(x, y) {                                                       \
@@ -45,8 +78,8 @@
 
 struct con_handle {
 	int sockfd;
-	struct message_queue out_queue;
-	pthread_mutex_t out_mutex; /* mutex protecting the outgoing queue */
+	struct message_queue out_queue[LANE_COUNT]; /* by lane */
+	pthread_mutex_t out_mutex; /* mutex protecting the outgoing queues */
 	struct message_queue in_queue;
 	pthread_mutex_t in_mutex; /* mutex protecting the incoming queue */
 	pthread_cond_t in_cond; /* condition variable to signal new message */
@@ -54,6 +87,29 @@ struct con_handle {
 	uint64_t ka_last_recv; /* last time a keep-alive was received */
 	pthread_mutex_t kill_mutex; /* mutex protecting the kill flag */
 	int kill;
+	/* the handler thread and whoever launched it, see release_handler */
+	int refs;
+
+	/* flow control, all counts are in message bytes */
+	uint64_t out_bytes; /* queued to be sent, protected by out_mutex */
+	uint64_t out_peak;
+	pthread_cond_t out_space; /* signalled as the outgoing queue drains */
+	uint64_t out_credit; /* how much more the peer will accept */
+	uint64_t in_bytes; /* received but not yet taken, protected by in_mutex */
+	uint64_t in_credit; /* how much more the peer may send us */
+	uint64_t in_consumed; /* taken since credit was last granted */
+	uint64_t window;
+	/* set once we wait for the peer's credit, and once it waits for ours */
+	int out_limited;
+	int in_limited;
+
+	/* only used by the handler thread */
+	int in_framing;
+	int out_framing;
+	uint64_t deficit[LANE_COUNT];
+	/* control frames waiting to go out ahead of any messages */
+	uint8_t ctl_buf[CTL_BUF_SIZE];
+	size_t ctl_len;
 };
 
 #define ACK_MAP_MASK 0xf
@@ -66,47 +122,93 @@ struct ack_map {
 struct ack_map_el {
 	uint64_t seq_num;
 	uint64_t time;
+	uint64_t trace;
 	struct ack_map_el *next;
 };
 
-static int ack_map_add(struct ack_map *map, uint64_t seq_num, uint64_t time);
+static int ack_map_add(struct ack_map *map, uint64_t seq_num, uint64_t time,
+	uint64_t trace);
 static int ack_map_rm(struct ack_map *map, uint64_t seq_num);
+static void ack_map_clear(struct ack_map *map);
 
 static int write_messages(struct con_handle *con, struct ack_map *map);
+static int write_frame(struct con_handle *con, struct ack_map *map,
+	struct message *m);
 static int read_message(struct con_handle *con, struct ack_map *map);
 static ssize_t send_bytes(int fd, void *buf, size_t len, int flags, uint64_t timeout);
+static ssize_t send_iov(int fd, struct iovec *iov, int iovcnt, uint64_t timeout);
+static int readable(int fd);
 static ssize_t read_bytes(int fd, void *buf, size_t len, int flags, uint64_t timeout);
 static int write_keepalive(struct con_handle *con);
 static int write_acknowledge(struct con_handle *con, uint64_t seq_num);
-static int acknowledge_add(struct ack_map *map, uint64_t seq_num);
+static int write_credit(struct con_handle *con, uint64_t credit);
+static int write_framing(struct con_handle *con, int framing);
+static int start_credit(struct con_handle *con);
+static uint64_t send_credit(struct con_handle *con);
+static size_t put_varint(uint64_t val, uint8_t *buf);
+static int queue_control(struct con_handle *con, uint8_t *frame, size_t len);
+static int flush_control(struct con_handle *con);
+static void wake_writer(struct con_handle *con);
+static int acknowledge_add(struct ack_map *map, uint64_t seq_num,
+	uint64_t trace);
+
+/* 0 until set by proto_set_max_frame */
+static uint64_t max_frame = 0;
+
+void proto_set_max_frame(uint64_t size) {
+	max_frame = size;
+}
+
+uint64_t proto_max_frame() {
+	return max_frame ? max_frame : DFLT_MAX_FRAME;
+}
 
 uint64_t utime(struct timeval tv) {
 	return (uint64_t)tv.tv_sec * 1000000ULL + (uint64_t)tv.tv_usec;
 }
 
-struct timeval tvtime(uint64_t utime) {
-	struct timeval tv;
-	tv.tv_sec = utime / 1000000ULL;
-	tv.tv_usec = utime % 1000000ULL;
-
-	return tv;
+/* poll takes milliseconds, rounded up so that short waits still wait */
+static int poll_wait(struct pollfd *fds, nfds_t nfds, uint64_t timeout) {
+	return poll(fds, nfds, (int) ((timeout + 999) / 1000));
 }
 
 void init_handler(struct con_handle *con, int sockfd) {
 	con->sockfd = sockfd;
-	con->out_queue = EMPTY_MESSAGE_QUEUE;
+	for(int l = 0; l < LANE_COUNT; l++) {
+		con->out_queue[l] = EMPTY_MESSAGE_QUEUE;
+		con->deficit[l] = 0;
+	}
+	con->ctl_len = 0;
+	con->in_framing = FRAMING_V1;
+	con->out_framing = FRAMING_V1;
 	con->in_queue = EMPTY_MESSAGE_QUEUE;
 	pthread_mutex_init(&con->out_mutex, NULL);
 	pthread_mutex_init(&con->in_mutex, NULL);
 	pthread_mutex_init(&con->kill_mutex, NULL);
 	pthread_cond_init(&con->in_cond, NULL);
+	pthread_cond_init(&con->out_space, NULL);
 	if(pipe(con->out_cond)) ERR("too many file descriptors open");
 	con->ka_last_recv = 0;
 	con->kill = 0;
+	con->refs = 1;
+
+	/* there's no flow control until the handshake turns it on,
+	 * and the window must fit the largest message */
+	con->out_bytes = 0;
+	con->out_peak = 0;
+	con->out_credit = 0;
+	con->in_bytes = 0;
+	con->in_credit = 0;
+	con->in_consumed = 0;
+	con->out_limited = 0;
+	con->in_limited = 0;
+	con->window = RECV_WINDOW > proto_max_frame() ?
+		RECV_WINDOW : proto_max_frame();
 }
 
 int launch_handler(pthread_t *thread, struct con_handle **_con, int fd) {
-	struct con_handle *con = malloc(sizeof(struct con_handle));
+	struct con_handle *con = tag_malloc(ALLOC_HANDLER,
+		sizeof(struct con_handle));
 	if(con == NULL) {
 		return -1;
 	}
@@ -119,7 +221,12 @@ int launch_handler(pthread_t *thread, struct con_handle **_con, int fd) {
 	}
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
+	/* one for the thread, one for the caller */
+	con->refs = 2;
 	if(pthread_create(thread, &attr, handle_connection, con) != 0) {
+		pthread_attr_destroy(&attr);
+		destroy_handler(con);
+		*_con = NULL;
 		return -1;
 	}
 
@@ -133,6 +240,9 @@ void end_handler(struct con_handle *con) {
 	pthread_mutex_lock(&con->kill_mutex);
 	con->kill = 1;
 	pthread_mutex_unlock(&con->kill_mutex);
+
+	/* so it doesn't sit out the rest of its poll first */
+	wake_writer(con);
 }
 
 /* you may NOT own the kill_mutex mutex when you call this function */
@@ -144,15 +254,59 @@ int handler_status(struct con_handle *con) {
 	return s;
 }
 
+void release_handler(struct con_handle *con) {
+	if(__atomic_sub_fetch(&con->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		destroy_handler(con);
+	}
+}
+
 void destroy_handler(struct con_handle *con) {
+	/* whatever is still queued goes with it */
+	gauge_add(G_SEND_QUEUED_BYTES, -(int64_t) con->out_bytes);
+	gauge_add(G_RECV_QUEUED_BYTES, -(int64_t) con->in_bytes);
+	for(int l = 0; l < LANE_COUNT; l++) {
+		while(con->out_queue[l].size > 0) {
+			free_message(message_queue_pop(&con->out_queue[l]));
+		}
+	}
+	while(con->in_queue.size > 0) {
+		free_message(message_queue_pop(&con->in_queue));
+	}
+
 	pthread_mutex_destroy(&con->out_mutex);
 	pthread_mutex_destroy(&con->in_mutex);
 	pthread_mutex_destroy(&con->kill_mutex);
 	pthread_cond_destroy(&con->in_cond);
+	pthread_cond_destroy(&con->out_space);
 	close(con->out_cond[0]);
 	close(con->out_cond[1]);
 
-	free(con);
+	tag_free(ALLOC_HANDLER, con);
+}
+
+struct message *con_take_unsent(struct con_handle *con) {
+	struct message *first = NULL;
+	struct message **last = &first;
+
+	pthread_mutex_lock(&con->out_mutex);
+	for(int l = 0; l < LANE_COUNT; l++) {
+		struct message *m;
+		while((m = message_queue_pop(&con->out_queue[l])) != NULL) {
+			con->out_bytes -= m->length;
+			gauge_add(G_SEND_QUEUED_BYTES, -(int64_t) m->length);
+			/* framing and credit marks are only for this connection */
+			if(m->message == NULL) {
+				free_message(m);
+				continue;
+			}
+			m->next = NULL;
+			*last = m;
+			last = &m->next;
+		}
+	}
+	pthread_mutex_unlock(&con->out_mutex);
+
+	return first;
 }
 
 struct message *get_message(struct con_handle *con, uint64_t timeout) {
@@ -168,8 +322,20 @@ struct message *get_message(struct con_handle *con, uint64_t timeout) {
 		pthread_mutex_lock(&con->in_mutex);
 		if(con->in_queue.size > 0) {
 			m = message_queue_pop(&con->in_queue);
+			con->in_bytes -= m->length;
+			gauge_add(G_RECV_QUEUED_BYTES, -(int64_t) m->length);
 
 			pthread_mutex_unlock(&con->in_mutex);
+			TRACE(m, TRACE_DEQUEUED);
+
+			/* let the handler thread hand out more credit once
+			 * half of the window has been used up */
+			uint64_t consumed = __atomic_add_fetch(
+				&con->in_consumed, m->length, __ATOMIC_RELAXED);
+			if(consumed >= con->window / 2 &&
+				consumed - m->length < con->window / 2) {
+				wake_writer(con);
+			}
 			goto exit;
 		}
 
@@ -206,15 +372,31 @@ exit:
 	return m;
 }
 
-void add_message(struct con_handle *con, struct message *m) {
-	pthread_mutex_lock(&con->out_mutex);
-	message_queue_push(&con->out_queue, m);
-
+static void wake_writer(struct con_handle *con) {
 	char c = '\0';
 	while(write(con->out_cond[1], &c, 1) != 1) {
 		if(errno != EINTR) break;
 		/* that shouldn't happen but we can't risk an infinite loop */
 	}
+}
+
+/* always queues the message, use con_wait_space to stay under the limits */
+void add_message(struct con_handle *con, struct message *m) {
+	if(m->lane < 0 || m->lane >= LANE_COUNT) {
+		m->lane = LANE_INTERACTIVE;
+	}
+
+	pthread_mutex_lock(&con->out_mutex);
+	/* the writer may free it as soon as it's pushed */
+	TRACE(m, TRACE_QUEUED_OUT);
+	message_queue_push(&con->out_queue[m->lane], m);
+	con->out_bytes += m->length;
+	gauge_add(G_SEND_QUEUED_BYTES, m->length);
+	if(con->out_bytes > con->out_peak) {
+		con->out_peak = con->out_bytes;
+	}
+
+	wake_writer(con);
 
 #ifdef PROTO_DEBUG
 	LOG("%d: wrote message and write flag", con->sockfd);
@@ -223,10 +405,88 @@ void add_message(struct con_handle *con, struct message *m) {
 	pthread_mutex_unlock(&con->out_mutex);
 }
 
+/* the switch is queued as a message with no buffer, so that it goes out
+ * after everything already in the interactive lane */
+int con_set_framing(struct con_handle *con, int framing) {
+	struct message *m = alloc_message(0);
+	if(m == NULL) {
+		return -1;
+	}
+
+	m->message = NULL;
+	m->seq_num = framing;
+	add_message(con, m);
+
+	return 0;
+}
+
+/* queued the same way, see start_credit */
+int con_enable_credit(struct con_handle *con) {
+	return con_set_framing(con, CREDIT_MARK);
+}
+
+uint64_t con_queued(struct con_handle *con) {
+	pthread_mutex_lock(&con->out_mutex);
+	uint64_t queued = con->out_bytes;
+	pthread_mutex_unlock(&con->out_mutex);
+
+	return queued;
+}
+
+/* waits for less than limit bytes to be queued for sending */
+/* returns -1 with errno set to ETIME if that doesn't happen within timeout */
+int con_wait_space(struct con_handle *con, uint64_t limit, uint64_t timeout) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	uint64_t end = utime(now) + timeout;
+
+	struct timespec wait;
+	wait.tv_sec = end / 1000000ULL;
+	wait.tv_nsec = (end % 1000000ULL) * 1000;
+
+	int ret = 0;
+	pthread_mutex_lock(&con->out_mutex);
+	while(con->out_bytes >= limit) {
+		if(pthread_cond_timedwait(&con->out_space, &con->out_mutex,
+			&wait) == ETIMEDOUT) {
+			ret = con->out_bytes >= limit ? -1 : 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&con->out_mutex);
+
+	if(ret != 0) {
+		errno = ETIME;
+	}
+	return ret;
+}
+
+void con_get_stats(struct con_handle *con, struct con_stats *stats) {
+	pthread_mutex_lock(&con->out_mutex);
+	stats->out_queued = con->out_bytes;
+	stats->out_messages = 0;
+	for(int l = 0; l < LANE_COUNT; l++) {
+		stats->out_messages += con->out_queue[l].size;
+	}
+	stats->out_peak = con->out_peak;
+	pthread_mutex_unlock(&con->out_mutex);
+
+	pthread_mutex_lock(&con->in_mutex);
+	stats->in_queued = con->in_bytes;
+	stats->in_messages = con->in_queue.size;
+	pthread_mutex_unlock(&con->in_mutex);
+
+	stats->out_credit = __atomic_load_n(&con->out_limited, __ATOMIC_RELAXED) ?
+		__atomic_load_n(&con->out_credit, __ATOMIC_RELAXED) : UINT64_MAX;
+	stats->window = con->window;
+}
+
 static void handler_cleanup(void *_con) {
 	struct con_handle *con = ((struct con_handle *) _con);
+	gauge_add(G_CONNECTIONS, -1);
 	end_handler(con);
-	destroy_handler(con);
+	/* whoever launched us may still be looking at it */
+	release_handler(con);
 }
 
 /* handles a connection to the client or server, made to be run as a thread */
@@ -236,8 +496,9 @@ void *handle_connection(void *_con) {
 	struct con_handle *con = ((struct con_handle *) _con);
 	struct ack_map map;
 
-	fd_set rset;
-	struct timeval select_wait;
+	/* poll rather than select, sockets can be numbered past FD_SETSIZE */
+	struct pollfd pfds[2];
+	uint64_t poll_wait_us;
 	struct timeval now;
 
 	uint64_t ka_last_sent;
@@ -250,26 +511,43 @@ void *handle_connection(void *_con) {
 	struct ack_map_el *el;
 
 	int ret;
+	/* set while there may be messages we can send */
+	int more = 0;
 
 	memset(&map, 0, sizeof(map));
 
+	gauge_add(G_CONNECTIONS, 1);
+
 	while(1) {
-		FD_ZERO(&rset);
-		FD_SET(con->sockfd, &rset);
-		FD_SET(con->out_cond[0], &rset);
-		select_wait = tvtime(WAIT_TIMEOUT);
+		pfds[0].fd = con->sockfd;
+		pfds[0].events = 0;
+		/* stop reading until the peer takes our acknowledgements */
+		if(con->ctl_len < CTL_BUF_SIZE / 2) {
+			pfds[0].events |= POLLIN;
+		}
+		if(con->ctl_len > 0) {
+			pfds[0].events |= POLLOUT;
+		}
+		pfds[1].fd = con->out_cond[0];
+		pfds[1].events = POLLIN;
+		/* don't sleep if the last turn left messages to send */
+		poll_wait_us = more && con->ctl_len == 0 ? 0 : WAIT_TIMEOUT;
 
-		if(select(FD_SETSIZE, &rset, NULL, NULL, &select_wait) == -1) {
+		if(poll_wait(pfds, 2, poll_wait_us) == -1) {
 #ifdef PROTO_DEBUG
-			ERR("%d: select error: %s", __LINE__,
+			ERR("%d: poll error: %s", __LINE__,
 				strerror(errno));
 #endif
 			if(errno != EINTR) {
 				goto error;
 			}
+			pfds[0].revents = 0;
+			pfds[1].revents = 0;
 		}
 
-		if(FD_ISSET(con->sockfd, &rset)) {
+		/* a hang up or error is found by the read */
+		if((pfds[0].events & POLLIN) &&
+			(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
 			ret = pthread_mutex_trylock(&con->in_mutex);
 			if(ret != 0) {
 				if(ret != EBUSY) {
@@ -283,55 +561,71 @@ void *handle_connection(void *_con) {
 				goto endread;
 			}
 
-			ret = read_message(con, &map);
-			if(ret != 0) {
-				pthread_mutex_unlock(&con->in_mutex);
-				goto error;
-			}
+			/* take whatever has arrived, as long as there's room
+			 * to acknowledge it */
+			int n = 0;
+			do {
+				ret = read_message(con, &map);
+				if(ret != 0) {
+					pthread_mutex_unlock(&con->in_mutex);
+					goto error;
+				}
+			} while(++n < READ_BATCH &&
+				con->ctl_len < CTL_BUF_SIZE / 2 &&
+				readable(con->sockfd));
 
 			pthread_mutex_unlock(&con->in_mutex);
 		}
 		endread:;
 
-		if(FD_ISSET(con->out_cond[0], &rset)) {
+		if(pfds[1].revents & POLLIN) {
 #ifdef PROTO_DEBUG
 			LOG("%d: out_cond flag set", con->sockfd);
 #endif
-			char c;
-			while(read(con->out_cond[0], &c, 1) != 1) {
+			/* poll said it's readable, so this won't block */
+			char c[64];
+			while(read(con->out_cond[0], c, sizeof(c)) == -1) {
 				if(errno != EINTR) break;
 				/* should not happen */
 			}
-#ifdef NOTDEFED
+			more = 1;
 		}
-		/* we can't rely on the out_cond being set when a message is
-		 * to be sent because write could have failed on the other end
-		 */
-		{
-#endif
-			ret = pthread_mutex_lock(&con->out_mutex);
-			if(ret != 0) {
-				if(ret != EBUSY) {
-#ifdef PROTO_DEBUG
-					ERR("%d: mutex lock error: %s",
-						__LINE__, strerror(ret));
-#endif
-					goto error;
-				}
+
+		/* replace the credit for what the application has taken */
+		uint64_t consumed =
+			__atomic_load_n(&con->in_consumed, __ATOMIC_RELAXED);
+		if(con->out_limited && consumed >= con->window / 2) {
+			__atomic_sub_fetch(&con->in_consumed, consumed,
+				__ATOMIC_RELAXED);
+			con->in_credit += consumed;
+			if(write_credit(con, consumed) != 0) {
+				goto error;
 			}
+		}
 
-			if(con->out_queue.size > 0) {
-				ret = write_messages(con, &map);
-				if(ret != 0) {
-					pthread_mutex_unlock(&con->out_mutex);
+		gettimeofday(&now, NULL);
+		if(utime(now) - ACK_WAITTIME / 2 > ka_last_sent) {
+			ret = write_keepalive(con);
+			if(ret == -1) {
+				goto error;
+			}
+			ka_last_sent = utime(now);
+		}
+
+		/* control frames always go first */
+		if(flush_control(con) != 0) {
+			goto error;
+		}
+
+		/* a message can't start until the control frames are out */
+		if(more && con->ctl_len == 0) {
+			more = write_messages(con, &map);
+			if(more == -1) {
 #ifdef PROTO_DEBUG
-					LOG("connection closed");
+				LOG("connection closed");
 #endif
-					goto error;
-				}
+				goto error;
 			}
-
-			pthread_mutex_unlock(&con->out_mutex);
 		}
 
 		/* check the acknowledges to make sure we're not overrun now */
@@ -347,6 +641,7 @@ void *handle_connection(void *_con) {
 					       "in time", el->seq_num);
 #endif
 					errno = ETIME;
+					counter_inc(C_TIMEOUTS);
 					goto error;
 				}
 
@@ -359,17 +654,10 @@ void *handle_connection(void *_con) {
 			LOG("keep alive not received in time");
 #endif
 			errno = ETIME;
+			counter_inc(C_TIMEOUTS);
 			goto error;
 		}
 
-		if(utime(now) - ACK_WAITTIME / 2 > ka_last_sent) {
-			ret = write_keepalive(con);
-			if(ret == -1) {
-				goto error;
-			}
-			ka_last_sent = utime(now);
-		}
-
 		if(handler_status(con) != 0) {
 			/* we have received the kill signal */
 			goto exit;
@@ -381,76 +669,263 @@ error:
 	ERR("%d: handler exiting: %s", con->sockfd,
 		strerror(errno));
 #endif
+	counter_inc(C_CONNECTION_ERRORS);
 exit:
+	ack_map_clear(&map);
 	pthread_cleanup_pop(1);
 	return NULL;
 }
 
+/* one turn of the writer.  the lanes are served deficit round robin, so bulk
+ * transfers keep getting their share without holding up chat, and the turn
+ * ends after WRITE_QUANTUM bytes or WRITE_BATCH messages so that reading
+ * isn't held up either.  returns 1 if there are still messages to send */
 static int write_messages(struct con_handle *con, struct ack_map *map) {
-	/* buffer for message type, ending zeroes, etc. */
-	uint8_t buf[8];
-	uint8_t hash[32];
-	ssize_t written;
+	uint64_t sent = 0;
+	int frames = 0;
+	int progress;
+	int l;
 
-	struct timeval tv;
-	uint64_t start;
+	do {
+		progress = 0;
+		for(l = 0; l < LANE_COUNT && sent < WRITE_QUANTUM &&
+			frames < WRITE_BATCH; l++) {
+			pthread_mutex_lock(&con->out_mutex);
+			struct message *m = message_queue_top(&con->out_queue[l]);
+			if(m == NULL) {
+				con->deficit[l] = 0;
+				pthread_mutex_unlock(&con->out_mutex);
+				continue;
+			}
+			/* wait for the peer to make room, receiving credit
+			 * wakes us */
+			if(m->length > send_credit(con)) {
+				pthread_mutex_unlock(&con->out_mutex);
+				continue;
+			}
+			con->deficit[l] += lane_weight[l] * LANE_QUANTUM;
+			progress = 1;
+
+			while(m != NULL && m->length <= con->deficit[l] &&
+				m->length <= send_credit(con)) {
+
+				message_queue_pop(&con->out_queue[l]);
+				con->deficit[l] -= m->length;
+				con->out_bytes -= m->length;
+				gauge_add(G_SEND_QUEUED_BYTES, -(int64_t) m->length);
+				pthread_cond_broadcast(&con->out_space);
+				pthread_mutex_unlock(&con->out_mutex);
+
+				/* don't hold up add_message while we write */
+				if(con->out_limited) {
+					__atomic_sub_fetch(&con->out_credit,
+						m->length, __ATOMIC_RELAXED);
+				}
+				sent += m->length;
+				frames++;
+				int ret;
+				if(m->message == NULL && m->seq_num == CREDIT_MARK) {
+					ret = start_credit(con);
+				} else if(m->message == NULL) {
+					ret = write_framing(con, m->seq_num);
+				} else {
+					ret = write_frame(con, map, m);
+				}
+				free_message(m);
+				if(ret != 0) {
+					return -1;
+				}
+
+				pthread_mutex_lock(&con->out_mutex);
+				m = sent < WRITE_QUANTUM && frames < WRITE_BATCH ?
+					message_queue_top(&con->out_queue[l]) : NULL;
+			}
+			if(con->out_queue[l].size == 0) {
+				con->deficit[l] = 0;
+			}
+			pthread_mutex_unlock(&con->out_mutex);
+		}
+	} while(progress && sent < WRITE_QUANTUM && frames < WRITE_BATCH);
 
-	gettimeofday(&tv, NULL);
-	start = utime(tv);
+	/* see if the next turn has anything to do */
+	int more = 0;
+	uint64_t credit = send_credit(con);
+	pthread_mutex_lock(&con->out_mutex);
+	for(l = 0; l < LANE_COUNT; l++) {
+		struct message *m = message_queue_top(&con->out_queue[l]);
+		if(m != NULL && m->length <= credit) {
+			more = 1;
+		}
+	}
+	pthread_mutex_unlock(&con->out_mutex);
 
-	while(con->out_queue.size > 0 && utime(tv) - start < ACK_WAITTIME / 2) {
-		struct message *next_message = message_queue_top(&con->out_queue);
+	return more;
+}
 
-		const uint64_t total_time = READWRITE_WAIT;
-		uint64_t end = utime(tv) + total_time;
+/* the frame goes out in one write, a frame in pieces costs a packet each */
+static int write_frame(struct con_handle *con, struct ack_map *map,
+	struct message *m) {
+	/* message type, sequence number, and length */
+	uint8_t head[20];
+	size_t hlen;
+	uint8_t hash[32];
+	ssize_t written;
+	int iovcnt;
+
+	if(con->out_framing == FRAMING_V2) {
+		head[0] = 0x80 | 2;
+		hlen = 1;
+		hlen += put_varint(m->seq_num, &head[hlen]);
+		hlen += put_varint(m->length, &head[hlen]);
+		/* no hash, the crypto layer's mac covers it */
+		iovcnt = 2;
+	} else {
+		encbe32(2, &head[0]);
+		encbe64(m->seq_num, &head[4]);
+		encbe64(m->length, &head[12]);
+		hlen = 20;
 
 		/* calculate sha256 hash */
-		sha256(next_message->message, next_message->length, hash);
-
-		encbe32(2, buf);
-		gettimeofday(&tv, NULL);
-		written = send_bytes(con->sockfd, buf, 4, 0, end - utime(tv));
-		IO_CHECK(written, 4);
-
-		/* write seqnum */
-		encbe64(next_message->seq_num, buf);
-		gettimeofday(&tv, NULL);
-		written = send_bytes(con->sockfd, buf, 8, 0, end - utime(tv));
-		IO_CHECK(written, 8);
-		/* write length */
-		encbe64(next_message->length, buf);
-		gettimeofday(&tv, NULL);
-		written = send_bytes(con->sockfd, buf, 8, 0, end - utime(tv));
-		IO_CHECK(written, 8);
-
-		gettimeofday(&tv, NULL);
-		written = send_bytes(con->sockfd, next_message->message,
-			next_message->length, 0, end - utime(tv));
-		IO_CHECK(written, next_message->length);
-
-		/* write the hash */
-		gettimeofday(&tv, NULL);
-		written = send_bytes(con->sockfd, hash, 32, 0, end - utime(tv));
-		IO_CHECK(written, 32);
-
-		/* add the ack */
-		if(acknowledge_add(map, next_message->seq_num) == -1) {
-			goto error;
-		}
+		sha256(m->message, m->length, hash);
+		iovcnt = 3;
+	}
+
+	struct iovec iov[3] = {
+		{ head, hlen },
+		{ m->message, m->length },
+		{ hash, sizeof(hash) },
+	};
+	size_t total = hlen + m->length + (iovcnt == 3 ? sizeof(hash) : 0);
+
+	written = send_iov(con->sockfd, iov, iovcnt, FRAME_WAIT(m->length));
+	IO_CHECK(written, (ssize_t) total);
+
+	counter_inc(C_FRAMES_OUT);
+	if(m->recv_time != 0) {
+		histogram_record(H_RELAY_US, metrics_now() - m->recv_time);
+	}
+	TRACE(m, TRACE_WRITTEN);
 
-		message_queue_pop(&con->out_queue);
+	/* add the ack */
+	if(acknowledge_add(map, m->seq_num, m->trace) == -1) {
+		goto error;
+	}
 #ifdef PROTO_DEBUG
-		LOG("%llu sent", next_message->seq_num);
+	LOG("%llu sent", m->seq_num);
 #endif
-		free_message(next_message);
-		gettimeofday(&tv, NULL);
+
+	return 0;
+error:
+	return -1;
+}
+
+/* from here on we only send what the peer has room for, and it only sends
+ * what we have room for, starting with our whole window.  the grant goes out
+ * after everything sent so far, so the peer starts counting with it.  credit
+ * it granted before we got here was kept, so nothing is lost */
+static int start_credit(struct con_handle *con) {
+	/* what was taken so far was never counted against any credit */
+	__atomic_store_n(&con->in_consumed, 0, __ATOMIC_RELAXED);
+	con->in_credit += con->window;
+	__atomic_store_n(&con->out_limited, 1, __ATOMIC_RELAXED);
+	return write_credit(con, con->window);
+}
+
+/* a peer without flow control takes anything up to the maximum frame size,
+ * which the read side checks */
+static uint64_t send_credit(struct con_handle *con) {
+	if(!con->out_limited) {
+		return UINT64_MAX;
+	}
+	return __atomic_load_n(&con->out_credit, __ATOMIC_RELAXED);
+}
+
+/* tells the peer that everything after this is in the given framing.  it's
+ * written straight out, in between messages, so that it lands in the right
+ * place among them */
+static int write_framing(struct con_handle *con, int framing) {
+	uint8_t buf[5];
+	size_t len;
+	ssize_t written;
+
+	if(con->out_framing == FRAMING_V2) {
+		buf[0] = 0x80 | 5;
+		len = 1;
+	} else {
+		encbe32(5, buf);
+		len = 4;
 	}
+	buf[len++] = framing;
+
+	written = send_bytes(con->sockfd, buf, len, 0, READWRITE_WAIT);
+	IO_CHECK(written, (ssize_t) len);
+	con->out_framing = framing;
 
 	return 0;
 error:
 	return -1;
 }
 
+/* reads the type of the next frame, in either framing */
+static int read_type(struct con_handle *con, uint32_t *type, uint64_t end) {
+	uint8_t buf[4];
+	ssize_t received;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	if(con->in_framing == FRAMING_V2) {
+		received = read_bytes(con->sockfd, buf, 1, 0, end - utime(now));
+		IO_CHECK(received, 1);
+		/* the high bit is always set, so v1 frames can't be mistaken
+		 * for v2 ones */
+		if((buf[0] & 0x80) == 0) {
+			errno = EPROTO;
+			goto error;
+		}
+		*type = buf[0] & 0x7f;
+	} else {
+		received = read_bytes(con->sockfd, buf, 4, 0, end - utime(now));
+		IO_CHECK(received, 4);
+		*type = decbe32(buf);
+	}
+
+	return 0;
+error:
+	return -1;
+}
+
+/* reads a number in a frame header, 8 bytes in v1 and a varint in v2 */
+static int read_number(struct con_handle *con, uint64_t *val, uint64_t end) {
+	uint8_t buf[8];
+	ssize_t received;
+	struct timeval now;
+
+	if(con->in_framing != FRAMING_V2) {
+		gettimeofday(&now, NULL);
+		received = read_bytes(con->sockfd, buf, 8, 0, end - utime(now));
+		IO_CHECK(received, 8);
+		*val = decbe64(buf);
+		return 0;
+	}
+
+	*val = 0;
+	for(int shift = 0; shift < 64; shift += 7) {
+		gettimeofday(&now, NULL);
+		received = read_bytes(con->sockfd, buf, 1, 0, end - utime(now));
+		IO_CHECK(received, 1);
+
+		*val |= (uint64_t) (buf[0] & 0x7f) << shift;
+		if((buf[0] & 0x80) == 0) {
+			return 0;
+		}
+	}
+
+	/* too long to be a 64-bit number */
+	errno = EPROTO;
+error:
+	return -1;
+}
+
 static int read_message(struct con_handle *con, struct ack_map *map) {
 	uint8_t buf[8];
 	uint8_t hash1[32];
@@ -459,8 +934,9 @@ static int read_message(struct con_handle *con, struct ack_map *map) {
 
 	uint32_t type;
 
-	struct message *in_message;
-	uint64_t seq_num, length;
+	/* only set while we own the message */
+	struct message *in_message = NULL;
+	uint64_t seq_num, length, val;
 
 	const uint64_t total_time = READWRITE_WAIT;
 	uint64_t end;
@@ -469,16 +945,16 @@ static int read_message(struct con_handle *con, struct ack_map *map) {
 	gettimeofday(&now, NULL);
 	end = total_time + utime(now);
 
-	received = read_bytes(con->sockfd, buf, 4, 0, end - utime(now));
-	IO_CHECK(received, 4);
+	if(read_type(con, &type, end) != 0) {
+		goto error;
+	}
 
-	type = decbe32(buf);
 	switch(type) {
 	case 1: /* ACK */
-		gettimeofday(&now, NULL);
-		received = read_bytes(con->sockfd, buf, 8, 0, end - utime(now));
-		IO_CHECK(received, 8);
-		if(ack_map_rm(map, decbe64(buf)) == -1) {
+		if(read_number(con, &val, end) != 0) {
+			goto error;
+		}
+		if(ack_map_rm(map, val) == -1) {
 #ifdef PROTO_DEBUG
 			ERR("ack_map doesn't contain key");
 #endif
@@ -486,7 +962,7 @@ static int read_message(struct con_handle *con, struct ack_map *map) {
 			goto error;
 		}
 #ifdef PROTO_DEBUG
-		LOG("%llu ack'ed", decbe64(buf));
+		LOG("%llu ack'ed", val);
 #endif
 		break;
 	case 3: /* KA */
@@ -496,49 +972,103 @@ static int read_message(struct con_handle *con, struct ack_map *map) {
 		LOG("ka received");
 #endif
 		break;
-	case 2: /* new message */
+	case 4: /* credit */
+		if(read_number(con, &val, end) != 0) {
+			goto error;
+		}
+		__atomic_add_fetch(&con->out_credit, val, __ATOMIC_RELAXED);
+		/* the first grant is sent when the peer starts waiting for
+		 * credit, everything after it counts against ours */
+		con->in_limited = 1;
+		/* there may be messages waiting on it */
+		wake_writer(con);
+		break;
+	case 5: /* framing */
 		gettimeofday(&now, NULL);
-		received = read_bytes(con->sockfd, buf, 8, 0, end - utime(now));
-		IO_CHECK(received, 8);
-		seq_num = decbe64(buf);
+		received = read_bytes(con->sockfd, buf, 1, 0, end - utime(now));
+		IO_CHECK(received, 1);
+		if(buf[0] != FRAMING_V1 && buf[0] != FRAMING_V2) {
+			errno = EPROTO;
+			goto error;
+		}
+		/* everything after this is in the new framing */
+		con->in_framing = buf[0];
+		break;
+	case 2: /* new message */
+		if(read_number(con, &seq_num, end) != 0 ||
+			read_number(con, &length, end) != 0) {
+			goto error;
+		}
 
-		gettimeofday(&now, NULL);
-		received = read_bytes(con->sockfd, buf, 8, 0, end - utime(now));
-		IO_CHECK(received, 8);
-		length = decbe64(buf);
+		/* don't let the peer make us allocate more than we allow */
+		if(length > proto_max_frame()) {
+			errno = EMSGSIZE;
+			goto error;
+		}
+		if(con->in_limited && length > con->in_credit) {
+#ifdef PROTO_DEBUG
+			ERR("peer sent more than its credit");
+#endif
+			errno = EPROTO;
+			goto error;
+		}
 
-		if((in_message = alloc_message(length)) == NULL) {
+		if(con->in_framing == FRAMING_V2) {
+			/* v2 messages leave out the nonce and half the mac,
+			 * leave room for them so the message can still be
+			 * re-encrypted in place for a v1 peer */
+			in_message = alloc_message(V2_HEADROOM + length +
+				V2_TAILROOM);
+			if(in_message == NULL) {
+				goto error;
+			}
+			in_message->message += V2_HEADROOM;
+		} else if((in_message = alloc_message(length)) == NULL) {
 			goto error;
 		}
 
 		in_message->seq_num = seq_num;
 		in_message->length = length;
+		in_message->recv_time = metrics_now();
+		in_message->trace = trace_start();
+		counter_inc(C_FRAMES_IN);
+
+		/* give the body time in proportion to its size */
+		end += FRAME_WAIT(length) - READWRITE_WAIT;
 
 		gettimeofday(&now, NULL);
 		received = read_bytes(con->sockfd, in_message->message,
 			in_message->length, 0, end - utime(now));
 		IO_CHECK(received, in_message->length);
 
-		gettimeofday(&now, NULL);
-		received = read_bytes(con->sockfd, hash1, 32, 0, end - utime(now));
-		IO_CHECK(received, 32);
+		/* v2 relies on the crypto layer's mac instead */
+		if(con->in_framing != FRAMING_V2) {
+			gettimeofday(&now, NULL);
+			received = read_bytes(con->sockfd, hash1, 32, 0,
+				end - utime(now));
+			IO_CHECK(received, 32);
 
-		sha256(in_message->message, in_message->length, hash2);
-		if(memcmp(hash1, hash2, 32) != 0) {
-			errno = EPROTO;
-			goto error;
+			sha256(in_message->message, in_message->length, hash2);
+			if(memcmp(hash1, hash2, 32) != 0) {
+				errno = EPROTO;
+				goto error;
+			}
 		}
 
-		if(message_queue_push(&con->in_queue, in_message) == -1) {
-			goto error;
+		message_queue_push(&con->in_queue, in_message);
+		if(con->in_limited) {
+			con->in_credit -= length;
 		}
+		con->in_bytes += length;
+		gauge_add(G_RECV_QUEUED_BYTES, length);
+		in_message = NULL;
 		pthread_cond_broadcast(&con->in_cond);
 
-		if(write_acknowledge(con, in_message->seq_num) == -1) {
+		if(write_acknowledge(con, seq_num) == -1) {
 			goto error;
 		}
 #ifdef PROTO_DEBUG
-		LOG("%llu ack sent", in_message->seq_num);
+		LOG("%llu ack sent", seq_num);
 #endif
 		break;
 	default:
@@ -551,6 +1081,7 @@ static int read_message(struct con_handle *con, struct ack_map *map) {
 
 	return 0;
 error:
+	if(in_message) free_message(in_message);
 	return -1;
 }
 
@@ -564,17 +1095,13 @@ static ssize_t send_bytes(int fd, void *buf, size_t len, int flags, uint64_t tim
 	size_t total = 0;
 	ssize_t written;
 
-	struct timeval wait;
-	fd_set wset;
+	struct pollfd pfd = { fd, POLLOUT, 0 };
 
 	do {
-		FD_ZERO(&wset);
-		FD_SET(fd, &wset);
-		wait = tvtime(timeout < WAIT_TIMEOUT ? timeout : WAIT_TIMEOUT);
-
-		if(select(FD_SETSIZE, NULL, &wset, NULL, &wait) == -1) {
+		if(poll_wait(&pfd, 1, timeout < WAIT_TIMEOUT ?
+			timeout : WAIT_TIMEOUT) == -1) {
 #ifdef PROTO_DEBUG
-			ERR("%d: select error: %s", __LINE__,
+			ERR("%d: poll error: %s", __LINE__,
 				strerror(errno));
 #endif
 			goto error;
@@ -593,6 +1120,73 @@ static ssize_t send_bytes(int fd, void *buf, size_t len, int flags, uint64_t tim
 		}
 
 		total += written;
+		counter_add(C_BYTES_OUT, written);
+	loopend:
+		gettimeofday(&cur, NULL);
+		timediff = utime(cur) - utime(start);
+	} while(timediff < timeout && total < len);
+
+	return total;
+error:
+	return -1;
+}
+
+/* send_bytes for a message in several pieces */
+static ssize_t send_iov(int fd, struct iovec *iov, int iovcnt, uint64_t timeout) {
+	struct timeval start, cur;
+	gettimeofday(&start, NULL);
+	uint64_t timediff;
+
+	size_t total = 0;
+	size_t len = 0;
+	ssize_t written;
+
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+
+	for(int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+
+	do {
+		if(poll_wait(&pfd, 1, timeout < WAIT_TIMEOUT ?
+			timeout : WAIT_TIMEOUT) == -1) {
+#ifdef PROTO_DEBUG
+			ERR("%d: poll error: %s", __LINE__,
+				strerror(errno));
+#endif
+			goto error;
+		}
+
+		written = sendmsg(fd, &msg, MSG_DONTWAIT);
+		if(written == -1) {
+			if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+#ifdef PROTO_DEBUG
+				ERR("%d: socket write error: %s",
+					__LINE__, strerror(errno));
+#endif
+				goto error;
+			}
+			goto loopend;
+		}
+
+		total += written;
+		counter_add(C_BYTES_OUT, written);
+		/* skip past what was written */
+		while(msg.msg_iovlen > 0 &&
+			(size_t) written >= msg.msg_iov->iov_len) {
+			written -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if(msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (uint8_t *) msg.msg_iov->iov_base + written;
+			msg.msg_iov->iov_len -= written;
+		}
 	loopend:
 		gettimeofday(&cur, NULL);
 		timediff = utime(cur) - utime(start);
@@ -603,6 +1197,12 @@ error:
 	return -1;
 }
 
+static int readable(int fd) {
+	struct pollfd pfd = { fd, POLLIN, 0 };
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
 /* reads the message using non-blocking operations
  * aborts after timeout (microseconds) */
 static ssize_t read_bytes(int fd, void *buf, size_t len, int flags, uint64_t timeout) {
@@ -613,17 +1213,13 @@ static ssize_t read_bytes(int fd, void *buf, size_t len, int flags, uint64_t tim
 	size_t total = 0;
 	ssize_t received = 0;
 
-	struct timeval wait;
-	fd_set rset;
+	struct pollfd pfd = { fd, POLLIN, 0 };
 
 	do {
-		FD_ZERO(&rset);
-		FD_SET(fd, &rset);
-		wait = tvtime(timeout < WAIT_TIMEOUT ? timeout : WAIT_TIMEOUT);
-
-		if(select(FD_SETSIZE, &rset, NULL, NULL, &wait) == -1) {
+		if(poll_wait(&pfd, 1, timeout < WAIT_TIMEOUT ?
+			timeout : WAIT_TIMEOUT) == -1) {
 #ifdef PROTO_DEBUG
-			ERR("%d: select error: %s", __LINE__,
+			ERR("%d: poll error: %s", __LINE__,
 				strerror(errno));
 #endif
 			goto error;
@@ -642,6 +1238,7 @@ static ssize_t read_bytes(int fd, void *buf, size_t len, int flags, uint64_t tim
 		}
 
 		total += received;
+		counter_add(C_BYTES_IN, received);
 	loopend:
 		gettimeofday(&cur, NULL);
 		timediff = utime(cur) - utime(start);
@@ -652,54 +1249,126 @@ error:
 	return -1;
 }
 
-static int write_keepalive(struct con_handle *con) {
-	uint8_t buf[4];
+/* control frames are collected and written together by flush_control */
+static int queue_control(struct con_handle *con, uint8_t *frame, size_t len) {
 	ssize_t written;
 
-	encbe32(3, buf);
-	written = send_bytes(con->sockfd, buf, 4, 0, 100000ULL);
-	IO_CHECK(written, 4);
+	if(con->ctl_len + len > CTL_BUF_SIZE) {
+		if(flush_control(con) != 0) {
+			return -1;
+		}
+	}
+	/* reading stops well before this, so it shouldn't happen */
+	if(con->ctl_len + len > CTL_BUF_SIZE) {
+		written = send_bytes(con->sockfd, con->ctl_buf, con->ctl_len, 0,
+			READWRITE_WAIT);
+		IO_CHECK(written, (ssize_t) con->ctl_len);
+		con->ctl_len = 0;
+	}
+
+	memcpy(&con->ctl_buf[con->ctl_len], frame, len);
+	con->ctl_len += len;
 
 	return 0;
 error:
 	return -1;
 }
 
-static int write_acknowledge(struct con_handle *con, uint64_t seq_num) {
-	uint8_t buf[8];
+/* writes as much of the control frames as the socket will take without
+ * blocking, the rest goes when poll says there's room */
+static int flush_control(struct con_handle *con) {
 	ssize_t written;
 
-	encbe32(1, buf);
-	written = send_bytes(con->sockfd, buf, 4, 0, 100000ULL);
-	IO_CHECK(written, 4);
+	if(con->ctl_len == 0) {
+		return 0;
+	}
+
+	written = send(con->sockfd, con->ctl_buf, con->ctl_len, MSG_DONTWAIT);
+	if(written == -1) {
+		if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+#ifdef PROTO_DEBUG
+			ERR("%d: socket write error: %s",
+				__LINE__, strerror(errno));
+#endif
+			return -1;
+		}
+		return 0;
+	}
 
-	encbe64(seq_num, buf);
-	written = send_bytes(con->sockfd, buf, 8, 0, 100000ULL);
-	IO_CHECK(written, 8);
+	counter_add(C_BYTES_OUT, written);
+	memmove(con->ctl_buf, &con->ctl_buf[written], con->ctl_len - written);
+	con->ctl_len -= written;
 
 	return 0;
-error:
-	return -1;
 }
 
-static int acknowledge_add(struct ack_map *map, uint64_t seq_num) {
+/* little-endian base 128 */
+static size_t put_varint(uint64_t val, uint8_t *buf) {
+	size_t len = 0;
+	while(val >= 0x80) {
+		buf[len++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	buf[len++] = val;
+
+	return len;
+}
+
+/* queues a control frame, with a number after the type if has_arg */
+static int write_control(struct con_handle *con, uint32_t type,
+	uint64_t arg, int has_arg) {
+	uint8_t buf[4 + VARINT_MAX];
+	size_t len;
+
+	if(con->out_framing == FRAMING_V2) {
+		buf[0] = 0x80 | type;
+		len = 1;
+		if(has_arg) len += put_varint(arg, &buf[len]);
+	} else {
+		encbe32(type, buf);
+		len = 4;
+		if(has_arg) {
+			encbe64(arg, &buf[len]);
+			len += 8;
+		}
+	}
+
+	return queue_control(con, buf, len);
+}
+
+static int write_keepalive(struct con_handle *con) {
+	return write_control(con, 3, 0, 0);
+}
+
+static int write_acknowledge(struct con_handle *con, uint64_t seq_num) {
+	return write_control(con, 1, seq_num, 1);
+}
+
+static int write_credit(struct con_handle *con, uint64_t credit) {
+	return write_control(con, 4, credit, 1);
+}
+
+static int acknowledge_add(struct ack_map *map, uint64_t seq_num,
+	uint64_t trace) {
 	struct timeval now;
 	gettimeofday(&now, NULL);
 
-	return ack_map_add(map, seq_num, utime(now));
+	return ack_map_add(map, seq_num, utime(now), trace);
 }
 
 /* values to be acknowledged map implementation */
-static int ack_map_add(struct ack_map *map, uint64_t seq_num, uint64_t time) {
+static int ack_map_add(struct ack_map *map, uint64_t seq_num, uint64_t time,
+	uint64_t trace) {
 	struct ack_map_el *next;
 
-	if((next = malloc(sizeof(struct ack_map_el))) == NULL) {
+	if((next = tag_malloc(ALLOC_ACK, sizeof(struct ack_map_el))) == NULL) {
 		errno = ENOMEM;
 		return -1;
 	}
 
 	next->seq_num = seq_num;
 	next->time = time;
+	next->trace = trace;
 	next->next = NULL;
 
 	struct ack_map_el **loc = &map->lists[seq_num & ACK_MAP_MASK];
@@ -722,7 +1391,8 @@ static int ack_map_rm(struct ack_map *map, uint64_t seq_num) {
 	while(el != NULL) {
 		if(el->seq_num == seq_num) {
 			*prev = el->next;
-			free(el);
+			TRACE(el, TRACE_ACKED);
+			tag_free(ALLOC_ACK, el);
 			return 0;
 		}
 		prev = &el->next;
@@ -732,3 +1402,15 @@ static int ack_map_rm(struct ack_map *map, uint64_t seq_num) {
 	return -1;
 }
 
+/* drops whatever is still waiting on an acknowledgement */
+static void ack_map_clear(struct ack_map *map) {
+	for(size_t i = 0; i <= ACK_MAP_MASK; i++) {
+		struct ack_map_el *el = map->lists[i];
+		while(el != NULL) {
+			struct ack_map_el *next = el->next;
+			tag_free(ALLOC_ACK, el);
+			el = next;
+		}
+		map->lists[i] = NULL;
+	}
+}
@@ -13,10 +13,58 @@ int launch_handler(pthread_t *thread, struct con_handle **con, int fd);
 
 int handler_status(struct con_handle *con);
 void end_handler(struct con_handle *con);
+/* the con from launch_handler stays valid after its thread exits, until the
+ * caller gives it up with release_handler, usually after joining the thread.
+ * the socket is left for the caller to close */
+void release_handler(struct con_handle *con);
 void destroy_handler(struct con_handle *con);
 
+/* takes back the messages still waiting to be sent, a list linked through
+ * next, each lane in the order it was queued.  only once the handler thread
+ * has exited */
+struct message *con_take_unsent(struct con_handle *con);
+
 struct message *get_message(struct con_handle *con, uint64_t timeout);
 void add_message(struct con_handle *con, struct message *m);
 
+/* the framings a connection can use, see message_protocol.txt.
+ * connections start out in v1 */
+#define FRAMING_V1 (1)
+#define FRAMING_V2 (2)
+
+/* switches what we send to the given framing, starting after the messages
+ * already queued in the interactive lane.  the peer follows along on its
+ * own, but has to switch what it sends itself */
+int con_set_framing(struct con_handle *con, int framing);
+
+/* turns on credit flow control, see message_protocol.txt.  like a framing
+ * switch it takes effect after the messages already queued in the
+ * interactive lane.  both sides have to agree to it in the handshake, until
+ * then a connection sends freely and takes any message up to the maximum
+ * frame size */
+int con_enable_credit(struct con_handle *con);
+
+/* the largest message accepted from a peer, DFLT_MAX_FRAME unless set.
+ * must be set before any connections are made */
+void proto_set_max_frame(uint64_t size);
+uint64_t proto_max_frame();
+
+/* bytes waiting to be sent */
+uint64_t con_queued(struct con_handle *con);
+int con_wait_space(struct con_handle *con, uint64_t limit, uint64_t timeout);
+
+struct con_stats {
+	uint64_t out_queued; /* bytes */
+	uint64_t out_messages;
+	uint64_t out_peak; /* the most bytes ever queued */
+	/* bytes the peer will still accept, UINT64_MAX without flow control */
+	uint64_t out_credit;
+	uint64_t in_queued; /* bytes received but not yet taken */
+	uint64_t in_messages;
+	uint64_t window; /* the most the peer can have in flight */
+};
+
+void con_get_stats(struct con_handle *con, struct con_stats *stats);
+
 #endif
 
@@ -0,0 +1,386 @@
+/* the baseline for the con_handle transport.  two connections are joined
+ * over a socketpair, or loopback tcp, and plain messages are pumped from one
+ * to the other with add_message and get_message at a range of sizes and
+ * queue depths, where the depth is how many messages the sender lets be
+ * outstanding before waiting for the receiver to take one.
+ *
+ * each run sends a fixed number of messages and is repeated, keeping the
+ * median by throughput, so that the numbers hold still between runs.
+ * syscalls are counted by wrapping the libc calls the transport makes on its
+ * sockets and pipes, the futex waits underneath the condition variables show
+ * up as context switches instead */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "protocol.h"
+
+#define DFLT_MESSAGES (20000)
+#define DFLT_REPEATS (5)
+
+/* large messages send fewer so that a run doesn't take all day */
+#define RUN_BYTES_MAX (64ULL << 20)
+
+#define RECV_WAIT (5000000ULL)
+
+static const uint64_t sizes[] = { 16, 256, 4096, 65536 };
+static const uint64_t depths[] = { 1, 8, 64, 512 };
+
+/* the libc calls the transport makes, passed straight to the kernel */
+static uint64_t syscalls = 0;
+
+#define COUNT() __atomic_add_fetch(&syscalls, 1, __ATOMIC_RELAXED)
+
+ssize_t read(int fd, void *buf, size_t len) {
+	COUNT();
+	return syscall(SYS_read, fd, buf, len);
+}
+
+ssize_t write(int fd, const void *buf, size_t len) {
+	COUNT();
+	return syscall(SYS_write, fd, buf, len);
+}
+
+ssize_t recv(int fd, void *buf, size_t len, int flags) {
+	COUNT();
+	return syscall(SYS_recvfrom, fd, buf, len, flags, NULL, NULL);
+}
+
+ssize_t send(int fd, const void *buf, size_t len, int flags) {
+	COUNT();
+	return syscall(SYS_sendto, fd, buf, len, flags, NULL, 0);
+}
+
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+	COUNT();
+	return syscall(SYS_sendmsg, fd, msg, flags);
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+	COUNT();
+#ifdef SYS_poll
+	return syscall(SYS_poll, fds, nfds, timeout);
+#else
+	struct timespec ts, *tsp = NULL;
+	if(timeout >= 0) {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = timeout % 1000 * 1000000L;
+		tsp = &ts;
+	}
+	return syscall(SYS_ppoll, fds, nfds, tsp, NULL, 0);
+#endif
+}
+
+/* fortified builds call these instead where they know the buffer's size */
+ssize_t __read_chk(int fd, void *buf, size_t len, size_t buflen) {
+	return read(fd, buf, len);
+}
+
+ssize_t __recv_chk(int fd, void *buf, size_t len, size_t buflen, int flags) {
+	return recv(fd, buf, len, flags);
+}
+
+struct link {
+	struct con_handle *s_con;
+	struct con_handle *r_con;
+	pthread_t s_thread;
+	pthread_t r_thread;
+	int fds[2];
+};
+
+struct result {
+	uint64_t messages;
+	uint64_t elapsed; /* us */
+	uint64_t syscalls;
+	uint64_t switches;
+};
+
+/* the receiver's side of a run */
+struct receiver {
+	pthread_t thread;
+	struct con_handle *con;
+	uint64_t size;
+	uint64_t messages;
+	uint64_t taken; /* protected by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int ret;
+};
+
+static uint64_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint64_t switches() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static int tcp_pair(int fds[2]) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	int lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if(lfd == -1) {
+		return -1;
+	}
+	if(bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+		listen(lfd, 1) != 0 ||
+		getsockname(lfd, (struct sockaddr *) &addr, &len) != 0) {
+		goto err1;
+	}
+
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if(fds[0] == -1) {
+		goto err1;
+	}
+	if(connect(fds[0], (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		goto err2;
+	}
+	fds[1] = accept(lfd, NULL, NULL);
+	if(fds[1] == -1) {
+		goto err2;
+	}
+
+	close(lfd);
+	return 0;
+
+err2:
+	close(fds[0]);
+err1:
+	close(lfd);
+	return -1;
+}
+
+static int open_link(struct link *p, int tcp, int framing) {
+	int ret = tcp ? tcp_pair(p->fds) :
+		socketpair(AF_UNIX, SOCK_STREAM, 0, p->fds);
+	if(ret != 0) {
+		return -1;
+	}
+
+	if(launch_handler(&p->s_thread, &p->s_con, p->fds[0]) != 0) {
+		goto err1;
+	}
+	if(launch_handler(&p->r_thread, &p->r_con, p->fds[1]) != 0) {
+		goto err2;
+	}
+	if(framing != FRAMING_V1 &&
+		(con_set_framing(p->s_con, framing) != 0 ||
+		con_set_framing(p->r_con, framing) != 0)) {
+		goto err3;
+	}
+	if(con_enable_credit(p->s_con) != 0 ||
+		con_enable_credit(p->r_con) != 0) {
+		goto err3;
+	}
+
+	return 0;
+
+err3:
+	end_handler(p->r_con);
+	pthread_join(p->r_thread, NULL);
+	release_handler(p->r_con);
+err2:
+	end_handler(p->s_con);
+	pthread_join(p->s_thread, NULL);
+	release_handler(p->s_con);
+err1:
+	close(p->fds[0]);
+	close(p->fds[1]);
+	return -1;
+}
+
+static void close_link(struct link *p) {
+	end_handler(p->s_con);
+	end_handler(p->r_con);
+	pthread_join(p->s_thread, NULL);
+	pthread_join(p->r_thread, NULL);
+	release_handler(p->s_con);
+	release_handler(p->r_con);
+	close(p->fds[0]);
+	close(p->fds[1]);
+}
+
+static void *receive(void *_arg) {
+	struct receiver *r = (struct receiver *) _arg;
+
+	for(uint64_t i = 0; i < r->messages; i++) {
+		struct message *m = get_message(r->con, RECV_WAIT);
+		if(m == NULL || m->length != r->size ||
+			m->message[0] != (uint8_t) i) {
+			fprintf(stderr, "message %llu lost\n",
+				(unsigned long long) i);
+			free_message(m);
+			r->ret = -1;
+			break;
+		}
+		free_message(m);
+
+		pthread_mutex_lock(&r->lock);
+		r->taken++;
+		pthread_cond_signal(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+
+	/* let the sender out if it's waiting */
+	pthread_mutex_lock(&r->lock);
+	r->taken = r->messages;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+
+	return NULL;
+}
+
+static int run(struct link *p, uint64_t size, uint64_t depth,
+	uint64_t messages, struct result *res) {
+	static uint64_t seq = 0;
+
+	struct receiver r = {
+		.con = p->r_con,
+		.size = size,
+		.messages = messages,
+		.taken = 0,
+		.ret = 0,
+	};
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+
+	uint64_t start_calls = __atomic_load_n(&syscalls, __ATOMIC_RELAXED);
+	uint64_t start_switches = switches();
+	uint64_t start = now();
+
+	if(pthread_create(&r.thread, NULL, receive, &r) != 0) {
+		return -1;
+	}
+
+	int ret = 0;
+	for(uint64_t i = 0; i < messages; i++) {
+		pthread_mutex_lock(&r.lock);
+		while(i - r.taken >= depth && r.taken < messages) {
+			pthread_cond_wait(&r.cond, &r.lock);
+		}
+		pthread_mutex_unlock(&r.lock);
+
+		struct message *m = alloc_message(size);
+		if(m == NULL) {
+			ret = -1;
+			break;
+		}
+		memset(m->message, 0x5a, size);
+		m->message[0] = (uint8_t) i;
+		/* the acknowledgements are matched up by sequence number */
+		m->seq_num = ++seq;
+		add_message(p->s_con, m);
+	}
+
+	pthread_join(r.thread, NULL);
+
+	res->elapsed = now() - start;
+	res->switches = switches() - start_switches;
+	res->syscalls = __atomic_load_n(&syscalls, __ATOMIC_RELAXED) -
+		start_calls;
+	res->messages = messages;
+
+	pthread_mutex_destroy(&r.lock);
+	pthread_cond_destroy(&r.cond);
+
+	return ret != 0 ? ret : r.ret;
+}
+
+static int cmp_rate(const void *a, const void *b) {
+	const struct result *x = (const struct result *) a;
+	const struct result *y = (const struct result *) b;
+	double rx = (double) x->messages / x->elapsed;
+	double ry = (double) y->messages / y->elapsed;
+	return rx < ry ? -1 : rx > ry;
+}
+
+int main(int argc, char **argv) {
+	uint64_t messages = argc > 1 ? strtoull(argv[1], NULL, 10) :
+		DFLT_MESSAGES;
+	int repeats = argc > 2 ? atoi(argv[2]) : DFLT_REPEATS;
+	int tcp = argc > 3 && strcmp(argv[3], "tcp") == 0;
+	int framing = argc > 4 ? atoi(argv[4]) : FRAMING_V1;
+
+	if(messages < 1 || repeats < 1 ||
+		(argc > 3 && !tcp && strcmp(argv[3], "unix") != 0) ||
+		(framing != FRAMING_V1 && framing != FRAMING_V2)) {
+		fprintf(stderr, "usage: %s [messages per run] [repeats] "
+			"[unix|tcp] [framing (1 or 2)]\n", argv[0]);
+		return 1;
+	}
+
+	struct result *results = malloc(repeats * sizeof(struct result));
+	if(results == NULL) {
+		fprintf(stderr, "failed to allocate memory\n");
+		return 1;
+	}
+
+	struct link p;
+	if(open_link(&p, tcp, framing) != 0) {
+		fprintf(stderr, "failed to connect: %s\n", strerror(errno));
+		return 1;
+	}
+
+	printf("%s, framing v%d, median of %d runs, %ld processors\n",
+		tcp ? "loopback tcp" : "unix socketpair", framing, repeats,
+		sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%7s %6s %8s %12s %10s %10s %10s\n", "size", "depth",
+		"messages", "msgs/s", "MB/s", "calls/msg", "csw/msg");
+
+	for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		uint64_t n = messages;
+		if(n * sizes[s] > RUN_BYTES_MAX) {
+			n = RUN_BYTES_MAX / sizes[s];
+		}
+
+		for(size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+			for(int i = 0; i < repeats; i++) {
+				if(run(&p, sizes[s], depths[d], n,
+					&results[i]) != 0) {
+					fprintf(stderr,
+						"failed to run benchmark\n");
+					return 1;
+				}
+			}
+			qsort(results, repeats, sizeof(struct result),
+				cmp_rate);
+			struct result *r = &results[repeats / 2];
+
+			double secs = r->elapsed / 1e6;
+			printf("%7llu %6llu %8llu %12.0f %10.1f %10.2f %10.2f\n",
+				(unsigned long long) sizes[s],
+				(unsigned long long) depths[d],
+				(unsigned long long) r->messages,
+				r->messages / secs,
+				r->messages * sizes[s] / secs / 1e6,
+				(double) r->syscalls / r->messages,
+				(double) r->switches / r->messages);
+		}
+	}
+
+	close_link(&p);
+	free(results);
+
+	return 0;
+}
@@ -0,0 +1,262 @@
+/* admission control for new connections, see admission.h */
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+
+#include "../util/defaults.h"
+#include "../util/log.h"
+#include "../util/metrics.h"
+
+#define ADMIT_BUCKETS (1024)
+
+/* tokens are kept in millionths of a connection so that they can refill
+ * by the microsecond */
+#define TOKEN (1000000ULL)
+
+struct host {
+	char address[INET6_ADDRSTRLEN];
+	uint64_t tokens;
+	uint64_t refilled; /* when tokens was last topped up, us */
+	uint64_t pending; /* handshakes admitted and not yet released */
+	uint64_t rejected; /* since the last log */
+
+	struct host *next;
+};
+
+/* the lock is only taken once per connection and once per handshake, so
+ * one is enough */
+static struct {
+	pthread_mutex_t lock;
+	struct host *b[ADMIT_BUCKETS];
+
+	uint64_t rate;
+	uint64_t host_handshakes;
+
+	uint64_t pending;
+	uint64_t hosts;
+
+	/* since the last log */
+	uint64_t admitted;
+	uint64_t rate_limited;
+	uint64_t host_busy;
+	uint64_t server_busy;
+} adm = { PTHREAD_MUTEX_INITIALIZER };
+
+void admit_set_limits(int rate, int host_handshakes) {
+	pthread_mutex_lock(&adm.lock);
+	adm.rate = rate > 0 ? rate : 0;
+	adm.host_handshakes = host_handshakes > 0 ? host_handshakes : 0;
+	pthread_mutex_unlock(&adm.lock);
+}
+
+static uint64_t burst() {
+	return (uint64_t) HOST_CONNECT_BURST * TOKEN;
+}
+
+/* fnv-1a, the addresses are short */
+static struct host **bucket(const char *address) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(; *address; address++) {
+		hash = (hash ^ (uint8_t) *address) * 0x100000001b3ULL;
+	}
+	return &adm.b[hash % ADMIT_BUCKETS];
+}
+
+static void refill(struct host *h, uint64_t now) {
+	if(adm.rate == 0) {
+		h->tokens = burst();
+	} else if(now > h->refilled) {
+		h->tokens += (now - h->refilled) * adm.rate;
+		if(h->tokens > burst()) {
+			h->tokens = burst();
+		}
+	}
+	h->refilled = now;
+}
+
+/* drops the hosts in the bucket that would be the same as new ones */
+static void expire(struct host **loc, uint64_t now) {
+	while(*loc) {
+		struct host *h = *loc;
+		refill(h, now);
+		if(h->pending == 0 && h->rejected == 0 &&
+			h->tokens == burst()) {
+			*loc = h->next;
+			free(h);
+			adm.hosts--;
+		} else {
+			loc = &h->next;
+		}
+	}
+}
+
+static struct host *find(struct host *h, const char *address) {
+	while(h && strcmp(h->address, address) != 0) {
+		h = h->next;
+	}
+
+	return h;
+}
+
+static struct host *add_host(struct host **loc, const char *address,
+	uint64_t now) {
+	struct host *h = malloc(sizeof(*h));
+	if(h == NULL) {
+		return NULL;
+	}
+
+	memset(h, 0, sizeof(*h));
+	strncpy(h->address, address, sizeof(h->address) - 1);
+	h->tokens = burst();
+	h->refilled = now;
+
+	h->next = *loc;
+	*loc = h;
+	adm.hosts++;
+
+	return h;
+}
+
+int admit_connection(const char *address) {
+	int ret = ADMIT_OK;
+	uint64_t now = metrics_now();
+
+	pthread_mutex_lock(&adm.lock);
+
+	/* the cheapest check first, it needs no host */
+	if(adm.pending >= MAX_PENDING_HANDSHAKES) {
+		adm.server_busy++;
+		ret = ADMIT_SERVER_BUSY;
+		goto end;
+	}
+
+	struct host **loc = bucket(address);
+	expire(loc, now);
+
+	struct host *h = find(*loc, address);
+	if(h == NULL && (h = add_host(loc, address, now)) == NULL) {
+		adm.server_busy++;
+		ret = ADMIT_SERVER_BUSY;
+		goto end;
+	}
+
+	if(adm.host_handshakes != 0 && h->pending >= adm.host_handshakes) {
+		h->rejected++;
+		adm.host_busy++;
+		ret = ADMIT_HOST_BUSY;
+		goto end;
+	}
+
+	if(adm.rate != 0) {
+		if(h->tokens < TOKEN) {
+			h->rejected++;
+			adm.rate_limited++;
+			ret = ADMIT_RATE_LIMITED;
+			goto end;
+		}
+		h->tokens -= TOKEN;
+	}
+
+	h->pending++;
+	adm.pending++;
+	adm.admitted++;
+
+end:
+	pthread_mutex_unlock(&adm.lock);
+
+	switch(ret) {
+	case ADMIT_RATE_LIMITED:
+		counter_inc(C_ADMIT_RATE_LIMITED);
+		break;
+	case ADMIT_HOST_BUSY:
+		counter_inc(C_ADMIT_HOST_BUSY);
+		break;
+	case ADMIT_SERVER_BUSY:
+		counter_inc(C_ADMIT_SERVER_BUSY);
+		break;
+	}
+
+	return ret;
+}
+
+void admit_release(const char *address) {
+	pthread_mutex_lock(&adm.lock);
+
+	/* a host with a handshake going is never expired */
+	struct host *h = find(*bucket(address), address);
+	if(h != NULL && h->pending > 0) {
+		h->pending--;
+		adm.pending--;
+	}
+
+	pthread_mutex_unlock(&adm.lock);
+}
+
+void admit_log() {
+	char worst[INET6_ADDRSTRLEN] = "";
+	uint64_t worst_rejected = 0;
+
+	pthread_mutex_lock(&adm.lock);
+
+	uint64_t now = metrics_now();
+	for(int i = 0; i < ADMIT_BUCKETS; i++) {
+		for(struct host *h = adm.b[i]; h; h = h->next) {
+			if(h->rejected > worst_rejected) {
+				worst_rejected = h->rejected;
+				strcpy(worst, h->address);
+			}
+			h->rejected = 0;
+		}
+		expire(&adm.b[i], now);
+	}
+
+	uint64_t admitted = adm.admitted;
+	uint64_t rate_limited = adm.rate_limited;
+	uint64_t host_busy = adm.host_busy;
+	uint64_t server_busy = adm.server_busy;
+	uint64_t pending = adm.pending;
+	uint64_t hosts = adm.hosts;
+	adm.admitted = adm.rate_limited = adm.host_busy = adm.server_busy = 0;
+
+	pthread_mutex_unlock(&adm.lock);
+
+	if(admitted + rate_limited + host_busy + server_busy == 0) {
+		return;
+	}
+
+	LOG("admission: %llu connections admitted, %llu rate limited, "
+		"%llu refused with their host busy, %llu with the server busy; "
+		"%llu handshakes queued or running, %llu hosts tracked",
+		(unsigned long long) admitted,
+		(unsigned long long) rate_limited,
+		(unsigned long long) host_busy,
+		(unsigned long long) server_busy,
+		(unsigned long long) pending,
+		(unsigned long long) hosts);
+	if(worst_rejected > 0) {
+		LOG("admission: %s turned away the most, %llu times", worst,
+			(unsigned long long) worst_rejected);
+	}
+}
+
+void end_admission() {
+	pthread_mutex_lock(&adm.lock);
+	for(int i = 0; i < ADMIT_BUCKETS; i++) {
+		struct host *h = adm.b[i];
+		while(h) {
+			struct host *next = h->next;
+			free(h);
+			h = next;
+		}
+		adm.b[i] = NULL;
+	}
+	adm.hosts = 0;
+	adm.pending = 0;
+	pthread_mutex_unlock(&adm.lock);
+}
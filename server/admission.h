@@ -0,0 +1,33 @@
+#ifndef IBCHAT_SERVER_ADMISSION_H
+#define IBCHAT_SERVER_ADMISSION_H
+
+/* decides whether a new connection is worth a handler thread and a
+ * handshake, before either is spent on it.  each host, by address, has a
+ * bucket of connections that refills at a steady rate and a cap on the
+ * handshakes it has going, and there's a cap on handshakes over all hosts.
+ * a host is forgotten once it has nothing going and its bucket is full
+ * again, so idle hosts cost nothing */
+
+/* admit_connection results */
+#define ADMIT_OK (0)
+#define ADMIT_RATE_LIMITED (1)
+#define ADMIT_HOST_BUSY (2)
+#define ADMIT_SERVER_BUSY (3)
+
+/* rate is connections per second a host may open once its burst is used,
+ * host_handshakes the most handshakes it may have going.  0 turns either
+ * limit off, the cap over all hosts always applies */
+void admit_set_limits(int rate, int host_handshakes);
+
+/* returns ADMIT_OK and takes a handshake for the host if the connection is
+ * let in, which must be given back with admit_release */
+int admit_connection(const char *address);
+void admit_release(const char *address);
+
+/* logs how many connections were let in and turned away since the last
+ * call, if there were any, along with the host turned away the most */
+void admit_log();
+
+void end_admission();
+
+#endif
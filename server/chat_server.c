@@ -1,6 +1,8 @@
 #include <errno.h>
 #include <getopt.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,14 +22,23 @@
 
 #include <libibur/util.h>
 
+#include "admission.h"
 #include "client_handler.h"
+#include "delivery.h"
+#include "presence.h"
+#include "stats.h"
+#include "streams.h"
 #include "user_db.h"
 #include "undelivered.h"
 #include "../crypto/keyfile.h"
 #include "../inet/connect.h"
+#include "../inet/protocol.h"
+#include "../util/alloc.h"
 #include "../util/line_prompt.h"
 #include "../util/defaults.h"
 #include "../util/log.h"
+#include "../util/metrics.h"
+#include "../util/trace.h"
 
 /* private info */
 RSA_KEY server_key;
@@ -40,35 +51,67 @@ FILE *lgf;
 
 void usage(char *argv0) {
 	ERR("usage: %s [-p port] "
-		"[-d server_root_directory] [--no-pw] <key file>", argv0);
+		"[-d server_root_directory] [-c user_cache_size] "
+		"[-m max_frame_size] [-t trace_rate] [-a acceptor_threads] "
+		"[-b accept_backlog] [-r host_connect_rate] "
+		"[-H host_handshakes] [--no-pw] "
+		"<key file>", argv0);
 }
 
 static struct option longopts[] = {
 	{ "port", 1, NULL, 'p' },
 	{ "root-dir", 1, NULL, 'd' },
+	{ "user-cache", 1, NULL, 'c' },
+	{ "max-frame", 1, NULL, 'm' },
+	{ "trace-rate", 1, NULL, 't' },
+	{ "acceptors", 1, NULL, 'a' },
+	{ "backlog", 1, NULL, 'b' },
+	{ "host-rate", 1, NULL, 'r' },
+	{ "host-handshakes", 1, NULL, 'H' },
 	{ "no-pw", 0, NULL, 'n' },
 	{ NULL, 0, NULL, 0 },
 };
-static char *optstring = "p:d:";
+static char *optstring = "p:d:c:m:t:a:b:r:H:";
 int process_opts(int argc, char **argv);
 void print_opts();
 
 static volatile sig_atomic_t stop;
+static volatile sig_atomic_t dump_allocs;
 void init_sighandlers();
 void signal_stop(int signum);
+void signal_dump_allocs(int signum);
 
 int load_server_key(char *keyfile, char *password, RSA_KEY *server_key);
 int check_root_dir(char *fname);
 int open_logfile(char *root_dir);
 int server_bind_err(struct sock server_socket);
 
-int handle_connections(int server_socket);
+/* each acceptor has its own listening socket on the port */
+struct acceptor {
+	pthread_t thread;
+	int fd;
+};
+
+static struct acceptor *acceptors;
+static int num_acceptors;
+
+int open_acceptors();
+void close_acceptors();
+
+int handle_connections();
 
 static struct {
 	char *port;
 	char *root_dir;
 	char *keyfile;
 	int use_password;
+	uint64_t user_cache;
+	uint64_t max_frame;
+	uint64_t trace_rate;
+	int acceptors;
+	int backlog;
+	int host_rate;
+	int host_handshakes;
 } opts;
 
 /* program entry point */
@@ -104,7 +147,7 @@ int chat_server(int argc, char **argv) {
 	}
 
 	/* load up the database */
-	if(user_db_init(opts.root_dir) != 0) {
+	if(user_db_init(opts.root_dir, opts.user_cache) != 0) {
 		goto err2;
 	}
 
@@ -112,34 +155,47 @@ int chat_server(int argc, char **argv) {
 		goto err3;
 	}
 
+	proto_set_max_frame(opts.max_frame);
+	trace_set_rate(opts.trace_rate);
+	admit_set_limits(opts.host_rate, opts.host_handshakes);
+
+	/* the server can run without it */
+	if(stats_start(opts.root_dir) != 0) {
+		ERR("failed to open stats socket: %s", strerror(errno));
+	}
+
 	/* set up the server */
-	struct sock server_socket = server_bind(opts.port);
-	if(server_bind_err(server_socket) != 0) {
+	if(open_acceptors() != 0) {
 		goto err3;
 	}
 
-	LOG("server opened on port %s", opts.port);
+	LOG("server opened on port %s with %d acceptors", opts.port,
+		num_acceptors);
 
 	/* program main body */
 	init_sighandlers();
 	/* TODO: start the manager thread */
-	if(handle_connections(server_socket.fd) != 0) {
+	if(handle_connections() != 0) {
 		ERR("handle connections error: %s", strerror(errno));
 		goto err4;
 	}
 
-	close(server_socket.fd);
+	close_acceptors();
+	end_admission();
+	stats_stop();
 	if(password) zfree(password, strlen(password));
 	rsa_free_prikey(&server_key);
 
 	return 0;
 
 err4:
-	close(server_socket.fd);
+	close_acceptors();
 err3:
+	stats_stop();
 	user_db_destroy();
 err2:
 err1:
+	set_logfile(NULL);
 	fclose(lgf);
 	/* cleanup */
 	if(password) zfree(password, strlen(password));
@@ -148,7 +204,123 @@ err1:
 	return 1;
 }
 
-int handle_connections(int server_socket) {
+int open_acceptors() {
+	int n = opts.acceptors;
+	if(n <= 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		if(n <= 0) {
+			n = 1;
+		}
+	}
+
+	acceptors = malloc(n * sizeof(struct acceptor));
+	if(acceptors == NULL) {
+		ERR("failed to allocate memory");
+		return 1;
+	}
+
+	int flags = BIND_NONBLOCK | (n > 1 ? BIND_REUSEPORT : 0);
+	for(num_acceptors = 0; num_acceptors < n; num_acceptors++) {
+		struct sock server_socket =
+			server_bind(opts.port, opts.backlog, flags);
+		if(num_acceptors == 0 && server_bind_err(server_socket) != 0) {
+			free(acceptors);
+			acceptors = NULL;
+			return 1;
+		}
+		if(server_socket.fd < 0) {
+			/* the ones we have can take the connections */
+			ERR("failed to open listening socket %d: %s",
+				num_acceptors, strerror(errno));
+			break;
+		}
+		acceptors[num_acceptors].fd = server_socket.fd;
+	}
+
+	return 0;
+}
+
+void close_acceptors() {
+	int i;
+	for(i = 0; i < num_acceptors; i++) {
+		close(acceptors[i].fd);
+	}
+	free(acceptors);
+	acceptors = NULL;
+	num_acceptors = 0;
+}
+
+/* takes every connection waiting on the socket and gives each its own
+ * handler thread.  the handler does the handshake and everything after it,
+ * so nothing here waits on a client */
+static void accept_connections(int server_socket) {
+	while(stop == 0) {
+		struct sock client = server_accept(server_socket);
+		if(client.fd == -1) {
+			switch(errno) {
+			case EAGAIN:
+				/* the queue is empty */
+				return;
+			case EINTR:
+			case ECONNABORTED:
+			case EPROTO:
+				continue;
+			default:
+				/* out of descriptors or memory, give the
+				 * handlers a chance to close some before
+				 * trying again */
+				ERR("failed to accept connection: %s",
+					strerror(errno));
+				usleep(100000);
+				return;
+			}
+		}
+
+		counter_inc(C_CONNECTIONS_ACCEPTED);
+
+		/* turned away before it costs a thread or a handshake, and
+		 * without a log line each, admit_log sums them up */
+		if(admit_connection(client.address) != ADMIT_OK) {
+			close(client.fd);
+			continue;
+		}
+
+		LOG("received connection from %s with fd %d",
+			client.address, client.fd);
+
+		if(spawn_handler(client.fd, client.address) != 0) {
+			ERR("%d: failed to spawn handler", client.fd);
+			counter_inc(C_CONNECTION_ERRORS);
+			admit_release(client.address);
+			close(client.fd);
+		}
+	}
+}
+
+static void *acceptor_thread(void *_arg) {
+	struct acceptor *a = (struct acceptor *) _arg;
+
+	struct pollfd pfd = { a->fd, POLLIN, 0 };
+
+	while(stop == 0) {
+		int ret = poll(&pfd, 1, 100);
+		if(ret == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			ERR("acceptor poll failed: %s", strerror(errno));
+			break;
+		}
+
+		if(ret > 0) {
+			accept_connections(a->fd);
+		}
+	}
+
+	return NULL;
+}
+
+int handle_connections() {
 	stop = 0;
 
 	if(init_handler_table() != 0) {
@@ -157,46 +329,79 @@ int handle_connections(int server_socket) {
 		return 1;
 	}
 
-	fd_set rd_set;
+	if(init_delivery() != 0) {
+		ERR("failed to start delivery threads: %s",
+			strerror(errno));
+		return 1;
+	}
+
+	if(init_presence() != 0) {
+		ERR("failed to start presence thread: %s",
+			strerror(errno));
+		return 1;
+	}
+
+	int started;
+	for(started = 0; started < num_acceptors; started++) {
+		int err = pthread_create(&acceptors[started].thread, NULL,
+			acceptor_thread, &acceptors[started]);
+		if(err != 0) {
+			ERR("failed to start acceptor thread: %s",
+				strerror(err));
+			stop = 1;
+			break;
+		}
+	}
+
 	struct timeval timeout;
+	uint64_t admit_logged = metrics_now();
 
 	while(stop == 0) {
-		FD_ZERO(&rd_set);
-		FD_SET(server_socket, &rd_set);
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 100000ULL;
+		if(dump_allocs) {
+			dump_allocs = 0;
+			alloc_log();
+		}
 
-		if(select(FD_SETSIZE, &rd_set, NULL, NULL, &timeout) == -1) {
-			if(errno == EINTR) {
-				continue;
-			} else {
-				goto err;
-			}
+		if(metrics_now() - admit_logged >=
+			ADMIT_LOG_INTERVAL * 1000000ULL) {
+			admit_logged = metrics_now();
+			admit_log();
 		}
 
-		if(FD_ISSET(server_socket, &rd_set)) {
-			/* accept a connection and set it up */
-			struct sock client = server_accept(server_socket);
-			LOG("received connection from %s with fd %d",
-				client.address, client.fd);
+		/* a signal cuts the wait short */
+		timeout.tv_sec = 0;
+		timeout.tv_usec = 100000ULL;
+		select(0, NULL, NULL, NULL, &timeout);
+	}
 
-			if(spawn_handler(client.fd) != 0) {
-				goto err;
-			}
-		}
+	int i;
+	for(i = 0; i < started; i++) {
+		pthread_join(acceptors[i].thread, NULL);
 	}
 
+	/* the sessions use everything below until they're gone */
 	end_handlers();
+	wait_handlers();
 
-	return 0;
-err:
-	return 1;
+	end_presence();
+	end_streams();
+	end_delivery();
+	destroy_handler_table();
+
+	return started == num_acceptors ? 0 : 1;
 }
 
 int process_opts(int argc, char **argv) {
 	opts.port = DFLT_PORT;
 	opts.root_dir = DFLT_ROOT_DIR;
 	opts.use_password = 1;
+	opts.user_cache = DFLT_USER_CACHE;
+	opts.max_frame = DFLT_MAX_FRAME;
+	opts.trace_rate = 0;
+	opts.acceptors = ACCEPT_THREADS;
+	opts.backlog = DFLT_BACKLOG;
+	opts.host_rate = HOST_CONNECT_RATE;
+	opts.host_handshakes = HOST_HANDSHAKES;
 
 	char option;
 	do {
@@ -211,6 +416,27 @@ int process_opts(int argc, char **argv) {
 		case 'n':
 			opts.use_password = 0;
 			break;
+		case 'c':
+			opts.user_cache = strtoull(optarg, NULL, 10);
+			break;
+		case 'm':
+			opts.max_frame = strtoull(optarg, NULL, 10);
+			break;
+		case 't':
+			opts.trace_rate = strtoull(optarg, NULL, 10);
+			break;
+		case 'a':
+			opts.acceptors = atoi(optarg);
+			break;
+		case 'b':
+			opts.backlog = atoi(optarg);
+			break;
+		case 'r':
+			opts.host_rate = atoi(optarg);
+			break;
+		case 'H':
+			opts.host_handshakes = atoi(optarg);
+			break;
 		}
 	} while(option != -1);
 
@@ -252,11 +478,25 @@ void print_opts() {
 	       "port    :%s\n"
 	       "root_dir:%s\n"
 	       "keyfile :%s\n"
-	       "use_pass:%d",
+	       "use_pass:%d\n"
+	       "usrcache:%llu\n"
+	       "maxframe:%llu\n"
+	       "tracert :%llu\n"
+	       "acceptrs:%d\n"
+	       "backlog :%d\n"
+	       "hostrate:%d\n"
+	       "hosthshk:%d",
 	       opts.port,
 	       opts.root_dir,
 	       opts.keyfile,
-	       opts.use_password);
+	       opts.use_password,
+	       opts.user_cache,
+	       opts.max_frame,
+	       opts.trace_rate,
+	       opts.acceptors,
+	       opts.backlog,
+	       opts.host_rate,
+	       opts.host_handshakes);
 }
 
 int load_server_key(char *keyfile, char *password, RSA_KEY *server_key) {
@@ -392,9 +632,14 @@ void init_sighandlers() {
 	signal(SIGQUIT, signal_stop);
 	signal(SIGHUP, signal_stop);
 	signal(SIGTERM, signal_stop);
+	signal(SIGUSR1, signal_dump_allocs);
 }
 
 void signal_stop(int signal) {
 	stop = 1;
 }
 
+void signal_dump_allocs(int signal) {
+	dump_allocs = 1;
+}
+
@@ -5,7 +5,7 @@
 #include <ibcrypt/rsa.h>
 #include <ibcrypt/rsa_util.h>
 #include <ibcrypt/rand.h>
-#include <ibcrypt/bignum.h>
+#include <ibcrypt/sha256.h>
 
 #include <libibur/util.h>
 #include <libibur/endian.h>
@@ -20,7 +20,8 @@
 #include "client_handler.h"
 #include "user_db.h"
 
-static int check_user(uint8_t *uid, RSA_PUBLIC_KEY *pkey) {
+/* fingerprint is the sha256 of the public key in wire format */
+static int check_user(uint8_t *uid, uint8_t *fingerprint) {
 	struct user *u = user_db_get(uid);
 	if(u == NULL) {
 		return 1;
@@ -28,11 +29,9 @@ static int check_user(uint8_t *uid, RSA_PUBLIC_KEY *pkey) {
 
 	/* compare the public keys */
 	{
-		uint64_t ret = 0;
-		ret |= (pkey->bits - u->pkey.bits);
-		ret |= (pkey->e - u->pkey.e);
+		int ret = memcmp_ct(fingerprint, u->pkey_wire->fingerprint, 0x20);
 
-		ret |= bno_cmp(&pkey->n, &u->pkey.n);
+		user_db_release(u);
 
 		if(ret != 0) {
 			return 3;
@@ -40,7 +39,9 @@ static int check_user(uint8_t *uid, RSA_PUBLIC_KEY *pkey) {
 	}
 
 	/* now check if the user is already logged in */
-	if(get_handler(uid) != NULL) {
+	struct client_handler *hndl = get_handler(uid);
+	if(hndl != NULL) {
+		put_handler(hndl);
 		return 2;
 	}
 
@@ -95,6 +96,7 @@ int auth_user(struct client_handler *cli_hndl, struct con_handle *con_hndl, stru
 	struct message *cli_response;
 
 	RSA_PUBLIC_KEY pb_key;
+	uint8_t fingerprint[0x20];
 
 	/* generate 256 bit challenge numbers and send them */
 	{
@@ -166,10 +168,11 @@ int auth_user(struct client_handler *cli_hndl, struct con_handle *con_hndl, stru
 		}
 
 		memcpy(uid, cli_response->message, 0x20);
+		sha256(pb_key_bin, keylen, fingerprint);
 	}
 
 	/* now we have a uid and public key, identify this user */
-	int ret = check_user(uid, &pb_key);
+	int ret = check_user(uid, fingerprint);
 
 	char msg[8];
 	memcpy(msg, "cliauth", 7);
@@ -4,8 +4,11 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <arpa/inet.h>
+
 #include <ibcrypt/rsa_util.h>
 #include <ibcrypt/rand.h>
 #include <ibcrypt/sha256.h>
@@ -14,60 +17,188 @@
 #include <libibur/endian.h>
 
 #include "client_handler.h"
+#include "admission.h"
 #include "chat_server.h"
 #include "client_auth.h"
+#include "delivery.h"
+#include "presence.h"
+#include "streams.h"
 #include "user_db.h"
 #include "undelivered.h"
 
 #include "../crypto/crypto_layer.h"
 #include "../crypto/handshake.h"
 #include "../inet/message.h"
+#include "../util/alloc.h"
 #include "../util/defaults.h"
-#include "../util/lock.h"
+#include "../util/epoch.h"
 #include "../util/log.h"
+#include "../util/metrics.h"
+#include "../util/trace.h"
 
 struct handler_arg {
 	pthread_t thread;
 	int fd;
+	char address[INET6_ADDRSTRLEN];
 };
 
-struct handler_table {
-	struct client_handler **buckets;
+/* the handler table is split into shards, each with its own writer lock.
+ * readers take no locks, they traverse under epoch protection.  a shard is
+ * resized a few buckets at a time like the user table, moving the nodes
+ * themselves so that nothing is allocated per handler */
+#define HT_SHARD_BITS (6)
+#define HT_SHARDS (1 << HT_SHARD_BITS)
+
+struct handler_node {
+	uint64_t hash;
+	struct client_handler *hndl;
+	struct handler_node *next;
+};
+
+struct handler_buckets {
 	uint64_t size; /* doubles as the modulus */
+	struct handler_node *b[];
+};
 
+struct handler_shard {
+	pthread_mutex_t lock; /* held by writers only */
+	struct handler_buckets *table;
+	/* while the shard is being resized, buckets below migrated have
+	 * been moved from the old table into the new one */
+	struct handler_buckets *old;
+	uint64_t migrated;
 	uint64_t elements;
+} __attribute__((aligned(64)));
+
+struct handler_table {
+	struct handler_shard shards[HT_SHARDS];
 
-	struct lock l;
+	uint64_t elements;
+	/* set by end_handlers, no sessions are added after it */
+	int stopping;
 } ht;
 
+/* handler threads that haven't exited yet, see wait_handlers */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	uint64_t running;
+} threads = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+
 /* client handler cleanup */
 struct ch_manager {
 	struct con_handle *handler;
 	pthread_t thread;
 	int fd;
+	int ended; /* the handler thread has been stopped and joined */
+};
+
+/* session cleanup, needs the connection as well */
+struct session_cleanup {
+	struct client_handler *c_hndl;
+	struct ch_manager *c_mgr;
 };
 
 void *client_handler(void *_arg);
-static int send_undelivered(uint8_t *id, struct ch_manager *c_mgr,
-	struct keyset *keys);
+static int send_undelivered(struct client_handler *c_hndl);
+static void keep_unsent(struct client_handler *c_hndl);
+/* relayed messages and stream chunks the session never sent are stored for
+ * the user's next login, the same as if they had been offline, so that
+ * closing a session loses nothing that was passed on to it.  the replies to
+ * its own requests mean nothing to the next session and are dropped.
+ * anything already written to the socket is left to the peer */
+static void keep_unsent(struct client_handler *c_hndl) {
+	struct message *m = mailbox_unsent(&c_hndl->mbox);
+	struct umessage *kept = NULL;
+	struct umessage **last = &kept;
+	uint64_t num = 0;
+
+	while(m != NULL) {
+		struct message *next = m->next;
+		if(m->length > 0 && (m->message[0] == 0 ||
+			m->message[0] == 5)) {
+			struct umessage *um = alloc_umessage(m->length);
+			if(um == NULL) {
+				ERR("%d: failed to allocate unsent message",
+					c_hndl->fd);
+			} else {
+				memcpy(um->message, m->message, m->length);
+				*last = um;
+				last = &um->next;
+				num++;
+			}
+		}
+		free_message(m);
+		m = next;
+	}
+	if(kept == NULL) {
+		return;
+	}
+
+	struct user *u = user_db_get(c_hndl->id);
+	if(u == NULL || undel_add_messages(u, kept) != 0) {
+		ERR("%d: failed to keep %llu unsent messages", c_hndl->fd,
+			(unsigned long long) num);
+	} else {
+		LOG("%d: kept %llu unsent messages", c_hndl->fd,
+			(unsigned long long) num);
+		counter_add(C_UNSENT_KEPT, num);
+	}
+	if(u != NULL) {
+		user_db_release(u);
+	}
+	free_umessage_list(kept);
+}
+
 static int client_handle_loop(struct client_handler *c_hndl,
 	struct ch_manager *c_mgr, struct keyset *keys);
 static int handle_message(struct message *m, struct client_handler *c_hndl);
+static int relay_message(struct message *m, uint8_t *uid,
+	struct client_handler *c_hndl);
+static int fanout_message(struct message *m, struct client_handler *c_hndl);
+static int send_pkeys(struct message *m, struct client_handler *c_hndl);
+static int presence_request(struct message *m, struct client_handler *c_hndl);
+static int stream_chunk(struct message *m, struct client_handler *c_hndl);
+static int stream_request(struct message *m, struct client_handler *c_hndl);
+static int send_stream_status(struct client_handler *c_hndl, uint64_t sid);
 static int send_u_notfound(struct client_handler *c_hndl, uint8_t *id);
 
-int spawn_handler(int fd) {
-	struct handler_arg *arg = malloc(sizeof(*arg));
+static void handler_exited() {
+	pthread_mutex_lock(&threads.lock);
+	if(--threads.running == 0) {
+		pthread_cond_broadcast(&threads.done);
+	}
+	pthread_mutex_unlock(&threads.lock);
+}
+
+int spawn_handler(int fd, char *address) {
+	struct handler_arg *arg = tag_malloc(ALLOC_HANDLER, sizeof(*arg));
+	if(arg == NULL) {
+		return -1;
+	}
 	arg->fd = fd;
+	strncpy(arg->address, address, sizeof(arg->address) - 1);
+	arg->address[sizeof(arg->address) - 1] = '\0';
 
 	pthread_attr_t handler_attributes;
 
 	if(pthread_attr_init(&handler_attributes) != 0) {
+		tag_free(ALLOC_HANDLER, arg);
 		return -1;
 	}
-	pthread_attr_setdetachstate(&handler_attributes, PTHREAD_CREATE_JOINABLE);
+	/* nothing waits for the handler to finish, it cleans up after
+	 * itself */
+	pthread_attr_setdetachstate(&handler_attributes, PTHREAD_CREATE_DETACHED);
+
+	pthread_mutex_lock(&threads.lock);
+	threads.running++;
+	pthread_mutex_unlock(&threads.lock);
 
 	LOG("%d: spawning handler thread", fd);
 	if(pthread_create(&arg->thread, &handler_attributes, client_handler, arg) != 0) {
+		pthread_attr_destroy(&handler_attributes);
+		tag_free(ALLOC_HANDLER, arg);
+		handler_exited();
 		return -1;
 	}
 
@@ -85,7 +216,7 @@ static int init_client_handler(void *_arg, struct client_handler *handler) {
 	handler->stop = 0;
 
 	/* free the argument */
-	free(arg);
+	tag_free(ALLOC_HANDLER, arg);
 
 	return 0;
 }
@@ -100,16 +231,23 @@ static int client_handler_handshake(struct con_handle *con, struct keyset *keys)
 
 	/* wait for a spot */
 	{
+		gauge_add(G_HANDSHAKES_WAITING, 1);
 		pthread_mutex_lock(&hs_mutex);
 		while(handshake_sem == MAX_HANDSHAKES) {
 			pthread_cond_wait(&hs_cond, &hs_mutex);
 		}
 		pthread_mutex_unlock(&hs_mutex);
+		gauge_add(G_HANDSHAKES_WAITING, -1);
 
 		handshake_sem++;
 	}
 
+	gauge_add(G_HANDSHAKES_ACTIVE, 1);
 	ret = server_handshake(con, &server_key, keys);
+	gauge_add(G_HANDSHAKES_ACTIVE, -1);
+	if(ret != 0) {
+		counter_inc(C_HANDSHAKE_FAILURES);
+	}
 
 	/* release our spot */
 	{
@@ -122,14 +260,24 @@ static int client_handler_handshake(struct con_handle *con, struct keyset *keys)
 	return ret;
 }
 
-void ch_cleanup_end_handler(void *_arg) {
-	struct ch_manager *arg = (struct ch_manager *)_arg;
+static void end_connection(struct ch_manager *c_mgr) {
+	if(c_mgr->ended) {
+		return;
+	}
+	c_mgr->ended = 1;
 
 	/* give them a chance to receive any left over messages */
 	sleep(1);
 
-	end_handler(arg->handler);
-	pthread_join(arg->thread, NULL);
+	end_handler(c_mgr->handler);
+	pthread_join(c_mgr->thread, NULL);
+}
+
+void ch_cleanup_end_handler(void *_arg) {
+	struct ch_manager *arg = (struct ch_manager *)_arg;
+
+	end_connection(arg);
+	release_handler(arg->handler);
 
 	close(arg->fd);
 }
@@ -139,12 +287,17 @@ void keys_cleanup_end_handler(void *keys) {
 }
 
 void ht_cleanup_end_handler(void *_arg) {
-	struct client_handler *arg = (struct client_handler *) _arg;
+	struct session_cleanup *sc = (struct session_cleanup *) _arg;
+	struct client_handler *arg = sc->c_hndl;
 	rem_handler(arg->id);
-
-	if(arg->stop && ht.elements == 0) {
-		destroy_handler_table();
-	}
+	gauge_add(G_SESSIONS, -1);
+	/* no one else can reach the mailbox now */
+	mailbox_close(&arg->mbox);
+
+	/* stopped while the keys are still good, so what it didn't get to
+	 * send can be kept */
+	end_connection(sc->c_mgr);
+	keep_unsent(arg);
 }
 
 void *client_handler(void *_arg) {
@@ -153,25 +306,34 @@ void *client_handler(void *_arg) {
 	struct keyset keys;
 
 	int ret, fd;
+	char address[INET6_ADDRSTRLEN];
 
 	fd = ((struct handler_arg *)_arg)->fd;
+	memcpy(address, ((struct handler_arg *)_arg)->address,
+		sizeof(address));
 
 	if(init_client_handler(_arg, &c_hndl) != 0) {
 		ERR("%d: failed to initialize client handler structure",
 			fd);
+		admit_release(address);
 		goto err1;
 	}
 
 	/* initiate the connection handler thread */
 	if(launch_handler(&c_mgr.thread, &c_mgr.handler, fd) != 0) {
 		ERR("%d: failed to launch handler thread", fd);
+		admit_release(address);
 		goto err2;
 	}
 	c_mgr.fd = fd;
+	c_mgr.ended = 0;
 	pthread_cleanup_push(ch_cleanup_end_handler, &c_mgr);
 
-	/* complete the handshake */
-	if((ret = client_handler_handshake(c_mgr.handler, &keys)) != 0) {
+	/* complete the handshake, after which the host can start another
+	 * whatever came of it */
+	ret = client_handler_handshake(c_mgr.handler, &keys);
+	admit_release(address);
+	if(ret != 0) {
 		LOG("%d: failed to complete handshake: %d", fd, ret);
 		goto err3;
 	}
@@ -181,21 +343,31 @@ void *client_handler(void *_arg) {
 	/* now we can start communicating with this user */
 	if(auth_user(&c_hndl, c_mgr.handler, &keys, c_hndl.id) != 0) {
 		ERR("%d: failed to authorize user", fd);
+		counter_inc(C_AUTH_FAILURES);
 		goto err4;
 	}
 
 	c_hndl.hndl = c_mgr.handler;
 	c_hndl.keys = &keys;
 
+	/* from here on the keys belong to the delivery threads */
+	if(mailbox_open(&c_hndl.mbox, c_mgr.handler, &keys) != 0) {
+		ERR("%d: failed to open mailbox", fd);
+		goto err4;
+	}
+
 	/* insert them into the user table */
 	if(add_handler(&c_hndl) != 0) {
 		ERR("%d: failed to add to the handler table", fd);
+		mailbox_close(&c_hndl.mbox);
 		goto err4;
 	}
-	pthread_cleanup_push(ht_cleanup_end_handler, &c_hndl);
+	gauge_add(G_SESSIONS, 1);
+	struct session_cleanup sc = { &c_hndl, &c_mgr };
+	pthread_cleanup_push(ht_cleanup_end_handler, &sc);
 
 	/* TODO: implement undelivered */
-	if(send_undelivered(c_hndl.id, &c_mgr, &keys) != 0) {
+	if(send_undelivered(&c_hndl) != 0) {
 		ERR("%d: failed to send undelivered messages", fd);
 		/* this is an acceptable error
 		 * we can continue to interact with the user */
@@ -205,6 +377,11 @@ void *client_handler(void *_arg) {
 		goto err5;
 	}
 
+	struct con_stats stats;
+	con_get_stats(c_mgr.handler, &stats);
+	LOG("%d: send queue peaked at %llu bytes", fd,
+		(unsigned long long) stats.out_peak);
+
 	/* thats it for now */
 err5:
 	pthread_cleanup_pop(1); /* remove from the handler table */
@@ -215,37 +392,83 @@ err3:
 err2:
 err1:
 	LOG("%d: exiting", fd);
+	handler_exited();
 	return NULL;
 }
 
-static int send_undelivered(uint8_t *id, struct ch_manager *c_mgr,
-	struct keyset *keys) {
+/* sends stored messages in order until the session falls behind, returns
+ * the ones it didn't get to */
+static struct umessage *send_stored(struct client_handler *c_hndl,
+	struct umessage *messages) {
+	while(messages) {
+		if(mailbox_wait_space(&c_hndl->mbox, BACKPRESSURE_WAIT) != 0) {
+			LOG("%d: not keeping up with its undelivered messages",
+				c_hndl->fd);
+			break;
+		}
+		DBG("%d: sending undel message of length %llu",
+			c_hndl->fd, messages->len);
+		/* the backlog shouldn't hold up anything sent live */
+		struct message *m = alloc_plain_message(messages->len);
+		if(m == NULL) {
+			break;
+		}
+		memcpy(m->message, messages->message, messages->len);
+		m->lane = LANE_BULK;
+		if(deliver(&c_hndl->mbox, m) != 0) {
+			break;
+		}
+		counter_inc(C_UNDEL_SENT);
+		struct umessage *next = messages->next;
+		free_umessage(messages);
+		messages = next;
+	}
+
+	return messages;
+}
 
-	struct user *u = user_db_get(id);
+/* the stored messages are read a batch at a time, and each one waits for
+ * room in the session, so memory doesn't grow with how much was stored,
+ * such as a long stream sent while the user was away.  whatever isn't sent
+ * is kept for the next login */
+static int send_undelivered(struct client_handler *c_hndl) {
+	struct user *u = user_db_get(c_hndl->id);
 	if(u == NULL) {
 		return -1;
 	}
 
-	struct umessage *messages;
-	if(undel_load(u, &messages) != 0) {
-		return -1;
+	struct undel_replay r;
+	struct umessage *batch = NULL;
+	int ret;
+	/* anything stored while replaying is taken in the next round */
+	while((ret = undel_replay_open(u, &r)) == 0) {
+		while(1) {
+			if(undel_replay_next(u, &r, UNDEL_REPLAY_BATCH,
+				&batch) != 0) {
+				goto stop;
+			}
+			if(batch == NULL) {
+				break;
+			}
+			if((batch = send_stored(c_hndl, batch)) != NULL) {
+				goto stop;
+			}
+		}
+		undel_replay_close(&r);
 	}
+	user_db_release(u);
 
-	while(messages) {
-		LOG("%d: sending undel message of length %llu",
-			c_mgr->fd, messages->len);
-		if(send_message(c_mgr->handler, keys,
-			messages->message, messages->len) != 0) {
+	return ret == 1 ? 0 : -1;
 
-			free_umessage_list(messages);
-			return -1;
-		}
-		struct umessage *next = messages->next;
-		free_umessage(messages);
-		messages = next;
+stop:
+	if(undel_replay_stop(u, &r, batch) != 0) {
+		ERR("%d: failed to keep the rest of its undelivered messages",
+			c_hndl->fd);
 	}
+	free_umessage_list(batch);
+	user_db_release(u);
 
-	return 0;
+	return -1;
 }
 
 static int client_handle_loop(struct client_handler *c_hndl,
@@ -253,118 +476,580 @@ static int client_handle_loop(struct client_handler *c_hndl,
 
 	/* while the connection is alive */
 	while(handler_status(c_mgr->handler) == 0 && c_hndl->stop == 0) {
+		/* replies go to our own mailbox, so don't take another request
+		 * while the ones already sent are piling up.  the peer runs out
+		 * of credit meanwhile, and if it still isn't taking them it's
+		 * dropped rather than buffered for.  the queue is mostly what
+		 * others sent it, which keep_unsent stores for its next login
+		 * as the session closes */
+		if(mailbox_wait_space(&c_hndl->mbox, BACKPRESSURE_WAIT) != 0) {
+			LOG("%d: not keeping up with what it's sent, "
+				"disconnecting and keeping the rest", c_hndl->fd);
+			counter_inc(C_BACKPRESSURE_DROPS);
+			return -1;
+		}
+
 		struct message *m = recv_message(c_hndl->hndl, keys, 1000000ULL);
 		if(m == NULL) continue;
+		TRACE(m, TRACE_DECRYPTED);
 
 		handle_message(m, c_hndl);
-		free_message(m);
 	}
 
 	return 0;
 }
 
+/* handle_message takes ownership of m */
 static int handle_message(struct message *m, struct client_handler *c_hndl) {
-	if(m->length < 33) {
-		return -1;
+	int ret = 0;
+
+	if(m->length < 1) {
+		ret = -1;
+		goto end;
 	}
 
+	/* types 0 and 1 start with a target user */
 	uint8_t uid[32];
-	memcpy(uid, &m->message[1], 32);
+	if(m->message[0] <= 1) {
+		if(m->length < 33) {
+			ret = -1;
+			goto end;
+		}
+		memcpy(uid, &m->message[1], 32);
+	}
 
 	switch(m->message[0]) {
-	case 0: {
+	case 0:
+		ret = relay_message(m, uid, c_hndl);
+		/* the message now belongs to the target */
+		m = NULL;
+		break;
+	case 1: {
 		struct user *u = user_db_get(uid);
 		if(u == NULL) {
-			/* user doesn't exist */
 			if(send_u_notfound(c_hndl, uid) != 0) {
-				return -1;
+				ret = -1;
 			}
 			break;
 		}
 
-		/* sanity check the message length field */
-		uint64_t payloadlen = decbe64(&m->message[1+0x20]);
-		if(1+0x20+0x08+payloadlen != m->length) {
-			ERR("%d: message length field does not "
-				"claimed length", c_hndl->fd);
-			return -1;
+		/* the key outlives the user reference */
+		struct pkey_blob *key = pkey_blob_ref(u->pkey_wire);
+		user_db_release(u);
+
+		struct message *resp = alloc_plain_message(0x21 + key->len);
+
+		if(resp == NULL) {
+			ERR(
+				"%d: failed to allocate memory",
+				c_hndl->fd);
+			pkey_blob_put(key);
+			ret = -1;
+			break;
 		}
 
-		/* prepare the message to be sent to the end user */
-		uint64_t resplen = 1 + 0x20 + 0x08 + payloadlen;
-		uint8_t *resp = malloc(resplen);
+		resp->message[0] = 1;
+		memcpy(&resp->message[1], uid, 32);
 
-		resp[0] = 0;
-		memcpy(&resp[1], c_hndl->id, 0x20);
-		encbe64(payloadlen, &resp[0x21]);
-		memcpy(&resp[0x29], &m->message[0x29], payloadlen);
+		memcpy(&resp->message[0x21], key->wire, key->len);
+		pkey_blob_put(key);
 
-		struct client_handler *t_hndl = get_handler(uid);
-		if(t_hndl == NULL) {
-			/* user not logged in */
-			if(undel_add_message(u, resp, resplen) != 0) {
-				ERR("%d: failed to add to undel "
-				"file", c_hndl->fd);
-				return -1;
-			}
-			break;
+		if(deliver(&c_hndl->mbox, resp) != 0) {
+			ERR(
+				"%d: failed to send response",
+				c_hndl->fd);
+			ret = -1;
 		}
+		break;
+	}
+	case 2:
+		ret = fanout_message(m, c_hndl);
+		break;
+	case 3:
+		ret = send_pkeys(m, c_hndl);
+		break;
+	case 4:
+		ret = presence_request(m, c_hndl);
+		break;
+	case 5:
+		ret = stream_chunk(m, c_hndl);
+		/* the chunk now belongs to the target */
+		m = NULL;
+		break;
+	case 6:
+		ret = stream_request(m, c_hndl);
+		break;
+	default:
+		ERR("%d: illegal message code %d",
+			c_hndl->fd, m->message[0]);
+		break;
+	}
+
+end:
+	if(m) free_message(m);
+	return ret;
+}
+
+/* forwards a type 0 message to its target, reusing the received buffer:
+ * the target id in the header is replaced by the sender's and the message is
+ * re-encrypted in place for the target, so the payload is only touched by
+ * the ciphers.  takes ownership of m */
+static int relay_message(struct message *m, uint8_t *uid,
+	struct client_handler *c_hndl) {
 
-		if(send_message(t_hndl->hndl, t_hndl->keys,
-			resp, resplen) != 0) {
-			ERR("%d: failed to send message"
-				"to target %d", c_hndl->fd, t_hndl->fd);
+	struct user *u = user_db_get(uid);
+	if(u == NULL) {
+		/* user doesn't exist */
+		free_message(m);
+		return send_u_notfound(c_hndl, uid);
+	}
+
+	/* sanity check the message length field */
+	if(m->length < 1+0x20+0x08 ||
+		1+0x20+0x08+decbe64(&m->message[1+0x20]) != m->length) {
+		ERR("%d: message length field does not "
+			"claimed length", c_hndl->fd);
+		user_db_release(u);
+		free_message(m);
+		return -1;
+	}
+
+	/* the message to the end user only differs in the id */
+	memcpy(&m->message[1], c_hndl->id, 0x20);
+
+	struct client_handler *t_hndl = get_handler(uid);
+	/* any wait for the target to catch up counts as queueing */
+	TRACE(m, TRACE_ROUTED);
+	if(t_hndl != NULL &&
+		mailbox_wait_space(&t_hndl->mbox, BACKPRESSURE_WAIT) != 0) {
+		/* the target isn't reading, keep it for when they log in again
+		 * instead of buffering without bound */
+		LOG("%d: %d is not keeping up, storing message",
+			c_hndl->fd, t_hndl->fd);
+		counter_inc(C_BACKPRESSURE_SPILLS);
+		put_handler(t_hndl);
+		t_hndl = NULL;
+	}
+	if(t_hndl == NULL) {
+		/* user not logged in */
+		int ret = undel_add_message(u, m->message, m->length);
+		user_db_release(u);
+		free_message(m);
+		if(ret != 0) {
+			ERR("%d: failed to add to undel "
+			"file", c_hndl->fd);
 			return -1;
 		}
+		return 0;
+	}
+	user_db_release(u);
+
+	/* the target's delivery thread encrypts it with the target's keys */
+	counter_inc(C_MESSAGES_RELAYED);
+	if(deliver(&t_hndl->mbox, m) != 0) {
+		ERR("%d: failed to send message"
+			"to target %d", c_hndl->fd, t_hndl->fd);
+		put_handler(t_hndl);
+		return -1;
+	}
+	put_handler(t_hndl);
 
-		break;
+	return 0;
+}
+
+/* the most targets a single type 2 message may have */
+#define FANOUT_MAX (256)
+
+struct fanout_target {
+	uint8_t *payload;
+	uint64_t plen;
+	struct user *u;
+	struct client_handler *hndl;
+	int done;
+};
+
+static struct message *fanout_envelope(struct client_handler *c_hndl,
+	struct fanout_target *t) {
+
+	struct message *env = alloc_plain_message(0x29 + t->plen);
+	if(env == NULL) {
+		return NULL;
 	}
-	case 1: {
-		struct user *u = user_db_get(uid);
-		if(u == NULL) {
-			if(send_u_notfound(c_hndl, uid) != 0) {
-				return -1;
-			}
-			break;
+
+	env->message[0] = 0;
+	memcpy(&env->message[1], c_hndl->id, 0x20);
+	encbe64(t->plen, &env->message[0x21]);
+	memcpy(&env->message[0x29], t->payload, t->plen);
+
+	return env;
+}
+
+/* appends the messages for every target that is the same user as t[0] */
+static int fanout_store(struct client_handler *c_hndl,
+	struct fanout_target *t, uint64_t num) {
+
+	struct umessage *head = NULL;
+	struct umessage **tail = &head;
+	int ret = -1;
+
+	for(uint64_t i = 0; i < num; i++) {
+		if(t[i].u != t[0].u || t[i].done) continue;
+		t[i].done = 1;
+
+		struct umessage *um = alloc_umessage(0x29 + t[i].plen);
+		if(um == NULL) {
+			goto err;
 		}
+		um->message[0] = 0;
+		memcpy(&um->message[1], c_hndl->id, 0x20);
+		encbe64(t[i].plen, &um->message[0x21]);
+		memcpy(&um->message[0x29], t[i].payload, t[i].plen);
+
+		*tail = um;
+		tail = &um->next;
+	}
 
-		uint8_t *resp = malloc(1 + 0x20 +
-			rsa_pubkey_bufsize(u->pkey.bits));
+	ret = undel_add_messages(t[0].u, head);
+err:
+	free_umessage_list(head);
+	return ret;
+}
 
-		if(resp == NULL) {
-			ERR(
-				"%d: failed to allocate memory",
+/* delivers a message to several targets at once, either with a payload per
+ * target or one payload shared between them.  the targets are all looked up
+ * in one pass, and the messages for targets that aren't logged in are
+ * written out afterwards with one append per user file */
+static int fanout_message(struct message *m, struct client_handler *c_hndl) {
+	uint8_t *buf = m->message;
+	uint64_t len = m->length;
+
+	if(len < 0x0a) {
+		goto bad;
+	}
+
+	uint8_t mode = buf[1];
+	uint64_t num = decbe64(&buf[2]);
+	if(mode > 1 || num == 0 || num > FANOUT_MAX) {
+		goto bad;
+	}
+
+	struct fanout_target t[FANOUT_MAX];
+	uint8_t *ids[FANOUT_MAX];
+	struct client_handler *hndls[FANOUT_MAX];
+
+	uint64_t off = 0x0a;
+	if(mode == 0) {
+		for(uint64_t i = 0; i < num; i++) {
+			if(len - off < 0x28) {
+				goto bad;
+			}
+			ids[i] = &buf[off];
+			t[i].plen = decbe64(&buf[off + 0x20]);
+			t[i].payload = &buf[off + 0x28];
+			off += 0x28;
+			if(t[i].plen > len - off) {
+				goto bad;
+			}
+			off += t[i].plen;
+		}
+	} else {
+		if(len - off < num * 0x20 + 0x08) {
+			goto bad;
+		}
+		uint64_t plen = decbe64(&buf[off + num * 0x20]);
+		uint8_t *payload = &buf[off + num * 0x20 + 0x08];
+		for(uint64_t i = 0; i < num; i++) {
+			ids[i] = &buf[off + i * 0x20];
+			t[i].plen = plen;
+			t[i].payload = payload;
+		}
+		off += num * 0x20 + 0x08;
+		if(plen > len - off) {
+			goto bad;
+		}
+		/* every target is sent its own copy, sealed with its own keys,
+		 * so cap the copies at what a single frame could have carried */
+		if(num * (0x29 + plen) > proto_max_frame()) {
+			ERR("%d: multi-target message too large to fan out",
 				c_hndl->fd);
 			return -1;
 		}
+		off += plen;
+	}
+	if(off != len) {
+		goto bad;
+	}
 
-		resp[0] = 1;
-		memcpy(&resp[1], uid, 32);
+	for(uint64_t i = 0; i < num; i++) {
+		t[i].u = user_db_get(ids[i]);
+		t[i].done = 0;
+	}
+	get_handlers(ids, num, hndls);
 
-		rsa_pubkey2wire(&u->pkey, &resp[0x21],
-			rsa_pubkey_bufsize(u->pkey.bits));
+	int ret = 0;
 
-		if(send_message(c_hndl->hndl, c_hndl->keys, resp, 0x21 +
-			rsa_pubkey_bufsize(u->pkey.bits)) != 0) {	
-			ERR(
-				"%d: failed to send response",
-				c_hndl->fd);
-			return -1;
+	/* deliver to everyone that's online first */
+	for(uint64_t i = 0; i < num; i++) {
+		t[i].hndl = hndls[i];
+		if(t[i].u == NULL) {
+			t[i].done = 1;
+			if(send_u_notfound(c_hndl, ids[i]) != 0) {
+				ret = -1;
+			}
+			continue;
+		}
+		if(t[i].hndl == NULL) {
+			continue;
+		}
+		/* don't hold everyone else up waiting on a slow reader,
+		 * store it for them instead */
+		if(mailbox_wait_space(&t[i].hndl->mbox, 0) != 0) {
+			LOG("%d: %d is not keeping up, storing message",
+				c_hndl->fd, t[i].hndl->fd);
+			counter_inc(C_BACKPRESSURE_SPILLS);
+			continue;
 		}
 
-		break;
+		t[i].done = 1;
+		counter_inc(C_MESSAGES_RELAYED);
+		struct message *env = fanout_envelope(c_hndl, &t[i]);
+		if(env == NULL || deliver(&t[i].hndl->mbox, env) != 0) {
+			ERR("%d: failed to send message "
+				"to target %d", c_hndl->fd, t[i].hndl->fd);
+			ret = -1;
+		}
 	}
-	default:
-		ERR("%d: illegal message code %d",
-			c_hndl->fd, m->message[0]);
-		break;
+
+	/* then store the rest */
+	for(uint64_t i = 0; i < num; i++) {
+		if(t[i].done) continue;
+		if(fanout_store(c_hndl, &t[i], num - i) != 0) {
+			ERR("%d: failed to add to undel "
+				"file", c_hndl->fd);
+			ret = -1;
+		}
+	}
+
+	for(uint64_t i = 0; i < num; i++) {
+		if(t[i].hndl) put_handler(t[i].hndl);
+		if(t[i].u) user_db_release(t[i].u);
+	}
+
+	return ret;
+
+bad:
+	ERR("%d: malformed multi-target message", c_hndl->fd);
+	return -1;
+}
+
+/* the most keys that can be requested in one type 3 message */
+#define PKEY_BATCH_MAX (256)
+
+/* answers a request for several public keys with a single response */
+static int send_pkeys(struct message *m, struct client_handler *c_hndl) {
+	uint8_t *buf = m->message;
+	uint64_t len = m->length;
+
+	if(len < 0x09) {
+		goto bad;
+	}
+	uint64_t num = decbe64(&buf[1]);
+	if(num == 0 || num > PKEY_BATCH_MAX || len != 0x09 + num * 0x20) {
+		goto bad;
+	}
+
+	struct pkey_blob *keys[PKEY_BATCH_MAX];
+
+	/* the response is sized up front so each key is copied once, only
+	 * the keys are held on to so the users can be evicted meanwhile */
+	uint64_t resplen = 0x09;
+	for(uint64_t i = 0; i < num; i++) {
+		struct user *u = user_db_get(&buf[0x09 + i * 0x20]);
+		keys[i] = NULL;
+		if(u) {
+			keys[i] = pkey_blob_ref(u->pkey_wire);
+			user_db_release(u);
+		}
+		resplen += 0x28 + (keys[i] ? keys[i]->len : 0);
+	}
+
+	int ret = 0;
+	struct message *resp = alloc_plain_message(resplen);
+	if(resp == NULL) {
+		ERR("%d: failed to allocate memory", c_hndl->fd);
+		ret = -1;
+		goto exit;
+	}
+
+	resp->message[0] = 3;
+	encbe64(num, &resp->message[1]);
+	uint8_t *ptr = &resp->message[0x09];
+	for(uint64_t i = 0; i < num; i++) {
+		memcpy(ptr, &buf[0x09 + i * 0x20], 0x20);
+		if(keys[i]) {
+			encbe64(keys[i]->len, &ptr[0x20]);
+			memcpy(&ptr[0x28], keys[i]->wire, keys[i]->len);
+			ptr += 0x28 + keys[i]->len;
+		} else {
+			/* not found */
+			encbe64(0, &ptr[0x20]);
+			ptr += 0x28;
+		}
+	}
+
+	if(deliver(&c_hndl->mbox, resp) != 0) {
+		ERR("%d: failed to send response", c_hndl->fd);
+		ret = -1;
+	}
+
+exit:
+	for(uint64_t i = 0; i < num; i++) {
+		if(keys[i]) pkey_blob_put(keys[i]);
+	}
+	return ret;
+
+bad:
+	ERR("%d: malformed public key request", c_hndl->fd);
+	return -1;
+}
+
+/* the most users one can be subscribed to at once */
+#define PRESENCE_MAX (1024)
+
+static int presence_request(struct message *m, struct client_handler *c_hndl) {
+	uint8_t *buf = m->message;
+	uint64_t len = m->length;
+
+	if(len < 0x09) {
+		goto bad;
+	}
+	uint64_t num = decbe64(&buf[1]);
+	if(num > PRESENCE_MAX || len != 0x09 + num * 0x20) {
+		goto bad;
+	}
+
+	uint8_t *ids[PRESENCE_MAX];
+	for(uint64_t i = 0; i < num; i++) {
+		ids[i] = &buf[0x09 + i * 0x20];
+	}
+
+	return presence_subscribe(c_hndl, ids, num);
+
+bad:
+	ERR("%d: malformed presence subscription", c_hndl->fd);
+	return -1;
+}
+
+/* the largest chunk a type 5 message may carry */
+#define STREAM_CHUNK_MAX (65536)
+
+/* passes one chunk of a stream on to its target as it arrives, or stores it
+ * if they aren't around, the same way as a type 0 message.  chunks that were
+ * already passed on are dropped, and anything out of order is answered with
+ * where the stream is at.  takes ownership of m */
+static int stream_chunk(struct message *m, struct client_handler *c_hndl) {
+	uint8_t *buf = m->message;
+	uint64_t len = m->length;
+	int ret;
+
+	if(len < 0x41) {
+		goto bad;
+	}
+
+	uint8_t target[0x20];
+	memcpy(target, &buf[0x01], 0x20);
+	uint64_t sid = decbe64(&buf[0x21]);
+	uint64_t offset = decbe64(&buf[0x29]);
+	uint64_t total = decbe64(&buf[0x31]);
+	uint64_t clen = decbe64(&buf[0x39]);
+	if(clen == 0 || clen > STREAM_CHUNK_MAX || len != 0x41 + clen ||
+		offset > total || clen > total - offset) {
+		goto bad;
+	}
+
+	struct user *u = user_db_get(target);
+	if(u == NULL) {
+		free_message(m);
+		return send_u_notfound(c_hndl, target);
+	}
+
+	switch(stream_check(c_hndl->id, sid, target, offset, total, clen)) {
+	case STREAM_DUPLICATE:
+		user_db_release(u);
+		free_message(m);
+		return 0;
+	case STREAM_REFUSED:
+		user_db_release(u);
+		free_message(m);
+		return send_stream_status(c_hndl, sid);
+	}
+
+	/* the target sees who it's from in place of themselves */
+	memcpy(&buf[0x01], c_hndl->id, 0x20);
+	m->lane = LANE_BULK;
+
+	struct client_handler *t_hndl = get_handler(target);
+	TRACE(m, TRACE_ROUTED);
+	if(t_hndl != NULL &&
+		mailbox_wait_space(&t_hndl->mbox, BACKPRESSURE_WAIT) != 0) {
+		LOG("%d: %d is not keeping up, storing chunk",
+			c_hndl->fd, t_hndl->fd);
+		counter_inc(C_BACKPRESSURE_SPILLS);
+		put_handler(t_hndl);
+		t_hndl = NULL;
+	}
+	if(t_hndl == NULL) {
+		ret = undel_add_message(u, buf, len);
+		free_message(m);
+	} else {
+		counter_inc(C_MESSAGES_RELAYED);
+		ret = deliver(&t_hndl->mbox, m);
+		put_handler(t_hndl);
+	}
+	user_db_release(u);
+
+	if(ret != 0) {
+		ERR("%d: failed to pass on stream chunk", c_hndl->fd);
+		return -1;
+	}
+	/* queued counts as passed on, if the target's session closes before
+	 * sending it the chunk is stored then, see keep_unsent */
+	stream_commit(c_hndl->id, sid, offset, clen);
+
+	return 0;
+
+bad:
+	ERR("%d: malformed stream chunk", c_hndl->fd);
+	free_message(m);
+	return -1;
+}
+
+static int stream_request(struct message *m, struct client_handler *c_hndl) {
+	if(m->length != 0x09) {
+		ERR("%d: malformed stream request", c_hndl->fd);
+		return -1;
+	}
+
+	return send_stream_status(c_hndl, decbe64(&m->message[1]));
+}
+
+static int send_stream_status(struct client_handler *c_hndl, uint64_t sid) {
+	uint8_t resp[0x11];
+
+	resp[0] = 6;
+	encbe64(sid, &resp[0x01]);
+	encbe64(stream_position(c_hndl->id, sid), &resp[0x09]);
+
+	if(deliver_buf(&c_hndl->mbox, resp, sizeof(resp)) != 0) {
+		ERR("%d: failed to send response", c_hndl->fd);
+		return -1;
 	}
 
 	return 0;
 }
 
 static int send_u_notfound(struct client_handler *c_hndl, uint8_t *uid) {
-	uint8_t *resp = malloc(1 + 0x20);
+	struct message *resp = alloc_plain_message(1 + 0x20);
 	if(resp == NULL) {
 		ERR(
 			"%d: failed to allocate memory",
@@ -372,20 +1057,16 @@ static int send_u_notfound(struct client_handler *c_hndl, uint8_t *uid) {
 		return -1;
 	}
 
-	resp[0] = 0xff;
-	memcpy(&resp[1], uid, 32);
+	resp->message[0] = 0xff;
+	memcpy(&resp->message[1], uid, 32);
 
-	if(send_message(c_hndl->hndl, c_hndl->keys, resp,
-		1+0x20) != 0) {
+	if(deliver(&c_hndl->mbox, resp) != 0) {
 		ERR(
 			"%d: failed to send response",
 			c_hndl->fd);
-
-		free(resp);
 		return -1;
 	}
 
-	free(resp);
 	return 0;
 }
 
@@ -395,8 +1076,10 @@ static int send_u_notfound(struct client_handler *c_hndl, uint8_t *uid) {
 #define TOP_LOAD (0.75)
 #define BOT_LOAD (0.5 / 2)
 
-#define MAX_SIZE ((uint64_t)1 << 20)
-#define MIN_SIZE ((uint64_t) 16)
+#define MIN_SIZE ((uint64_t) 8)
+
+/* number of old buckets moved into the new table per add or remove */
+#define MIGRATE_STEP ((uint64_t) 16)
 
 static uint64_t hash_id(uint8_t *id) {
 	uint8_t shasum[32];
@@ -408,164 +1091,410 @@ static uint64_t hash_id(uint8_t *id) {
 		decbe64(&shasum[24]);
 }
 
-static int resize_handler_table(uint64_t nsize) {
-	if(nsize > MAX_SIZE || nsize < MIN_SIZE) {
-		return 0;
-	}
+static struct handler_shard *get_shard(uint64_t hash) {
+	return &ht.shards[hash >> (64 - HT_SHARD_BITS)];
+}
 
-	size_t alloc_size = nsize * sizeof(struct client_handler *);
-	struct client_handler **nbuckets = malloc(alloc_size);
-	if(nbuckets == NULL) {
-		return -1;
+static struct handler_buckets *alloc_buckets(uint64_t size) {
+	size_t alloc_size = sizeof(struct handler_buckets) +
+		size * sizeof(struct handler_node *);
+	struct handler_buckets *table = tag_malloc(ALLOC_HANDLER, alloc_size);
+	if(table == NULL) {
+		return NULL;
 	}
 
-	memset(nbuckets, 0, alloc_size);
+	memset(table, 0, alloc_size);
+	table->size = size;
 
-	uint64_t i;
+	return table;
+}
 
-	for(i = 0; i < ht.size; i++) {
-		struct client_handler *cur = ht.buckets[i];
-		struct client_handler *next;
+static void free_buckets(struct handler_buckets *table) {
+	uint64_t i;
+	for(i = 0; i < table->size; i++) {
+		struct handler_node *cur = table->b[i];
+		struct handler_node *next;
 		while(cur != NULL) {
 			next = cur->next;
+			tag_free(ALLOC_HANDLER, cur);
+			cur = next;
+		}
+	}
 
-			uint64_t index = hash_id(cur->id) % nsize;
-			cur->next = nbuckets[index];
-			nbuckets[hash_id(cur->id) % nsize] = cur;
+	tag_free(ALLOC_HANDLER, table);
+}
 
-			cur = next;
+/* moves the nodes of an old bucket into the new table, the shard lock must
+ * be held.  each node is taken from the end of its chain and put in front
+ * of its new bucket before it is unlinked from the old one.  a reader in
+ * the old chain that gets to it has seen the rest of that chain already and
+ * only goes on into the new one, and since readers look in the old table
+ * first they can't miss it */
+static void migrate_bucket(struct handler_shard *shard, uint64_t i) {
+	struct handler_node **head = &shard->old->b[i];
+	while(*head != NULL) {
+		struct handler_node **loc = head;
+		while((*loc)->next != NULL) {
+			loc = &((*loc)->next);
 		}
+
+		struct handler_node *node = *loc;
+		struct handler_node **bucket =
+			&shard->table->b[node->hash % shard->table->size];
+		__atomic_store_n(&node->next, *bucket, __ATOMIC_RELEASE);
+		__atomic_store_n(bucket, node, __ATOMIC_RELEASE);
+		__atomic_store_n(loc, NULL, __ATOMIC_RELEASE);
 	}
+}
 
-	free(ht.buckets);
-	ht.buckets = nbuckets;
-	ht.size = nsize;
+/* moves up to count buckets into the new table, the shard lock must be
+ * held.  once they're all moved the old table is returned to be reclaimed */
+static struct handler_buckets *migrate_shard(struct handler_shard *shard,
+	uint64_t count) {
 
-	return 0;
+	struct handler_buckets *old = shard->old;
+	if(old == NULL) {
+		return NULL;
+	}
+
+	for(; count > 0 && shard->migrated < old->size; count--) {
+		migrate_bucket(shard, shard->migrated);
+		shard->migrated++;
+	}
+	if(shard->migrated < old->size) {
+		return NULL;
+	}
+
+	__atomic_store_n(&shard->old, NULL, __ATOMIC_RELEASE);
+	shard->migrated = 0;
+
+	return old;
 }
 
-int init_handler_table() {
-	size_t size = MIN_SIZE * sizeof(struct client_handler *);
-	ht.buckets = malloc(size);
-	if(ht.buckets == NULL) {
-		return 1;
+/* carries on with the shard's migration, and starts a new one if its load
+ * factor is out of bounds.  the shard lock must be held.  a finished old
+ * table is returned to be reclaimed */
+static struct handler_buckets *resize_shard(struct handler_shard *shard) {
+	struct handler_buckets *done = migrate_shard(shard, MIGRATE_STEP);
+	if(shard->old != NULL) {
+		return done;
 	}
-	memset(ht.buckets, 0, size);
-	ht.size = MIN_SIZE;
-	ht.elements = 0;
 
-	if(init_lock(&ht.l) != 0) {
-		return 1;
+	struct handler_buckets *cur = shard->table;
+	uint64_t nsize = cur->size;
+	if(shard->elements > (uint64_t) (cur->size * TOP_LOAD)) {
+		nsize <<= 1;
+	} else if(cur->size > MIN_SIZE &&
+		shard->elements < (uint64_t) (cur->size * BOT_LOAD)) {
+		nsize >>= 1;
 	}
 
-	return 0;
+	if(nsize == cur->size) {
+		return done;
+	}
+
+	struct handler_buckets *table = alloc_buckets(nsize);
+	if(table == NULL) {
+		/* keep using the current table, it still works */
+		return done;
+	}
+
+	/* the old table is published first, a reader that sees the new
+	 * one also sees where the rest of the handlers are */
+	shard->migrated = 0;
+	__atomic_store_n(&shard->old, cur, __ATOMIC_RELEASE);
+	__atomic_store_n(&shard->table, table, __ATOMIC_RELEASE);
+
+	return done;
 }
 
-void end_handlers() {
-	acquire_writelock(&ht.l);
+/* finds the link pointing to the node for id, the shard lock must be held */
+static struct handler_node **find_node(struct handler_shard *shard,
+	uint8_t *id, uint64_t hash) {
+
+	struct handler_node **loc = &shard->table->b[hash % shard->table->size];
+	while(*loc != NULL) {
+		if((*loc)->hash == hash && memcmp((*loc)->hndl->id, id, 32) == 0) {
+			return loc;
+		}
+		loc = &((*loc)->next);
+	}
 
+	/* it may not have been moved into the new table yet */
+	struct handler_buckets *old = shard->old;
+	if(old != NULL && hash % old->size >= shard->migrated) {
+		loc = &old->b[hash % old->size];
+		while(*loc != NULL) {
+			if((*loc)->hash == hash &&
+				memcmp((*loc)->hndl->id, id, 32) == 0) {
+				return loc;
+			}
+			loc = &((*loc)->next);
+		}
+	}
+
+	return NULL;
+}
+
+int init_handler_table() {
+	int i;
+	for(i = 0; i < HT_SHARDS; i++) {
+		struct handler_shard *shard = &ht.shards[i];
+		shard->table = alloc_buckets(MIN_SIZE);
+		if(shard->table == NULL) {
+			return 1;
+		}
+		shard->old = NULL;
+		shard->migrated = 0;
+		shard->elements = 0;
+
+		if(pthread_mutex_init(&shard->lock, NULL) != 0) {
+			return 1;
+		}
+	}
+	ht.elements = 0;
+	ht.stopping = 0;
+
+	return 0;
+}
+
+static void stop_bucket_handlers(struct handler_buckets *table) {
 	uint64_t i;
-	for(i = 0; i < ht.size; i++) {
-		struct client_handler *cur = ht.buckets[i];
+	for(i = 0; i < table->size; i++) {
+		struct handler_node *cur = table->b[i];
 
 		while(cur) {
-			cur->stop = 1;
+			cur->hndl->stop = 1;
 			cur = cur->next;
 		}
 	}
-	release_writelock(&ht.l);
+}
+
+void end_handlers() {
+	/* read by add_handler under a shard lock, which is taken below */
+	__atomic_store_n(&ht.stopping, 1, __ATOMIC_RELEASE);
+
+	int i;
+	for(i = 0; i < HT_SHARDS; i++) {
+		struct handler_shard *shard = &ht.shards[i];
+		pthread_mutex_lock(&shard->lock);
+
+		stop_bucket_handlers(shard->table);
+		if(shard->old != NULL) {
+			stop_bucket_handlers(shard->old);
+		}
+
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void wait_handlers() {
+	pthread_mutex_lock(&threads.lock);
+	while(threads.running != 0) {
+		pthread_cond_wait(&threads.done, &threads.lock);
+	}
+	pthread_mutex_unlock(&threads.lock);
 }
 
 void destroy_handler_table() {
-	free(ht.buckets);
-	destroy_lock(&ht.l);
+	int i;
+	for(i = 0; i < HT_SHARDS; i++) {
+		free_buckets(ht.shards[i].table);
+		/* the buckets already moved are empty */
+		if(ht.shards[i].old != NULL) {
+			free_buckets(ht.shards[i].old);
+		}
+		pthread_mutex_destroy(&ht.shards[i].lock);
+	}
 }
 
-struct client_handler *get_handler(uint8_t* id) {
-	acquire_readlock(&ht.l);
+/* must be called inside of an epoch read section */
+static struct client_handler *lookup_chain(struct handler_buckets *table,
+	uint8_t *id, uint64_t hash) {
 
-	uint64_t index = hash_id(id) % ht.size;
-	struct client_handler *cur = ht.buckets[index];
+	struct handler_node *cur =
+		__atomic_load_n(&table->b[hash % table->size], __ATOMIC_ACQUIRE);
 
 	while(cur != NULL) {
-		if(memcmp(cur->id, id, 32) == 0) {
-			goto exit;
+		if(cur->hash == hash && memcmp(cur->hndl->id, id, 32) == 0) {
+			/* the handler can't go away until the reference
+			 * is put back */
+			struct client_handler *ret = cur->hndl;
+			__atomic_add_fetch(&ret->refs, 1, __ATOMIC_ACQ_REL);
+			return ret;
 		}
 
-		cur = cur->next;
+		cur = __atomic_load_n(&cur->next, __ATOMIC_ACQUIRE);
 	}
 
-exit:
-	release_readlock(&ht.l);
-	return cur;
+	return NULL;
 }
 
-int add_handler(struct client_handler *handler) {
-	acquire_writelock(&ht.l);
+/* must be called inside of an epoch read section */
+static struct client_handler *lookup_handler(uint8_t *id) {
+	uint64_t hash = hash_id(id);
+	struct handler_shard *shard = get_shard(hash);
 
-	uint64_t index = hash_id(handler->id) % ht.size;
-	struct client_handler **loc = &ht.buckets[index];
+	struct client_handler *ret = NULL;
+	struct handler_buckets *table;
 
-	int ret = 0;
+	/* the old table is searched first, handlers are put into the new one
+	 * before they leave the old.  if a resize started meanwhile the
+	 * handler may have moved past us, so look again */
+	do {
+		table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+		struct handler_buckets *old =
+			__atomic_load_n(&shard->old, __ATOMIC_ACQUIRE);
 
-	while(*loc != NULL) {
-		/* don't tolerate duplicates */
-		if(memcmp((*loc)->id, handler->id, 32) == 0) {
-			ret = 1;
-			goto exit;
+		if(old != NULL) {
+			ret = lookup_chain(old, id, hash);
 		}
+		if(ret == NULL) {
+			ret = lookup_chain(table, id, hash);
+		}
+	} while(ret == NULL &&
+		__atomic_load_n(&shard->table, __ATOMIC_ACQUIRE) != table);
 
-		loc = &((*loc)->next);
-	}
+	return ret;
+}
+
+struct client_handler *get_handler(uint8_t* id) {
+	epoch_enter();
+	struct client_handler *ret = lookup_handler(id);
+	epoch_exit();
+
+	return ret;
+}
 
-	handler->next = NULL;
-	*loc = handler;
-	ht.elements++;
+uint64_t get_handlers(uint8_t **ids, uint64_t num,
+	struct client_handler **handlers) {
 
-	if(ht.elements >
-		(uint64_t) (ht.size * TOP_LOAD)) {
-		/* resize */
-		ret = resize_handler_table(ht.size << 1);
+	uint64_t found = 0;
+
+	epoch_enter();
+	for(uint64_t i = 0; i < num; i++) {
+		handlers[i] = lookup_handler(ids[i]);
+		if(handlers[i]) found++;
 	}
+	epoch_exit();
 
-exit:
-	release_writelock(&ht.l);
-	return ret;
+	return found;
 }
 
-int rem_handler(uint8_t* id) {
-	acquire_writelock(&ht.l);
+void put_handler(struct client_handler *handler) {
+	/* the last reference is dropped under the mutex, so rem_handler can't
+	 * see it go and destroy the handler before we're done with it */
+	pthread_mutex_lock(&handler->ref_mutex);
+	if(__atomic_sub_fetch(&handler->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_cond_broadcast(&handler->ref_cond);
+	}
+	pthread_mutex_unlock(&handler->ref_mutex);
+}
 
-	uint64_t index = hash_id(id) % ht.size;
-	struct client_handler **loc = &ht.buckets[index];
+int add_handler(struct client_handler *handler) {
+	uint64_t hash = hash_id(handler->id);
+	struct handler_shard *shard = get_shard(hash);
 
-	int ret = 0;
+	handler->refs = 0;
+	if(pthread_mutex_init(&handler->ref_mutex, NULL) != 0) {
+		return -1;
+	}
+	if(pthread_cond_init(&handler->ref_cond, NULL) != 0) {
+		pthread_mutex_destroy(&handler->ref_mutex);
+		return -1;
+	}
 
-	while(*loc != NULL) {
-		if(memcmp((*loc)->id, id, 32) == 0) {
-			break;
-		}
+	struct handler_node *node = tag_malloc(ALLOC_HANDLER, sizeof(*node));
+	if(node == NULL) {
+		goto err;
+	}
+	node->hash = hash;
+	node->hndl = handler;
 
-		loc = &((*loc)->next);
+	pthread_mutex_lock(&shard->lock);
+
+	/* don't tolerate duplicates, or sessions end_handlers would miss */
+	if(__atomic_load_n(&ht.stopping, __ATOMIC_ACQUIRE) ||
+		find_node(shard, handler->id, hash) != NULL) {
+		pthread_mutex_unlock(&shard->lock);
+		tag_free(ALLOC_HANDLER, node);
+		goto err;
 	}
 
+	struct handler_node **bucket = &shard->table->b[hash % shard->table->size];
+	node->next = *bucket;
+	__atomic_store_n(bucket, node, __ATOMIC_RELEASE);
+	shard->elements++;
+	__atomic_add_fetch(&ht.elements, 1, __ATOMIC_RELAXED);
+
+	struct handler_buckets *old = resize_shard(shard);
+
+	/* told while the shard is still locked, so a session for the same
+	 * user coming or going can't get its news in before ours.  the
+	 * presence lock never waits on a shard lock */
+	presence_online(handler->id);
+
+	pthread_mutex_unlock(&shard->lock);
+
+	if(old != NULL) {
+		epoch_synchronize();
+		free_buckets(old);
+	}
+
+	return 0;
+
+err:
+	pthread_cond_destroy(&handler->ref_cond);
+	pthread_mutex_destroy(&handler->ref_mutex);
+	return 1;
+}
+
+/* removes the handler and waits until nobody else holds a reference to it */
+int rem_handler(uint8_t* id) {
+	uint64_t hash = hash_id(id);
+	struct handler_shard *shard = get_shard(hash);
+
+	pthread_mutex_lock(&shard->lock);
+
+	struct handler_node **loc = find_node(shard, id, hash);
+
 	/* didn't find it */
-	if(*loc == NULL) {
-		ret = 1;
-		goto exit;
+	if(loc == NULL) {
+		pthread_mutex_unlock(&shard->lock);
+		return 1;
 	}
 
-	/* we don't allocate the memory, so don't free it */
-	*loc = (*loc)->next;
-	ht.elements--;
+	struct handler_node *node = *loc;
+	struct client_handler *handler = node->hndl;
+
+	__atomic_store_n(loc, node->next, __ATOMIC_RELEASE);
+	shard->elements--;
+	__atomic_sub_fetch(&ht.elements, 1, __ATOMIC_RELAXED);
+
+	struct handler_buckets *old = resize_shard(shard);
 
-	if(ht.elements <
-		(uint64_t) (ht.size * BOT_LOAD)) {
-		ret = resize_handler_table(ht.size >> 1);
+	/* under the shard lock, see add_handler */
+	presence_offline(id);
+
+	pthread_mutex_unlock(&shard->lock);
+
+	/* wait for any readers still looking at the node */
+	epoch_synchronize();
+	tag_free(ALLOC_HANDLER, node);
+	if(old != NULL) {
+		free_buckets(old);
 	}
 
-exit:
-	release_writelock(&ht.l);
-	return ret;
-}
+	/* no new references can be taken now, wait out the existing ones */
+	pthread_mutex_lock(&handler->ref_mutex);
+	while(__atomic_load_n(&handler->refs, __ATOMIC_ACQUIRE) != 0) {
+		pthread_cond_wait(&handler->ref_cond, &handler->ref_mutex);
+	}
+	pthread_mutex_unlock(&handler->ref_mutex);
 
+	/* we don't allocate the handler, so don't free it */
+	pthread_cond_destroy(&handler->ref_cond);
+	pthread_mutex_destroy(&handler->ref_mutex);
+
+	return 0;
+}
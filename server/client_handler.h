@@ -8,6 +8,8 @@
 #include "../inet/message.h"
 #include "../crypto/crypto_layer.h"
 
+#include "delivery.h"
+
 struct client_handler {
 	pthread_t thread;
 
@@ -16,20 +18,35 @@ struct client_handler {
 
 	struct con_handle *hndl;
 	struct keyset *keys;
+	/* everything sent after authorization goes through here */
+	struct mailbox mbox;
 
 	/* this will only be written to in one location, a mutex is overkill */
 	int stop;
 
-	/* for use in the handler table */
-	struct client_handler *next;
+	/* references handed out by get_handler, rem_handler waits for them */
+	uint64_t refs;
+	pthread_mutex_t ref_mutex;
+	pthread_cond_t ref_cond;
 };
 
-int spawn_handler(int fd);
+/* address is the peer's, its handshake was taken with admit_connection and
+ * the handler gives it back once the handshake is over */
+int spawn_handler(int fd, char *address);
 
 int init_handler_table();
+/* tells every session to stop, and refuses new ones */
 void end_handlers();
+/* waits for every handler thread to exit, after end_handlers */
+void wait_handlers();
 void destroy_handler_table();
+/* handlers returned must be given back with put_handler */
 struct client_handler *get_handler(uint8_t* id);
+/* looks up several handlers at once, the ones not logged in are set to NULL.
+ * returns the number found */
+uint64_t get_handlers(uint8_t **ids, uint64_t num,
+	struct client_handler **handlers);
+void put_handler(struct client_handler *handler);
 int add_handler(struct client_handler *handler);
 int rem_handler(uint8_t* id);
 
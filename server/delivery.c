@@ -0,0 +1,269 @@
+/* a pool of threads that encrypt and send messages on behalf of sessions */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "delivery.h"
+
+#include "../util/defaults.h"
+#include "../util/log.h"
+#include "../util/trace.h"
+
+/* the most messages sent from one mailbox before others get a turn */
+#define DELIVERY_BATCH (64)
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* mailboxes with messages waiting */
+	struct mailbox *first;
+	struct mailbox *last;
+
+	int stop;
+
+	pthread_t *threads;
+	long nthreads;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	NULL, NULL, 0, NULL, 0 };
+
+static void schedule(struct mailbox *mb) {
+	pthread_mutex_lock(&pool.lock);
+	mb->next = NULL;
+	if(pool.last) {
+		pool.last->next = mb;
+	} else {
+		pool.first = mb;
+	}
+	pool.last = mb;
+	pthread_cond_signal(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static struct mailbox *next_mailbox() {
+	pthread_mutex_lock(&pool.lock);
+	while(pool.first == NULL && !pool.stop) {
+		pthread_cond_wait(&pool.cond, &pool.lock);
+	}
+
+	struct mailbox *mb = pool.first;
+	if(mb) {
+		pool.first = mb->next;
+		if(pool.first == NULL) {
+			pool.last = NULL;
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return mb;
+}
+
+/* only one thread runs a given mailbox at a time, guaranteed by the
+ * scheduled flag, so the keys need no further locking */
+static void run_mailbox(struct mailbox *mb) {
+	struct message *batch[DELIVERY_BATCH];
+	int n = 0;
+
+	pthread_mutex_lock(&mb->lock);
+	while(n < DELIVERY_BATCH && mb->queue.size > 0) {
+		batch[n] = message_queue_pop(&mb->queue);
+		mb->bytes -= batch[n]->length;
+		n++;
+	}
+	pthread_mutex_unlock(&mb->lock);
+
+	for(int i = 0; i < n; i++) {
+		if(send_plain_message(mb->con, mb->keys, batch[i]) != 0) {
+			ERR("failed to send delivered message");
+		}
+	}
+
+	pthread_mutex_lock(&mb->lock);
+	int more = mb->queue.size > 0;
+	if(!more) {
+		mb->scheduled = 0;
+		pthread_cond_broadcast(&mb->idle);
+	}
+	pthread_mutex_unlock(&mb->lock);
+
+	/* go to the back of the line so busy sessions don't starve others */
+	if(more) {
+		schedule(mb);
+	}
+}
+
+static void *delivery_thread(void *_arg) {
+	struct mailbox *mb;
+	while((mb = next_mailbox()) != NULL) {
+		run_mailbox(mb);
+	}
+
+	return NULL;
+}
+
+int init_delivery() {
+	long nthreads = DELIVERY_THREADS;
+	if(nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(nthreads <= 0) {
+		nthreads = 1;
+	}
+
+	pool.stop = 0;
+	pool.threads = malloc(nthreads * sizeof(pthread_t));
+	if(pool.threads == NULL) {
+		errno = ENOMEM;
+		return 1;
+	}
+
+	for(pool.nthreads = 0; pool.nthreads < nthreads; pool.nthreads++) {
+		if(pthread_create(&pool.threads[pool.nthreads], NULL,
+			delivery_thread, NULL) != 0) {
+			end_delivery();
+			return 1;
+		}
+	}
+
+	LOG("started %ld delivery threads", nthreads);
+
+	return 0;
+}
+
+/* lets the delivery threads empty the run queue, then stops them */
+void end_delivery() {
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	for(long i = 0; i < pool.nthreads; i++) {
+		pthread_join(pool.threads[i], NULL);
+	}
+
+	free(pool.threads);
+	pool.threads = NULL;
+	pool.nthreads = 0;
+}
+
+int mailbox_open(struct mailbox *mb, struct con_handle *con,
+	struct keyset *keys) {
+
+	mb->queue = EMPTY_MESSAGE_QUEUE;
+	mb->bytes = 0;
+	mb->scheduled = 0;
+	mb->closed = 0;
+	mb->con = con;
+	mb->keys = keys;
+	mb->first_nonce = keys->nonce;
+	mb->next = NULL;
+
+	if(pthread_mutex_init(&mb->lock, NULL) != 0) {
+		return 1;
+	}
+	if(pthread_cond_init(&mb->idle, NULL) != 0) {
+		pthread_mutex_destroy(&mb->lock);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* whatever was posted before closing is still sent */
+void mailbox_close(struct mailbox *mb) {
+	pthread_mutex_lock(&mb->lock);
+	mb->closed = 1;
+	while(mb->scheduled) {
+		pthread_cond_wait(&mb->idle, &mb->lock);
+	}
+
+	struct message *m;
+	while((m = message_queue_pop(&mb->queue)) != NULL) {
+		free_message(m);
+	}
+	pthread_mutex_unlock(&mb->lock);
+
+	pthread_cond_destroy(&mb->idle);
+	pthread_mutex_destroy(&mb->lock);
+}
+
+struct message *mailbox_unsent(struct mailbox *mb) {
+	struct message *first = NULL;
+	struct message **last = &first;
+
+	struct message *m = con_take_unsent(mb->con);
+	while(m != NULL) {
+		struct message *next = m->next;
+		/* anything from before the mailbox was opened isn't ours */
+		if(m->seq_num < mb->first_nonce ||
+			unsend_message(mb->keys, m) != 0) {
+			free_message(m);
+		} else {
+			m->next = NULL;
+			*last = m;
+			last = &m->next;
+		}
+		m = next;
+	}
+
+	return first;
+}
+
+int deliver(struct mailbox *mb, struct message *m) {
+	pthread_mutex_lock(&mb->lock);
+	if(mb->closed) {
+		pthread_mutex_unlock(&mb->lock);
+		free_message(m);
+		errno = EPIPE;
+		return -1;
+	}
+
+	TRACE(m, TRACE_ENQUEUED);
+	message_queue_push(&mb->queue, m);
+	mb->bytes += m->length;
+
+	int wake = !mb->scheduled;
+	mb->scheduled = 1;
+	pthread_mutex_unlock(&mb->lock);
+
+	if(wake) {
+		schedule(mb);
+	}
+
+	return 0;
+}
+
+uint64_t mailbox_queued(struct mailbox *mb) {
+	pthread_mutex_lock(&mb->lock);
+	uint64_t queued = mb->bytes;
+	pthread_mutex_unlock(&mb->lock);
+
+	return queued + con_queued(mb->con);
+}
+
+int mailbox_wait_space(struct mailbox *mb, uint64_t timeout) {
+	if(mailbox_queued(mb) < SEND_HIGH_WATER) {
+		return 0;
+	}
+
+	/* the mailbox empties into the connection quickly,
+	 * so it's the connection that we wait on */
+	return con_wait_space(mb->con, SEND_LOW_WATER, timeout);
+}
+
+int deliver_buf(struct mailbox *mb, uint8_t *ptext, uint64_t plen) {
+	struct message *m = alloc_plain_message(plen);
+	if(m == NULL) {
+		return -1;
+	}
+
+	memcpy(m->message, ptext, plen);
+
+	return deliver(mb, m);
+}
+
@@ -0,0 +1,59 @@
+#ifndef IBCHAT_SERVER_DELIVERY_H
+#define IBCHAT_SERVER_DELIVERY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "../inet/protocol.h"
+#include "../inet/message.h"
+#include "../crypto/crypto_layer.h"
+
+/* every session sends through its mailbox once it has been authorized.
+ * messages are posted as plaintext by any thread and a delivery thread
+ * encrypts and queues them, so only one thread at a time ever uses the
+ * session's keys */
+struct mailbox {
+	pthread_mutex_t lock;
+	pthread_cond_t idle; /* signalled when a delivery thread is done */
+
+	struct message_queue queue;
+	uint64_t bytes; /* in the queue */
+	/* set while on the run queue or being drained */
+	int scheduled;
+	int closed;
+
+	struct con_handle *con;
+	struct keyset *keys;
+	uint64_t first_nonce; /* of the first message sent through it */
+
+	struct mailbox *next; /* run queue link */
+};
+
+int init_delivery();
+void end_delivery();
+
+int mailbox_open(struct mailbox *mb, struct con_handle *con,
+	struct keyset *keys);
+/* waits for the messages already posted to be sent,
+ * nothing may be posted after this is called */
+void mailbox_close(struct mailbox *mb);
+/* takes back what the mailbox passed to the connection and it never sent,
+ * as plaintext messages linked through next.  only once the mailbox is
+ * closed and the connection's thread has exited */
+struct message *mailbox_unsent(struct mailbox *mb);
+
+/* m must come from alloc_plain_message or recv_message, it is consumed even
+ * on failure.  it's always queued, use mailbox_wait_space to stay under the
+ * limits */
+int deliver(struct mailbox *mb, struct message *m);
+/* copies the plaintext into a new message and delivers it */
+int deliver_buf(struct mailbox *mb, uint8_t *ptext, uint64_t plen);
+
+/* bytes posted to the session and not sent yet */
+uint64_t mailbox_queued(struct mailbox *mb);
+/* once SEND_HIGH_WATER bytes are waiting, waits for the session to drain
+ * below SEND_LOW_WATER.  returns non-zero if it didn't within timeout */
+int mailbox_wait_space(struct mailbox *mb, uint64_t timeout);
+
+#endif
+
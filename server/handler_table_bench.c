@@ -0,0 +1,177 @@
+/* measures how get_handler throughput scales with the number of reader
+ * threads, optionally with a thread continuously logging users in and out */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/time.h>
+
+#include <libibur/endian.h>
+
+#include "client_handler.h"
+
+#define DFLT_THREADS (64)
+#define DFLT_HANDLERS (10000)
+#define DFLT_SECONDS (2)
+
+/* handlers at the end of the array are logged in and out by the churn thread */
+#define CHURN_HANDLERS (256)
+
+static struct client_handler *handlers;
+static uint64_t num_handlers;
+
+static volatile int running;
+
+struct reader_arg {
+	pthread_t thread;
+	uint64_t seed;
+	uint64_t ops;
+	uint64_t misses;
+};
+
+static uint64_t xorshift(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static uint64_t now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static void *reader(void *_arg) {
+	struct reader_arg *arg = (struct reader_arg *) _arg;
+
+	uint64_t ops = 0;
+	uint64_t misses = 0;
+	while(running) {
+		uint64_t idx = xorshift(&arg->seed) % num_handlers;
+		struct client_handler *h = get_handler(handlers[idx].id);
+		if(h != NULL) {
+			put_handler(h);
+		} else {
+			misses++;
+		}
+		ops++;
+	}
+
+	arg->ops = ops;
+	arg->misses = misses;
+
+	return NULL;
+}
+
+static void *churn(void *_arg) {
+	uint64_t *cycles = (uint64_t *) _arg;
+	uint64_t first = num_handlers - CHURN_HANDLERS;
+	uint64_t i = 0;
+	while(running) {
+		struct client_handler *h = &handlers[first + i % CHURN_HANDLERS];
+		rem_handler(h->id);
+		add_handler(h);
+		i++;
+	}
+	*cycles = i;
+
+	return NULL;
+}
+
+static int run(int threads, int churning, int seconds) {
+	struct reader_arg *args = malloc(threads * sizeof(*args));
+	if(args == NULL) {
+		return -1;
+	}
+
+	pthread_t churn_thread;
+	uint64_t cycles = 0;
+
+	running = 1;
+	for(int i = 0; i < threads; i++) {
+		args[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		pthread_create(&args[i].thread, NULL, reader, &args[i]);
+	}
+	if(churning) {
+		pthread_create(&churn_thread, NULL, churn, &cycles);
+	}
+
+	uint64_t start = now();
+	sleep(seconds);
+	running = 0;
+
+	uint64_t ops = 0;
+	uint64_t misses = 0;
+	for(int i = 0; i < threads; i++) {
+		pthread_join(args[i].thread, NULL);
+		ops += args[i].ops;
+		misses += args[i].misses;
+	}
+	if(churning) {
+		pthread_join(churn_thread, NULL);
+	}
+	uint64_t elapsed = now() - start;
+
+	printf("%7d %14.0f %14.0f %10llu %10llu\n", threads,
+		ops * 1e6 / elapsed, ops * 1e6 / elapsed / threads,
+		(unsigned long long) misses, (unsigned long long) cycles);
+
+	free(args);
+
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : DFLT_THREADS;
+	num_handlers = argc > 2 ? strtoull(argv[2], NULL, 10) : DFLT_HANDLERS;
+	int seconds = argc > 3 ? atoi(argv[3]) : DFLT_SECONDS;
+
+	if(max_threads < 1 || num_handlers <= CHURN_HANDLERS || seconds < 1) {
+		fprintf(stderr, "usage: %s [max threads] [handlers (> %d)] "
+			"[seconds per run]\n", argv[0], CHURN_HANDLERS);
+		return 1;
+	}
+
+	if(init_handler_table() != 0) {
+		fprintf(stderr, "failed to initialize handler table\n");
+		return 1;
+	}
+
+	handlers = calloc(num_handlers, sizeof(struct client_handler));
+	if(handlers == NULL) {
+		fprintf(stderr, "failed to allocate memory\n");
+		return 1;
+	}
+	for(uint64_t i = 0; i < num_handlers; i++) {
+		encbe64(i, handlers[i].id);
+		if(add_handler(&handlers[i]) != 0) {
+			fprintf(stderr, "failed to add handler\n");
+			return 1;
+		}
+	}
+
+	printf("%llu handlers online, %ld processors\n",
+		(unsigned long long) num_handlers,
+		sysconf(_SC_NPROCESSORS_ONLN));
+
+	for(int churning = 0; churning <= 1; churning++) {
+		printf("\n%s\n", churning ? "readers with login/logout churn" :
+			"readers only");
+		printf("%7s %14s %14s %10s %10s\n", "threads", "lookups/s",
+			"per thread", "misses", "churns");
+		for(int t = 1; t <= max_threads; t *= 2) {
+			if(run(t, churning, seconds) != 0) {
+				fprintf(stderr, "failed to run benchmark\n");
+				return 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
@@ -1,4 +1,4 @@
 DIR=server
-FILTER=$(wildcard */*_test.c)
+FILTER=$(wildcard */*_test.c) $(wildcard */*_bench.c)
 SERVERSOURCES+=$(filter-out $(FILTER),$(wildcard $(DIR)/*.c))
 
@@ -0,0 +1,464 @@
+/* tracks who is subscribed to whose online state */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libibur/endian.h>
+
+#include "presence.h"
+#include "client_handler.h"
+#include "delivery.h"
+
+#include "../util/defaults.h"
+#include "../util/log.h"
+
+#define TOP_LOAD (0.75)
+#define MIN_SIZE ((uint64_t) 64)
+
+/* size of a single user's entry in a presence message */
+#define ENTRY_SIZE (0x21)
+
+/* the first member of both watched users and subscribers,
+ * so the same table code works for both */
+struct presence_node {
+	uint8_t id[0x20];
+	struct presence_node *next;
+};
+
+struct presence_table {
+	struct presence_node **b;
+	uint64_t size;
+	uint64_t elements;
+};
+
+struct edge;
+
+/* a user that someone is subscribed to */
+struct watched {
+	struct presence_node node;
+
+	int online;
+	/* the state subscribers were last told about */
+	int reported;
+
+	struct edge *edges;
+	struct watched *dirty_next;
+	int dirty;
+};
+
+/* a user that is subscribed to others */
+struct subscriber {
+	struct presence_node node;
+
+	struct edge *edges;
+
+	/* entries waiting for the next flush */
+	uint8_t *pending;
+	uint64_t npending;
+	uint64_t pending_cap;
+	struct subscriber *pending_next;
+};
+
+/* one subscription, linked into both of its ends */
+struct edge {
+	struct subscriber *sub;
+	struct watched *w;
+
+	struct edge *sub_next;
+	struct edge *w_next;
+	struct edge **w_pprev;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	struct presence_table watched;
+	struct presence_table subs;
+
+	struct watched *dirty;
+	struct subscriber *pending;
+
+	int running;
+	int stop;
+	pthread_t thread;
+} pr = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* uids are already sha256 hashes, so any part of them is a good hash */
+static uint64_t hash_id(uint8_t *id) {
+	return decbe64(id);
+}
+
+static struct presence_node **table_loc(struct presence_table *t,
+	uint8_t *id) {
+
+	struct presence_node **loc = &t->b[hash_id(id) & (t->size - 1)];
+	while(*loc && memcmp((*loc)->id, id, 0x20) != 0) {
+		loc = &(*loc)->next;
+	}
+
+	return loc;
+}
+
+static struct presence_node *table_get(struct presence_table *t,
+	uint8_t *id) {
+
+	if(t->size == 0) return NULL;
+	return *table_loc(t, id);
+}
+
+static int table_grow(struct presence_table *t) {
+	uint64_t nsize = t->size ? t->size * 2 : MIN_SIZE;
+	struct presence_node **nb = calloc(nsize, sizeof(*nb));
+	if(nb == NULL) {
+		return 1;
+	}
+
+	for(uint64_t i = 0; i < t->size; i++) {
+		struct presence_node *cur = t->b[i];
+		while(cur) {
+			struct presence_node *next = cur->next;
+			uint64_t idx = hash_id(cur->id) & (nsize - 1);
+			cur->next = nb[idx];
+			nb[idx] = cur;
+			cur = next;
+		}
+	}
+
+	free(t->b);
+	t->b = nb;
+	t->size = nsize;
+
+	return 0;
+}
+
+static int table_add(struct presence_table *t, struct presence_node *n) {
+	if(t->elements + 1 > t->size * TOP_LOAD && table_grow(t) != 0) {
+		return 1;
+	}
+
+	struct presence_node **bucket = &t->b[hash_id(n->id) & (t->size - 1)];
+	n->next = *bucket;
+	*bucket = n;
+	t->elements++;
+
+	return 0;
+}
+
+static void table_rem(struct presence_table *t, struct presence_node *n) {
+	struct presence_node **loc = table_loc(t, n->id);
+	*loc = n->next;
+	t->elements--;
+}
+
+static void mark_dirty(struct watched *w) {
+	if(!w->dirty) {
+		w->dirty = 1;
+		w->dirty_next = pr.dirty;
+		pr.dirty = w;
+	}
+}
+
+static void set_state(uint8_t *id, int online) {
+	pthread_mutex_lock(&pr.lock);
+	struct watched *w = (struct watched *) table_get(&pr.watched, id);
+	if(w) {
+		w->online = online;
+		mark_dirty(w);
+	}
+	pthread_mutex_unlock(&pr.lock);
+}
+
+static void drop_edge(struct edge *e) {
+	struct watched *w = e->w;
+
+	*e->w_pprev = e->w_next;
+	if(e->w_next) e->w_next->w_pprev = e->w_pprev;
+	free(e);
+
+	/* dirty entries are freed by the flush */
+	if(w->edges == NULL && !w->dirty) {
+		table_rem(&pr.watched, &w->node);
+		free(w);
+	}
+}
+
+static void drop_subscriptions(struct subscriber *sub) {
+	struct edge *e = sub->edges;
+	while(e) {
+		struct edge *next = e->sub_next;
+		drop_edge(e);
+		e = next;
+	}
+	sub->edges = NULL;
+}
+
+static int append_entry(struct subscriber *sub, uint8_t *id, int online) {
+	if(sub->npending == sub->pending_cap) {
+		uint64_t ncap = sub->pending_cap ? sub->pending_cap * 2 : 16;
+		uint8_t *np = realloc(sub->pending, ncap * ENTRY_SIZE);
+		if(np == NULL) {
+			return 1;
+		}
+		sub->pending = np;
+		sub->pending_cap = ncap;
+	}
+
+	uint8_t *entry = &sub->pending[sub->npending * ENTRY_SIZE];
+	memcpy(entry, id, 0x20);
+	entry[0x20] = online;
+
+	if(sub->npending++ == 0) {
+		sub->pending_next = pr.pending;
+		pr.pending = sub;
+	}
+
+	return 0;
+}
+
+/* sends a subscriber its pending entries, the lock must be held */
+static void send_pending(struct subscriber *sub) {
+	struct client_handler *hndl = get_handler(sub->node.id);
+	if(hndl == NULL) {
+		goto end;
+	}
+
+	struct message *m = alloc_plain_message(9 + sub->npending * ENTRY_SIZE);
+	if(m == NULL) {
+		ERR("%d: failed to allocate presence message", hndl->fd);
+		put_handler(hndl);
+		goto end;
+	}
+
+	m->message[0] = 4;
+	encbe64(sub->npending, &m->message[1]);
+	memcpy(&m->message[9], sub->pending, sub->npending * ENTRY_SIZE);
+
+	if(deliver(&hndl->mbox, m) != 0) {
+		ERR("%d: failed to send presence message", hndl->fd);
+	}
+	put_handler(hndl);
+
+end:
+	sub->npending = 0;
+}
+
+/* turns the changes since the last flush into one message per subscriber */
+static void flush() {
+	struct watched *w = pr.dirty;
+	pr.dirty = NULL;
+
+	while(w) {
+		struct watched *next = w->dirty_next;
+		w->dirty = 0;
+
+		if(w->online != w->reported) {
+			w->reported = w->online;
+			for(struct edge *e = w->edges; e; e = e->w_next) {
+				if(append_entry(e->sub, w->node.id, w->online)
+					!= 0) {
+					ERR("failed to allocate memory");
+				}
+			}
+		}
+
+		if(w->edges == NULL) {
+			table_rem(&pr.watched, &w->node);
+			free(w);
+		}
+
+		w = next;
+	}
+
+	struct subscriber *sub = pr.pending;
+	pr.pending = NULL;
+	while(sub) {
+		struct subscriber *next = sub->pending_next;
+		send_pending(sub);
+		sub = next;
+	}
+}
+
+static void *presence_thread(void *_arg) {
+	pthread_mutex_lock(&pr.lock);
+	while(!pr.stop) {
+		struct timespec wait;
+		clock_gettime(CLOCK_REALTIME, &wait);
+		wait.tv_sec += PRESENCE_INTERVAL / 1000;
+		wait.tv_nsec += (long) (PRESENCE_INTERVAL % 1000) * 1000000L;
+		if(wait.tv_nsec >= 1000000000L) {
+			wait.tv_sec++;
+			wait.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&pr.cond, &pr.lock, &wait);
+
+		flush();
+	}
+	pthread_mutex_unlock(&pr.lock);
+
+	return NULL;
+}
+
+int init_presence() {
+	pr.stop = 0;
+	if(pthread_create(&pr.thread, NULL, presence_thread, NULL) != 0) {
+		return 1;
+	}
+	pr.running = 1;
+
+	return 0;
+}
+
+void end_presence() {
+	if(!pr.running) {
+		return;
+	}
+
+	pthread_mutex_lock(&pr.lock);
+	pr.stop = 1;
+	pthread_cond_broadcast(&pr.cond);
+	pthread_mutex_unlock(&pr.lock);
+
+	pthread_join(pr.thread, NULL);
+	pr.running = 0;
+}
+
+void presence_online(uint8_t *id) {
+	set_state(id, 1);
+}
+
+void presence_offline(uint8_t *id) {
+	pthread_mutex_lock(&pr.lock);
+
+	struct watched *w = (struct watched *) table_get(&pr.watched, id);
+	if(w) {
+		w->online = 0;
+		mark_dirty(w);
+	}
+
+	/* they won't be around to hear about anyone else */
+	struct subscriber *sub =
+		(struct subscriber *) table_get(&pr.subs, id);
+	if(sub) {
+		drop_subscriptions(sub);
+		if(sub->npending) {
+			/* take them off the pending list */
+			struct subscriber **loc = &pr.pending;
+			while(*loc != sub) loc = &(*loc)->pending_next;
+			*loc = sub->pending_next;
+		}
+		table_rem(&pr.subs, &sub->node);
+		free(sub->pending);
+		free(sub);
+	}
+
+	pthread_mutex_unlock(&pr.lock);
+}
+
+static struct watched *get_watched(uint8_t *id) {
+	struct watched *w = (struct watched *) table_get(&pr.watched, id);
+	if(w) {
+		return w;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if(w == NULL) {
+		return NULL;
+	}
+	memcpy(w->node.id, id, 0x20);
+
+	/* the handler table is updated before we're told about changes,
+	 * so this can't miss one */
+	struct client_handler *hndl = get_handler(id);
+	if(hndl) {
+		put_handler(hndl);
+		w->online = 1;
+	}
+	w->reported = w->online;
+
+	if(table_add(&pr.watched, &w->node) != 0) {
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+int presence_subscribe(struct client_handler *hndl, uint8_t **ids,
+	uint64_t num) {
+
+	int ret = -1;
+
+	pthread_mutex_lock(&pr.lock);
+
+	struct subscriber *sub =
+		(struct subscriber *) table_get(&pr.subs, hndl->id);
+	if(sub == NULL) {
+		sub = calloc(1, sizeof(*sub));
+		if(sub == NULL) {
+			goto err;
+		}
+		memcpy(sub->node.id, hndl->id, 0x20);
+		if(table_add(&pr.subs, &sub->node) != 0) {
+			free(sub);
+			goto err;
+		}
+	}
+
+	drop_subscriptions(sub);
+
+	struct message *m = alloc_plain_message(9 + num * ENTRY_SIZE);
+	if(m == NULL) {
+		goto err;
+	}
+	m->message[0] = 4;
+	encbe64(num, &m->message[1]);
+
+	for(uint64_t i = 0; i < num; i++) {
+		struct watched *w = get_watched(ids[i]);
+		if(w == NULL) {
+			free_message(m);
+			goto err;
+		}
+		struct edge *e = malloc(sizeof(*e));
+		if(e == NULL) {
+			if(w->edges == NULL && !w->dirty) {
+				table_rem(&pr.watched, &w->node);
+				free(w);
+			}
+			free_message(m);
+			goto err;
+		}
+
+		e->sub = sub;
+		e->w = w;
+		e->sub_next = sub->edges;
+		sub->edges = e;
+		e->w_next = w->edges;
+		if(w->edges) w->edges->w_pprev = &e->w_next;
+		e->w_pprev = &w->edges;
+		w->edges = e;
+
+		/* they're told the current state now, not the reported one */
+		uint8_t *entry = &m->message[9 + i * ENTRY_SIZE];
+		memcpy(entry, ids[i], 0x20);
+		entry[0x20] = w->online;
+	}
+
+	ret = deliver(&hndl->mbox, m);
+
+	pthread_mutex_unlock(&pr.lock);
+	return ret;
+
+err:
+	ERR("%d: failed to subscribe to presence", hndl->fd);
+	pthread_mutex_unlock(&pr.lock);
+	return ret;
+}
+
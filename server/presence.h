@@ -0,0 +1,26 @@
+#ifndef IBCHAT_SERVER_PRESENCE_H
+#define IBCHAT_SERVER_PRESENCE_H
+
+#include <stdint.h>
+
+#include "client_handler.h"
+
+/* users subscribe to the online state of a set of other users.  changes are
+ * collected and sent out every PRESENCE_INTERVAL milliseconds, one message
+ * per subscriber, and a user that goes offline and back online in between
+ * isn't reported at all */
+
+int init_presence();
+void end_presence();
+
+/* called by the handler table when a user logs in or out */
+void presence_online(uint8_t *id);
+void presence_offline(uint8_t *id);
+
+/* replaces the set of users hndl is subscribed to and sends it their
+ * current state */
+int presence_subscribe(struct client_handler *hndl, uint8_t **ids,
+	uint64_t num);
+
+#endif
+
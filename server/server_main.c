@@ -6,6 +6,7 @@ int gen_key(int, char**);
 int help(int, char**);
 
 int chat_server(int, char**);
+int stats_client(int, char**);
 
 struct program {
 	int (*main)(int, char**);
@@ -14,6 +15,7 @@ struct program {
 
 struct program programs[] = {
 	{ &gen_key, "keygen" },
+	{ &stats_client, "stats" },
 	{ &help, "help" },
 };
 
@@ -26,7 +26,7 @@ int main(int argc, char **argv) {
 	struct sock server;
 	struct sock client;
 
-	server = server_bind(PORT);
+	server = server_bind(PORT, SOMAXCONN, 0);
 	if(server.fd < 0) {
 		if(server.fd == -2) {
 			fprintf(stderr, "getaddrinfo failed\n");
@@ -0,0 +1,323 @@
+/* the stats socket, see stats.h and stats.txt */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wordexp.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "stats.h"
+
+#include "../util/alloc.h"
+#include "../util/defaults.h"
+#include "../util/log.h"
+#include "../util/metrics.h"
+#include "../util/trace.h"
+
+/* how long a client has to send its command, and to take each part of the
+ * answer, so that a stuck client can't hold up the others */
+#define CLIENT_WAIT (1) /* seconds */
+#define COMMAND_MAX (64)
+
+static const char *STATS_SOCKET_SUFFIX = "/stats.sock";
+
+/* args is the rest of the command line after the name, "" if none */
+struct stats_command {
+	const char *name;
+	int (*run)(FILE *f, char *args);
+};
+
+static int cmd_metrics(FILE *f, char *args);
+static int cmd_alloc(FILE *f, char *args);
+static int cmd_trace(FILE *f, char *args);
+static int cmd_trace_rate(FILE *f, char *args);
+
+static struct stats_command commands[] = {
+	{ "metrics", cmd_metrics },
+	{ "alloc", cmd_alloc },
+	{ "trace", cmd_trace },
+	{ "trace-rate", cmd_trace_rate },
+};
+
+static struct {
+	int fd;
+	char *path;
+	pthread_t thread;
+	volatile int stop;
+} stats = { -1, NULL, 0, 0 };
+
+/* reads the command line, an empty one if the client sends nothing */
+static void read_command(int fd, char *cmd) {
+	size_t len = 0;
+	/* the wait is for the whole line, not each byte of it */
+	uint64_t end = metrics_now() + CLIENT_WAIT * 1000000ULL;
+
+	/* poll rather than select, the server's connections can push the
+	 * client's fd past FD_SETSIZE */
+	while(len < COMMAND_MAX - 1) {
+		uint64_t now = metrics_now();
+		if(now >= end) {
+			break;
+		}
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int ret = poll(&pfd, 1, (int) ((end - now + 999) / 1000));
+		if(ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if(ret <= 0) {
+			break;
+		}
+
+		ssize_t r = read(fd, &cmd[len], 1);
+		if(r <= 0 || cmd[len] == '\n') {
+			break;
+		}
+		len++;
+	}
+
+	if(len > 0 && cmd[len - 1] == '\r') {
+		len--;
+	}
+	cmd[len] = '\0';
+}
+
+static int socket_path(char *root_dir, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if(strlen(root_dir) + strlen(STATS_SOCKET_SUFFIX) >=
+		sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, root_dir);
+	strcat(addr->sun_path, STATS_SOCKET_SUFFIX);
+
+	return 0;
+}
+
+static int cmd_metrics(FILE *f, char *args) {
+	return metrics_write(f);
+}
+
+static int cmd_alloc(FILE *f, char *args) {
+	return alloc_write(f);
+}
+
+static int cmd_trace(FILE *f, char *args) {
+	return trace_dump(f);
+}
+
+/* with no argument just reports the rate */
+static int cmd_trace_rate(FILE *f, char *args) {
+	if(args[0] != '\0') {
+		char *end;
+		errno = 0;
+		unsigned long long n = strtoull(args, &end, 10);
+		if(errno != 0 || *end != '\0' || args[0] == '-') {
+			fprintf(f, "invalid rate: %s\n", args);
+			return ferror(f) ? -1 : 0;
+		}
+		trace_set_rate(n);
+		LOG("trace rate set to %llu", n);
+	}
+
+	fprintf(f, "%llu\n", (unsigned long long) trace_rate());
+	return ferror(f) ? -1 : 0;
+}
+
+static void serve_client(int fd) {
+	char cmd[COMMAND_MAX];
+	read_command(fd, cmd);
+
+	struct timeval wait = { CLIENT_WAIT, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &wait, sizeof(wait));
+
+	FILE *f = fdopen(fd, "w");
+	if(f == NULL) {
+		close(fd);
+		return;
+	}
+
+	const char *name = cmd[0] ? cmd : commands[0].name;
+	char *args = strchr(cmd, ' ');
+	if(args != NULL) {
+		*args++ = '\0';
+		args += strspn(args, " ");
+	} else {
+		args = "";
+	}
+
+	size_t i;
+	for(i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		if(strcmp(name, commands[i].name) == 0) {
+			break;
+		}
+	}
+
+	if(i == sizeof(commands) / sizeof(commands[0])) {
+		fprintf(f, "unknown command: %s\ncommands:", name);
+		for(i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+			fprintf(f, " %s", commands[i].name);
+		}
+		fprintf(f, "\n");
+	} else if(commands[i].run(f, args) != 0) {
+		ERR("failed to write %s to stats client", name);
+	}
+
+	fclose(f);
+}
+
+static void *stats_thread(void *arg) {
+	while(!stats.stop) {
+		struct pollfd pfd = { stats.fd, POLLIN, 0 };
+
+		if(poll(&pfd, 1, 100) <= 0) {
+			continue;
+		}
+
+		int client = accept(stats.fd, NULL, NULL);
+		if(client == -1) {
+			continue;
+		}
+
+		serve_client(client);
+	}
+
+	return NULL;
+}
+
+int stats_start(char *root_dir) {
+	struct sockaddr_un addr;
+
+	stats.path = malloc(strlen(root_dir) + strlen(STATS_SOCKET_SUFFIX) + 1);
+	if(stats.path == NULL) {
+		return -1;
+	}
+	strcpy(stats.path, root_dir);
+	strcat(stats.path, STATS_SOCKET_SUFFIX);
+
+	if(socket_path(root_dir, &addr) != 0) {
+		ERR("stats socket path too long: %s", stats.path);
+		goto err1;
+	}
+
+	stats.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(stats.fd == -1) {
+		goto err1;
+	}
+
+	/* left over from a previous run */
+	unlink(stats.path);
+	if(bind(stats.fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+		listen(stats.fd, 8) != 0) {
+		goto err2;
+	}
+
+	stats.stop = 0;
+	if(pthread_create(&stats.thread, NULL, stats_thread, NULL) != 0) {
+		goto err3;
+	}
+
+	LOG("stats socket opened at %s", stats.path);
+
+	return 0;
+
+err3:
+	unlink(stats.path);
+err2:
+	close(stats.fd);
+	stats.fd = -1;
+err1:
+	free(stats.path);
+	stats.path = NULL;
+	return -1;
+}
+
+void stats_stop() {
+	if(stats.fd == -1) {
+		return;
+	}
+
+	stats.stop = 1;
+	pthread_join(stats.thread, NULL);
+
+	close(stats.fd);
+	unlink(stats.path);
+	free(stats.path);
+	stats.fd = -1;
+	stats.path = NULL;
+}
+
+/* the "stats" program: sends a command to a running server's stats socket
+ * and prints what comes back */
+int stats_client(int argc, char **argv) {
+	char *root_dir = DFLT_ROOT_DIR;
+	char cmd[COMMAND_MAX];
+	struct sockaddr_un addr;
+	int i = 2;
+
+	if(argc > 3 && strcmp(argv[2], "-d") == 0) {
+		root_dir = argv[3];
+		i = 4;
+	}
+
+	cmd[0] = '\0';
+	for(; i < argc; i++) {
+		if(strlen(cmd) + strlen(argv[i]) + 2 >= COMMAND_MAX) {
+			fprintf(stderr, "command too long\n");
+			return 1;
+		}
+		if(cmd[0]) strcat(cmd, " ");
+		strcat(cmd, argv[i]);
+	}
+	strcat(cmd, "\n");
+
+	wordexp_t expanded;
+	memset(&expanded, 0, sizeof(expanded));
+	if(wordexp(root_dir, &expanded, WRDE_UNDEF) != 0 ||
+		expanded.we_wordc != 1) {
+		fprintf(stderr, "invalid root dir\n");
+		wordfree(&expanded);
+		return 1;
+	}
+	int ret = socket_path(expanded.we_wordv[0], &addr);
+	wordfree(&expanded);
+	if(ret != 0) {
+		fprintf(stderr, "stats socket path too long\n");
+		return 1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1 ||
+		connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		fprintf(stderr, "failed to connect to %s: %s\n",
+			addr.sun_path, strerror(errno));
+		if(fd != -1) close(fd);
+		return 1;
+	}
+
+	size_t len = strlen(cmd);
+	if(write(fd, cmd, len) != (ssize_t) len) {
+		fprintf(stderr, "failed to send command: %s\n",
+			strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	char buf[4096];
+	ssize_t r;
+	while((r = read(fd, buf, sizeof(buf))) > 0) {
+		fwrite(buf, 1, r, stdout);
+	}
+	close(fd);
+
+	return r == 0 ? 0 : 1;
+}
+
@@ -0,0 +1,15 @@
+#ifndef IBCHAT_SERVER_STATS_H
+#define IBCHAT_SERVER_STATS_H
+
+/* serves the metrics over a unix socket in the root directory.  a client
+ * connects, sends a command line and gets the answer back before the
+ * connection is closed.  with no command, the metrics are sent */
+int stats_start(char *root_dir);
+void stats_stop();
+
+/* the "stats" program, queries a running server:
+ * stats [-d server_root_directory] [command [args]] */
+int stats_client(int argc, char **argv);
+
+#endif
+
@@ -0,0 +1,298 @@
+/* keeps track of how far along each stream is */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libibur/endian.h>
+
+#include "streams.h"
+
+#include "../util/defaults.h"
+
+/* the table is keyed by sender, each sender holds their own streams so
+ * they're easy to count.  it grows with the number of senders */
+#define TOP_LOAD (0.75)
+#define MIN_SIZE ((uint64_t) 256)
+
+struct stream {
+	uint64_t sid;
+	uint8_t target[0x20];
+	uint64_t total;
+	uint64_t next;
+	time_t used;
+
+	struct stream *next_el;
+};
+
+struct sender {
+	uint8_t id[0x20];
+	struct stream *streams;
+	int count;
+
+	struct sender *next_el;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct sender **b;
+	uint64_t size; /* doubles as the modulus */
+	uint64_t elements;
+	/* when every sender's idle streams were last dropped */
+	time_t swept;
+} st = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+
+/* uids are already sha256 hashes, so any part of them is a good hash */
+static uint64_t hash_id(uint8_t *id) {
+	return decbe64(id);
+}
+
+static struct sender **bucket(uint8_t *id) {
+	return &st.b[hash_id(id) % st.size];
+}
+
+/* moves every sender into a table of nsize buckets, keeping the old one if
+ * there's no memory for it */
+static void resize(uint64_t nsize) {
+	struct sender **nb = calloc(nsize, sizeof(struct sender *));
+	if(nb == NULL) {
+		return;
+	}
+
+	for(uint64_t i = 0; i < st.size; i++) {
+		struct sender *cur = st.b[i];
+		while(cur) {
+			struct sender *next = cur->next_el;
+			uint64_t idx = hash_id(cur->id) % nsize;
+			cur->next_el = nb[idx];
+			nb[idx] = cur;
+			cur = next;
+		}
+	}
+
+	free(st.b);
+	st.b = nb;
+	st.size = nsize;
+}
+
+static struct sender *find_sender(uint8_t *id) {
+	if(st.b == NULL) {
+		return NULL;
+	}
+
+	struct sender *u = *bucket(id);
+	while(u && memcmp(u->id, id, 0x20) != 0) {
+		u = u->next_el;
+	}
+
+	return u;
+}
+
+static struct sender *add_sender(uint8_t *id) {
+	if(st.b == NULL) {
+		resize(MIN_SIZE);
+		if(st.b == NULL) {
+			return NULL;
+		}
+	}
+
+	struct sender *u = malloc(sizeof(*u));
+	if(u == NULL) {
+		return NULL;
+	}
+	memcpy(u->id, id, 0x20);
+	u->streams = NULL;
+	u->count = 0;
+
+	struct sender **b = bucket(id);
+	u->next_el = *b;
+	*b = u;
+	st.elements++;
+
+	if(st.elements > (uint64_t) (st.size * TOP_LOAD)) {
+		resize(st.size << 1);
+	}
+
+	return u;
+}
+
+/* drops the sender's streams that haven't been used in a while */
+static void expire(struct sender *u, time_t now) {
+	struct stream **loc = &u->streams;
+	while(*loc) {
+		struct stream *s = *loc;
+		if(now - s->used > STREAM_IDLE) {
+			*loc = s->next_el;
+			u->count--;
+			free(s);
+		} else {
+			loc = &s->next_el;
+		}
+	}
+}
+
+/* drops the idle streams of every sender, and the senders left with none.
+ * otherwise senders that never come back would be kept forever */
+static void sweep(time_t now) {
+	st.swept = now;
+
+	for(uint64_t i = 0; i < st.size; i++) {
+		struct sender **loc = &st.b[i];
+		while(*loc) {
+			struct sender *u = *loc;
+			expire(u, now);
+			if(u->streams == NULL) {
+				*loc = u->next_el;
+				st.elements--;
+				free(u);
+			} else {
+				loc = &u->next_el;
+			}
+		}
+	}
+}
+
+static struct stream *find(struct sender *u, uint64_t sid) {
+	struct stream *s = u ? u->streams : NULL;
+	while(s && s->sid != sid) {
+		s = s->next_el;
+	}
+
+	return s;
+}
+
+/* makes room for a new stream from the sender by forgetting their oldest
+ * finished one, returns non-zero if they have too many going */
+static int make_room(struct sender *u) {
+	if(u->count < STREAMS_PER_USER) {
+		return 0;
+	}
+
+	struct stream **loc;
+	struct stream **oldest = NULL;
+	for(loc = &u->streams; *loc; loc = &(*loc)->next_el) {
+		struct stream *s = *loc;
+		if(s->next == s->total &&
+			(oldest == NULL || s->used < (*oldest)->used)) {
+			oldest = loc;
+		}
+	}
+	if(oldest == NULL) {
+		return 1;
+	}
+
+	struct stream *s = *oldest;
+	*oldest = s->next_el;
+	u->count--;
+	free(s);
+
+	return 0;
+}
+
+int stream_check(uint8_t *sender, uint64_t sid, uint8_t *target,
+	uint64_t offset, uint64_t total, uint64_t len) {
+
+	int ret = STREAM_REFUSED;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&st.lock);
+
+	if(now - st.swept >= STREAM_SWEEP) {
+		sweep(now);
+	}
+
+	struct sender *u = find_sender(sender);
+	if(u != NULL) {
+		expire(u, now);
+	}
+
+	struct stream *s = find(u, sid);
+	if(s == NULL) {
+		if(offset != 0) {
+			goto end;
+		}
+		if(u == NULL && (u = add_sender(sender)) == NULL) {
+			goto end;
+		}
+		if(make_room(u) != 0) {
+			goto end;
+		}
+
+		s = malloc(sizeof(*s));
+		if(s == NULL) {
+			goto end;
+		}
+		s->sid = sid;
+		memcpy(s->target, target, 0x20);
+		s->total = total;
+		s->next = 0;
+		s->next_el = u->streams;
+		u->streams = s;
+		u->count++;
+	}
+
+	/* a stream can't change what it's sending or to who */
+	if(s->total != total || memcmp(s->target, target, 0x20) != 0) {
+		goto end;
+	}
+	s->used = now;
+
+	if(offset + len <= s->next) {
+		/* already have it, the sender is catching up after a
+		 * reconnect */
+		ret = STREAM_DUPLICATE;
+	} else if(offset == s->next) {
+		ret = STREAM_NEXT;
+	}
+
+end:
+	pthread_mutex_unlock(&st.lock);
+	return ret;
+}
+
+void stream_commit(uint8_t *sender, uint64_t sid, uint64_t offset,
+	uint64_t len) {
+
+	pthread_mutex_lock(&st.lock);
+	struct stream *s = find(find_sender(sender), sid);
+	if(s && s->next == offset) {
+		s->next += len;
+	}
+	pthread_mutex_unlock(&st.lock);
+}
+
+uint64_t stream_position(uint8_t *sender, uint64_t sid) {
+	uint64_t pos = 0;
+
+	pthread_mutex_lock(&st.lock);
+	struct stream *s = find(find_sender(sender), sid);
+	if(s) {
+		pos = s->next;
+	}
+	pthread_mutex_unlock(&st.lock);
+
+	return pos;
+}
+
+void end_streams() {
+	pthread_mutex_lock(&st.lock);
+	for(uint64_t i = 0; i < st.size; i++) {
+		while(st.b[i]) {
+			struct sender *u = st.b[i];
+			st.b[i] = u->next_el;
+			while(u->streams) {
+				struct stream *s = u->streams;
+				u->streams = s->next_el;
+				free(s);
+			}
+			free(u);
+		}
+	}
+	free(st.b);
+	st.b = NULL;
+	st.size = 0;
+	st.elements = 0;
+	pthread_mutex_unlock(&st.lock);
+}
@@ -0,0 +1,29 @@
+#ifndef IBCHAT_SERVER_STREAMS_H
+#define IBCHAT_SERVER_STREAMS_H
+
+#include <stdint.h>
+
+/* large payloads are sent as a stream of chunks, each relayed or stored as
+ * it arrives.  the server only remembers how far along each stream is, so a
+ * sender that reconnects can ask where to pick up from */
+
+/* stream_check results */
+#define STREAM_NEXT (0)
+#define STREAM_DUPLICATE (1)
+#define STREAM_REFUSED (-1)
+
+void end_streams();
+
+/* checks a chunk against its stream.  a chunk at offset 0 starts a stream,
+ * after that only the chunk starting where the last one ended is next */
+int stream_check(uint8_t *sender, uint64_t sid, uint8_t *target,
+	uint64_t offset, uint64_t total, uint64_t len);
+/* moves the stream past a chunk once it has been passed on */
+void stream_commit(uint8_t *sender, uint64_t sid, uint64_t offset,
+	uint64_t len);
+
+/* the offset the stream expects next, 0 for streams that aren't known */
+uint64_t stream_position(uint8_t *sender, uint64_t sid);
+
+#endif
+
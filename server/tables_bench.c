@@ -0,0 +1,328 @@
+/* replays a mixed workload against the tables every message and login goes
+ * through: user lookups, handler lookups, login/logout churn on the handler
+ * table and registrations into the user database, at 1 to N threads.
+ * reports the throughput of each operation along with its tail latency.
+ *
+ * the database lives in a temporary root directory, so registrations pay
+ * for their user and undelivered files like they would in the server.
+ * every operation is timed, which adds the cost of reading the clock twice
+ * to each of them */
+
+#define _GNU_SOURCE
+
+#include <ftw.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ibcrypt/rsa.h>
+
+#include <libibur/endian.h>
+
+#include "chat_server.h"
+#include "client_handler.h"
+#include "undelivered.h"
+#include "user_db.h"
+
+#include "../util/metrics.h"
+
+#define DFLT_THREADS (64)
+#define DFLT_USERS (4096)
+#define DFLT_SECONDS (2)
+
+/* user files are signed with the server's key, and registrations only need
+ * a key to copy, so they all share the server's */
+#define KEY_BITS (1024)
+
+/* handlers at the end of the array are logged in and out by the workers,
+ * each working on its own share of them */
+#define CHURN_HANDLERS (256)
+
+enum op {
+	OP_USER_GET,
+	OP_HANDLER_GET,
+	OP_CHURN,
+	OP_REGISTER,
+	OP_COUNT
+};
+
+/* out of every 1024 operations */
+static const struct {
+	const char *name;
+	int weight;
+} ops[OP_COUNT] = {
+	{ "user_db_get", 480 },
+	{ "get_handler", 480 },
+	{ "rem+add_handler", 60 },
+	{ "user_db_add", 4 },
+};
+
+struct worker {
+	pthread_t thread;
+	int idx;
+	int threads;
+	uint64_t seed;
+	struct histogram hist[OP_COUNT]; /* nanoseconds */
+	int ret;
+} __attribute__((aligned(64)));
+
+static struct client_handler *handlers;
+static uint8_t (*uids)[0x20];
+static uint64_t num_users;
+
+static uint64_t registered = 0;
+
+static volatile int running;
+
+static uint64_t xorshift(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static uint64_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* uids are just their index, registrations count on from the users made at
+ * the start so that they're never repeated */
+static void make_uid(uint64_t n, uint8_t *uid) {
+	memset(uid, 0, 0x20);
+	encbe64(n, &uid[0x18]);
+}
+
+static int register_user(uint64_t n) {
+	uint8_t uid[0x20];
+	struct user u;
+	make_uid(n, uid);
+	if(user_init(uid, server_pub_key, &u) != 0) {
+		return -1;
+	}
+	return user_db_add(u) == 0 ? 0 : -1;
+}
+
+static enum op pick_op(uint64_t *seed) {
+	int r = xorshift(seed) & 1023;
+	for(int op = 0; op < OP_COUNT - 1; op++) {
+		if(r < ops[op].weight) {
+			return op;
+		}
+		r -= ops[op].weight;
+	}
+	return OP_COUNT - 1;
+}
+
+static void *worker(void *_arg) {
+	struct worker *w = (struct worker *) _arg;
+
+	/* this worker's share of the churn handlers */
+	uint64_t first = num_users - CHURN_HANDLERS;
+	uint64_t next_churn = w->idx;
+
+	while(running) {
+		enum op op = pick_op(&w->seed);
+		uint64_t idx = xorshift(&w->seed) % num_users;
+
+		uint64_t start = now();
+		switch(op) {
+		case OP_USER_GET: {
+			struct user *u = user_db_get(uids[idx]);
+			if(u != NULL) {
+				user_db_release(u);
+			}
+			break;
+		}
+		case OP_HANDLER_GET: {
+			struct client_handler *h = get_handler(uids[idx]);
+			if(h != NULL) {
+				put_handler(h);
+			}
+			break;
+		}
+		case OP_CHURN: {
+			if(next_churn >= CHURN_HANDLERS) {
+				next_churn = w->idx;
+			}
+			struct client_handler *h = &handlers[first + next_churn];
+			next_churn += w->threads;
+			rem_handler(h->id);
+			if(add_handler(h) != 0) {
+				w->ret = -1;
+			}
+			break;
+		}
+		case OP_REGISTER:
+			if(register_user(__atomic_fetch_add(&registered, 1,
+				__ATOMIC_RELAXED)) != 0) {
+				w->ret = -1;
+			}
+			break;
+		default:
+			break;
+		}
+		hist_record(&w->hist[op], now() - start);
+
+		if(w->ret != 0) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int run(int threads, int seconds) {
+	struct worker *workers;
+	if(posix_memalign((void **) &workers, 64,
+		threads * sizeof(struct worker)) != 0) {
+		return -1;
+	}
+	memset(workers, 0, threads * sizeof(struct worker));
+
+	running = 1;
+	int started;
+	for(started = 0; started < threads; started++) {
+		struct worker *w = &workers[started];
+		w->idx = started;
+		w->threads = threads;
+		w->seed = 0x9e3779b97f4a7c15ULL * (started + 1);
+		if(pthread_create(&w->thread, NULL, worker, w) != 0) {
+			break;
+		}
+	}
+
+	uint64_t start = now();
+	if(started == threads) {
+		sleep(seconds);
+	}
+	running = 0;
+
+	int ret = started == threads ? 0 : -1;
+	struct histogram total[OP_COUNT];
+	memset(total, 0, sizeof(total));
+	for(int i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if(workers[i].ret != 0) {
+			ret = -1;
+		}
+		for(int op = 0; op < OP_COUNT; op++) {
+			hist_merge(&total[op], &workers[i].hist[op]);
+		}
+	}
+	double elapsed = (now() - start) / 1e9;
+	free(workers);
+
+	if(ret != 0) {
+		return ret;
+	}
+
+	uint64_t all = 0;
+	for(int op = 0; op < OP_COUNT; op++) {
+		struct histogram *h = &total[op];
+		all += h->count;
+		printf("%7d %-16s %12.0f %8llu %8llu %8llu %10llu\n", threads,
+			ops[op].name, h->count / elapsed,
+			(unsigned long long) hist_quantile(h, 0.5),
+			(unsigned long long) hist_quantile(h, 0.99),
+			(unsigned long long) hist_quantile(h, 0.999),
+			(unsigned long long) h->max);
+	}
+	printf("%7d %-16s %12.0f\n", threads, "all", all / elapsed);
+
+	return 0;
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag,
+	struct FTW *ftw) {
+	return remove(path);
+}
+
+int main(int argc, char **argv) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : DFLT_THREADS;
+	num_users = argc > 2 ? strtoull(argv[2], NULL, 10) : DFLT_USERS;
+	int seconds = argc > 3 ? atoi(argv[3]) : DFLT_SECONDS;
+	uint64_t cache = argc > 4 ? strtoull(argv[4], NULL, 10) : 0;
+
+	if(max_threads < 1 || max_threads > CHURN_HANDLERS ||
+		num_users <= CHURN_HANDLERS || seconds < 1) {
+		fprintf(stderr, "usage: %s [max threads (<= %d)] "
+			"[users (> %d)] [seconds per run] "
+			"[user cache size, 0 for none]\n",
+			argv[0], CHURN_HANDLERS, CHURN_HANDLERS);
+		return 1;
+	}
+
+	char root[] = "/tmp/ibchat-bench-XXXXXX";
+	if(mkdtemp(root) == NULL) {
+		fprintf(stderr, "failed to create root directory\n");
+		return 1;
+	}
+
+	int ret = 1;
+	if(rsa_gen_key(&server_key, KEY_BITS, 65537) != 0) {
+		fprintf(stderr, "failed to generate key\n");
+		goto err1;
+	}
+	if(rsa_pub_key(&server_key, &server_pub_key) != 0) {
+		fprintf(stderr, "failed to generate key\n");
+		goto err2;
+	}
+
+	if(user_db_init(root, cache) != 0 || undel_init(root) != 0 ||
+		init_handler_table() != 0) {
+		fprintf(stderr, "failed to initialize tables\n");
+		goto err2;
+	}
+
+	handlers = calloc(num_users, sizeof(struct client_handler));
+	uids = malloc(num_users * sizeof(*uids));
+	if(handlers == NULL || uids == NULL) {
+		fprintf(stderr, "failed to allocate memory\n");
+		goto err3;
+	}
+
+	for(uint64_t i = 0; i < num_users; i++) {
+		make_uid(i, uids[i]);
+		memcpy(handlers[i].id, uids[i], 0x20);
+		if(register_user(i) != 0 || add_handler(&handlers[i]) != 0) {
+			fprintf(stderr, "failed to add user\n");
+			goto err3;
+		}
+	}
+	registered = num_users;
+
+	printf("%llu users online, user cache %llu, %ld processors\n",
+		(unsigned long long) num_users, (unsigned long long) cache,
+		sysconf(_SC_NPROCESSORS_ONLN));
+	printf("mix per 1024:");
+	for(int op = 0; op < OP_COUNT; op++) {
+		printf(" %s %d", ops[op].name, ops[op].weight);
+	}
+	printf("\n\n%7s %-16s %12s %8s %8s %8s %10s\n", "threads", "op",
+		"ops/s", "p50 ns", "p99 ns", "p999 ns", "max ns");
+
+	for(int t = 1; t <= max_threads; t *= 2) {
+		if(run(t, seconds) != 0) {
+			fprintf(stderr, "failed to run benchmark\n");
+			goto err3;
+		}
+	}
+
+	ret = 0;
+err3:
+	/* the handlers are left in the table */
+	free(uids);
+	user_db_destroy();
+err2:
+	rsa_free_pubkey(&server_pub_key);
+	rsa_free_prikey(&server_key);
+err1:
+	nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return ret;
+}
@@ -1,3 +1,4 @@
+#include <dirent.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
@@ -13,7 +14,10 @@
 #include <libibur/util.h>
 #include <libibur/endian.h>
 
+#include "../util/alloc.h"
+#include "../util/defaults.h"
 #include "../util/log.h"
+#include "../util/metrics.h"
 
 #include "undelivered.h"
 #include "user_db.h"
@@ -25,9 +29,32 @@ static uint8_t INITIAL_PREV_MAC[32] = {
 };
 
 static const char *UNDEL_DIR_SUFFIX = "/undel/";
+static const char *REPLAY_SUFFIX = ".replay";
 
 static char *UNDEL_DIR;
 
+#ifdef UNDEL_FAULTS
+/* crash-test builds exit at the chosen write point, see undel_set_fault */
+static uint64_t fault_at = 0;
+static uint64_t fault_count = 0;
+
+void undel_set_fault(uint64_t n) {
+	fault_at = n;
+	fault_count = 0;
+}
+
+#define FAULT() do {\
+	if(fault_at != 0 && ++fault_count == fault_at) {\
+		_exit(UNDEL_FAULT_EXIT);\
+	}\
+} while(0)
+/* so that each write reaches the file by itself */
+#define FAULT_FILE(f) setvbuf(f, NULL, _IONBF, 0)
+#else
+#define FAULT()
+#define FAULT_FILE(f)
+#endif
+
 int check_undel_dir() {
 	struct stat st = {0};
 	if(stat(UNDEL_DIR, &st) == -1) {
@@ -61,17 +88,60 @@ static char *undel_path(struct user *u) {
 	return path;
 }
 
-int undel_init_file(struct user *u) {
-	char *path = undel_path(u);
-	if(path == NULL) {
-		ERR("failed to allocate memory");
-		return -1;
+/* where a new file is written before it replaces the old one, hidden from
+ * count_backlog */
+static char *undel_tmp_path(struct user *u) {
+	char *path = malloc(strlen(UNDEL_DIR) + 1 + 64 + 1);
+	if(path == NULL) return NULL;
+	strcpy(path, UNDEL_DIR);
+	strcat(path, ".");
+	to_hex(u->uid, 32, &path[strlen(UNDEL_DIR) + 1]);
+
+	return path;
+}
+
+/* the messages taken out of the user's file while they're sent on login,
+ * still counted in the backlog */
+static char *undel_replay_path(struct user *u) {
+	char *path = malloc(strlen(UNDEL_DIR) + 64 +
+		strlen(REPLAY_SUFFIX) + 1);
+	if(path == NULL) return NULL;
+	strcpy(path, UNDEL_DIR);
+	to_hex(u->uid, 32, &path[strlen(UNDEL_DIR)]);
+	strcat(path, REPLAY_SUFFIX);
+
+	return path;
+}
+
+/* where what's left of a stopped replay is written before it replaces the
+ * replay file */
+static char *undel_replay_tmp_path(struct user *u) {
+	char *path = malloc(strlen(UNDEL_DIR) + 1 + 64 +
+		strlen(REPLAY_SUFFIX) + 1);
+	if(path == NULL) return NULL;
+	strcpy(path, UNDEL_DIR);
+	strcat(path, ".");
+	to_hex(u->uid, 32, &path[strlen(UNDEL_DIR) + 1]);
+	strcat(path, REPLAY_SUFFIX);
+
+	return path;
+}
+
+static void list_size(struct umessage *messages, uint64_t *num,
+	uint64_t *len) {
+	*num = 0;
+	*len = 0;
+	for(; messages; messages = messages->next) {
+		(*num)++;
+		*len += 8 + messages->len + 32;
 	}
+}
 
+/* writes a file holding no messages */
+static int write_empty(struct user *u, char *path) {
 	FILE *f = fopen(path, "wb");
 	if(f == NULL) {
 		ERR("failed to open undel file: %s", path);
-		free(path);
 		return -1;
 	}
 
@@ -80,20 +150,95 @@ int undel_init_file(struct user *u) {
 	encbe64(0x00, &buf[8]);
 	hmac_sha256(u->und_auth, 32, buf, 0x10, &buf[0x10]);
 
-	int ret = 0;
-
 	if(fwrite(buf, 1, 0x30, f) != 0x30) {
 		ERR("failed to write to undel file: %s", path);
-		ret = -1;
+		fclose(f);
+		return -1;
+	}
+	if(fclose(f) != 0) {
+		ERR("failed to write to undel file: %s", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* the empty file is written alongside and renamed over the old one, so that
+ * a crash leaves either the old file or the new one and never a truncated
+ * file with no header */
+int undel_init_file(struct user *u) {
+	int ret = -1;
+
+	char *path = undel_path(u);
+	char *tmp = undel_tmp_path(u);
+	if(path == NULL || tmp == NULL) {
+		ERR("failed to allocate memory");
+		goto err1;
+	}
+
+	if(write_empty(u, tmp) != 0) {
+		goto err2;
+	}
+
+	FAULT();
+	if(rename(tmp, path) != 0) {
+		ERR("failed to replace undel file: %s", path);
+		goto err2;
 	}
 
+	ret = 0;
+	goto err1;
+
+err2:
+	unlink(tmp);
+err1:
 	free(path);
-	fclose(f);
+	free(tmp);
 
 	return ret;
 }
 
+static int append_file(struct user *u, char *path,
+	struct umessage *messages);
+
 int undel_add_message(struct user *u, uint8_t *message, uint64_t len) {
+	struct umessage m = { message, len, NULL };
+	return undel_add_messages(u, &m);
+}
+
+int undel_add_messages(struct user *u, struct umessage *messages) {
+	uint64_t start = metrics_now();
+
+	char *path = undel_path(u);
+	if(path == NULL) {
+		ERR("failed to allocate memory");
+		return -1;
+	}
+
+	pthread_mutex_lock(&u->undel_lock);
+	int ret = append_file(u, path, messages);
+	pthread_mutex_unlock(&u->undel_lock);
+	free(path);
+	if(ret != 0) {
+		return -1;
+	}
+
+	uint64_t addnum, addlen;
+	list_size(messages, &addnum, &addlen);
+	counter_add(C_MESSAGES_STORED, addnum);
+	gauge_add(G_UNDEL_MESSAGES, addnum);
+	gauge_add(G_UNDEL_BYTES, addlen);
+	histogram_record(H_UNDEL_APPEND_US, metrics_now() - start);
+
+	return 0;
+}
+
+/* appends every message in the list with a single update of the header.
+ * the messages are written past the end of the file first and the header
+ * only then updated to take them in, so a crash part way leaves the file
+ * as it was, with the next append writing over whatever made it out */
+static int append_file(struct user *u, char *path,
+	struct umessage *messages) {
 #define READ(buf, size) do {\
 	if(fread(buf, size, 1, f) != 1) {\
 		ERR("failed to read from file: %s", path);\
@@ -115,6 +260,13 @@ int undel_add_message(struct user *u, uint8_t *message, uint64_t len) {
 	}\
 } while(0)
 
+#define FLUSH() do {\
+	if(fflush(f) != 0) {\
+		ERR("failed to write to file: %s", path);\
+		goto err;\
+	}\
+} while(0)
+
 #define MACCHK() do {\
 	if(memcmp_ct(macc, macf, 0x20) != 0) {\
 		ERR("invalid mac in %s", path);\
@@ -124,16 +276,12 @@ int undel_add_message(struct user *u, uint8_t *message, uint64_t len) {
 
 	int ret = -1;
 
-	char *path = undel_path(u);
-	if(path == NULL) {
-		ERR("failed to allocate memory");
-		return -1;
-	}
 	FILE *f = fopen(path, "rb+");
 	if(f == NULL) {
 		ERR("failed to open file: %s", path);
-		goto err;
+		return -1;
 	}
+	FAULT_FILE(f);
 
 	uint8_t macc[0x20], *macf;
 	uint8_t prefix[0x30];
@@ -152,14 +300,9 @@ int undel_add_message(struct user *u, uint8_t *message, uint64_t len) {
 	uint64_t flen = decbe64(&prefix[0]);
 	uint64_t mnum = decbe64(&prefix[8]);
 
-	/* write in new values */
-	SEEK(0);
-
-	encbe64(flen + 8 + len + 32, &prefix[0]);
-	encbe64(mnum + 1, &prefix[8]);
-	hmac_sha256(u->und_auth, 32, prefix, 0x10, &prefix[0x10]);
-
-	WRITE(prefix, 0x30);
+	uint64_t addnum, addlen;
+	list_size(messages, &addnum, &addlen);
+	struct umessage *m;
 
 	SEEK(flen - 32);
 
@@ -168,22 +311,40 @@ int undel_add_message(struct user *u, uint8_t *message, uint64_t len) {
 		memcpy(prev_mac, INITIAL_PREV_MAC, 0x20);
 	}
 
-	encbe64(len, len_buf);
+	/* anything past flen was left by an append that didn't finish */
+	SEEK(flen);
+	for(m = messages; m; m = m->next) {
+		encbe64(m->len, len_buf);
+
+		hmac_sha256_init(&hctx, u->und_auth, 32);
+		hmac_sha256_update(&hctx, prev_mac, 32);
+		hmac_sha256_update(&hctx, len_buf, 8);
+		hmac_sha256_update(&hctx, m->message, m->len);
+		hmac_sha256_final(&hctx, prev_mac);
+
+		FAULT();
+		WRITE(len_buf, 8);
+		FAULT();
+		WRITE(m->message, m->len);
+		FAULT();
+		WRITE(prev_mac, 0x20);
+	}
+	FLUSH();
+
+	/* now take them in */
+	FAULT();
+	SEEK(0);
 
-	hmac_sha256_init(&hctx, u->und_auth, 32);
-	hmac_sha256_update(&hctx, prev_mac, 32);
-	hmac_sha256_update(&hctx, len_buf, 8);
-	hmac_sha256_update(&hctx, message, len);
-	hmac_sha256_final(&hctx, prev_mac);
+	encbe64(flen + addlen, &prefix[0]);
+	encbe64(mnum + addnum, &prefix[8]);
+	hmac_sha256(u->und_auth, 32, prefix, 0x10, &prefix[0x10]);
 
-	fflush(f);
-	WRITE(len_buf, 8);
-	WRITE(message, len);
-	WRITE(prev_mac, 0x20);
+	WRITE(prefix, 0x30);
+	FLUSH();
+	FAULT();
 
 	ret = 0;
 err:
-	free(path);
 	memsets(macc, 0, sizeof(macc));
 	memsets(prefix, 0, sizeof(prefix));
 	memsets(prev_mac, 0, sizeof(prev_mac));
@@ -197,6 +358,7 @@ err:
 #undef READ
 #undef WRITE
 #undef SEEK
+#undef FLUSH
 #undef MACCHK
 }
 
@@ -216,12 +378,14 @@ int undel_load(struct user *u, struct umessage **messages) {
 } while(0)
 
 	int ret = -1;
+	uint64_t start = metrics_now();
 
 	char *path = undel_path(u);
 	if(path == NULL) {
 		ERR("failed to allocate memory");
 		return -1;
 	}
+	pthread_mutex_lock(&u->undel_lock);
 	FILE *f = fopen(path, "rb");
 	if(f == NULL) {
 		ERR("failed to open file: %s", path);
@@ -277,6 +441,11 @@ int undel_load(struct user *u, struct umessage **messages) {
 	*messages = head;
 
 	ret = undel_init_file(u);
+	if(ret == 0) {
+		gauge_add(G_UNDEL_MESSAGES, -(int64_t) mnum);
+		gauge_add(G_UNDEL_BYTES, -(int64_t) (decbe64(&prefix[0]) - 0x30));
+		histogram_record(H_UNDEL_LOAD_US, metrics_now() - start);
+	}
 err:
 	free(path);
 	memsets(macc, 0, sizeof(macc));
@@ -285,19 +454,271 @@ err:
 	memsets(len_buf, 0, sizeof(len_buf));
 	memsets(&hctx, 0, sizeof(hctx));
 	mnum = 0;
-	fclose(f);
+	if(f) fclose(f);
+	pthread_mutex_unlock(&u->undel_lock);
+
+	return ret;
+}
+
+/* the user's file is renamed out of the way and a new one started, so that
+ * what's left of the replay can be kept apart from what's stored after it */
+int undel_replay_open(struct user *u, struct undel_replay *r) {
+	int ret = -1;
+
+	uint8_t prefix[0x30];
+	uint8_t macc[0x20];
+
+	pthread_mutex_lock(&u->undel_lock);
+
+	char *path = undel_path(u);
+	r->u = u;
+	r->path = undel_replay_path(u);
+	r->f = NULL;
+	if(path == NULL || r->path == NULL) {
+		ERR("failed to allocate memory");
+		goto err;
+	}
+
+	/* a replay that was stopped goes first, it holds the older messages */
+	if(access(r->path, F_OK) != 0) {
+		FILE *f = fopen(path, "rb");
+		if(f == NULL) {
+			if(errno != ENOENT) {
+				ERR("failed to open file: %s", path);
+				goto err;
+			}
+			/* a crash took it between the rename and the new file */
+			if(undel_init_file(u) != 0) {
+				goto err;
+			}
+			ret = 1;
+			goto err;
+		}
+		int got = fread(prefix, 0x10, 1, f) == 1;
+		fclose(f);
+		if(!got) {
+			ERR("failed to read from file: %s", path);
+			goto err;
+		}
+		if(decbe64(&prefix[8]) == 0) {
+			ret = 1;
+			goto err;
+		}
+
+		if(rename(path, r->path) != 0) {
+			ERR("failed to take over undel file: %s", path);
+			goto err;
+		}
+		FAULT();
+		if(undel_init_file(u) != 0) {
+			goto err;
+		}
+	}
+
+	r->f = fopen(r->path, "rb");
+	if(r->f == NULL) {
+		ERR("failed to open file: %s", r->path);
+		goto err;
+	}
+	if(fread(prefix, 0x30, 1, r->f) != 1) {
+		ERR("failed to read from file: %s", r->path);
+		goto err;
+	}
+	hmac_sha256(u->und_auth, 32, prefix, 0x10, macc);
+	if(memcmp_ct(macc, &prefix[0x10], 0x20) != 0) {
+		ERR("invalid mac in %s", r->path);
+		goto err;
+	}
+
+	r->left = decbe64(&prefix[8]);
+	memcpy(r->prev_mac, INITIAL_PREV_MAC, 0x20);
+
+	free(path);
+	memsets(prefix, 0, sizeof(prefix));
+	memsets(macc, 0, sizeof(macc));
+
+	return 0;
+
+err:
+	if(r->f) fclose(r->f);
+	r->f = NULL;
+	free(r->path);
+	r->path = NULL;
+	free(path);
+	memsets(prefix, 0, sizeof(prefix));
+	memsets(macc, 0, sizeof(macc));
+	pthread_mutex_unlock(&u->undel_lock);
+
+	return ret;
+}
+
+int undel_replay_next(struct user *u, struct undel_replay *r, uint64_t max,
+	struct umessage **messages) {
+
+	int ret = -1;
+	uint64_t start = metrics_now();
+
+	uint8_t macc[0x20];
+	uint8_t macf[0x20];
+	uint8_t len_buf[8];
+
+	HMAC_SHA256_CTX hctx;
+
+	struct umessage *head = NULL;
+	struct umessage **cur = &head;
+	uint64_t num = 0;
+	uint64_t len = 0;
+
+	while(r->left > 0 && (num == 0 || len < max)) {
+		if(fread(len_buf, 8, 1, r->f) != 1) {
+			goto read_err;
+		}
+
+		uint64_t mlen = decbe64(len_buf);
+		struct umessage *m = alloc_umessage(mlen);
+		if(m == NULL) {
+			ERR("failed to allocate memory");
+			goto err;
+		}
+		*cur = m;
+		cur = &m->next;
+
+		if(mlen > 0 && fread(m->message, mlen, 1, r->f) != 1) {
+			goto read_err;
+		}
+		if(fread(macf, 0x20, 1, r->f) != 1) {
+			goto read_err;
+		}
+
+		hmac_sha256_init(&hctx, u->und_auth, 0x20);
+		hmac_sha256_update(&hctx, r->prev_mac, 0x20);
+		hmac_sha256_update(&hctx, len_buf, 8);
+		hmac_sha256_update(&hctx, m->message, mlen);
+		hmac_sha256_final(&hctx, macc);
+
+		if(memcmp_ct(macc, macf, 0x20) != 0) {
+			ERR("invalid mac in %s", r->path);
+			goto err;
+		}
+		memcpy(r->prev_mac, macc, 0x20);
+
+		r->left--;
+		num++;
+		len += 8 + mlen + 32;
+	}
+
+	if(num > 0) {
+		gauge_add(G_UNDEL_MESSAGES, -(int64_t) num);
+		gauge_add(G_UNDEL_BYTES, -(int64_t) len);
+		histogram_record(H_UNDEL_LOAD_US, metrics_now() - start);
+	}
+
+	*messages = head;
+	head = NULL;
+	ret = 0;
+	goto end;
+
+read_err:
+	ERR("failed to read from file: %s", r->path);
+err:
+end:
+	free_umessage_list(head);
+	memsets(macc, 0, sizeof(macc));
+	memsets(macf, 0, sizeof(macf));
+	memsets(len_buf, 0, sizeof(len_buf));
+	memsets(&hctx, 0, sizeof(hctx));
+
+	return ret;
+}
+
+void undel_replay_close(struct undel_replay *r) {
+	fclose(r->f);
+	if(unlink(r->path) != 0) {
+		ERR("failed to remove replayed file: %s", r->path);
+	}
+	free(r->path);
+	memsets(r->prev_mac, 0, sizeof(r->prev_mac));
+	pthread_mutex_unlock(&r->u->undel_lock);
+}
+
+/* what's left is copied to a new replay file, a batch at a time, which then
+ * replaces the old one.  if that fails the old one is kept whole, and the
+ * messages already sent are sent again rather than any being lost */
+int undel_replay_stop(struct user *u, struct undel_replay *r,
+	struct umessage *unsent) {
+
+	int ret = -1;
+	uint64_t num = 0, len = 0;
+	uint64_t n, l;
+
+	char *tmp = undel_replay_tmp_path(u);
+	if(tmp == NULL) {
+		ERR("failed to allocate memory");
+		goto end;
+	}
+	if(write_empty(u, tmp) != 0) {
+		goto end;
+	}
+
+	if(unsent != NULL) {
+		if(append_file(u, tmp, unsent) != 0) {
+			goto end;
+		}
+		list_size(unsent, &num, &len);
+	}
+
+	while(1) {
+		struct umessage *batch;
+		if(undel_replay_next(u, r, UNDEL_REPLAY_BATCH, &batch) != 0) {
+			goto end;
+		}
+		if(batch == NULL) {
+			break;
+		}
+
+		int failed = append_file(u, tmp, batch) != 0;
+		list_size(batch, &n, &l);
+		num += n;
+		len += l;
+		free_umessage_list(batch);
+		if(failed) {
+			goto end;
+		}
+	}
+
+	FAULT();
+	if(rename(tmp, r->path) != 0) {
+		ERR("failed to replace undel file: %s", r->path);
+		goto end;
+	}
+
+	ret = 0;
+end:
+	if(ret != 0 && tmp != NULL) {
+		unlink(tmp);
+	}
+	free(tmp);
+
+	/* the messages are still stored one way or the other */
+	gauge_add(G_UNDEL_MESSAGES, num);
+	gauge_add(G_UNDEL_BYTES, len);
+
+	fclose(r->f);
+	free(r->path);
+	memsets(r->prev_mac, 0, sizeof(r->prev_mac));
+	pthread_mutex_unlock(&r->u->undel_lock);
 
 	return ret;
 }
 
 struct umessage *alloc_umessage(uint64_t len) {
-	struct umessage *m = malloc(sizeof(*m));
+	struct umessage *m = tag_malloc(ALLOC_UMESSAGE, sizeof(*m));
 	if(m == NULL) {
 		return NULL;
 	}
-	m->message = malloc(len);
+	m->message = tag_malloc(ALLOC_UMESSAGE, len);
 	if(m->message == NULL) {
-		free(m);
+		tag_free(ALLOC_UMESSAGE, m);
 		return NULL;
 	}
 	m->len = len;
@@ -306,8 +727,9 @@ struct umessage *alloc_umessage(uint64_t len) {
 }
 
 void free_umessage(struct umessage *m) {
-	zfree(m->message, m->len);
-	free(m);
+	memsets(m->message, 0, m->len);
+	tag_free(ALLOC_UMESSAGE, m->message);
+	tag_free(ALLOC_UMESSAGE, m);
 }
 
 void free_umessage_list(struct umessage *m) {
@@ -318,6 +740,50 @@ void free_umessage_list(struct umessage *m) {
 	}
 }
 
+/* sets the backlog gauges from the file headers.  the macs aren't checked,
+ * the numbers are only for the stats */
+static void count_backlog() {
+	DIR *dir = opendir(UNDEL_DIR);
+	if(dir == NULL) {
+		return;
+	}
+
+	char *path = malloc(strlen(UNDEL_DIR) + 256 + 1);
+	if(path == NULL) {
+		closedir(dir);
+		return;
+	}
+
+	int64_t messages = 0;
+	int64_t bytes = 0;
+	struct dirent *ent;
+	while((ent = readdir(dir)) != NULL) {
+		if(ent->d_name[0] == '.') {
+			continue;
+		}
+		strcpy(path, UNDEL_DIR);
+		strcat(path, ent->d_name);
+
+		uint8_t prefix[0x10];
+		FILE *f = fopen(path, "rb");
+		if(f == NULL) {
+			continue;
+		}
+		if(fread(prefix, 0x10, 1, f) == 1 &&
+			decbe64(&prefix[0]) >= 0x30) {
+			messages += decbe64(&prefix[8]);
+			bytes += decbe64(&prefix[0]) - 0x30;
+		}
+		fclose(f);
+	}
+
+	free(path);
+	closedir(dir);
+
+	gauge_set(G_UNDEL_MESSAGES, messages);
+	gauge_set(G_UNDEL_BYTES, bytes);
+}
+
 int undel_init(char *root_dir) {
 	UNDEL_DIR = malloc(strlen(root_dir) + strlen(UNDEL_DIR_SUFFIX) + 1);
 	if(UNDEL_DIR == NULL) {
@@ -327,6 +793,12 @@ int undel_init(char *root_dir) {
 	strcpy(UNDEL_DIR, root_dir);
 	strcat(UNDEL_DIR, UNDEL_DIR_SUFFIX);
 
-	return check_undel_dir();
+	if(check_undel_dir() != 0) {
+		return -1;
+	}
+
+	count_backlog();
+
+	return 0;
 }
 
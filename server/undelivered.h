@@ -2,6 +2,7 @@
 #define SERVER_UNDELIVERED_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 #include "user_db.h"
 
@@ -13,13 +14,49 @@ struct umessage {
 
 int undel_init_file(struct user *u);
 int undel_add_message(struct user *u, uint8_t *message, uint64_t len);
+int undel_add_messages(struct user *u, struct umessage *messages);
 int undel_load(struct user *u, struct umessage **messages);
 
+/* reads a user's stored messages back a batch at a time, so that sending
+ * them on login takes the same memory however many there are */
+struct undel_replay {
+	struct user *u;
+	FILE *f;
+	char *path;
+	uint64_t left; /* messages not read yet */
+	uint8_t prev_mac[0x20];
+};
+
+/* takes the stored messages out of the user's file to be replayed, leaving
+ * it empty for new ones.  a replay that was stopped is picked up again
+ * before anything newer.  returns 1 if there's nothing to replay.  the
+ * user's store is locked from a successful open until the replay is closed
+ * or stopped, new messages for them wait until then */
+int undel_replay_open(struct user *u, struct undel_replay *r);
+/* reads the next messages, at least one and then as many as fit in max
+ * bytes.  *messages is NULL once everything has been read */
+int undel_replay_next(struct user *u, struct undel_replay *r, uint64_t max,
+	struct umessage **messages);
+/* ends a replay once everything read has been sent */
+void undel_replay_close(struct undel_replay *r);
+/* ends a replay part way.  the messages in unsent, which stay the caller's,
+ * and everything not read yet are kept for the next replay, in order */
+int undel_replay_stop(struct user *u, struct undel_replay *r,
+	struct umessage *unsent);
+
 struct umessage *alloc_umessage(uint64_t len);
 void free_umessage(struct umessage *m);
 void free_umessage_list(struct umessage *m);
 
 int undel_init(char *root_dir);
 
+#ifdef UNDEL_FAULTS
+/* the status the process exits with when it hits the fault */
+#define UNDEL_FAULT_EXIT (75)
+/* exits the process at the nth point where the store writes from now on,
+ * 0 turns it off.  only in builds made with UNDEL-FAULTS=1 */
+void undel_set_fault(uint64_t n);
+#endif
+
 #endif
 
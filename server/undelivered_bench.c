@@ -0,0 +1,172 @@
+/* measures the undelivered message store: messages are appended round robin
+ * across a number of offline users' files, then every file is replayed a
+ * batch at a time like it would be as the users log in.  the files live in a
+ * temporary root directory and nothing is synced, so this is the store's
+ * own cost on top of the page cache */
+
+#define _GNU_SOURCE
+
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libibur/endian.h>
+
+#include "undelivered.h"
+#include "user_db.h"
+
+#include "../util/defaults.h"
+
+#define DFLT_USERS (64)
+#define DFLT_MESSAGES (256)
+#define DFLT_BATCH (1)
+
+static const uint64_t sizes[] = { 64, 1024, 16384 };
+
+static uint64_t now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag,
+	struct FTW *ftw) {
+	return remove(path);
+}
+
+static int run(struct user *users, uint64_t num_users, uint64_t messages,
+	uint64_t batch, uint64_t size) {
+	for(uint64_t i = 0; i < num_users; i++) {
+		if(undel_init_file(&users[i]) != 0) {
+			return -1;
+		}
+	}
+
+	/* every message in a batch shares one buffer, only the sizes matter */
+	uint8_t *buf = malloc(size);
+	struct umessage *list = malloc(batch * sizeof(struct umessage));
+	if(buf == NULL || list == NULL) {
+		free(buf);
+		free(list);
+		return -1;
+	}
+	memset(buf, 0x5a, size);
+	for(uint64_t i = 0; i < batch; i++) {
+		list[i].message = buf;
+		list[i].len = size;
+		list[i].next = i + 1 < batch ? &list[i + 1] : NULL;
+	}
+
+	int ret = -1;
+	uint64_t start = now();
+	for(uint64_t n = 0; n < messages; n += batch) {
+		for(uint64_t i = 0; i < num_users; i++) {
+			if(undel_add_messages(&users[i], list) != 0) {
+				fprintf(stderr, "failed to append\n");
+				goto err;
+			}
+		}
+	}
+	uint64_t appended = now() - start;
+	uint64_t count = (messages + batch - 1) / batch * batch * num_users;
+
+	uint64_t loaded_bytes = 0;
+	uint64_t loaded = 0;
+	start = now();
+	for(uint64_t i = 0; i < num_users; i++) {
+		struct undel_replay r;
+		if(undel_replay_open(&users[i], &r) != 0) {
+			fprintf(stderr, "failed to load\n");
+			goto err;
+		}
+		struct umessage *m;
+		while(undel_replay_next(&users[i], &r, UNDEL_REPLAY_BATCH,
+			&m) == 0 && m != NULL) {
+			for(struct umessage *c = m; c; c = c->next) {
+				loaded_bytes += c->len;
+				loaded++;
+			}
+			free_umessage_list(m);
+		}
+		undel_replay_close(&r);
+	}
+	uint64_t replayed = now() - start;
+
+	if(loaded != count) {
+		fprintf(stderr, "loaded %llu messages of %llu\n",
+			(unsigned long long) loaded,
+			(unsigned long long) count);
+		goto err;
+	}
+
+	printf("%7llu %6llu %9llu %12.0f %10.1f %12.0f %10.1f\n",
+		(unsigned long long) size, (unsigned long long) batch,
+		(unsigned long long) count,
+		count * 1e6 / appended, count * size / (double) appended,
+		loaded * 1e6 / replayed, loaded_bytes / (double) replayed);
+
+	ret = 0;
+err:
+	free(buf);
+	free(list);
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	uint64_t num_users = argc > 1 ? strtoull(argv[1], NULL, 10) :
+		DFLT_USERS;
+	uint64_t messages = argc > 2 ? strtoull(argv[2], NULL, 10) :
+		DFLT_MESSAGES;
+	uint64_t batch = argc > 3 ? strtoull(argv[3], NULL, 10) : DFLT_BATCH;
+
+	if(num_users < 1 || messages < 1 || batch < 1) {
+		fprintf(stderr, "usage: %s [users] [messages per user] "
+			"[messages per append]\n", argv[0]);
+		return 1;
+	}
+
+	char root[] = "/tmp/ibchat-bench-XXXXXX";
+	if(mkdtemp(root) == NULL) {
+		fprintf(stderr, "failed to create root directory\n");
+		return 1;
+	}
+
+	int ret = 1;
+	struct user *users = calloc(num_users, sizeof(struct user));
+	if(users == NULL) {
+		fprintf(stderr, "failed to allocate memory\n");
+		goto err;
+	}
+	for(uint64_t i = 0; i < num_users; i++) {
+		encbe64(i, &users[i].uid[0x18]);
+		memset(users[i].und_auth, (int) i, 0x20);
+		pthread_mutex_init(&users[i].undel_lock, NULL);
+	}
+
+	if(undel_init(root) != 0) {
+		fprintf(stderr, "failed to initialize store\n");
+		goto err;
+	}
+
+	printf("%llu users, %llu messages each\n",
+		(unsigned long long) num_users, (unsigned long long) messages);
+	printf("%7s %6s %9s %12s %10s %12s %10s\n", "size", "batch",
+		"messages", "appends/s", "MB/s", "replayed/s", "MB/s");
+
+	for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		if(run(users, num_users, messages, batch, sizes[s]) != 0) {
+			fprintf(stderr, "failed to run benchmark\n");
+			goto err;
+		}
+	}
+
+	ret = 0;
+err:
+	free(users);
+	nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+	return ret;
+}
@@ -0,0 +1,527 @@
+/* crash-recovery test for the undelivered message store.  needs the store
+ * built with UNDEL-FAULTS=1, then linked like the benchmarks.
+ *
+ * for each write point in turn a child process appends messages, reporting
+ * every append that returns, and is made to exit at that write point like a
+ * crash would.  the parent then loads the file and checks that every
+ * acknowledged message survived in order, that at most the append in flight
+ * was added besides, and that the file still takes new messages.  the same
+ * is done for a crash while the file is being emptied by undel_load, and
+ * for one while a replay is taken over and stopped part way.
+ *
+ * then several threads append to the store at once, first on their own and
+ * then while it's replayed over and over, and every acknowledged message
+ * has to come out once, in the order its thread appended it */
+
+#define _GNU_SOURCE
+
+#include <ftw.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "undelivered.h"
+#include "user_db.h"
+
+#ifndef UNDEL_FAULTS
+#error "build the store with UNDEL-FAULTS=1"
+#endif
+
+/* messages already stored before the child starts */
+#define PREFILL (3)
+/* appends the child makes, alternating single messages and batches */
+#define APPENDS (4)
+#define BATCH (3)
+
+/* threads appending at once, and the messages each of them appends */
+#define WRITERS (4)
+#define PER_WRITER (300)
+
+static struct user u;
+
+/* message n holds n, with a length that varies with it */
+static struct umessage *make_message(uint64_t n) {
+	uint64_t len = 8 + n % 7 * 13;
+	struct umessage *m = alloc_umessage(len);
+	if(m == NULL) {
+		return NULL;
+	}
+	memset(m->message, (int) n, len);
+	memcpy(m->message, &n, 8);
+	return m;
+}
+
+/* appends messages first through first + num - 1 as one batch */
+static int append(uint64_t first, uint64_t num) {
+	struct umessage *head = NULL, **cur = &head;
+	for(uint64_t i = 0; i < num; i++) {
+		if((*cur = make_message(first + i)) == NULL) {
+			free_umessage_list(head);
+			return -1;
+		}
+		cur = &(*cur)->next;
+	}
+	int ret = undel_add_messages(&u, head);
+	free_umessage_list(head);
+	return ret;
+}
+
+static uint64_t batch_size(int i) {
+	return i % 2 ? BATCH : 1;
+}
+
+/* returns the number of messages loaded if they're 0, 1, 2 ... in order,
+ * -1 otherwise */
+static int64_t load_in_order() {
+	struct umessage *m;
+	if(undel_load(&u, &m) != 0) {
+		return -1;
+	}
+
+	int64_t n = 0;
+	for(struct umessage *c = m; c; c = c->next, n++) {
+		struct umessage *e = make_message(n);
+		int same = e != NULL && e->len == c->len &&
+			memcmp(e->message, c->message, c->len) == 0;
+		if(e) free_umessage(e);
+		if(!same) {
+			n = -1;
+			break;
+		}
+	}
+	free_umessage_list(m);
+
+	return n;
+}
+
+/* runs one crash, returns 1 once the fault is past the last write point */
+static int crash_append(uint64_t point) {
+	if(undel_init_file(&u) != 0 || append(0, PREFILL) != 0) {
+		return -1;
+	}
+
+	int fds[2];
+	if(pipe(fds) != 0) {
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if(pid == -1) {
+		return -1;
+	}
+	if(pid == 0) {
+		close(fds[0]);
+		undel_set_fault(point);
+		uint64_t next = PREFILL;
+		for(int i = 0; i < APPENDS; i++) {
+			if(append(next, batch_size(i)) != 0) {
+				_exit(1);
+			}
+			next += batch_size(i);
+			/* acknowledged */
+			if(write(fds[1], &next, sizeof(next)) != sizeof(next)) {
+				_exit(1);
+			}
+		}
+		_exit(0);
+	}
+
+	close(fds[1]);
+	uint64_t acked = PREFILL, n;
+	int appends = 0;
+	while(read(fds[0], &n, sizeof(n)) == sizeof(n)) {
+		acked = n;
+		appends++;
+	}
+	close(fds[0]);
+
+	int status;
+	if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+		return -1;
+	}
+	int crashed = WEXITSTATUS(status) == UNDEL_FAULT_EXIT;
+	if(!crashed && WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "point %llu: append failed\n",
+			(unsigned long long) point);
+		return -1;
+	}
+
+	/* the append in flight may or may not have made it, but not part
+	 * of it */
+	uint64_t in_flight = crashed ? batch_size(appends) : 0;
+	int64_t loaded = load_in_order();
+	if(loaded < 0 || (uint64_t) loaded < acked ||
+		((uint64_t) loaded != acked &&
+		(uint64_t) loaded != acked + in_flight)) {
+		fprintf(stderr, "point %llu: %lld messages loaded, %llu "
+			"acknowledged\n", (unsigned long long) point,
+			(long long) loaded, (unsigned long long) acked);
+		return -1;
+	}
+
+	/* and the file carries on from there, load emptied it */
+	if(append(0, PREFILL) != 0 || load_in_order() != PREFILL) {
+		fprintf(stderr, "point %llu: store unusable after crash\n",
+			(unsigned long long) point);
+		return -1;
+	}
+
+	return crashed ? 0 : 1;
+}
+
+/* a crash while load empties the file leaves the messages to load again */
+static int crash_load(uint64_t point) {
+	if(undel_init_file(&u) != 0 || append(0, PREFILL) != 0) {
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if(pid == -1) {
+		return -1;
+	}
+	if(pid == 0) {
+		struct umessage *m;
+		undel_set_fault(point);
+		_exit(undel_load(&u, &m) == 0 ? 0 : 1);
+	}
+
+	int status;
+	if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+		return -1;
+	}
+	int crashed = WEXITSTATUS(status) == UNDEL_FAULT_EXIT;
+	if(!crashed && WEXITSTATUS(status) != 0) {
+		return -1;
+	}
+
+	int64_t loaded = load_in_order();
+	if(loaded != (crashed ? PREFILL : 0)) {
+		fprintf(stderr, "load point %llu: %lld messages left\n",
+			(unsigned long long) point, (long long) loaded);
+		return -1;
+	}
+
+	return crashed ? 0 : 1;
+}
+
+/* replays everything stored, returns the number of messages if they're
+ * first, first + 1 ... in order, -1 otherwise */
+static int64_t replay_in_order(uint64_t first) {
+	struct undel_replay r;
+	int64_t n = 0;
+	int ret;
+	while((ret = undel_replay_open(&u, &r)) == 0) {
+		struct umessage *m;
+		while((ret = undel_replay_next(&u, &r, 1, &m)) == 0 &&
+			m != NULL) {
+			struct umessage *e = make_message(first + n);
+			int same = m->next == NULL && e != NULL &&
+				e->len == m->len &&
+				memcmp(e->message, m->message, m->len) == 0;
+			if(e) free_umessage(e);
+			free_umessage_list(m);
+			if(!same) {
+				ret = -1;
+				break;
+			}
+			n++;
+		}
+		if(ret != 0) {
+			undel_replay_stop(&u, &r, NULL);
+			return -1;
+		}
+		undel_replay_close(&r);
+	}
+
+	return ret == 1 ? n : -1;
+}
+
+/* a crash while a replay takes the file over, or while it's stopped after
+ * the first message, leaves every message to replay again.  otherwise only
+ * the first is gone */
+static int crash_replay(uint64_t point) {
+	if(undel_init_file(&u) != 0 || append(0, PREFILL) != 0) {
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if(pid == -1) {
+		return -1;
+	}
+	if(pid == 0) {
+		struct undel_replay r;
+		struct umessage *m;
+		undel_set_fault(point);
+		if(undel_replay_open(&u, &r) != 0 ||
+			undel_replay_next(&u, &r, 1, &m) != 0 || m == NULL) {
+			_exit(1);
+		}
+		free_umessage_list(m);
+		_exit(undel_replay_stop(&u, &r, NULL) == 0 ? 0 : 1);
+	}
+
+	int status;
+	if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+		return -1;
+	}
+	int crashed = WEXITSTATUS(status) == UNDEL_FAULT_EXIT;
+	if(!crashed && WEXITSTATUS(status) != 0) {
+		return -1;
+	}
+
+	uint64_t first = crashed ? 0 : 1;
+	int64_t replayed = replay_in_order(first);
+	if(replayed != (int64_t) (PREFILL - first)) {
+		fprintf(stderr, "replay point %llu: %lld messages replayed\n",
+			(unsigned long long) point, (long long) replayed);
+		return -1;
+	}
+
+	/* and the file carries on from there */
+	if(append(0, PREFILL) != 0 || replay_in_order(0) != PREFILL) {
+		fprintf(stderr, "replay point %llu: store unusable after "
+			"crash\n", (unsigned long long) point);
+		return -1;
+	}
+
+	return crashed ? 0 : 1;
+}
+
+/* each writer appends its own messages, alternating single messages and
+ * batches like the crash test */
+static void *writer(void *arg) {
+	uint64_t first = (uint64_t) (uintptr_t) arg * PER_WRITER;
+	uint64_t done = 0;
+	for(int i = 0; done < PER_WRITER; i++) {
+		uint64_t num = batch_size(i);
+		if(num > PER_WRITER - done) {
+			num = PER_WRITER - done;
+		}
+		if(append(first + done, num) != 0) {
+			return (void *) 1;
+		}
+		done += num;
+		/* spread out so that replays land in between */
+		usleep(100);
+	}
+	return NULL;
+}
+
+static int start_writers(pthread_t *threads) {
+	for(uintptr_t i = 0; i < WRITERS; i++) {
+		if(pthread_create(&threads[i], NULL, writer, (void *) i) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int join_writers(pthread_t *threads) {
+	int ret = 0;
+	for(int i = 0; i < WRITERS; i++) {
+		void *res;
+		if(pthread_join(threads[i], &res) != 0 || res != NULL) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+/* checks that each message is the next one from its writer */
+static int take_in_order(uint64_t *next, struct umessage *m) {
+	for(; m; m = m->next) {
+		uint64_t n;
+		if(m->len < 8) {
+			return -1;
+		}
+		memcpy(&n, m->message, 8);
+		uint64_t w = n / PER_WRITER;
+		if(w >= WRITERS || n != w * PER_WRITER + next[w]) {
+			return -1;
+		}
+
+		struct umessage *e = make_message(n);
+		int same = e != NULL && e->len == m->len &&
+			memcmp(e->message, m->message, m->len) == 0;
+		if(e) free_umessage(e);
+		if(!same) {
+			return -1;
+		}
+		next[w]++;
+	}
+	return 0;
+}
+
+static int all_taken(uint64_t *next) {
+	for(int i = 0; i < WRITERS; i++) {
+		if(next[i] != PER_WRITER) {
+			fprintf(stderr, "writer %d: %llu of %d messages\n", i,
+				(unsigned long long) next[i], PER_WRITER);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* replays one round of what's stored, returns 1 if there was nothing */
+static int replay_round(uint64_t *next) {
+	struct undel_replay r;
+	int ret = undel_replay_open(&u, &r);
+	if(ret != 0) {
+		return ret;
+	}
+
+	struct umessage *m;
+	while((ret = undel_replay_next(&u, &r, 256, &m)) == 0 && m != NULL) {
+		ret = take_in_order(next, m);
+		free_umessage_list(m);
+		if(ret != 0) {
+			break;
+		}
+	}
+	if(ret != 0) {
+		undel_replay_stop(&u, &r, NULL);
+		return -1;
+	}
+	undel_replay_close(&r);
+	return 0;
+}
+
+/* appends from several threads at once all land, none split or out of
+ * order */
+static int concurrent_appends() {
+	uint64_t next[WRITERS] = { 0 };
+	pthread_t threads[WRITERS];
+
+	if(undel_init_file(&u) != 0 || start_writers(threads) != 0 ||
+		join_writers(threads) != 0) {
+		return -1;
+	}
+
+	struct umessage *m;
+	if(undel_load(&u, &m) != 0) {
+		return -1;
+	}
+	int ret = take_in_order(next, m);
+	free_umessage_list(m);
+	if(ret != 0 || !all_taken(next)) {
+		fprintf(stderr, "concurrent appends: messages lost or out of "
+			"order\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* appends racing replays taking the file over, whatever is acknowledged is
+ * replayed exactly once.  returns the number of rounds that replayed
+ * something */
+static int64_t appends_during_replay() {
+	uint64_t next[WRITERS] = { 0 };
+	pthread_t threads[WRITERS];
+	int64_t rounds = 0;
+
+	if(undel_init_file(&u) != 0 || start_writers(threads) != 0) {
+		return -1;
+	}
+
+	int ret;
+	uint64_t taken = 0;
+	while(taken < WRITERS * PER_WRITER) {
+		if((ret = replay_round(next)) < 0) {
+			join_writers(threads);
+			fprintf(stderr, "replay race: messages out of order\n");
+			return -1;
+		}
+		rounds += ret == 0;
+
+		taken = 0;
+		for(int i = 0; i < WRITERS; i++) {
+			taken += next[i];
+		}
+	}
+	if(join_writers(threads) != 0) {
+		return -1;
+	}
+
+	/* nothing left over, or replayed twice */
+	if(replay_round(next) != 1 || !all_taken(next)) {
+		fprintf(stderr, "replay race: messages lost or repeated\n");
+		return -1;
+	}
+
+	return rounds;
+}
+
+static int rm_entry(const char *path, const struct stat *st, int flag,
+	struct FTW *ftw) {
+	return remove(path);
+}
+
+int main() {
+	char root[] = "/tmp/ibchat-test-XXXXXX";
+	if(mkdtemp(root) == NULL) {
+		fprintf(stderr, "failed to create root directory\n");
+		return 1;
+	}
+
+	memset(&u, 0, sizeof(u));
+	memset(u.uid, 0x11, sizeof(u.uid));
+	memset(u.und_auth, 0x22, sizeof(u.und_auth));
+	pthread_mutex_init(&u.undel_lock, NULL);
+
+	int ret = 1;
+	if(undel_init(root) != 0) {
+		fprintf(stderr, "failed to initialize store\n");
+		goto err;
+	}
+
+	uint64_t point;
+	int r = 0;
+	for(point = 1; (r = crash_append(point)) == 0; point++);
+	if(r < 0) {
+		goto err;
+	}
+	printf("append: recovered from %llu crash points\n",
+		(unsigned long long) point - 1);
+
+	for(point = 1; (r = crash_load(point)) == 0; point++);
+	if(r < 0) {
+		goto err;
+	}
+	printf("load: recovered from %llu crash points\n",
+		(unsigned long long) point - 1);
+
+	for(point = 1; (r = crash_replay(point)) == 0; point++);
+	if(r < 0) {
+		goto err;
+	}
+	printf("replay: recovered from %llu crash points\n",
+		(unsigned long long) point - 1);
+
+	if(concurrent_appends() != 0) {
+		goto err;
+	}
+	printf("concurrent: %d writers, %d messages each\n", WRITERS,
+		PER_WRITER);
+
+	int64_t rounds = appends_during_replay();
+	if(rounds < 0) {
+		goto err;
+	}
+	printf("replay race: %d writers, taken in %lld rounds\n", WRITERS,
+		(long long) rounds);
+
+	ret = 0;
+err:
+	nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+	if(ret != 0) {
+		printf("FAILED\n");
+	}
+	return ret;
+}
@@ -7,8 +7,11 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
 #include <libibur/endian.h>
@@ -23,15 +26,21 @@
 #include "undelivered.h"
 #include "chat_server.h"
 
+#include "../util/alloc.h"
+#include "../util/defaults.h"
 #include "../util/lock.h"
 #include "../util/log.h"
+#include "../util/metrics.h"
 
 #define TOP_LOAD (0.75)
 #define BOT_LOAD (0.5 / 2)
 
-#define MAX_SIZE ((uint64_t)1 << 20)
 #define MIN_SIZE ((uint64_t) 16)
 
+/* number of old buckets moved into the new table per write operation,
+ * enough to finish a migration before the next one is due */
+#define MIGRATE_STEP ((uint64_t) 16)
+
 static const char *USER_DIR_SUFFIX = "/users/";
 
 static char *USER_DIR;
@@ -40,15 +49,40 @@ static const char USER_FILE_MAGIC[8] = "userdb\0\0";
 
 struct user_db_ent {
 	struct user u;
-	pthread_mutex_t undel_lock;
+
+	/* number of outstanding user_db_get references */
+	uint64_t refs;
+	/* set on every access, cleared by the eviction hand */
+	int accessed;
+
+	/* cached hash_id of the uid */
+	uint64_t hash;
 	struct user_db_ent *next;
+
+	/* circular eviction list, only used in lazy mode */
+	struct user_db_ent *clock_prev;
+	struct user_db_ent *clock_next;
 };
 
 struct user_db_st {
 	struct user_db_ent **buckets;
 	uint64_t size;
 
+	/* while the table is being resized, buckets below migrated
+	 * have been moved from the old table into the new one */
+	struct user_db_ent **old_buckets;
+	uint64_t old_size;
+	uint64_t migrated;
+
 	uint64_t elements;
+	/* entries with outstanding references, which can't be evicted.  it's
+	 * updated without the lock, so it may briefly be off either way */
+	int64_t pinned;
+
+	/* 0 if every user is loaded at startup, otherwise users are loaded
+	 * on first access and at most this many unreferenced users are kept */
+	uint64_t cache_size;
+	struct user_db_ent *hand;
 
 	struct lock l;
 } db;
@@ -63,10 +97,6 @@ static uint64_t hash_id(uint8_t *id) {
 		decbe64(&shasum[24]);
 }
 
-static uint64_t hash(struct user *u) {
-	return hash_id(u->uid);
-}
-
 static int init_user_db_st() {
 	size_t size = MIN_SIZE * sizeof(struct user_db_ent *);
 	db.buckets = malloc(size);
@@ -76,29 +106,53 @@ static int init_user_db_st() {
 	memset(db.buckets, 0, size);
 
 	db.size = MIN_SIZE;
+	db.old_buckets = NULL;
+	db.old_size = 0;
+	db.migrated = 0;
 	db.elements = 0;
+	db.pinned = 0;
+	db.hand = NULL;
 
-	if(init_lock(&db.l) != 0) {
+	if(init_brlock(&db.l) != 0) {
 		return 1;
 	}
 
 	return 0;
 }
 
-static int resize() {
-	uint64_t nsize = db.size;
-	if(db.size < MAX_SIZE &&
-		(uint64_t) (db.elements / TOP_LOAD) > db.size) {
-		db.size *= 2;
+/* moves up to count buckets from the old table into the new one */
+static void migrate(uint64_t count) {
+	if(db.old_buckets == NULL) {
+		return;
 	}
-	if(db.size > MIN_SIZE &&
-		(uint64_t) (db.elements / BOT_LOAD) < db.size) {
-		db.size /= 2;
+
+	for(; count > 0 && db.migrated < db.old_size; count--) {
+		struct user_db_ent *cur = db.old_buckets[db.migrated];
+		struct user_db_ent *next;
+		while(cur != NULL) {
+			next = cur->next;
+			uint64_t nidx = cur->hash % db.size;
+			cur->next = db.buckets[nidx];
+			db.buckets[nidx] = cur;
+			cur = next;
+		}
+		db.old_buckets[db.migrated] = NULL;
+		db.migrated++;
 	}
 
-	if(nsize == db.size) {
-		return 0;
+	if(db.migrated == db.old_size) {
+		free(db.old_buckets);
+		db.old_buckets = NULL;
+		db.old_size = 0;
+		db.migrated = 0;
 	}
+}
+
+/* starts moving the table into nsize buckets, the move is finished a few
+ * buckets at a time by later write operations */
+static int start_rehash(uint64_t nsize) {
+	/* only one migration can be in flight */
+	migrate(db.old_size);
 
 	size_t bufsize = nsize * sizeof(struct user_db_ent *);
 	struct user_db_ent **nbuckets = malloc(bufsize);
@@ -107,47 +161,195 @@ static int resize() {
 	}
 	memset(nbuckets, 0, bufsize);
 
-	for(uint64_t i = 0; i < db.size; i++) {
-		struct user_db_ent *cur = db.buckets[i];
-		struct user_db_ent *next;
-		while(cur != NULL) {
-			next = cur->next;
-			uint64_t nidx = hash(&cur->u) % nsize;
-			cur->next = nbuckets[nidx];
-			nbuckets[nidx] = cur;
-			cur = next;
-		}
-	}
+	db.old_buckets = db.buckets;
+	db.old_size = db.size;
+	db.migrated = 0;
 
-	free(db.buckets);
 	db.buckets = nbuckets;
 	db.size = nsize;
 
 	return 0;
 }
 
-static int user_db_add_no_write(struct user u) {
-	uint64_t idx = hash(&u) % db.size;
+/* does a step of any migration in progress and starts a new one if the
+ * load factor is out of bounds */
+static int resize() {
+	migrate(MIGRATE_STEP);
+	if(db.old_buckets != NULL) {
+		return 0;
+	}
 
-	struct user_db_ent *ent = malloc(sizeof(struct user_db_ent));
-	if(ent == NULL) {
-		return 1;
+	uint64_t nsize = db.size;
+	if((uint64_t) (db.elements / TOP_LOAD) > nsize) {
+		nsize *= 2;
+	}
+	if(nsize > MIN_SIZE &&
+		(uint64_t) (db.elements / BOT_LOAD) < nsize) {
+		nsize /= 2;
+	}
+
+	if(nsize == db.size) {
+		return 0;
+	}
+
+	return start_rehash(nsize);
+}
+
+/* grows the table in one step so that it can hold elements entries */
+static int reserve(uint64_t elements) {
+	uint64_t nsize = db.size;
+	while((uint64_t) (elements / TOP_LOAD) > nsize) {
+		nsize *= 2;
+	}
+
+	if(nsize == db.size) {
+		return 0;
 	}
-	if(pthread_mutex_init(&ent->undel_lock, NULL) != 0) {
-		free(ent);
+
+	if(start_rehash(nsize) != 0) {
 		return 1;
 	}
+	migrate(db.old_size);
 
+	return 0;
+}
+
+/* finds the link pointing to the entry for uid, or NULL */
+static struct user_db_ent **user_db_loc(uint8_t *uid, uint64_t h) {
+	struct user_db_ent **loc = &db.buckets[h % db.size];
+	while(*loc != NULL) {
+		if((*loc)->hash == h && memcmp_ct((*loc)->u.uid, uid, 0x20) == 0) {
+			return loc;
+		}
+		loc = &(*loc)->next;
+	}
+
+	/* it may not have been moved into the new table yet */
+	if(db.old_buckets != NULL && h % db.old_size >= db.migrated) {
+		loc = &db.old_buckets[h % db.old_size];
+		while(*loc != NULL) {
+			if((*loc)->hash == h &&
+				memcmp_ct((*loc)->u.uid, uid, 0x20) == 0) {
+				return loc;
+			}
+			loc = &(*loc)->next;
+		}
+	}
+
+	return NULL;
+}
+
+/* inserts the user without checking the load factor */
+static struct user_db_ent *user_db_insert(struct user u) {
+	struct user_db_ent *ent = tag_malloc(ALLOC_USER,
+		sizeof(struct user_db_ent));
+	if(ent == NULL) {
+		return NULL;
+	}
 	ent->u = u;
+	if(pthread_mutex_init(&ent->u.undel_lock, NULL) != 0) {
+		tag_free(ALLOC_USER, ent);
+		return NULL;
+	}
+	ent->refs = 0;
+	ent->accessed = 1;
+	ent->hash = hash_id(u.uid);
+
+	/* new entries always go into the new table */
+	uint64_t idx = ent->hash % db.size;
 	struct user_db_ent *bucket = db.buckets[idx];
 	ent->next = bucket;
 	db.buckets[idx] = ent;
 
+	/* new entries go just behind the hand so they are checked last */
+	if(db.cache_size) {
+		if(db.hand == NULL) {
+			ent->clock_prev = ent;
+			ent->clock_next = ent;
+			db.hand = ent;
+		} else {
+			ent->clock_next = db.hand;
+			ent->clock_prev = db.hand->clock_prev;
+			ent->clock_prev->clock_next = ent;
+			db.hand->clock_prev = ent;
+		}
+	}
+
 	db.elements++;
+	gauge_set(G_USERS_LOADED, db.elements);
+
+	return ent;
+}
+
+static int user_db_add_no_write(struct user u) {
+	if(user_db_insert(u) == NULL) {
+		user_free(&u);
+		return 1;
+	}
 
 	return resize();
 }
 
+static void free_ent(struct user_db_ent *ent) {
+	user_free(&ent->u);
+	pthread_mutex_destroy(&ent->u.undel_lock);
+	tag_free(ALLOC_USER, ent);
+}
+
+/* unlinks and frees an entry, the write lock must be held */
+static void user_db_evict(struct user_db_ent *ent) {
+	struct user_db_ent **loc = user_db_loc(ent->u.uid, ent->hash);
+	*loc = ent->next;
+
+	if(ent->clock_next == ent) {
+		db.hand = NULL;
+	} else {
+		ent->clock_prev->clock_next = ent->clock_next;
+		ent->clock_next->clock_prev = ent->clock_prev;
+		if(db.hand == ent) {
+			db.hand = ent->clock_next;
+		}
+	}
+
+	db.elements--;
+	gauge_set(G_USERS_LOADED, db.elements);
+
+	free_ent(ent);
+}
+
+/* the entries that could be evicted */
+static uint64_t idle_elements() {
+	int64_t pinned = __atomic_load_n(&db.pinned, __ATOMIC_RELAXED);
+	if(pinned <= 0) {
+		return db.elements;
+	}
+	return (uint64_t) pinned < db.elements ? db.elements - pinned : 0;
+}
+
+/* approximates LRU with the clock algorithm: recently accessed entries get
+ * a second chance and referenced entries are never evicted, nor counted
+ * against the cache size.  the write lock must be held */
+static void user_db_shrink() {
+	/* two passes clear every accessed bit */
+	uint64_t steps = 2 * db.elements;
+	while(idle_elements() > db.cache_size && steps-- > 0) {
+		struct user_db_ent *ent = db.hand;
+		db.hand = ent->clock_next;
+
+		if(ent->refs != 0) {
+			continue;
+		}
+		if(ent->accessed) {
+			ent->accessed = 0;
+			continue;
+		}
+
+		user_db_evict(ent);
+	}
+
+	resize();
+}
+
 static int check_user_dir() {
 	struct stat st = {0};
 	if(stat(USER_DIR, &st) == -1) {
@@ -277,6 +479,13 @@ static int parse_user_file(char *name, struct user *user) {
 		INV();
 	}
 
+	/* the file already holds the key in wire format, keep it */
+	user->pkey_wire = pkey_blob_new(pkey_buf, pkey_size);
+	if(user->pkey_wire == NULL) {
+		ERR("failed to allocate memory");
+		goto err;
+	}
+
 	/* public keys can be passed by value */
 	user->pkey = pkey;
 	memcpy(user->uid, uid, 0x20);
@@ -336,7 +545,7 @@ static int write_user_file(struct user *u) {
 	/* signature 1 */
 	bufsize += sigsize;
 	/* public key */
-	bufsize += rsa_pubkey_bufsize(u->pkey.bits);
+	bufsize += u->pkey_wire->len;
 	/* signature 2 */
 	bufsize += sigsize;
 
@@ -354,18 +563,18 @@ static int write_user_file(struct user *u) {
 	uint8_t *sizebuf = undelivered + 0x20;
 	uint8_t *sig1 = sizebuf + 8;
 	uint8_t *pkey = sig1 + sigsize;
-	uint8_t *sig2 = pkey + rsa_pubkey_bufsize(u->pkey.bits);
+	uint8_t *sig2 = pkey + u->pkey_wire->len;
 
 	memcpy(magic, USER_FILE_MAGIC, 8);
 	memcpy(uid, u->uid, 0x20);
 	memcpy(undelivered, u->und_auth, 0x20);
-	encbe64(rsa_pubkey_bufsize(u->pkey.bits), sizebuf);
+	encbe64(u->pkey_wire->len, sizebuf);
 
 	if(rsa_pss_sign(&server_key, buf, sig1 - buf, sig1, sigsize) != 0) {
 		INV();
 	}
 
-	rsa_pubkey2wire(&u->pkey, pkey, rsa_pubkey_bufsize(u->pkey.bits));
+	memcpy(pkey, u->pkey_wire->wire, u->pkey_wire->len);
 
 	if(rsa_pss_sign(&server_key, buf, sig2 - buf, sig2, sigsize) != 0) {
 		INV();
@@ -388,27 +597,64 @@ exit:
 #undef WRITE
 }
 
-static int load_user_files() {
-	if(check_user_dir() != 0) {
-		return 1;
+/* a shard of the user directory to be parsed by a single loader thread */
+struct loader_arg {
+	pthread_t thread;
+
+	char (*names)[65];
+	uint64_t start;
+	uint64_t end;
+
+	struct user *users;
+	uint64_t loaded;
+	/* set if the shard couldn't be read at all */
+	int failed;
+};
+
+static void *user_file_loader(void *_arg) {
+	struct loader_arg *arg = (struct loader_arg *) _arg;
+
+	size_t upathlen = strlen(USER_DIR);
+	char *path = malloc(upathlen + 64 + 1);
+	if(path == NULL) {
+		ERR("failed to allocate memory");
+		arg->failed = 1;
+		return NULL;
 	}
+	memcpy(path, USER_DIR, upathlen);
 
-	LOG("reading user files from user dir %s", USER_DIR);
+	for(uint64_t i = arg->start; i < arg->end; i++) {
+		memcpy(path + upathlen, arg->names[i], 65);
+
+		if(parse_user_file(path, &arg->users[arg->loaded]) != 0) {
+			ERR("failed to parse user file: %s", arg->names[i]);
+			continue;
+		}
 
+		arg->loaded++;
+	}
+
+	free(path);
+
+	return NULL;
+}
+
+/* reads the names of all valid user files in the user directory */
+static int list_user_files(char (**names)[65], uint64_t *num) {
 	DIR *userdir = opendir(USER_DIR);
 	if(userdir == NULL) {
 		ERR("failed to open userdir: %s", USER_DIR);
 		return 1;
 	}
 
-	size_t upathlen = strlen(USER_DIR);
-	char *path = malloc(upathlen + 64 + 1);
-	if(path == NULL) {
+	uint64_t cap = 64;
+	uint64_t n = 0;
+	char (*list)[65] = malloc(cap * sizeof(*list));
+	if(list == NULL) {
 		ERR("failed to allocate memory");
+		closedir(userdir);
 		return 1;
 	}
-	memcpy(path, USER_DIR, upathlen);
-	path[upathlen + 64] = '\0';
 
 	struct dirent *ent;
 	char *name;
@@ -427,32 +673,144 @@ static int load_user_files() {
 		for(int i = 0; i < 64; i++) {
 			valid &= ((name[i] >= '0' && name[i] <= '9') ||
 			          (name[i] >= 'a' && name[i] <= 'f'));
-			path[upathlen + i] = name[i];
 		}
 		if(!valid) {
 			ERR("unrecognised file in user dir: %s", name);
 			continue;
 		}
-		LOG("loading user file %s", name);
-
-		struct user u;
 
-		if(parse_user_file(path, &u) != 0) {
-			ERR("failed to parse user file: %s", name);
-			continue;
+		if(n == cap) {
+			char (*nlist)[65] = realloc(list, 2 * cap * sizeof(*list));
+			if(nlist == NULL) {
+				ERR("failed to allocate memory");
+				free(list);
+				closedir(userdir);
+				return 1;
+			}
+			list = nlist;
+			cap *= 2;
 		}
 
-		/* add it to the struct */
-		if(user_db_add_no_write(u) != 0) {
-			ERR("failed to add user to struct: %s", name);
-		}
+		memcpy(list[n], name, 65);
+		n++;
 	}
 
 	closedir(userdir);
 
+	*names = list;
+	*num = n;
+
 	return 0;
 }
 
+static int load_user_files() {
+	if(check_user_dir() != 0) {
+		return 1;
+	}
+
+	LOG("reading user files from user dir %s", USER_DIR);
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	char (*names)[65];
+	uint64_t num;
+	if(list_user_files(&names, &num) != 0) {
+		return 1;
+	}
+
+	/* each user file takes two signature verifications to load,
+	 * so spread them across as many threads as we have processors */
+	long nthreads = USER_LOAD_THREADS;
+	if(nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(nthreads <= 0) {
+		nthreads = 1;
+	}
+	if((uint64_t) nthreads > num) {
+		nthreads = num ? num : 1;
+	}
+
+	int ret = 1;
+	struct user *users = malloc((num ? num : 1) * sizeof(struct user));
+	struct loader_arg *args = malloc(nthreads * sizeof(struct loader_arg));
+	if(users == NULL || args == NULL) {
+		ERR("failed to allocate memory");
+		goto exit;
+	}
+
+	long launched;
+	for(launched = 0; launched < nthreads; launched++) {
+		struct loader_arg *arg = &args[launched];
+		arg->names = names;
+		arg->start = num * launched / nthreads;
+		arg->end = num * (launched + 1) / nthreads;
+		arg->users = &users[arg->start];
+		arg->loaded = 0;
+		arg->failed = 0;
+
+		if(pthread_create(&arg->thread, NULL, user_file_loader, arg)
+			!= 0) {
+			ERR("failed to launch user loader thread");
+			break;
+		}
+	}
+
+	uint64_t loaded = 0;
+	int failed = launched != nthreads;
+	for(long i = 0; i < launched; i++) {
+		pthread_join(args[i].thread, NULL);
+		loaded += args[i].loaded;
+		failed |= args[i].failed;
+	}
+
+	/* starting without a whole shard of users would be worse than not
+	 * starting */
+	if(failed) {
+		ERR("failed to load user files");
+		goto free_users;
+	}
+
+	/* size the table once for all of the users */
+	if(reserve(db.elements + loaded) != 0) {
+		ERR("failed to allocate user table");
+		goto free_users;
+	}
+
+	for(long i = 0; i < nthreads; i++) {
+		for(uint64_t j = 0; j < args[i].loaded; j++) {
+			if(user_db_insert(args[i].users[j]) == NULL) {
+				ERR("failed to add user to struct");
+				user_free(&args[i].users[j]);
+			}
+		}
+	}
+
+	gettimeofday(&end, NULL);
+	uint64_t elapsed = (end.tv_sec - start.tv_sec) * 1000000ULL +
+		end.tv_usec - start.tv_usec;
+
+	LOG("loaded %llu of %llu user files in %llu ms using %ld threads "
+		"(%llu users/s)", loaded, num, elapsed / 1000, nthreads,
+		elapsed ? loaded * 1000000ULL / elapsed : loaded);
+
+	ret = 0;
+	goto exit;
+free_users:
+	for(long i = 0; i < launched; i++) {
+		for(uint64_t j = 0; j < args[i].loaded; j++) {
+			user_free(&args[i].users[j]);
+		}
+	}
+exit:
+	free(users);
+	free(args);
+	free(names);
+
+	return ret;
+}
+
 static int init_user_dir(char *root_dir) {
 	USER_DIR = malloc(strlen(root_dir) + strlen(USER_DIR_SUFFIX) + 1);
 	if(USER_DIR == NULL) {
@@ -465,7 +823,35 @@ static int init_user_dir(char *root_dir) {
 	return 0;
 }
 
-int user_db_init(char *root_dir) {
+static char *user_file_path(uint8_t *uid) {
+	size_t upathlen = strlen(USER_DIR);
+	char *path = malloc(upathlen + 64 + 1);
+	if(path == NULL) {
+		return NULL;
+	}
+
+	strcpy(path, USER_DIR);
+	to_hex(uid, 0x20, path + upathlen);
+	path[upathlen + 64] = '\0';
+
+	return path;
+}
+
+/* checks for a user file without parsing it */
+static int user_file_exists(uint8_t *uid) {
+	char *path = user_file_path(uid);
+	if(path == NULL) {
+		return -1;
+	}
+
+	struct stat st;
+	int ret = stat(path, &st) == 0;
+	free(path);
+
+	return ret;
+}
+
+int user_db_init(char *root_dir, uint64_t cache_size) {
 	/* set the umask */
 	umask(0077);
 
@@ -473,11 +859,19 @@ int user_db_init(char *root_dir) {
 	if(init_user_db_st() != 0) {
 		return 1;
 	}
+	db.cache_size = cache_size;
 
 	if(init_user_dir(root_dir) != 0) {
 		return 1;
 	}
 
+	if(cache_size != 0) {
+		/* users are loaded as they are accessed */
+		LOG("loading users on demand, caching up to %llu users",
+			cache_size);
+		return check_user_dir();
+	}
+
 	/* add all existing user files */
 	if(load_user_files() != 0) {
 		return 1;
@@ -486,47 +880,125 @@ int user_db_init(char *root_dir) {
 	return 0;
 }
 
-void user_db_destroy() {
-	for(uint64_t i = 0; i < db.size; i++) {
-		struct user_db_ent *cur = db.buckets[i];
+static void free_buckets(struct user_db_ent **buckets, uint64_t size) {
+	for(uint64_t i = 0; i < size; i++) {
+		struct user_db_ent *cur = buckets[i];
 		struct user_db_ent *next;
 		while(cur != NULL) {
 			next = cur->next;
-			pthread_mutex_destroy(&cur->undel_lock);
-			free(cur);
+			free_ent(cur);
 			cur = next;
 		}
 	}
 
+	free(buckets);
+}
+
+void user_db_destroy() {
+	free_buckets(db.buckets, db.size);
+	if(db.old_buckets != NULL) {
+		free_buckets(db.old_buckets, db.old_size);
+	}
+
+	db.buckets = NULL;
+	db.old_buckets = NULL;
 	db.size = 0;
+	db.old_size = 0;
 	db.elements = 0;
+	db.pinned = 0;
+	db.hand = NULL;
 
 	destroy_lock(&db.l);
 }
 
 /* allows it to be called from within user_db_add */
-static struct user *user_db_get_nolock(uint8_t *uid) {
-	uint64_t idx = hash_id(uid) % db.size;
-
-	struct user_db_ent *ent = db.buckets[idx];
-	struct user *ret = NULL;
-	while(ent) {
-		if(memcmp_ct(ent->u.uid, uid, 0x20) == 0) {
-			ret = &ent->u;
-			break;
+static struct user_db_ent *user_db_get_nolock(uint8_t *uid) {
+	struct user_db_ent **loc = user_db_loc(uid, hash_id(uid));
+
+	return loc ? *loc : NULL;
+}
+
+static void user_db_ref(struct user_db_ent *ent) {
+	if(__sync_fetch_and_add(&ent->refs, 1) == 0) {
+		__sync_fetch_and_add(&db.pinned, 1);
+	}
+	if(!ent->accessed) {
+		ent->accessed = 1;
+	}
+}
+
+/* loads a user that isn't in memory from their user file */
+static struct user *user_db_fault(uint8_t *uid) {
+	int exists = user_file_exists(uid);
+	if(exists != 1) {
+		if(exists == -1) {
+			ERR("failed to allocate memory");
 		}
+		return NULL;
+	}
 
-		ent = ent->next;
+	char *path = user_file_path(uid);
+	if(path == NULL) {
+		ERR("failed to allocate memory");
+		return NULL;
 	}
 
-	return ret;
+	/* verify the file without holding the lock */
+	struct user u;
+	uint64_t start = metrics_now();
+	int ret = parse_user_file(path, &u);
+	free(path);
+	if(ret != 0) {
+		return NULL;
+	}
+	histogram_record(H_USER_LOAD_US, metrics_now() - start);
+
+	acquire_writelock(&db.l);
+
+	/* someone else may have loaded them in the meantime */
+	struct user_db_ent *ent = user_db_get_nolock(uid);
+	if(ent != NULL) {
+		user_free(&u);
+	} else if((ent = user_db_insert(u)) == NULL) {
+		ERR("failed to add user to struct");
+		user_free(&u);
+		release_writelock(&db.l);
+		return NULL;
+	}
+
+	user_db_ref(ent);
+	user_db_shrink();
+
+	release_writelock(&db.l);
+
+	return &ent->u;
 }
 
 struct user *user_db_get(uint8_t *uid) {
 	acquire_readlock(&db.l);
-	struct user *ret = user_db_get_nolock(uid);
+	struct user_db_ent *ent = user_db_get_nolock(uid);
+	if(ent != NULL) {
+		user_db_ref(ent);
+	}
 	release_readlock(&db.l);
-	return ret;
+
+	if(ent != NULL) {
+		counter_inc(C_USER_CACHE_HITS);
+		return &ent->u;
+	}
+	counter_inc(C_USER_CACHE_MISSES);
+	if(db.cache_size != 0) {
+		return user_db_fault(uid);
+	}
+
+	return NULL;
+}
+
+void user_db_release(struct user *u) {
+	struct user_db_ent *ent = (struct user_db_ent *) u;
+	if(__sync_sub_and_fetch(&ent->refs, 1) == 0) {
+		__sync_fetch_and_sub(&db.pinned, 1);
+	}
 }
 
 /* registers a new user */
@@ -536,10 +1008,22 @@ int user_db_add(struct user u) {
 	int ret = 0;
 
 	/* check if the user exists first */
-	if(user_db_get_nolock(u.uid) != NULL) {
-		char name[64];
+	int exists = user_db_get_nolock(u.uid) != NULL;
+	if(!exists && db.cache_size != 0) {
+		exists = user_file_exists(u.uid);
+	}
+	if(exists == -1) {
+		ERR("failed to allocate memory");
+		user_free(&u);
+		ret = 1;
+		goto exit;
+	}
+	if(exists) {
+		char name[65];
 		to_hex(u.uid, 0x20, name);
+		name[64] = '\0';
 		ERR("attempted to add already added user %s", name);
+		user_free(&u);
 		ret = -1;
 		goto exit;
 	}
@@ -547,6 +1031,7 @@ int user_db_add(struct user u) {
 	/* create a user file */
 	if(write_user_file(&u) != 0) {
 		ERR("failed to write user file");
+		user_free(&u);
 		ret = 1;
 		goto exit;
 	}
@@ -558,6 +1043,10 @@ int user_db_add(struct user u) {
 		goto exit;
 	}
 
+	if(db.cache_size != 0) {
+		user_db_shrink();
+	}
+
 exit:
 	release_writelock(&db.l);
 	return ret;
@@ -587,6 +1076,52 @@ int user_init(uint8_t *uid, RSA_PUBLIC_KEY pkey, struct user *u) {
 		return 1;
 	}
 
+	uint64_t wirelen = rsa_pubkey_bufsize(u->pkey.bits);
+	uint8_t *wire = malloc(wirelen);
+	if(wire == NULL) {
+		rsa_free_pubkey(&u->pkey);
+		return 1;
+	}
+	if(rsa_pubkey2wire(&u->pkey, wire, wirelen) != 0 ||
+		(u->pkey_wire = pkey_blob_new(wire, wirelen)) == NULL) {
+		free(wire);
+		rsa_free_pubkey(&u->pkey);
+		return 1;
+	}
+	free(wire);
+
 	return 0;
 }
 
+void user_free(struct user *u) {
+	rsa_free_pubkey(&u->pkey);
+	if(u->pkey_wire) pkey_blob_put(u->pkey_wire);
+	u->pkey_wire = NULL;
+}
+
+struct pkey_blob *pkey_blob_new(uint8_t *wire, uint64_t len) {
+	struct pkey_blob *b = tag_malloc(ALLOC_USER,
+		sizeof(struct pkey_blob) + len);
+	if(b == NULL) {
+		return NULL;
+	}
+
+	b->refs = 1;
+	b->len = len;
+	memcpy(b->wire, wire, len);
+	sha256(wire, len, b->fingerprint);
+
+	return b;
+}
+
+struct pkey_blob *pkey_blob_ref(struct pkey_blob *b) {
+	__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+void pkey_blob_put(struct pkey_blob *b) {
+	if(__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		tag_free(ALLOC_USER, b);
+	}
+}
+
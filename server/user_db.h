@@ -1,24 +1,53 @@
 #ifndef IBCHAT_SERVER_USER_DB_H
 #define IBCHAT_SERVER_USER_DB_H
 
+#include <pthread.h>
 #include <stdint.h>
 
 #include <ibcrypt/rsa.h>
 
+/* a public key in wire format, immutable once built so it can be shared
+ * by reference */
+struct pkey_blob {
+	uint64_t refs;
+	/* sha256 of the wire format, identifies the key */
+	uint8_t fingerprint[0x20];
+	uint64_t len;
+	uint8_t wire[];
+};
+
 struct user {
 	RSA_PUBLIC_KEY pkey;
 	uint8_t uid[0x20];
 	uint8_t und_auth[0x20];
+	/* held by undelivered.c for anything that touches the user's stored
+	 * messages, so that senders and a login can't trip over each other */
+	pthread_mutex_t undel_lock;
+
+	/* built once when the user is loaded or registered so it can be
+	 * handed out without serializing it */
+	struct pkey_blob *pkey_wire;
 };
 
-int user_db_init(char *root_dir);
+/* cache_size 0 loads every user at startup, otherwise users are loaded
+ * on first access and at most cache_size idle users are kept in memory */
+int user_db_init(char *root_dir, uint64_t cache_size);
 void user_db_destroy();
 
+/* every user returned must be given back with user_db_release */
 struct user *user_db_get(uint8_t *uid);
-/* registers a new user */
+void user_db_release(struct user *u);
+/* registers a new user, the database owns u afterwards even on failure */
 int user_db_add(struct user u);
 
 int user_init(uint8_t *uid, RSA_PUBLIC_KEY pkey, struct user *u);
+/* frees the memory held by a user that isn't in the database */
+void user_free(struct user *u);
+
+/* the new blob holds one reference */
+struct pkey_blob *pkey_blob_new(uint8_t *wire, uint64_t len);
+struct pkey_blob *pkey_blob_ref(struct pkey_blob *b);
+void pkey_blob_put(struct pkey_blob *b);
 
 #endif
 
@@ -0,0 +1,131 @@
+/* allocation accounting by tag.  each allocation costs a few relaxed atomic
+ * adds on its tag's cache line, the sizes are the ones malloc really handed
+ * out so nothing extra is stored alongside the memory */
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "alloc.h"
+#include "log.h"
+#include "metrics.h"
+
+static const char *tag_names[ALLOC_TAGS] = {
+	"message",
+	"umessage",
+	"user",
+	"handler",
+	"ack",
+};
+
+struct tag_stats {
+	int64_t bytes;
+	int64_t objects;
+	uint64_t allocs;
+	int64_t peak; /* bytes */
+} __attribute__((aligned(64)));
+
+static struct tag_stats tags[ALLOC_TAGS];
+
+/* the allocation counts as of the last report, for the rates */
+static struct {
+	pthread_mutex_t lock;
+	uint64_t time;
+	uint64_t allocs[ALLOC_TAGS];
+} last = { PTHREAD_MUTEX_INITIALIZER, 0, { 0 } };
+
+void *tag_malloc(enum alloc_tag tag, size_t size) {
+	void *p = malloc(size);
+	if(p == NULL) {
+		return NULL;
+	}
+
+	struct tag_stats *t = &tags[tag];
+	int64_t len = malloc_usable_size(p);
+	int64_t bytes = __atomic_add_fetch(&t->bytes, len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->objects, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&t->allocs, 1, __ATOMIC_RELAXED);
+
+	int64_t peak = __atomic_load_n(&t->peak, __ATOMIC_RELAXED);
+	while(bytes > peak && !__atomic_compare_exchange_n(&t->peak, &peak,
+		bytes, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return p;
+}
+
+void tag_free(enum alloc_tag tag, void *p) {
+	if(p == NULL) {
+		return;
+	}
+
+	struct tag_stats *t = &tags[tag];
+	__atomic_sub_fetch(&t->bytes, (int64_t) malloc_usable_size(p),
+		__ATOMIC_RELAXED);
+	__atomic_sub_fetch(&t->objects, 1, __ATOMIC_RELAXED);
+
+	free(p);
+}
+
+/* fills in each tag's allocations per second since the last report */
+static void take_rates(double *rates) {
+	pthread_mutex_lock(&last.lock);
+	uint64_t now = metrics_now();
+	double secs = last.time ? (now - last.time) / 1e6 : 0;
+	for(int i = 0; i < ALLOC_TAGS; i++) {
+		uint64_t allocs = __atomic_load_n(&tags[i].allocs,
+			__ATOMIC_RELAXED);
+		rates[i] = secs > 0 ? (allocs - last.allocs[i]) / secs : 0;
+		last.allocs[i] = allocs;
+	}
+	last.time = now;
+	pthread_mutex_unlock(&last.lock);
+}
+
+#define LINE_LEN (80)
+
+static void format_header(char *buf) {
+	snprintf(buf, LINE_LEN, "%-9s %12s %10s %12s %12s %10s", "tag",
+		"live bytes", "objects", "peak bytes", "allocs", "allocs/s");
+}
+
+static void format_line(char *buf, int i, double rate) {
+	struct tag_stats *t = &tags[i];
+	snprintf(buf, LINE_LEN, "%-9s %12lld %10lld %12lld %12llu %10.0f",
+		tag_names[i],
+		(long long) __atomic_load_n(&t->bytes, __ATOMIC_RELAXED),
+		(long long) __atomic_load_n(&t->objects, __ATOMIC_RELAXED),
+		(long long) __atomic_load_n(&t->peak, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&t->allocs,
+			__ATOMIC_RELAXED),
+		rate);
+}
+
+int alloc_write(FILE *f) {
+	char line[LINE_LEN];
+	double rates[ALLOC_TAGS];
+	take_rates(rates);
+
+	format_header(line);
+	fprintf(f, "%s\n", line);
+	for(int i = 0; i < ALLOC_TAGS; i++) {
+		format_line(line, i, rates[i]);
+		fprintf(f, "%s\n", line);
+	}
+
+	return ferror(f) ? -1 : 0;
+}
+
+void alloc_log() {
+	char line[LINE_LEN];
+	double rates[ALLOC_TAGS];
+	take_rates(rates);
+
+	format_header(line);
+	LOG("%s", line);
+	for(int i = 0; i < ALLOC_TAGS; i++) {
+		format_line(line, i, rates[i]);
+		LOG("%s", line);
+	}
+}
@@ -0,0 +1,31 @@
+#ifndef IBCHAT_UTIL_ALLOC_H
+#define IBCHAT_UTIL_ALLOC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* what the counted allocations are for.  the names are in alloc.c, in the
+ * same order */
+enum alloc_tag {
+	ALLOC_MESSAGE,  /* struct message, queued on connections and mailboxes */
+	ALLOC_UMESSAGE, /* undelivered messages on their way in or out */
+	ALLOC_USER,     /* user database entries */
+	ALLOC_HANDLER,  /* connection state and handler table nodes */
+	ALLOC_ACK,      /* frames waiting to be acknowledged */
+	ALLOC_TAGS
+};
+
+/* malloc and free, counting the memory against the tag.  memory from
+ * tag_malloc must be freed with tag_free and the same tag */
+void *tag_malloc(enum alloc_tag tag, size_t size);
+void tag_free(enum alloc_tag tag, void *p);
+
+/* writes the live bytes and objects, high-water mark, allocations and the
+ * allocation rate since the last report for each tag.  returns non-zero if
+ * writing failed */
+int alloc_write(FILE *f);
+/* the same, to the log */
+void alloc_log();
+
+#endif
+
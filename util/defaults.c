@@ -1,3 +1,5 @@
+#include <stdint.h>
+
 /* the maximum number of handshakes a server can run at the same time */
 const int MAX_HANDSHAKES = 1;
 
@@ -7,3 +9,70 @@ char *DFLT_ROOT_DIR = "~/.ibchat_server/";
 
 char *DFLT_ADDR = "ibchat.seanp.xyz";
 
+
+/* the number of threads accepting connections, each with its own listening
+ * socket, 0 uses one thread per online processor */
+const int ACCEPT_THREADS = 0;
+
+/* the length of each listening socket's accept queue, the kernel caps it at
+ * net.core.somaxconn */
+const int DFLT_BACKLOG = 4096;
+
+/* new connections a host may open per second once it has used up its
+ * burst, 0 for no limit */
+const int HOST_CONNECT_RATE = 10;
+const int HOST_CONNECT_BURST = 50;
+
+/* handshakes one host may have queued or running, 0 for no limit */
+const int HOST_HANDSHAKES = 8;
+
+/* handshakes queued or running over all hosts, each one holds a pair of
+ * threads.  connections past this are closed as soon as they're accepted */
+const int MAX_PENDING_HANDSHAKES = 256;
+
+/* seconds between logs of the connections turned away */
+const int ADMIT_LOG_INTERVAL = 60;
+
+/* the number of threads used to load user files at startup,
+ * 0 uses one thread per online processor */
+const int USER_LOAD_THREADS = 0;
+
+/* the number of idle users kept in memory when users are loaded on demand,
+ * 0 loads every user at startup */
+const uint64_t DFLT_USER_CACHE = 0;
+
+/* the number of threads encrypting and sending messages to sessions,
+ * 0 uses one thread per online processor */
+const int DELIVERY_THREADS = 0;
+
+/* milliseconds between presence updates sent to subscribers */
+const int PRESENCE_INTERVAL = 1000;
+
+/* the largest message accepted from a peer, in bytes */
+const uint64_t DFLT_MAX_FRAME = 1 << 20;
+
+/* how many bytes a peer may have in flight to us before it has to wait
+ * for more credit, raised to the maximum frame size if that is larger */
+const uint64_t RECV_WINDOW = 4 << 20;
+
+/* once this many bytes are queued to a connection senders are made to wait
+ * until it drains below the low water mark */
+const uint64_t SEND_HIGH_WATER = 8 << 20;
+const uint64_t SEND_LOW_WATER = 4 << 20;
+
+/* microseconds a sender waits on a full connection before its message is
+ * stored as undelivered instead, and a session that isn't taking what it's
+ * sent is given before it's dropped */
+const uint64_t BACKPRESSURE_WAIT = 1000000ULL;
+
+/* bytes of stored messages read into memory at a time as they're sent on
+ * login, at least one message is always read */
+const uint64_t UNDEL_REPLAY_BATCH = 1 << 20;
+
+/* the most unfinished streams a user may have going at once */
+const int STREAMS_PER_USER = 16;
+
+/* seconds a stream is remembered after its last chunk */
+const int STREAM_IDLE = 24 * 60 * 60;
+/* seconds between sweeps that forget idle streams of every user */
+const int STREAM_SWEEP = 60 * 60;
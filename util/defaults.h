@@ -1,6 +1,8 @@
 #ifndef IBCHAT_UTIL_DEFAULTS_H
 #define IBCHAT_UTIL_DEFAULTS_H
 
+#include <stdint.h>
+
 /* VALUES FOUND IN DEFAULTS.C */
 
 /* the maximum number of handshakes a server can run at the same time */
@@ -12,5 +14,72 @@ extern char *DFLT_ROOT_DIR;
 
 extern char *DFLT_ADDR;
 
+/* the number of threads accepting connections, each with its own listening
+ * socket, 0 uses one thread per online processor */
+extern const int ACCEPT_THREADS;
+
+/* the length of each listening socket's accept queue, the kernel caps it at
+ * net.core.somaxconn */
+extern const int DFLT_BACKLOG;
+
+/* new connections a host may open per second once it has used up its
+ * burst, 0 for no limit */
+extern const int HOST_CONNECT_RATE;
+extern const int HOST_CONNECT_BURST;
+
+/* handshakes one host may have queued or running, 0 for no limit */
+extern const int HOST_HANDSHAKES;
+
+/* handshakes queued or running over all hosts, each one holds a pair of
+ * threads.  connections past this are closed as soon as they're accepted */
+extern const int MAX_PENDING_HANDSHAKES;
+
+/* seconds between logs of the connections turned away */
+extern const int ADMIT_LOG_INTERVAL;
+
+/* the number of threads used to load user files at startup,
+ * 0 uses one thread per online processor */
+extern const int USER_LOAD_THREADS;
+
+/* the number of idle users kept in memory when users are loaded on demand,
+ * 0 loads every user at startup */
+extern const uint64_t DFLT_USER_CACHE;
+
+/* the number of threads encrypting and sending messages to sessions,
+ * 0 uses one thread per online processor */
+extern const int DELIVERY_THREADS;
+
+/* milliseconds between presence updates sent to subscribers */
+extern const int PRESENCE_INTERVAL;
+
+/* the largest message accepted from a peer, in bytes */
+extern const uint64_t DFLT_MAX_FRAME;
+
+/* how many bytes a peer may have in flight to us before it has to wait
+ * for more credit, raised to the maximum frame size if that is larger */
+extern const uint64_t RECV_WINDOW;
+
+/* once this many bytes are queued to a connection senders are made to wait
+ * until it drains below the low water mark */
+extern const uint64_t SEND_HIGH_WATER;
+extern const uint64_t SEND_LOW_WATER;
+
+/* microseconds a sender waits on a full connection before its message is
+ * stored as undelivered instead, and a session that isn't taking what it's
+ * sent is given before it's dropped */
+extern const uint64_t BACKPRESSURE_WAIT;
+
+/* bytes of stored messages read into memory at a time as they're sent on
+ * login, at least one message is always read */
+extern const uint64_t UNDEL_REPLAY_BATCH;
+
+/* the most unfinished streams a user may have going at once */
+extern const int STREAMS_PER_USER;
+
+/* seconds a stream is remembered after its last chunk */
+extern const int STREAM_IDLE;
+/* seconds between sweeps that forget idle streams of every user */
+extern const int STREAM_SWEEP;
+
 #endif
 
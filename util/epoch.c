@@ -0,0 +1,113 @@
+/* each thread publishes the global epoch it observed when it entered a
+ * read-side critical section, or 0 when it is outside of one.
+ * synchronize advances the global epoch and waits for every thread to
+ * either leave or observe the new epoch */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "log.h"
+
+struct epoch_rec {
+	uint64_t epoch;
+	int nesting;
+	int in_use;
+	struct epoch_rec *next;
+} __attribute__((aligned(64)));
+
+static uint64_t global_epoch = 1;
+
+/* records are never freed, only reused once their thread exits */
+static struct epoch_rec *records = NULL;
+
+static pthread_key_t rec_key;
+static pthread_once_t rec_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct epoch_rec *self = NULL;
+
+static void release_rec(void *_rec) {
+	struct epoch_rec *rec = (struct epoch_rec *) _rec;
+	__atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_rec_key() {
+	pthread_key_create(&rec_key, release_rec);
+}
+
+static struct epoch_rec *register_thread() {
+	pthread_once(&rec_key_once, make_rec_key);
+
+	struct epoch_rec *rec;
+
+	/* try to take over the record of a thread that has exited */
+	for(rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL;
+		rec = rec->next) {
+		int expected = 0;
+		if(__atomic_compare_exchange_n(&rec->in_use, &expected, 1, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			goto done;
+		}
+	}
+
+	if(posix_memalign((void **) &rec, 64, sizeof(*rec)) != 0) {
+		ERR("failed to allocate epoch record");
+		abort();
+	}
+	rec->epoch = 0;
+	rec->nesting = 0;
+	rec->in_use = 1;
+
+	rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&records, &rec->next, rec, 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+done:
+	pthread_setspecific(rec_key, rec);
+	self = rec;
+
+	return rec;
+}
+
+void epoch_enter() {
+	struct epoch_rec *rec = self;
+	if(rec == NULL) {
+		rec = register_thread();
+	}
+
+	if(rec->nesting++ == 0) {
+		__atomic_store_n(&rec->epoch,
+			__atomic_load_n(&global_epoch, __ATOMIC_RELAXED),
+			__ATOMIC_RELAXED);
+		/* the epoch must be visible before any shared reads */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void epoch_exit() {
+	struct epoch_rec *rec = self;
+	if(--rec->nesting == 0) {
+		__atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+	}
+}
+
+void epoch_synchronize() {
+	/* order the caller's unlinking before reading reader epochs */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t target = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+
+	struct epoch_rec *rec;
+	for(rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL;
+		rec = rec->next) {
+		uint64_t e;
+		while((e = __atomic_load_n(&rec->epoch, __ATOMIC_ACQUIRE)) != 0
+			&& e < target) {
+			sched_yield();
+		}
+	}
+}
+
@@ -0,0 +1,16 @@
+#ifndef IBCHAT_UTIL_EPOCH_H
+#define IBCHAT_UTIL_EPOCH_H
+
+/* epoch based reclamation for data structures with lock-free readers.
+ * readers wrap their accesses in epoch_enter/epoch_exit, writers unlink
+ * an object and call epoch_synchronize before freeing it */
+
+void epoch_enter();
+void epoch_exit();
+
+/* blocks until every reader that was inside a critical section when this
+ * was called has left it, must not be called from inside one */
+void epoch_synchronize();
+
+#endif
+
@@ -1,5 +1,5 @@
 DIR=util
-FILTER=$(wildcard */*_test.c) $(DIR)/gen_key.c
+FILTER=$(wildcard */*_test.c) $(wildcard */*_bench.c) $(DIR)/gen_key.c
 SERVERSOURCES+=$(DIR)/gen_key.c
 SOURCES+=$(filter-out $(FILTER),$(wildcard $(DIR)/*.c))
 
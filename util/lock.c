@@ -1,57 +1,136 @@
 /* a thread-safe lock allowing for multiple readers or a single writer at any
  * given point in time */
 
-#include <limits.h>
+/* readers only touch their counter and the writer flag unless a writer is
+ * around.  a writer raises the flag, which turns away new readers, and then
+ * waits for the existing readers to drain */
+
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "lock.h"
 
-#define MAX_READERS (INT_MAX - 1)
+static int next_slot = 0;
+static __thread int thread_slot = -1;
+
+/* each thread sticks to one counter so releases match acquires */
+static int *reader_count(struct lock *l) {
+	if(l->slots == NULL) {
+		return &l->readers;
+	}
+
+	if(thread_slot == -1) {
+		thread_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED)
+			% LOCK_READER_SLOTS;
+	}
+
+	return &l->slots[thread_slot].readers;
+}
+
+static int active_readers(struct lock *l) {
+	if(l->slots == NULL) {
+		return __atomic_load_n(&l->readers, __ATOMIC_SEQ_CST);
+	}
+
+	int total = 0;
+	for(int i = 0; i < LOCK_READER_SLOTS; i++) {
+		total += __atomic_load_n(&l->slots[i].readers, __ATOMIC_SEQ_CST);
+	}
+
+	return total;
+}
+
+static void drop_reader(struct lock *l, int *count) {
+	int left = __atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST);
+	assert(left >= 0);
+
+	/* only a waiting writer needs to hear about it */
+	if(left == 0 && __atomic_load_n(&l->writer, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&l->wait_mutex);
+		pthread_cond_signal(&l->write_cond);
+		pthread_mutex_unlock(&l->wait_mutex);
+	}
+}
 
 void acquire_readlock(struct lock *l) {
-	pthread_mutex_lock(&l->use_state_mutex);
-	while(l->use_state < 0 || l->use_state == MAX_READERS) {
-		pthread_cond_wait(&l->use_state_cond,
-			&l->use_state_mutex);
+	int *count = reader_count(l);
+
+	while(1) {
+		__atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&l->writer, __ATOMIC_SEQ_CST) == 0) {
+			return;
+		}
+
+		/* writers have priority, back out until it's done */
+		drop_reader(l, count);
+
+		pthread_mutex_lock(&l->wait_mutex);
+		while(__atomic_load_n(&l->writer, __ATOMIC_SEQ_CST)) {
+			pthread_cond_wait(&l->read_cond, &l->wait_mutex);
+		}
+		pthread_mutex_unlock(&l->wait_mutex);
 	}
-	l->use_state++;
-	pthread_mutex_unlock(&l->use_state_mutex);
 }
 
 void release_readlock(struct lock *l) {
-	pthread_mutex_lock(&l->use_state_mutex);
-	assert(l->use_state > 0);
-	l->use_state--;
-	pthread_cond_broadcast(&l->use_state_cond);
-	pthread_mutex_unlock(&l->use_state_mutex);
+	drop_reader(l, reader_count(l));
 }
 
 void acquire_writelock(struct lock *l) {
-	pthread_mutex_lock(&l->use_state_mutex);
-	while(l->use_state != 0) {
-		pthread_cond_wait(&l->use_state_cond,
-			&l->use_state_mutex);
+	pthread_mutex_lock(&l->write_mutex);
+
+	__atomic_store_n(&l->writer, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&l->wait_mutex);
+	while(active_readers(l) != 0) {
+		pthread_cond_wait(&l->write_cond, &l->wait_mutex);
 	}
-	l->use_state--;
-	pthread_mutex_unlock(&l->use_state_mutex);
+	pthread_mutex_unlock(&l->wait_mutex);
 }
 
 void release_writelock(struct lock *l) {
-	pthread_mutex_lock(&l->use_state_mutex);
-	assert(l->use_state == -1);
-	l->use_state++;
-	pthread_cond_broadcast(&l->use_state_cond);
-	pthread_mutex_unlock(&l->use_state_mutex);
+	pthread_mutex_lock(&l->wait_mutex);
+	assert(l->writer == 1);
+	__atomic_store_n(&l->writer, 0, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&l->read_cond);
+	pthread_mutex_unlock(&l->wait_mutex);
+
+	pthread_mutex_unlock(&l->write_mutex);
 }
 
 int init_lock(struct lock *l) {
-	l->use_state = 0;
-	return pthread_mutex_init(&l->use_state_mutex, NULL) |
-		pthread_cond_init(&l->use_state_cond, NULL);
+	l->writer = 0;
+	l->readers = 0;
+	l->slots = NULL;
+	return pthread_mutex_init(&l->wait_mutex, NULL) |
+		pthread_mutex_init(&l->write_mutex, NULL) |
+		pthread_cond_init(&l->read_cond, NULL) |
+		pthread_cond_init(&l->write_cond, NULL);
+}
+
+int init_brlock(struct lock *l) {
+	if(init_lock(l) != 0) {
+		return 1;
+	}
+
+	size_t size = LOCK_READER_SLOTS * sizeof(struct lock_slot);
+	if(posix_memalign((void **) &l->slots, sizeof(struct lock_slot),
+		size) != 0) {
+		l->slots = NULL;
+		return 1;
+	}
+	memset(l->slots, 0, size);
+
+	return 0;
 }
 
 void destroy_lock(struct lock *l) {
-	pthread_mutex_destroy(&l->use_state_mutex);
-	pthread_cond_destroy(&l->use_state_cond);
+	pthread_mutex_destroy(&l->wait_mutex);
+	pthread_mutex_destroy(&l->write_mutex);
+	pthread_cond_destroy(&l->read_cond);
+	pthread_cond_destroy(&l->write_cond);
+	free(l->slots);
+	l->slots = NULL;
 }
 
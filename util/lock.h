@@ -3,15 +3,29 @@
 
 #include <pthread.h>
 
+/* number of reader counters used by big-reader locks */
+#define LOCK_READER_SLOTS (64)
+
+struct lock_slot {
+	int readers;
+} __attribute__((aligned(64)));
+
 struct lock {
-	pthread_mutex_t use_state_mutex;
-	pthread_cond_t use_state_cond;
-	int use_state;
+	pthread_mutex_t wait_mutex; /* protects sleeping on the conditions */
+	pthread_cond_t read_cond; /* readers waiting for the writer to finish */
+	pthread_cond_t write_cond; /* writer waiting for the readers to leave */
+	pthread_mutex_t write_mutex; /* serializes writers */
+	int writer; /* set while a writer is waiting or active */
+	int readers;
+	/* per-thread reader counts, only for big-reader locks */
+	struct lock_slot *slots;
 };
 
 #define LOCK_STRUCT_INIT \
-	{ PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0 };
+	{ PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, \
+	  PTHREAD_COND_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, 0, 0, NULL };
 
+/* read locks are not recursive, a waiting writer blocks new readers */
 void acquire_readlock(struct lock *l);
 
 void release_readlock(struct lock *l);
@@ -21,6 +35,9 @@ void acquire_writelock(struct lock *l);
 void release_writelock(struct lock *l);
 
 int init_lock(struct lock *l);
+/* initializes a lock whose readers don't share a counter, for read-mostly
+ * data.  writers have to check every counter so they are slower */
+int init_brlock(struct lock *l);
 void destroy_lock(struct lock *l);
 
 #endif
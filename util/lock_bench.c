@@ -0,0 +1,243 @@
+/* compares the throughput of the reader-writer locks available to the server:
+ * struct lock, the big-reader struct lock, the previous mutex and condition
+ * lock, and pthread_rwlock_t */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/time.h>
+
+#include "lock.h"
+
+#define DFLT_THREADS (64)
+#define DFLT_SECONDS (1)
+
+/* one in this many operations is a write in the mixed workload */
+#define WRITE_RATIO (100)
+
+/* the lock this replaced, kept to compare against */
+struct legacy_lock {
+	pthread_mutex_t m;
+	pthread_cond_t c;
+	int state;
+};
+
+static void legacy_read(struct legacy_lock *l) {
+	pthread_mutex_lock(&l->m);
+	while(l->state < 0) {
+		pthread_cond_wait(&l->c, &l->m);
+	}
+	l->state++;
+	pthread_mutex_unlock(&l->m);
+}
+
+static void legacy_write(struct legacy_lock *l) {
+	pthread_mutex_lock(&l->m);
+	while(l->state != 0) {
+		pthread_cond_wait(&l->c, &l->m);
+	}
+	l->state--;
+	pthread_mutex_unlock(&l->m);
+}
+
+static void legacy_release(struct legacy_lock *l) {
+	pthread_mutex_lock(&l->m);
+	l->state = l->state < 0 ? 0 : l->state - 1;
+	pthread_cond_broadcast(&l->c);
+	pthread_mutex_unlock(&l->m);
+}
+
+enum lock_kind {
+	LOCK,
+	BRLOCK,
+	LEGACY,
+	RWLOCK,
+	NUM_KINDS,
+};
+
+static const char *kind_names[NUM_KINDS] = {
+	"lock", "brlock", "legacy", "rwlock",
+};
+
+static struct lock lk;
+static struct lock brlk;
+static struct legacy_lock legacy = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0
+};
+static pthread_rwlock_t rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+static enum lock_kind kind;
+static int write_ratio;
+
+/* a little shared state so the critical section isn't empty */
+static volatile uint64_t shared[8];
+
+static volatile int running;
+
+struct worker_arg {
+	pthread_t thread;
+	uint64_t seed;
+	uint64_t ops;
+};
+
+static uint64_t xorshift(uint64_t *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static uint64_t now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+static void do_read() {
+	uint64_t sum = 0;
+	switch(kind) {
+	case LOCK:
+	case BRLOCK:
+		acquire_readlock(kind == LOCK ? &lk : &brlk);
+		for(int i = 0; i < 8; i++) sum += shared[i];
+		release_readlock(kind == LOCK ? &lk : &brlk);
+		break;
+	case LEGACY:
+		legacy_read(&legacy);
+		for(int i = 0; i < 8; i++) sum += shared[i];
+		legacy_release(&legacy);
+		break;
+	case RWLOCK:
+		pthread_rwlock_rdlock(&rwlock);
+		for(int i = 0; i < 8; i++) sum += shared[i];
+		pthread_rwlock_unlock(&rwlock);
+		break;
+	default:
+		break;
+	}
+	(void) sum;
+}
+
+static void do_write() {
+	switch(kind) {
+	case LOCK:
+	case BRLOCK:
+		acquire_writelock(kind == LOCK ? &lk : &brlk);
+		for(int i = 0; i < 8; i++) shared[i]++;
+		release_writelock(kind == LOCK ? &lk : &brlk);
+		break;
+	case LEGACY:
+		legacy_write(&legacy);
+		for(int i = 0; i < 8; i++) shared[i]++;
+		legacy_release(&legacy);
+		break;
+	case RWLOCK:
+		pthread_rwlock_wrlock(&rwlock);
+		for(int i = 0; i < 8; i++) shared[i]++;
+		pthread_rwlock_unlock(&rwlock);
+		break;
+	default:
+		break;
+	}
+}
+
+static void *worker(void *_arg) {
+	struct worker_arg *arg = (struct worker_arg *) _arg;
+
+	uint64_t ops = 0;
+	while(running) {
+		if(write_ratio && xorshift(&arg->seed) % write_ratio == 0) {
+			do_write();
+		} else {
+			do_read();
+		}
+		ops++;
+	}
+
+	arg->ops = ops;
+
+	return NULL;
+}
+
+static double run(int threads, int seconds) {
+	struct worker_arg *args = malloc(threads * sizeof(*args));
+	if(args == NULL) {
+		return -1;
+	}
+
+	running = 1;
+	for(int i = 0; i < threads; i++) {
+		args[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+		pthread_create(&args[i].thread, NULL, worker, &args[i]);
+	}
+
+	uint64_t start = now();
+	sleep(seconds);
+	running = 0;
+
+	uint64_t ops = 0;
+	for(int i = 0; i < threads; i++) {
+		pthread_join(args[i].thread, NULL);
+		ops += args[i].ops;
+	}
+	uint64_t elapsed = now() - start;
+
+	free(args);
+
+	return ops * 1e6 / elapsed;
+}
+
+int main(int argc, char **argv) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : DFLT_THREADS;
+	int seconds = argc > 2 ? atoi(argv[2]) : DFLT_SECONDS;
+
+	if(max_threads < 1 || seconds < 1) {
+		fprintf(stderr, "usage: %s [max threads] [seconds per run]\n",
+			argv[0]);
+		return 1;
+	}
+
+	if(init_lock(&lk) != 0 || init_brlock(&brlk) != 0) {
+		fprintf(stderr, "failed to initialize locks\n");
+		return 1;
+	}
+
+	printf("%ld processors, ops/s\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+	for(write_ratio = 0; write_ratio <= WRITE_RATIO;
+		write_ratio += WRITE_RATIO) {
+		if(write_ratio) {
+			printf("\n1 in %d operations writes\n", write_ratio);
+		} else {
+			printf("\nreads only\n");
+		}
+		printf("%7s", "threads");
+		for(int k = 0; k < NUM_KINDS; k++) {
+			printf(" %14s", kind_names[k]);
+		}
+		printf("\n");
+
+		for(int t = 1; t <= max_threads; t *= 2) {
+			printf("%7d", t);
+			for(kind = 0; kind < NUM_KINDS; kind++) {
+				double rate = run(t, seconds);
+				if(rate < 0) {
+					fprintf(stderr, "failed to run benchmark\n");
+					return 1;
+				}
+				printf(" %14.0f", rate);
+				fflush(stdout);
+			}
+			printf("\n");
+		}
+	}
+
+	destroy_lock(&lk);
+	destroy_lock(&brlk);
+
+	return 0;
+}
+
@@ -1,69 +1,314 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <stdarg.h>
+#include <sched.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <sys/time.h>
 
+#include "log.h"
+
+/* each thread formats its lines into its own ring, and a single writer
+ * thread copies them out to the files.  the rings are single producer,
+ * single consumer, so logging never takes a lock once the thread's ring is
+ * set up.  lines from different threads can come out slightly out of order */
+
+#define RING_SLOTS (64) /* must be a power of two */
+#define LINE_SIZE (256) /* longer lines are truncated */
+
+/* how long lines can sit in a ring before the writer picks them up */
+#define FLUSH_INTERVAL (20000000L) /* nanoseconds */
+
+#define TIME_LEN (sizeof("YYYY-mm-dd HH:MM:SS:mmm - ") - 1)
+
+struct log_line {
+	uint8_t to_file;
+	uint8_t to_err;
+	uint16_t len;
+	char text[LINE_SIZE];
+};
+
+struct log_ring {
+	uint64_t head; /* only moved by the owning thread */
+	uint64_t tail; /* only moved by the writer */
+	uint64_t dropped;
+	int dead; /* the owning thread has exited */
+	struct log_ring *next;
+	struct log_line lines[RING_SLOTS];
+};
+
 static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
-static char time_str[30];
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static struct log_ring *rings = NULL;
+static int wake_pending = 0;
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static int writer_running = 0;
+
+static __thread struct log_ring *thread_ring = NULL;
+
+/* formatting the date is the expensive part, so it's done once a second */
+static __thread time_t cached_sec = -1;
+static __thread char cached_time[24];
 
 static FILE *lgf = NULL;
 static int debug_mode = 0;
+static int log_level = LOG_LEVEL_INFO;
+
+static void drain_rings();
 
 void set_logfile(FILE *f) {
+	log_flush();
+	pthread_mutex_lock(&log_lock);
 	lgf = f;
+	pthread_mutex_unlock(&log_lock);
 }
 
 void set_debug_mode(int dbm) {
 	debug_mode = dbm;
 }
 
-static void fmt_time() {
-	char time[20];
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	struct tm *tm_info;
+void set_log_level(int level) {
+	__atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
 
-	tm_info = localtime(&tv.tv_sec);
+static void *log_writer(void *arg) {
+	struct timespec wait;
 
-	strftime(time, 26, "%Y-%m-%d %H:%M:%S", tm_info);
-	sprintf(time_str, "%s:%.3d - ", time, (int)tv.tv_usec / 1000);
+	pthread_mutex_lock(&log_lock);
+	for(;;) {
+		if(!wake_pending) {
+			clock_gettime(CLOCK_REALTIME, &wait);
+			wait.tv_nsec += FLUSH_INTERVAL;
+			if(wait.tv_nsec >= 1000000000L) {
+				wait.tv_sec++;
+				wait.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&log_wake, &log_lock, &wait);
+		}
+		wake_pending = 0;
+
+		drain_rings();
+	}
+
+	return NULL;
 }
 
-static void write_to_file(FILE *f, int time, char *format, va_list args) {
-	if(f == NULL) return;
-	va_list arg_copy;
-	va_copy(arg_copy, args);
-	if(time) fputs(time_str, f);
-	vfprintf(f, format, arg_copy);
-	fputs("\n", f);
-	fflush(f);
-	va_end(arg_copy);
+/* runs as the thread exits.  anything it logs after this goes in a new ring */
+static void ring_exit(void *_ring) {
+	struct log_ring *ring = (struct log_ring *) _ring;
+	thread_ring = NULL;
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
 }
 
-static void write_message(int log, int err, char *format, va_list args) {
+static void log_init() {
+	pthread_t thread;
+
+	if(pthread_key_create(&ring_key, ring_exit) != 0) {
+		return;
+	}
+	if(pthread_create(&thread, NULL, log_writer, NULL) != 0) {
+		return;
+	}
+	pthread_detach(thread);
+	writer_running = 1;
+
+	/* don't lose the last lines on the way out */
+	atexit(log_flush);
+}
+
+static struct log_ring *get_ring() {
+	if(thread_ring != NULL) {
+		return thread_ring;
+	}
+
+	pthread_once(&log_once, log_init);
+	if(!writer_running) {
+		return NULL;
+	}
+
+	struct log_ring *ring = calloc(1, sizeof(struct log_ring));
+	if(ring == NULL) {
+		return NULL;
+	}
+	if(pthread_setspecific(ring_key, ring) != 0) {
+		free(ring);
+		return NULL;
+	}
+
 	pthread_mutex_lock(&log_lock);
-	fmt_time();
-	if(log) {
-		write_to_file(lgf, 1, format, args);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&log_lock);
+
+	thread_ring = ring;
+	return ring;
+}
+
+static void write_line(struct log_line *line) {
+	if(line->to_file && lgf != NULL) {
+		fwrite(line->text, 1, line->len, lgf);
+	}
+	if(line->to_err) {
+		fwrite(&line->text[TIME_LEN], 1, line->len - TIME_LEN, stderr);
+	}
+}
+
+/* must be called with log_lock held */
+static void drain_rings() {
+	struct log_ring **prev = &rings;
+	struct log_ring *ring;
+
+	while((ring = *prev) != NULL) {
+		/* check this before emptying it, so that nothing logged
+		 * after we look is lost */
+		int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = ring->tail;
+
+		for(; tail < head; tail++) {
+			write_line(&ring->lines[tail & (RING_SLOTS - 1)]);
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0,
+			__ATOMIC_RELAXED);
+		if(dropped && lgf != NULL) {
+			fprintf(lgf, "%llu log lines dropped\n",
+				(unsigned long long) dropped);
+		}
+
+		if(dead) {
+			*prev = ring->next;
+			free(ring);
+		} else {
+			prev = &ring->next;
+		}
 	}
-	if(err) {
-		write_to_file(stderr, 0, format, args);
+
+	if(lgf != NULL) {
+		fflush(lgf);
 	}
+}
+
+void log_flush() {
+	pthread_mutex_lock(&log_lock);
+	drain_rings();
 	pthread_mutex_unlock(&log_lock);
 }
 
+static void wake_writer() {
+	pthread_mutex_lock(&log_lock);
+	wake_pending = 1;
+	pthread_cond_signal(&log_wake);
+	pthread_mutex_unlock(&log_lock);
+}
+
+static void fmt_line(struct log_line *line, char *format, va_list args) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+
+	if(tv.tv_sec != cached_sec) {
+		struct tm tm_info;
+		localtime_r(&tv.tv_sec, &tm_info);
+		strftime(cached_time, sizeof(cached_time), "%Y-%m-%d %H:%M:%S",
+			&tm_info);
+		cached_sec = tv.tv_sec;
+	}
+
+	/* leave room for the newline */
+	size_t max = sizeof(line->text) - 1;
+	snprintf(line->text, max, "%.19s:%.3d - ", cached_time,
+		(int) (tv.tv_usec / 1000) % 1000);
+
+	int len = vsnprintf(&line->text[TIME_LEN], max - TIME_LEN, format,
+		args);
+	if(len < 0) {
+		len = 0;
+	}
+	if((size_t) len >= max - TIME_LEN) {
+		len = max - TIME_LEN - 1;
+	}
+
+	line->text[TIME_LEN + len] = '\n';
+	line->len = TIME_LEN + len + 1;
+}
+
+static void write_message(int level, int to_err, char *format, va_list args) {
+	struct log_ring *ring = get_ring();
+	if(ring == NULL) {
+		/* couldn't set up a ring, write it out ourselves */
+		struct log_line line;
+		fmt_line(&line, format, args);
+		line.to_file = 1;
+		line.to_err = to_err;
+		pthread_mutex_lock(&log_lock);
+		drain_rings();
+		write_line(&line);
+		if(lgf != NULL) {
+			fflush(lgf);
+		}
+		pthread_mutex_unlock(&log_lock);
+		return;
+	}
+
+	uint64_t head = ring->head;
+	while(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+		RING_SLOTS) {
+		/* errors are worth waiting for, the rest isn't */
+		if(level < LOG_LEVEL_ERROR) {
+			__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		wake_writer();
+		sched_yield();
+	}
+
+	struct log_line *line = &ring->lines[head & (RING_SLOTS - 1)];
+	fmt_line(line, format, args);
+	line->to_file = 1;
+	line->to_err = to_err;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+	/* errors should show up right away, and a busy thread shouldn't have to
+	 * wait out the flush interval to get its ring emptied */
+	if(level >= LOG_LEVEL_ERROR || head + 1 -
+		__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SLOTS / 2) {
+		wake_writer();
+	}
+}
+
+void log_write(int level, char *format, ...) {
+	if(level < __atomic_load_n(&log_level, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	write_message(level, debug_mode, format, args);
+	va_end(args);
+}
+
 void LOG(char *format, ...) {
+	if(LOG_LEVEL_INFO < __atomic_load_n(&log_level, __ATOMIC_RELAXED)) {
+		return;
+	}
+
 	va_list args;
 	va_start(args, format);
-	write_message(1, debug_mode, format, args);
+	write_message(LOG_LEVEL_INFO, debug_mode, format, args);
 	va_end(args);
 }
 
 void ERR(char *format, ...) {
 	va_list args;
 	va_start(args, format);
-	write_message(1, 1, format, args);
+	write_message(LOG_LEVEL_ERROR, 1, format, args);
 	va_end(args);
 }
 
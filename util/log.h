@@ -7,9 +7,33 @@
 	exit(1);\
 } while(0)
 
+#define LOG_LEVEL_DEBUG (0)
+#define LOG_LEVEL_INFO  (1)
+#define LOG_LEVEL_ERROR (2)
+
+/* DBG is for hot paths, it compiles to nothing unless the build asks for
+ * debug logging (make DEBUG-LOG=1) */
+#ifndef LOG_COMPILE_LEVEL
+# define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+# define DBG(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+# define DBG(...) do { } while(0)
+#endif
+
+/* pending lines are written to the old file before switching */
 void set_logfile(FILE *f);
 void set_debug_mode(int dbm);
+/* lines below the level are discarded, LOG_LEVEL_INFO by default */
+void set_log_level(int level);
+
+/* lines are queued and written by a background thread, this waits for
+ * everything logged so far to be written */
+void log_flush();
 
+void log_write(int level, char *format, ...);
 void LOG(char *format, ...);
 void ERR(char *format, ...);
 
@@ -0,0 +1,214 @@
+/* counters, gauges and latency histograms for the stats socket.
+ * everything is updated with relaxed atomics, nothing here takes a lock */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define PREFIX "ibchat_"
+
+/* counters are bumped on every frame, so each thread adds into one of
+ * several copies to keep them from bouncing a cache line between cores.
+ * must be a power of two */
+#define COUNTER_SHARDS (16)
+
+static const char *counter_names[COUNTER_COUNT] = {
+	"connections_accepted_total",
+	"connection_errors_total",
+	"timeouts_total",
+	"frames_received_total",
+	"frames_sent_total",
+	"bytes_received_total",
+	"bytes_sent_total",
+	"handshakes_total",
+	"handshake_failures_total",
+	"auth_failures_total",
+	"messages_relayed_total",
+	"messages_stored_total",
+	"backpressure_spills_total",
+	"backpressure_drops_total",
+	"undelivered_sent_total",
+	"user_cache_hits_total",
+	"user_cache_misses_total",
+	"admit_rate_limited_total",
+	"admit_host_busy_total",
+	"admit_server_busy_total",
+	"unsent_kept_total",
+};
+
+static const char *gauge_names[GAUGE_COUNT] = {
+	"connections",
+	"sessions",
+	"handshakes_waiting",
+	"handshakes_active",
+	"send_queued_bytes",
+	"recv_queued_bytes",
+	"undelivered_messages",
+	"undelivered_bytes",
+	"users_loaded",
+};
+
+static const char *histogram_names[HISTOGRAM_COUNT] = {
+	"handshake_us",
+	"relay_latency_us",
+	"undelivered_append_us",
+	"undelivered_load_us",
+	"user_load_us",
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+struct counter_shard {
+	uint64_t v[COUNTER_COUNT];
+} __attribute__((aligned(64)));
+
+static struct counter_shard counters[COUNTER_SHARDS];
+static int64_t gauges[GAUGE_COUNT];
+static struct histogram histograms[HISTOGRAM_COUNT];
+
+static unsigned next_shard = 0;
+static __thread int thread_shard = -1;
+
+void counter_add(enum metric_counter c, uint64_t n) {
+	if(thread_shard < 0) {
+		thread_shard = __atomic_fetch_add(&next_shard, 1,
+			__ATOMIC_RELAXED) & (COUNTER_SHARDS - 1);
+	}
+	__atomic_add_fetch(&counters[thread_shard].v[c], n, __ATOMIC_RELAXED);
+}
+
+void gauge_add(enum metric_gauge g, int64_t n) {
+	__atomic_add_fetch(&gauges[g], n, __ATOMIC_RELAXED);
+}
+
+void gauge_set(enum metric_gauge g, int64_t v) {
+	__atomic_store_n(&gauges[g], v, __ATOMIC_RELAXED);
+}
+
+static int bucket_index(uint64_t v) {
+	if(v < HIST_SUB_BUCKETS) {
+		return v;
+	}
+	int e = 63 - __builtin_clzll(v);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+		((v >> (e - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* the largest value that lands in the bucket */
+static uint64_t bucket_top(int idx) {
+	if(idx < HIST_SUB_BUCKETS) {
+		return idx;
+	}
+	int e = idx / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+	uint64_t sub = idx % HIST_SUB_BUCKETS;
+	uint64_t low = (HIST_SUB_BUCKETS + sub) << (e - HIST_SUB_BITS);
+	return low + (1ULL << (e - HIST_SUB_BITS)) - 1;
+}
+
+void hist_record(struct histogram *h, uint64_t value) {
+	__atomic_add_fetch(&h->buckets[bucket_index(value)], 1,
+		__ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&h->sum, value, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while(value > max && !__atomic_compare_exchange_n(&h->max, &max,
+		value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void hist_snapshot(struct histogram *h, struct histogram *copy) {
+	/* the count is made from the buckets so that it matches them */
+	copy->count = 0;
+	for(int i = 0; i < HIST_BUCKETS; i++) {
+		copy->buckets[i] = __atomic_load_n(&h->buckets[i],
+			__ATOMIC_RELAXED);
+		copy->count += copy->buckets[i];
+	}
+	copy->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+	copy->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+}
+
+void hist_merge(struct histogram *into, struct histogram *from) {
+	for(int i = 0; i < HIST_BUCKETS; i++) {
+		into->buckets[i] += from->buckets[i];
+	}
+	into->count += from->count;
+	into->sum += from->sum;
+	if(from->max > into->max) {
+		into->max = from->max;
+	}
+}
+
+uint64_t hist_quantile(struct histogram *h, double q) {
+	uint64_t rank = (uint64_t) (q * h->count);
+	uint64_t seen = 0;
+	for(int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if(seen > rank) {
+			uint64_t top = bucket_top(i);
+			/* nothing in the top bucket is bigger than the max */
+			return top < h->max ? top : h->max;
+		}
+	}
+	return h->count == 0 ? 0 : h->max;
+}
+
+void histogram_record(enum metric_histogram h, uint64_t value) {
+	hist_record(&histograms[h], value);
+}
+
+uint64_t metrics_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void write_histogram(FILE *f, const char *name, struct histogram *hist) {
+	/* copy it first so the quantiles agree with each other */
+	struct histogram snap;
+	hist_snapshot(hist, &snap);
+
+	fprintf(f, "# TYPE " PREFIX "%s summary\n", name);
+
+	for(size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+		fprintf(f, PREFIX "%s{quantile=\"%g\"} %llu\n", name,
+			quantiles[q], (unsigned long long)
+			hist_quantile(&snap, quantiles[q]));
+	}
+
+	fprintf(f, PREFIX "%s_max %llu\n", name,
+		(unsigned long long) snap.max);
+	fprintf(f, PREFIX "%s_sum %llu\n", name,
+		(unsigned long long) snap.sum);
+	fprintf(f, PREFIX "%s_count %llu\n", name,
+		(unsigned long long) snap.count);
+}
+
+int metrics_write(FILE *f) {
+	for(int c = 0; c < COUNTER_COUNT; c++) {
+		uint64_t total = 0;
+		for(int s = 0; s < COUNTER_SHARDS; s++) {
+			total += __atomic_load_n(&counters[s].v[c],
+				__ATOMIC_RELAXED);
+		}
+		fprintf(f, "# TYPE " PREFIX "%s counter\n", counter_names[c]);
+		fprintf(f, PREFIX "%s %llu\n", counter_names[c],
+			(unsigned long long) total);
+	}
+
+	for(int g = 0; g < GAUGE_COUNT; g++) {
+		fprintf(f, "# TYPE " PREFIX "%s gauge\n", gauge_names[g]);
+		fprintf(f, PREFIX "%s %lld\n", gauge_names[g], (long long)
+			__atomic_load_n(&gauges[g], __ATOMIC_RELAXED));
+	}
+
+	for(int h = 0; h < HISTOGRAM_COUNT; h++) {
+		write_histogram(f, histogram_names[h], &histograms[h]);
+	}
+
+	return ferror(f) ? -1 : 0;
+}
+
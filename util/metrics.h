@@ -0,0 +1,103 @@
+#ifndef IBCHAT_UTIL_METRICS_H
+#define IBCHAT_UTIL_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* every metric the server keeps.  the names are in metrics.c, in the same
+ * order, and new metrics go at the end of their enum */
+
+/* only ever go up */
+enum metric_counter {
+	C_CONNECTIONS_ACCEPTED,
+	C_CONNECTION_ERRORS,
+	C_TIMEOUTS,
+	C_FRAMES_IN,
+	C_FRAMES_OUT,
+	C_BYTES_IN,
+	C_BYTES_OUT,
+	C_HANDSHAKES,
+	C_HANDSHAKE_FAILURES,
+	C_AUTH_FAILURES,
+	C_MESSAGES_RELAYED,
+	C_MESSAGES_STORED,
+	C_BACKPRESSURE_SPILLS,
+	C_BACKPRESSURE_DROPS,
+	C_UNDEL_SENT,
+	C_USER_CACHE_HITS,
+	C_USER_CACHE_MISSES,
+	C_ADMIT_RATE_LIMITED,
+	C_ADMIT_HOST_BUSY,
+	C_ADMIT_SERVER_BUSY,
+	C_UNSENT_KEPT,
+	COUNTER_COUNT
+};
+
+/* current values */
+enum metric_gauge {
+	G_CONNECTIONS,
+	G_SESSIONS,
+	G_HANDSHAKES_WAITING,
+	G_HANDSHAKES_ACTIVE,
+	G_SEND_QUEUED_BYTES,
+	G_RECV_QUEUED_BYTES,
+	G_UNDEL_MESSAGES,
+	G_UNDEL_BYTES,
+	G_USERS_LOADED,
+	GAUGE_COUNT
+};
+
+/* distributions of times in microseconds */
+enum metric_histogram {
+	H_HANDSHAKE_US,
+	H_RELAY_US,
+	H_UNDEL_APPEND_US,
+	H_UNDEL_LOAD_US,
+	H_USER_LOAD_US,
+	HISTOGRAM_COUNT
+};
+
+void counter_add(enum metric_counter c, uint64_t n);
+#define counter_inc(c) counter_add(c, 1)
+
+void gauge_add(enum metric_gauge g, int64_t n);
+void gauge_set(enum metric_gauge g, int64_t v);
+
+void histogram_record(enum metric_histogram h, uint64_t value);
+
+/* the histograms behind the metrics, for anything else that wants the same
+ * quantiles.  they're log-linear: each power of two is split into
+ * 2^HIST_SUB_BITS buckets, which keeps every value within 12.5% of its
+ * bucket's bounds */
+#define HIST_SUB_BITS (3)
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+/* safe to call from several threads at once on the same histogram */
+void hist_record(struct histogram *h, uint64_t value);
+/* copies a histogram that may be being recorded into, so that quantiles
+ * taken from the copy agree with each other */
+void hist_snapshot(struct histogram *h, struct histogram *copy);
+/* adds from into into, neither may be being recorded into */
+void hist_merge(struct histogram *into, struct histogram *from);
+/* the value below which q of the recorded values fall, to within the
+ * bucket width, never more than the max.  h must not be being recorded
+ * into, take a snapshot first */
+uint64_t hist_quantile(struct histogram *h, double q);
+
+/* a monotonic clock in microseconds, for timing things to record */
+uint64_t metrics_now();
+
+/* writes a snapshot of every metric in the prometheus text format.
+ * returns non-zero if writing failed */
+int metrics_write(FILE *f);
+
+#endif
+
@@ -0,0 +1,173 @@
+/* sampled per-message trace points.  each traced message gets a slot in a
+ * fixed ring, claimed when it's read and overwritten by whatever message
+ * claims it next, so there is nothing to free and nothing to lock */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.h"
+#include "metrics.h"
+
+#define TRACE_SAMPLES (4096) /* must be a power of two */
+
+struct trace_sample {
+	uint64_t id; /* 0 while the slot is being reset */
+	uint64_t t[TRACE_STAGES]; /* metrics_now() at each stage, 0 if not hit */
+};
+
+static const char *stage_names[TRACE_STAGES] = {
+	"read",
+	"dequeued",
+	"decrypted",
+	"routed",
+	"enqueued",
+	"queued_out",
+	"written",
+	"acked",
+};
+
+static struct trace_sample ring[TRACE_SAMPLES];
+
+static uint64_t rate = 0;
+static uint64_t seen = 0;
+static uint64_t next_id = 0;
+
+void trace_set_rate(uint64_t n) {
+	__atomic_store_n(&rate, n, __ATOMIC_RELAXED);
+}
+
+uint64_t trace_rate() {
+	return __atomic_load_n(&rate, __ATOMIC_RELAXED);
+}
+
+uint64_t trace_start() {
+	uint64_t n = __atomic_load_n(&rate, __ATOMIC_RELAXED);
+	if(n == 0) {
+		return 0;
+	}
+	if(n > 1 && __atomic_fetch_add(&seen, 1, __ATOMIC_RELAXED) % n != 0) {
+		return 0;
+	}
+
+	uint64_t id = __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+	struct trace_sample *s = &ring[id & (TRACE_SAMPLES - 1)];
+
+	/* stop the slot's previous message from writing into it */
+	__atomic_store_n(&s->id, 0, __ATOMIC_RELEASE);
+	for(int i = 0; i < TRACE_STAGES; i++) {
+		__atomic_store_n(&s->t[i], 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&s->t[TRACE_READ], metrics_now(), __ATOMIC_RELAXED);
+	__atomic_store_n(&s->id, id, __ATOMIC_RELEASE);
+
+	return id;
+}
+
+void trace_point(uint64_t id, enum trace_stage stage) {
+	struct trace_sample *s = &ring[id & (TRACE_SAMPLES - 1)];
+	if(__atomic_load_n(&s->id, __ATOMIC_ACQUIRE) != id) {
+		/* the slot has been taken by a newer message */
+		return;
+	}
+	/* keep the first time a stage is hit */
+	uint64_t zero = 0;
+	__atomic_compare_exchange_n(&s->t[stage], &zero, metrics_now(), 0,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void write_row(FILE *f, const char *from, const char *to,
+	uint64_t *d, uint64_t n) {
+	if(n == 0) {
+		fprintf(f, "%-10s -> %-10s %8d\n", from, to, 0);
+		return;
+	}
+
+	qsort(d, n, sizeof(uint64_t), cmp_u64);
+
+	uint64_t sum = 0;
+	for(uint64_t i = 0; i < n; i++) {
+		sum += d[i];
+	}
+
+	fprintf(f, "%-10s -> %-10s %8llu %10llu %10llu %10llu %10llu %10llu\n",
+		from, to, (unsigned long long) n,
+		(unsigned long long) (sum / n),
+		(unsigned long long) d[n / 2],
+		(unsigned long long) d[n * 9 / 10],
+		(unsigned long long) d[n * 99 / 100],
+		(unsigned long long) d[n - 1]);
+}
+
+int trace_dump(FILE *f) {
+	struct trace_sample *copy = malloc(sizeof(ring));
+	uint64_t *d = malloc(TRACE_SAMPLES * sizeof(uint64_t));
+	if(copy == NULL || d == NULL) {
+		free(copy);
+		free(d);
+		return -1;
+	}
+
+	/* take a consistent copy of each slot, skipping ones being reset */
+	uint64_t num = 0;
+	for(int i = 0; i < TRACE_SAMPLES; i++) {
+		struct trace_sample *s = &ring[i];
+		uint64_t id = __atomic_load_n(&s->id, __ATOMIC_ACQUIRE);
+		if(id == 0) {
+			continue;
+		}
+		copy[num].id = id;
+		for(int j = 0; j < TRACE_STAGES; j++) {
+			copy[num].t[j] = __atomic_load_n(&s->t[j],
+				__ATOMIC_RELAXED);
+		}
+		if(__atomic_load_n(&s->id, __ATOMIC_ACQUIRE) == id) {
+			num++;
+		}
+	}
+
+	fprintf(f, "tracing 1 in %llu messages, %llu samples\n",
+		(unsigned long long) trace_rate(), (unsigned long long) num);
+	fprintf(f, "%-24s %8s %10s %10s %10s %10s %10s\n", "stage (us)",
+		"count", "mean", "p50", "p90", "p99", "max");
+
+	/* the time between each stage and the next one the message hit */
+	for(int s = 0; s < TRACE_STAGES - 1; s++) {
+		uint64_t n = 0;
+		for(uint64_t i = 0; i < num; i++) {
+			uint64_t *t = copy[i].t;
+			if(t[s] == 0 || t[s + 1] == 0 || t[s + 1] < t[s]) {
+				continue;
+			}
+			d[n++] = t[s + 1] - t[s];
+		}
+		write_row(f, stage_names[s], stage_names[s + 1], d, n);
+	}
+
+	/* and through the whole server */
+	int ends[] = { TRACE_WRITTEN, TRACE_ACKED };
+	for(size_t e = 0; e < sizeof(ends) / sizeof(ends[0]); e++) {
+		uint64_t n = 0;
+		for(uint64_t i = 0; i < num; i++) {
+			uint64_t *t = copy[i].t;
+			if(t[ends[e]] == 0 || t[ends[e]] < t[TRACE_READ]) {
+				continue;
+			}
+			d[n++] = t[ends[e]] - t[TRACE_READ];
+		}
+		write_row(f, stage_names[TRACE_READ], stage_names[ends[e]],
+			d, n);
+	}
+
+	free(copy);
+	free(d);
+
+	return ferror(f) ? -1 : 0;
+}
+
@@ -0,0 +1,40 @@
+#ifndef IBCHAT_UTIL_TRACE_H
+#define IBCHAT_UTIL_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* the points a relayed message passes on its way through the server, in
+ * order.  a message that is stored instead of relayed stops at ROUTED */
+enum trace_stage {
+	TRACE_READ,       /* frame read off the socket */
+	TRACE_DEQUEUED,   /* taken off the connection's receive queue */
+	TRACE_DECRYPTED,  /* decrypted, handed to the client handler */
+	TRACE_ROUTED,     /* target looked up and ready to hand over */
+	TRACE_ENQUEUED,   /* posted to the target's mailbox */
+	TRACE_QUEUED_OUT, /* encrypted and queued on the target's connection */
+	TRACE_WRITTEN,    /* written to the target's socket */
+	TRACE_ACKED,      /* acknowledged by the target */
+	TRACE_STAGES
+};
+
+/* traces one in every n messages read, 0 turns tracing off (the default) */
+void trace_set_rate(uint64_t n);
+uint64_t trace_rate();
+
+/* called as a message is read, returns the id of its trace or 0 if it
+ * isn't sampled */
+uint64_t trace_start();
+void trace_point(uint64_t id, enum trace_stage stage);
+
+/* for anything with a trace field, costs a branch when it isn't traced */
+#define TRACE(m, stage) do {\
+	if((m)->trace) trace_point((m)->trace, stage);\
+} while(0)
+
+/* writes the latency between each pair of stages over the samples in the
+ * ring.  returns non-zero if writing failed */
+int trace_dump(FILE *f);
+
+#endif
+